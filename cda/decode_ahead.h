@@ -0,0 +1,333 @@
+﻿//=============================================================================
+// 先読みデコード (2016/09/24版)
+//                                                Copyright (c) 2006-2016 MAYO.
+//=============================================================================
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "plugin_ini.h"
+
+//-----------------------------------------------------------------------------
+// 先読みデコード
+// ・別スレッドでデコード関数を呼び出し、リングバッファに溜めておく。
+// ・デコードスレッドが書き込み、Read()を呼ぶスレッドが読み出す（各１つ）。
+// ・シーク等でデコーダを操作する場合は、Stop()してから行い、Start()で再開する。
+// ・Read()は再生スレッドを止めないように、デコードが間に合わなければ短時間だけ待って
+//   無音で埋める（途切れはするが、終端とは判断されない）。
+// ・CRTは使用しない。CRTなしでビルドする場合は、先にCopyMemory/FillMemoryを再定義しておくこと。
+//-----------------------------------------------------------------------------
+class DecodeAhead
+{
+public:
+	// デコード関数（sizeバイトまで書き込み、書き込んだバイト数を返す、0で終了）
+	typedef int (*DecodeProc)(void* context, void* buffer, int size);
+
+	// デコードが間に合わない場合に、Read()で待つ最大時間（ミリ秒）
+	// ・Start()直後の最初のRead()は、最初のデコードを待つので長めにする。
+	enum { UNDERRUN_WAIT = 20, START_WAIT = 1000 };
+
+public:
+	DecodeAhead()
+		: m_proc(NULL)
+		, m_context(NULL)
+		, m_ring(NULL)
+		, m_chunk(NULL)
+		, m_size(0)
+		, m_chunk_size(0)
+		, m_align(1)
+		, m_silence(0)
+		, m_frames(0)
+		, m_thread(NULL)
+		, m_data_event(NULL)
+		, m_space_event(NULL)
+		, m_write(0)
+		, m_read(0)
+		, m_end(FALSE)
+		, m_quit(FALSE)
+	{
+	}
+
+	~DecodeAhead()
+	{
+		Release();
+	}
+
+	//-------------------------------------------------------------------------
+	// 初期化（スレッドはまだ開始しない）
+	// ・sizeはリングバッファのバイト数、chunkは１回にデコードするバイト数。
+	// ・chunkはalign（１サンプルのバイト数）の倍数に切り詰める。
+	// ・sizeは２のべき乗に切り上げる（累計バイト数が一周しても位置がずれない）。
+	// ・silenceは、デコードが間に合わない場合に埋める値（8bit PCMなら0x80）。
+	//-------------------------------------------------------------------------
+	bool Init(DecodeProc proc, void* context, int size, int chunk, int align, BYTE silence = 0)
+	{
+		Release();
+
+		if (!proc || align <= 0 || size <= 0 || size > 0x10000000) {
+			return false;
+		}
+
+		chunk -= chunk % align;
+		if (chunk <= 0) {
+			return false;
+		}
+
+		// リングバッファには、最低でも２回分入るようにする
+		DWORD ring = 1;
+		while (ring < static_cast<DWORD>(size) || ring < static_cast<DWORD>(chunk) * 2) {
+			ring <<= 1;
+		}
+
+		size = static_cast<int>(ring);
+
+		HANDLE heap = GetProcessHeap();
+		m_ring = static_cast<BYTE*>(HeapAlloc(heap, 0, size + chunk));
+		if (!m_ring) {
+			return false;
+		}
+
+		m_chunk = m_ring + size;
+
+		m_data_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+		m_space_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (!m_data_event || !m_space_event) {
+			Release();
+			return false;
+		}
+
+		m_proc = proc;
+		m_context = context;
+		m_size = size;
+		m_chunk_size = chunk;
+		m_align = align;
+		m_silence = silence;
+		return true;
+	}
+
+	//-------------------------------------------------------------------------
+	// 解放
+	//-------------------------------------------------------------------------
+	void Release()
+	{
+		Stop();
+
+		if (m_data_event) {
+			CloseHandle(m_data_event);
+			m_data_event = NULL;
+		}
+
+		if (m_space_event) {
+			CloseHandle(m_space_event);
+			m_space_event = NULL;
+		}
+
+		if (m_ring) {
+			HeapFree(GetProcessHeap(), 0, m_ring);
+			m_ring = NULL;
+			m_chunk = NULL;
+		}
+
+		m_proc = NULL;
+		m_size = 0;
+	}
+
+	//-------------------------------------------------------------------------
+	// 先読み開始（バッファは空にする）
+	//-------------------------------------------------------------------------
+	bool Start()
+	{
+		if (!m_ring || m_thread) {
+			return false;
+		}
+
+		m_write = 0;
+		m_read = 0;
+		m_end = FALSE;
+		m_quit = FALSE;
+		m_frames = 0;
+
+		ResetEvent(m_data_event);
+		ResetEvent(m_space_event);
+
+		DWORD id = 0;
+		m_thread = CreateThread(NULL, 0, ThreadProc, this, 0, &id);
+		if (!m_thread) {
+			return false;
+		}
+
+		// 再生側より先に進めたいので、少し優先度を上げる
+		SetThreadPriority(m_thread, THREAD_PRIORITY_ABOVE_NORMAL);
+		return true;
+	}
+
+	//-------------------------------------------------------------------------
+	// 先読み停止（デコード中の分が終わるまで待つ）
+	//-------------------------------------------------------------------------
+	void Stop()
+	{
+		if (!m_thread) {
+			return;
+		}
+
+		InterlockedExchange(&m_quit, TRUE);
+		SetEvent(m_space_event);
+
+		WaitForSingleObject(m_thread, INFINITE);
+		CloseHandle(m_thread);
+		m_thread = NULL;
+	}
+
+	//-------------------------------------------------------------------------
+	// 先読み中か？
+	//-------------------------------------------------------------------------
+	bool IsActive() const
+	{
+		return (m_thread != NULL);
+	}
+
+	//-------------------------------------------------------------------------
+	// 読み取り
+	// ・溜まっていれば、コピーするだけで戻る。
+	// ・足りない場合は、UNDERRUN_WAITまで待ち、それでも足りなければ残りを無音で埋めて
+	//   sizeバイト返す。sizeより少なく返すのは、終端に達した場合だけ。
+	//-------------------------------------------------------------------------
+	int Read(void* buffer, int size)
+	{
+		BYTE* dest = static_cast<BYTE*>(buffer);
+		DWORD want = (size > 0)? static_cast<DWORD>(size) : 0;
+		DWORD done = 0;
+
+		const DWORD wait = (m_frames == 0)? START_WAIT : UNDERRUN_WAIT;
+		const DWORD start = GetTickCount();
+
+		while (done < want) {
+			DWORD read = m_read;
+			DWORD avail = static_cast<DWORD>(m_write) - read;
+			if (avail == 0) {
+				// 終了フラグは最後の書き込みの後に立つので、その後にもう一度確認する
+				if (m_end) {
+					if (static_cast<DWORD>(m_write) == read) {
+						break;
+					}
+
+					continue;
+				}
+
+				DWORD elapsed = GetTickCount() - start;
+				if (elapsed >= wait) {
+					FillMemory(dest + done, want - done, m_silence);
+					done = want;
+					break;
+				}
+
+				WaitForSingleObject(m_data_event, wait - elapsed);
+				continue;
+			}
+
+			DWORD count = (avail > want - done)? (want - done) : avail;
+			DWORD pos = read & (m_size - 1);
+			DWORD first = m_size - pos;
+			first = (first > count)? count : first;
+
+			CopyMemory(dest + done, m_ring + pos, first);
+			CopyMemory(dest + done + first, m_ring, count - first);
+
+			InterlockedExchange(&m_read, static_cast<LONG>(read + count));
+			SetEvent(m_space_event);
+			done += count;
+		}
+
+		m_frames += done / m_align;
+		return static_cast<int>(done);
+	}
+
+	//-------------------------------------------------------------------------
+	// Start()以降にRead()で読み取ったサンプル数（無音で埋めた分も含む）
+	//-------------------------------------------------------------------------
+	DWORD GetReadFrames() const
+	{
+		return m_frames;
+	}
+
+private:
+	//-------------------------------------------------------------------------
+	// スレッド関数
+	//-------------------------------------------------------------------------
+	static DWORD WINAPI ThreadProc(void* param)
+	{
+		static_cast<DecodeAhead*>(param)->Produce();
+		return 0;
+	}
+
+	//-------------------------------------------------------------------------
+	// デコードしてリングバッファに書き込む
+	//-------------------------------------------------------------------------
+	void Produce()
+	{
+		while (!m_quit) {
+			DWORD write = m_write;
+			DWORD used = write - static_cast<DWORD>(m_read);
+			if (m_size - used < m_chunk_size) {
+				WaitForSingleObject(m_space_event, INFINITE);
+				continue;
+			}
+
+			// 折り返さなければ、リングバッファに直接デコードする
+			DWORD pos = write & (m_size - 1);
+			bool direct = (m_size - pos >= m_chunk_size);
+			BYTE* dest = direct? (m_ring + pos) : m_chunk;
+
+			int readed = m_proc(m_context, dest, m_chunk_size);
+			if (readed <= 0) {
+				break;
+			}
+
+			DWORD count = static_cast<DWORD>(readed);
+			if (!direct) {
+				DWORD first = m_size - pos;
+				first = (first > count)? count : first;
+
+				CopyMemory(m_ring + pos, m_chunk, first);
+				CopyMemory(m_ring, m_chunk + first, count - first);
+			}
+
+			InterlockedExchange(&m_write, static_cast<LONG>(write + count));
+			SetEvent(m_data_event);
+		}
+
+		InterlockedExchange(&m_end, TRUE);
+		SetEvent(m_data_event);
+	}
+
+private:
+	DecodeProc		m_proc;
+	void*			m_context;
+	BYTE*			m_ring;			// リングバッファ
+	BYTE*			m_chunk;		// 折り返す場合のデコード先
+	DWORD			m_size;			// リングバッファのバイト数（２のべき乗）
+	DWORD			m_chunk_size;	// １回にデコードするバイト数
+	DWORD			m_align;		// １サンプルのバイト数
+	BYTE			m_silence;		// 無音の値
+	DWORD			m_frames;		// 読み取ったサンプル数（読み取り側のみ使用）
+	HANDLE			m_thread;
+	HANDLE			m_data_event;	// 書き込んだら通知
+	HANDLE			m_space_event;	// 読み取ったら通知
+	volatile LONG	m_write;		// 書き込んだ累計バイト数（デコードスレッドのみ更新）
+	volatile LONG	m_read;			// 読み取った累計バイト数（読み取り側のみ更新）
+	volatile LONG	m_end;			// デコードが終了したか？
+	volatile LONG	m_quit;			// 停止要求
+};
+
+//-----------------------------------------------------------------------------
+// 先読みする時間（ミリ秒）を取得する
+// ・DLLと同じ場所の、拡張子を.iniにしたファイルの[Config]DecodeAheadを読む。
+// ・0（既定値）なら先読みしない。
+//-----------------------------------------------------------------------------
+inline int GetDecodeAheadTime(HINSTANCE instance)
+{
+	const UINT MAX_TIME = 10000;
+
+	UINT time = GetPluginIniInt(instance, L"DecodeAhead", 0);
+	return (time > MAX_TIME)? MAX_TIME : static_cast<int>(time);
+}
@@ -1,5 +1,5 @@
 ﻿//=============================================================================
-// Lunaプラグイン インターフェイス (2016/09/03版)
+// Lunaプラグイン インターフェイス (2016/09/24版)
 //                                                Copyright (c) 2006-2016 MAYO.
 //=============================================================================
 #pragma once
@@ -162,5 +162,109 @@ LunaPlugin;
 
 LPEXPORT LunaPlugin* LPAPI GetLunaPlugin(HINSTANCE instance);
 
+
+//-----------------------------------------------------------------------------
+// 拡張プラグイン構造体
+// ・GetLunaPlugin2をエクスポートしているプラグインだけが対応しています。
+// ・baseは、GetLunaPluginで取得できるものと同じです。
+// ・versionを確認し、そのバージョンまでに追加された関数だけを呼び出してください。
+//-----------------------------------------------------------------------------
+#define LUNA_PLUGIN2_VERSION	4	// 現在の拡張部分のバージョン
+
+//-----------------------------------------------------------------------------
+// 一括解析の結果を受け取るコールバック
+// ・解析スレッドから呼び出しますが、同時に複数は呼び出しません。
+// ・呼び出す順番は、pathsの順番とは限りません。
+// ・metaは、コールバック中だけ有効です。解析できない時はNULLです。
+//
+// Params:	user	ParseBatch()に渡した値
+//			index	pathsのインデックス
+//			result	解析・再生できる時 1、できない時 0
+//			meta	メタデータ
+//-----------------------------------------------------------------------------
+typedef void (LPAPI* ParseCallback)(void* user, int index, int result, const Metadata* meta);
+
+typedef struct
+{
+	LunaPlugin		base;		// 基本部分
+	int				version;	// 拡張部分のバージョン
+
+	//-------------------------------------------------------------------------
+	// サンプル単位の読み取り位置設定 (version 1)
+	// ・先頭からのサンプル数（全チャンネルで１サンプル）で指定します。
+	// ・範囲外の場合は、終端に合わせてください。
+	//
+	// Params:	handle	再生ハンドル
+	//			frame	シークするサンプル位置
+	//
+	// Returns:	設定できたサンプル位置、失敗時は-1
+	//-------------------------------------------------------------------------
+	__int64 (LPAPI* SeekFrame)(Handle handle, __int64 frame);
+
+	//-------------------------------------------------------------------------
+	// 現在のサンプル位置取得 (version 1)
+	// ・次のRender()で出力する先頭のサンプル位置を返してください。
+	//
+	// Params:	handle	再生ハンドル
+	//
+	// Returns:	サンプル位置、失敗時は-1
+	//-------------------------------------------------------------------------
+	__int64 (LPAPI* TellFrame)(Handle handle);
+
+	//-------------------------------------------------------------------------
+	// float形式での読み取り (version 2)
+	// ・チャンネル毎のバッファへ、±1.0を最大値とするfloatで出力します。
+	// ・範囲外の値もクリップせずに出力します。
+	// ・同じハンドルでは、Render()とどちらか一方だけを使用してください。
+	//
+	// Params:	handle	再生ハンドル
+	//			planes	チャンネル数分の出力先（各frames個以上）
+	//			frames	出力するサンプル数
+	//
+	// Returns:	出力したサンプル数、終了時は0
+	//-------------------------------------------------------------------------
+	int (LPAPI* RenderFloat)(Handle handle, float** planes, int frames);
+
+	//-------------------------------------------------------------------------
+	// 次に再生するデータの事前準備 (version 3)
+	// ・現在の曲が終わる前に呼び出すと、別スレッドで開いて先頭をデコードしておきます。
+	// ・その後、同じpathでOpen()を呼び出すと、準備したハンドルをすぐに返します。
+	// ・準備できるのは１つだけです。新たに呼び出すと、前の準備は閉じます。
+	// ・pathをNULLにすると、準備を閉じるだけになります。
+	//
+	// Params:	path	次に再生する対象パス
+	//
+	// Returns:	準備を開始した時 1
+	//			準備できない時 0（Open()は通常どおり呼び出せます）
+	//-------------------------------------------------------------------------
+	int (LPAPI* Prepare)(const wchar_t* path);
+
+	//-------------------------------------------------------------------------
+	// 複数ファイルの一括解析 (version 4)
+	// ・複数のスレッドで解析し、結果をcallbackで返します。
+	// ・全て解析し終わるまで戻りません。
+	//
+	// Params:	paths		対象パスの配列
+	//			count		対象パスの数
+	//			callback	結果を受け取るコールバック
+	//			user		callbackに渡す値
+	//
+	// Returns:	解析・再生できたファイル数
+	//-------------------------------------------------------------------------
+	int (LPAPI* ParseBatch)(const wchar_t* const* paths, int count, ParseCallback callback, void* user);
+}
+LunaPlugin2;
+
+//-----------------------------------------------------------------------------
+// エクスポート関数：拡張プラグイン取得
+// ・"GetLunaPlugin2"という名前でエクスポートしてください（任意）。
+// ・ホストは、GetProcAddressで見つかった場合、GetLunaPluginの代わりに呼び出します。
+//
+// Params:	instance	DLLのインスタンスハンドル
+//
+// Returns:	拡張プラグイン構造体へのポインタ、エラー等の場合はNULL
+//-----------------------------------------------------------------------------
+LPEXPORT LunaPlugin2* LPAPI GetLunaPlugin2(HINSTANCE instance);
+
 #pragma pack(pop)
 
@@ -10,6 +10,7 @@
 #include "mem_api.h"
 #include "luna_pi.h"
 #include "cd_ctrl.h"
+#include "decode_ahead.h"
 
 //-----------------------------------------------------------------------------
 // 定義
@@ -24,11 +25,39 @@ struct Context
 	UINT	cur_sec;	// 現在のセクタ
 	BYTE*	tmp_buf;	// データ読み取りバッファ
 	bool	exists;		// バッファにデータがあるか？
+	UINT	offset;		// セクタの途中から出力する場合の、先頭のバイト位置
+	DecodeAhead	ahead;		// 先読み（有効時は、ドライブは先読みスレッドだけが操作する）
+	UINT	ahead_base;	// 先読み開始時のサンプル位置
 };
 
+// １セクタのサンプル数
+static const UINT SECT_FRAMES = CDDA_SECT_SIZE / 4;
+
 // 再生中かどうか？（２重処理防止のために使う）
 static bool g_playing = false;
 
+// 先読み時に１回で読み取るセクタ数
+static const int AHEAD_SECTORS = 8;
+
+// 先読みする時間（.iniのConfig/DecodeAhead、ミリ秒）
+static int g_ahead_time = 0;
+
+// プラグイン構造体（GetLunaPluginは、baseの部分を返す）
+static LunaPlugin2 g_plugin;
+
+// セクタの途中からの読み取り
+static int RenderOffset(Context* cxt, BYTE* buffer, int size);
+
+// セクタ単位の読み取り（先読みスレッドからも呼ぶ）
+static int ReadSectors(void* context, void* buffer, int size);
+static int RenderSector(Context* cxt, BYTE* buffer);
+
+// 先読みを（再）開始
+static void StartAhead(Context* cxt);
+
+// 現在のサンプル位置
+static UINT GetPosition(const Context* cxt);
+
 // operator new/delete
 void* operator new(size_t size)
 {
@@ -167,15 +196,33 @@ static Handle LPAPI Open(const wchar_t* path, Output* out)
 		return NULL;
 	}
 
+	cxt->tmp_buf = static_cast<BYTE*>(mem_alloc(CDDA_SECT_SIZE));
+	if (!cxt->tmp_buf) {
+		cxt->cd_ctrl.TermCDDA();
+		cxt->cd_ctrl.LockMedia(false);
+		cxt->cd_ctrl.CloseDevice();
+		delete cxt;
+		return NULL;
+	}
+
 	cxt->std_sec = toc.track_list[track    ].std_sector;
 	cxt->end_sec = toc.track_list[track + 1].std_sector - 1;
 	cxt->cur_sec = cxt->std_sec;
+	cxt->exists = false;
+	cxt->offset = 0;
 
 	out->sample_rate	= 44100;
 	out->sample_bits	= 16;
 	out->num_channels	= 2;
 	out->unit_length	= CDDA_SECT_SIZE;
 
+	if (g_ahead_time > 0) {
+		int size = MulDiv(176400, g_ahead_time, 1000);
+		if (cxt->ahead.Init(ReadSectors, cxt, size, CDDA_SECT_SIZE * AHEAD_SECTORS, 4)) {
+			StartAhead(cxt);
+		}
+	}
+
 	g_playing = true;
 	return cxt;
 }
@@ -187,9 +234,11 @@ static void LPAPI Close(Handle handle)
 {
 	Context* cxt = static_cast<Context*>(handle);
 	if (cxt) {
+		cxt->ahead.Release();
 		cxt->cd_ctrl.TermCDDA();
 		cxt->cd_ctrl.LockMedia(false);
 		cxt->cd_ctrl.CloseDevice();
+		mem_free(cxt->tmp_buf);
 		delete cxt;
 	}
 
@@ -206,6 +255,46 @@ static int LPAPI Render(Handle handle, void* buffer, int size)
 		return 0;
 	}
 
+	if (cxt->ahead.IsActive()) {
+		return cxt->ahead.Read(buffer, size);
+	}
+
+	return ReadSectors(cxt, buffer, size);
+}
+
+//-----------------------------------------------------------------------------
+// セクタ単位の読み取り
+// ・先読み時はsizeが複数セクタ分になるので、１セクタずつ読む。
+//-----------------------------------------------------------------------------
+static int ReadSectors(void* context, void* buffer, int size)
+{
+	Context* cxt = static_cast<Context*>(context);
+	BYTE* dest = static_cast<BYTE*>(buffer);
+
+	int used = 0;
+	while (used + CDDA_SECT_SIZE <= size) {
+		int readed = RenderSector(cxt, dest + used);
+		used += readed;
+
+		if (readed != CDDA_SECT_SIZE) {
+			break;
+		}
+	}
+
+	return used;
+}
+
+//-----------------------------------------------------------------------------
+// １セクタ分の読み取り
+//-----------------------------------------------------------------------------
+static int RenderSector(Context* cxt, BYTE* buffer)
+{
+	const int size = CDDA_SECT_SIZE;
+
+	if (cxt->offset != 0) {
+		return RenderOffset(cxt, buffer, size);
+	}
+
 	if (cxt->cur_sec > cxt->end_sec) {
 		return 0;
 	}
@@ -218,6 +307,45 @@ static int LPAPI Render(Handle handle, void* buffer, int size)
 	return size;
 }
 
+//-----------------------------------------------------------------------------
+// セクタの途中からの読み取り
+// ・前のセクタの残りと、次のセクタの先頭をつなげて、１セクタ分を出力する。
+//-----------------------------------------------------------------------------
+static int RenderOffset(Context* cxt, BYTE* buffer, int size)
+{
+	if (!cxt->exists) {
+		if (cxt->cur_sec > cxt->end_sec) {
+			return 0;
+		}
+
+		if (!cxt->cd_ctrl.ReadCDDA(cxt->cur_sec, 1, cxt->tmp_buf, CDDA_SECT_SIZE)) {
+			return 0;
+		}
+
+		++cxt->cur_sec;
+		cxt->exists = true;
+	}
+
+	int rest = CDDA_SECT_SIZE - cxt->offset;
+	CopyMemory(buffer, cxt->tmp_buf + cxt->offset, rest);
+
+	// 最後のセクタの残りで終わり
+	cxt->exists = false;
+	if (cxt->cur_sec > cxt->end_sec) {
+		return rest;
+	}
+
+	if (!cxt->cd_ctrl.ReadCDDA(cxt->cur_sec, 1, cxt->tmp_buf, CDDA_SECT_SIZE)) {
+		return rest;
+	}
+
+	++cxt->cur_sec;
+	cxt->exists = true;
+
+	CopyMemory(buffer + rest, cxt->tmp_buf, size - rest);
+	return size;
+}
+
 //-----------------------------------------------------------------------------
 // シーク
 //-----------------------------------------------------------------------------
@@ -228,17 +356,93 @@ static int LPAPI Seek(Handle handle, int time_ms)
 		return 0;
 	}
 
+	cxt->ahead.Stop();
+
 	cxt->cur_sec = cxt->std_sec + MulDiv(time_ms, 176400, CDDA_SECT_SIZE * 1000);
+	cxt->exists = false;
+	cxt->offset = 0;
+
+	StartAhead(cxt);
 	return MulDiv(cxt->cur_sec - cxt->std_sec, CDDA_SECT_SIZE * 1000, 176400);
 }
 
+//-----------------------------------------------------------------------------
+// サンプル単位のシーク
+//-----------------------------------------------------------------------------
+static __int64 LPAPI SeekFrame(Handle handle, __int64 frame)
+{
+	Context* cxt = static_cast<Context*>(handle);
+	if (!cxt || frame < 0) {
+		return -1;
+	}
+
+	// 64bitの除算はCRTが必要になるので、トラック内に収めてから32bitで計算する
+	UINT frames = (cxt->end_sec - cxt->std_sec + 1) * SECT_FRAMES;
+	if (frame > frames) {
+		frame = frames;
+	}
+
+	cxt->ahead.Stop();
+
+	UINT pos = static_cast<UINT>(frame);
+	cxt->cur_sec = cxt->std_sec + pos / SECT_FRAMES;
+	cxt->offset = (pos % SECT_FRAMES) * 4;
+	cxt->exists = false;
+
+	StartAhead(cxt);
+	return frame;
+}
+
+//-----------------------------------------------------------------------------
+// 現在のサンプル位置取得
+//-----------------------------------------------------------------------------
+static __int64 LPAPI TellFrame(Handle handle)
+{
+	Context* cxt = static_cast<Context*>(handle);
+	if (!cxt) {
+		return -1;
+	}
+
+	// 先読み中は、cur_secは先読みスレッドが進めている
+	if (cxt->ahead.IsActive()) {
+		return cxt->ahead_base + cxt->ahead.GetReadFrames();
+	}
+
+	return GetPosition(cxt);
+}
+
+//-----------------------------------------------------------------------------
+// 現在のサンプル位置
+//-----------------------------------------------------------------------------
+static UINT GetPosition(const Context* cxt)
+{
+	// バッファにあるのは、cur_secの１つ前のセクタ
+	UINT sec = cxt->cur_sec - cxt->std_sec;
+	if (cxt->exists) {
+		--sec;
+	}
+
+	return sec * SECT_FRAMES + cxt->offset / 4;
+}
+
+//-----------------------------------------------------------------------------
+// 先読みを（再）開始
+//-----------------------------------------------------------------------------
+static void StartAhead(Context* cxt)
+{
+	cxt->ahead_base = GetPosition(cxt);
+	cxt->ahead.Start();
+}
+
 
 //-----------------------------------------------------------------------------
 // プラグインエクスポート関数
 //-----------------------------------------------------------------------------
-LPEXPORT LunaPlugin* LPAPI GetLunaPlugin(HINSTANCE /*instance*/)
+LPEXPORT LunaPlugin* LPAPI GetLunaPlugin(HINSTANCE instance)
 {
-	static LunaPlugin plugin;
+	g_ahead_time = GetDecodeAheadTime(instance);
+
+	LunaPlugin& plugin = g_plugin.base;
 
 	plugin.plugin_kind = KIND_PLUGIN;
 	plugin.plugin_name = L"Audio CD plugin v1.03";
@@ -253,3 +457,20 @@ LPEXPORT LunaPlugin* LPAPI GetLunaPlugin(HINSTANCE /*instance*/)
 	plugin.Seek		= Seek;
 	return &plugin;
 }
+
+//-----------------------------------------------------------------------------
+// 拡張プラグインエクスポート関数
+//-----------------------------------------------------------------------------
+LPEXPORT LunaPlugin2* LPAPI GetLunaPlugin2(HINSTANCE instance)
+{
+	if (!GetLunaPlugin(instance)) {
+		return NULL;
+	}
+
+	// 16bit固定なので、float出力(version 2)には対応しない
+	g_plugin.version	= 1;
+	g_plugin.SeekFrame	= SeekFrame;
+	g_plugin.TellFrame	= TellFrame;
+
+	return &g_plugin;
+}
@@ -0,0 +1,55 @@
+﻿//=============================================================================
+// プラグイン設定ファイル (2016/10/01版)
+//                                                Copyright (c) 2006-2016 MAYO.
+//=============================================================================
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+//-----------------------------------------------------------------------------
+// DLLと同じ場所の、拡張子をextにしたファイルのパスを取得する
+// ・pathは、MAX_PATH文字分を用意すること。
+//-----------------------------------------------------------------------------
+inline bool GetPluginFilePath(HINSTANCE instance, const wchar_t* ext, wchar_t* path)
+{
+	DWORD length = GetModuleFileNameW(instance, path, MAX_PATH);
+	if (length == 0 || length + lstrlenW(ext) >= MAX_PATH) {
+		return false;
+	}
+
+	wchar_t* dot = path + length;
+	for (wchar_t* p = path + length; p != path && p[-1] != L'\\'; --p) {
+		if (p[-1] == L'.') {
+			dot = p - 1;
+			break;
+		}
+	}
+
+	lstrcpyW(dot, ext);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// 設定ファイルのパスを取得する
+// ・DLLと同じ場所の、拡張子を.iniにしたファイル。
+// ・ini_pathは、MAX_PATH文字分を用意すること。
+//-----------------------------------------------------------------------------
+inline bool GetPluginIniPath(HINSTANCE instance, wchar_t* ini_path)
+{
+	return GetPluginFilePath(instance, L".ini", ini_path);
+}
+
+//-----------------------------------------------------------------------------
+// 設定ファイルの[Config]から、整数の設定値を取得する
+// ・設定ファイルや設定値がなければ、default_valueを返す。
+//-----------------------------------------------------------------------------
+inline UINT GetPluginIniInt(HINSTANCE instance, const wchar_t* key, UINT default_value)
+{
+	wchar_t ini_path[MAX_PATH];
+	if (!GetPluginIniPath(instance, ini_path)) {
+		return default_value;
+	}
+
+	return GetPrivateProfileIntW(L"Config", key, default_value, ini_path);
+}
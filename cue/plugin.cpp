@@ -8,8 +8,10 @@
 #include <mmsystem.h>
 #include <shlwapi.h>
 #include "luna_pi.h"
+#include "file_stream.h"
 #include "wx_misc.h"
 #include "wx_text_rw.h"
+#include "pre_open.h"
 
 //-----------------------------------------------------------------------------
 // 定義
@@ -18,6 +20,32 @@ static bool IsEqual(const wchar_t* s1, const wchar_t* s2, int len);
 static bool ParseCueSheet(const wchar_t* cue_path, wchar_t* img_path, int& track_num);
 
 static const DWORD BLOCK_SIZE = 176400;
+static const DWORD FRAME_SIZE = 4;
+
+// RenderFloatや事前準備で、一旦読み込むバッファのバイト数（スタックに置くので4KB未満）
+static const DWORD TEMP_READ_SIZE = 2048;
+
+// 16bitを±1.0に合わせる倍率
+static const float FLOAT_SCALE = 1.0f / 32768.0f;
+
+// プラグイン構造体（GetLunaPluginは、baseの部分を返す）
+static LunaPlugin2 g_plugin;
+
+// 次の曲の事前準備
+static PreOpen g_pre_open;
+
+//-----------------------------------------------------------------------------
+// new/delete operators
+//-----------------------------------------------------------------------------
+void* operator new(size_t size)
+{
+	return HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, size);
+}
+
+void operator delete(void* ptr)
+{
+	HeapFree(GetProcessHeap(), 0, ptr);
+}
 
 //-----------------------------------------------------------------------------
 // UNICODE用文字列比較
@@ -119,15 +147,13 @@ static int LPAPI Parse(const wchar_t* path, Metadata* meta)
 		return false;
 	}
 
-	HANDLE file = CreateFile(img_path, GENERIC_READ,
-		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
-		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-	if (file == INVALID_HANDLE_VALUE) {
+	FileStream file;
+	if (!file.Open(img_path)) {
 		return false;
 	}
 
-	DWORD size = GetFileSize(file, NULL);
-	CloseHandle(file);
+	DWORD size = file.GetSize();
+	file.Close();
 
 	meta->seekable = true;
 	meta->duration = MulDiv(size, 1000, BLOCK_SIZE);
@@ -137,9 +163,9 @@ static int LPAPI Parse(const wchar_t* path, Metadata* meta)
 }
 
 //-----------------------------------------------------------------------------
-// 再生するデータを開く
+// イメージファイルを開く
 //-----------------------------------------------------------------------------
-static Handle LPAPI Open(const wchar_t* path, Output* out)
+static Handle OpenImage(const wchar_t* path, Output* out)
 {
 	wchar_t img_path[MAX_PATH];
 	int track_num = 0;
@@ -148,10 +174,13 @@ static Handle LPAPI Open(const wchar_t* path, Output* out)
 		return NULL;
 	}
 
-	HANDLE file = CreateFile(img_path, GENERIC_READ,
-		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
-		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-	if (file == INVALID_HANDLE_VALUE) {
+	FileStream* file = new FileStream();
+	if (!file) {
+		return NULL;
+	}
+
+	if (!file->Open(img_path)) {
+		delete file;
 		return NULL;
 	}
 
@@ -163,15 +192,54 @@ static Handle LPAPI Open(const wchar_t* path, Output* out)
 	return file;
 }
 
+//-----------------------------------------------------------------------------
+// 再生するデータを開く（事前準備していれば、それを返す）
+//-----------------------------------------------------------------------------
+static Handle LPAPI Open(const wchar_t* path, Output* out)
+{
+	Handle handle = g_pre_open.Take(path, out);
+	if (handle) {
+		return handle;
+	}
+
+	return OpenImage(path, out);
+}
+
+//-----------------------------------------------------------------------------
+// 事前準備で開く
+// ・デコードは不要なので、先頭を読んでファイルキャッシュに載せておく。
+//-----------------------------------------------------------------------------
+static Handle PrepareImage(const wchar_t* path, Output* out)
+{
+	FileStream* file = static_cast<FileStream*>(OpenImage(path, out));
+	if (!file) {
+		return NULL;
+	}
+
+	// 位置指定で読むので、読み取り位置は先頭のまま
+	BYTE temp[TEMP_READ_SIZE];
+	DWORD pos = 0;
+	DWORD rest = MulDiv(BLOCK_SIZE, PreOpen::PREROLL_TIME, 1000);
+	while (rest > 0) {
+		DWORD readed = file->ReadAt(pos, temp, TEMP_READ_SIZE);
+		if (readed == 0) {
+			break;
+		}
+
+		pos += readed;
+		rest = (rest > readed)? (rest - readed) : 0;
+	}
+
+	return file;
+}
+
 //-----------------------------------------------------------------------------
 // 再生するデータを閉じる
 //-----------------------------------------------------------------------------
 static void LPAPI Close(Handle handle)
 {
-	HANDLE file = static_cast<HANDLE>(handle);
-	if (file && file != INVALID_HANDLE_VALUE) {
-		CloseHandle(file);
-	}
+	FileStream* file = static_cast<FileStream*>(handle);
+	delete file;
 }
 
 //-----------------------------------------------------------------------------
@@ -179,46 +247,129 @@ static void LPAPI Close(Handle handle)
 //-----------------------------------------------------------------------------
 static int LPAPI Render(Handle handle, void* buffer, int size)
 {
-	HANDLE file = static_cast<HANDLE>(handle);
-	if (file && file != INVALID_HANDLE_VALUE) {
-		DWORD readed = 0;
-		if (ReadFile(file, buffer, size, &readed, NULL)) {
-			return static_cast<int>(readed);
-		}
+	FileStream* file = static_cast<FileStream*>(handle);
+	if (file && size > 0) {
+		return static_cast<int>(file->Read(buffer, size));
 	}
 
 	return 0;
 }
 
+//-----------------------------------------------------------------------------
+// float形式での読み取り
+//-----------------------------------------------------------------------------
+static int LPAPI RenderFloat(Handle handle, float** planes, int frames)
+{
+	FileStream* file = static_cast<FileStream*>(handle);
+	if (!file || !planes) {
+		return 0;
+	}
+
+	const int chunk = TEMP_READ_SIZE / FRAME_SIZE;
+
+	short temp[TEMP_READ_SIZE / sizeof(short)];
+	int used = 0;
+	while (used < frames) {
+		int count = (chunk > frames - used)? (frames - used) : chunk;
+
+		DWORD readed = file->Read(temp, count * FRAME_SIZE);
+
+		int samples = readed / FRAME_SIZE;
+		if (samples <= 0) {
+			break;
+		}
+
+		float* left = planes[0] + used;
+		float* right = planes[1] + used;
+		for (int i = 0; i < samples; ++i) {
+			left[i] = temp[i * 2] * FLOAT_SCALE;
+			right[i] = temp[i * 2 + 1] * FLOAT_SCALE;
+		}
+
+		used += samples;
+	}
+
+	return used;
+}
+
 //-----------------------------------------------------------------------------
 // シーク
 //-----------------------------------------------------------------------------
 static int LPAPI Seek(Handle handle, int time_ms)
 {
-	HANDLE file = static_cast<HANDLE>(handle);
-	if (file && file != INVALID_HANDLE_VALUE) {
+	FileStream* file = static_cast<FileStream*>(handle);
+	if (file) {
 		DWORD addr = MulDiv(time_ms, BLOCK_SIZE, 1000);
-		if (SetFilePointer(file, addr, NULL, FILE_BEGIN)) {
-			return MulDiv(addr, 1000, BLOCK_SIZE);
-		}
+		file->Seek(addr);
+		return MulDiv(addr, 1000, BLOCK_SIZE);
 	}
 
 	return 0;
 }
 
+//-----------------------------------------------------------------------------
+// サンプル単位のシーク
+//-----------------------------------------------------------------------------
+static __int64 LPAPI SeekFrame(Handle handle, __int64 frame)
+{
+	FileStream* file = static_cast<FileStream*>(handle);
+	if (!file || frame < 0) {
+		return -1;
+	}
+
+	// 64bitの除算はCRTが必要になるので、32bitに収めてから計算する
+	DWORD frames = file->GetSize() / FRAME_SIZE;
+	if (frame > frames) {
+		frame = frames;
+	}
+
+	DWORD addr = static_cast<DWORD>(frame) * FRAME_SIZE;
+	file->Seek(addr);
+	return frame;
+}
+
+//-----------------------------------------------------------------------------
+// 現在のサンプル位置取得
+//-----------------------------------------------------------------------------
+static __int64 LPAPI TellFrame(Handle handle)
+{
+	FileStream* file = static_cast<FileStream*>(handle);
+	if (!file) {
+		return -1;
+	}
+
+	return file->Tell() / FRAME_SIZE;
+}
+
+//-----------------------------------------------------------------------------
+// 次の曲の事前準備
+//-----------------------------------------------------------------------------
+static int LPAPI Prepare(const wchar_t* path)
+{
+	return g_pre_open.Start(path, PrepareImage, Close);
+}
+
+//-----------------------------------------------------------------------------
+// プラグイン解放
+//-----------------------------------------------------------------------------
+static void LPAPI Release()
+{
+	g_pre_open.Cancel();
+}
+
 
 //-----------------------------------------------------------------------------
 // プラグインエクスポート関数
 //-----------------------------------------------------------------------------
 LPEXPORT LunaPlugin* LPAPI GetLunaPlugin(HINSTANCE /*instance*/)
 {
-	static LunaPlugin plugin;
+	LunaPlugin& plugin = g_plugin.base;
 
 	plugin.plugin_kind = KIND_PLUGIN;
 	plugin.plugin_name = L"CueSheet plugin v1.01";
 	plugin.support_type = L"*.cue";
 
-	plugin.Release	= NULL;
+	plugin.Release	= Release;
 	plugin.Property	= NULL;
 	plugin.Parse	= Parse;
 	plugin.Open		= Open;
@@ -228,3 +379,22 @@ LPEXPORT LunaPlugin* LPAPI GetLunaPlugin(HINSTANCE /*instance*/)
 
 	return &plugin;
 }
+
+//-----------------------------------------------------------------------------
+// 拡張プラグインエクスポート関数
+//-----------------------------------------------------------------------------
+LPEXPORT LunaPlugin2* LPAPI GetLunaPlugin2(HINSTANCE instance)
+{
+	if (!GetLunaPlugin(instance)) {
+		return NULL;
+	}
+
+	// 一括解析(version 4)には対応しない
+	g_plugin.version	= 3;
+	g_plugin.SeekFrame	= SeekFrame;
+	g_plugin.TellFrame	= TellFrame;
+	g_plugin.RenderFloat	= RenderFloat;
+	g_plugin.Prepare	= Prepare;
+
+	return &g_plugin;
+}
@@ -9,6 +9,11 @@
 #include "FLAC/stream_decoder.h"
 #include "FLAC/metadata.h"
 #include "luna_pi.h"
+#include "file_stream.h"
+#include "decode_ahead.h"
+#include "pre_open.h"
+#include "batch_parser.h"
+#include "meta_cache.h"
 
 //-----------------------------------------------------------------------------
 // 定義
@@ -24,7 +29,7 @@ typedef UINT (*RenderProc)(UINT blocksize, UINT channels, const FLAC__int32* con
 // FLACのclient_dataに渡すオブジェクト
 struct MediaData
 {
-	HANDLE		file;
+	FileStream*	file;
 	Metadata*	meta;
 	bool		ret;
 };
@@ -32,7 +37,7 @@ struct MediaData
 // 再生時コンテキスト
 struct Context
 {
-	HANDLE					file;
+	FileStream*				file;
 	FLAC__StreamDecoder*	decoder;
 	Output*					out;
 	int						samples;
@@ -40,6 +45,17 @@ struct Context
 	int						size;
 	int						used;
 	RenderProc				proc;
+	int						align;		// １サンプルのバイト数
+	BYTE*					rest_buf;	// バッファに入りきらなかったフレーム
+	int						rest_size;
+	int						rest_used;
+	__int64					position;	// 次に出力するサンプル位置
+	float**					planes;		// RenderFloat()の出力先（sizeとusedはサンプル数）
+	float					scale;		// 整数サンプルを±1.0に合わせる倍率
+	int						bits;		// 出力のビット数
+	int						channels;	// 出力のチャンネル数
+	DecodeAhead				ahead;		// 先読み（有効時は、デコーダは先読みスレッドだけが操作する）
+	__int64					ahead_base;	// 先読み開始時のサンプル位置
 };
 
 union Int4Byte
@@ -50,6 +66,27 @@ union Int4Byte
 
 } //namespace
 
+// プラグイン構造体（GetLunaPluginは、baseの部分を返す）
+static LunaPlugin2 g_plugin;
+
+// 先読みする時間（ミリ秒、0なら先読みしない）
+static int g_ahead_time = 0;
+
+// 先読み時に１回でデコードする、おおよそのバイト数
+static const int AHEAD_CHUNK_SIZE = 16384;
+
+// 解析結果の版（Parseの結果が変わる変更をしたら上げて、メタデータキャッシュを無効にする）
+static const DWORD PARSER_VERSION = 1;
+
+// 次の曲の事前準備
+static PreOpen g_pre_open;
+
+// 一括解析
+static BatchParser g_batch_parser;
+
+// メタデータキャッシュ
+static MetaCache g_meta_cache;
+
 // プロトタイプ宣言
 
 // FLAC関連コールバック
@@ -65,6 +102,21 @@ static FLAC__StreamDecoderWriteStatus WriteData(const FLAC__StreamDecoder* decod
 static void MetaData(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *metadata, void *client_data);
 static void OnError(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *client_data);
 
+// サンプル単位のシーク
+static __int64 LPAPI SeekFrame(Handle handle, __int64 frame);
+
+// 出力先が一杯になるまでデコード
+static void FillOutput(Context* cxt);
+
+// 退避先に残っている分を出力先へ移す
+static void DrainRest(Context* cxt);
+
+// 整数PCMでのデコード（先読みスレッドからも呼ぶ）
+static int DecodePcm(void* context, void* buffer, int size);
+
+// 先読みを（再）開始
+static void StartAhead(Context* cxt);
+
 // タグ内容をUNICODEで取得
 static bool get_tag(wchar_t* buf, int bufLen, const FLAC__StreamMetadata* meta, const char* key);
 
@@ -75,6 +127,10 @@ static UINT Render20(UINT blocksize, UINT channels, const FLAC__int32* const dat
 static UINT Render24(UINT blocksize, UINT channels, const FLAC__int32* const data[], void* dest);
 static UINT Render32(UINT blocksize, UINT channels, const FLAC__int32* const data[], void* dest);
 
+// float出力用の変換関数
+static void RenderFloat32(UINT blocksize, UINT channels, const FLAC__int32* const data[], float* const planes[], int offset, float scale);
+static void UnpackFloat32(const BYTE* src, int bits, int channels, int frames, float* const planes[], int offset);
+
 //-----------------------------------------------------------------------------
 // Dll Entry Point
 //-----------------------------------------------------------------------------
@@ -102,38 +158,34 @@ static void LPAPI Property(HINSTANCE inst, HWND parent)
 }
 
 //-----------------------------------------------------------------------------
-// 解析
+// 解析（decoderは使い回すので、終了後は未初期化の状態に戻す）
 //-----------------------------------------------------------------------------
-static int LPAPI Parse(const wchar_t* path, Metadata* meta)
+static int ParseWith(void* worker, const wchar_t* path, Metadata* meta)
 {
-	HANDLE file = CreateFile(path, GENERIC_READ,
-		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
-		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-	if (file == INVALID_HANDLE_VALUE) {
+	FLAC__StreamDecoder* decoder = static_cast<FLAC__StreamDecoder*>(worker);
+	if (!decoder) {
 		return false;
 	}
 
-	FLAC__StreamDecoder* decoder = FLAC__stream_decoder_new();
-	if (!decoder) {
-		CloseHandle(file);
+	FileStream file;
+	if (!file.Open(path)) {
 		return false;
 	}
 
+	// 設定はfinishで既定値に戻るので、毎回設定する
 	FLAC__stream_decoder_set_md5_checking(decoder, false);
 	FLAC__stream_decoder_set_metadata_ignore_all(decoder);
 	FLAC__stream_decoder_set_metadata_respond(decoder, FLAC__METADATA_TYPE_STREAMINFO);
 	FLAC__stream_decoder_set_metadata_respond(decoder, FLAC__METADATA_TYPE_VORBIS_COMMENT);
 
 	MediaData md;
-	md.file = file;
+	md.file = &file;
 	md.meta = meta;
 	md.ret = false;
 
 	FLAC__StreamDecoderInitStatus status = FLAC__stream_decoder_init_stream(decoder,
 		ReadInfo, NULL, NULL, NULL, NULL, WriteInfo, MetaInfo, OnError, &md);
 	if (status != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
-		FLAC__stream_decoder_delete(decoder);
-		CloseHandle(file);
 		return false;
 	}
 
@@ -143,33 +195,78 @@ static int LPAPI Parse(const wchar_t* path, Metadata* meta)
 
 	if (!FLAC__stream_decoder_process_until_end_of_metadata(decoder)) {
 		FLAC__stream_decoder_finish(decoder);
-		FLAC__stream_decoder_delete(decoder);
-		CloseHandle(file);
 		return false;
 	}
 
 	FLAC__stream_decoder_finish(decoder);
-	FLAC__stream_decoder_delete(decoder);
-	CloseHandle(file);
 
 	return md.ret;
 }
 
 //-----------------------------------------------------------------------------
-// 再生するデータを開く
+// 解析用デコーダの作成・削除（一括解析では、スレッド毎に使い回す）
 //-----------------------------------------------------------------------------
-static Handle LPAPI Open(const wchar_t* path, Output* out)
+static void* CreateParser()
+{
+	return FLAC__stream_decoder_new();
+}
+
+static void DeleteParser(void* worker)
+{
+	FLAC__stream_decoder_delete(static_cast<FLAC__StreamDecoder*>(worker));
+}
+
+//-----------------------------------------------------------------------------
+// 解析（キャッシュにあれば、ファイルは開かない）
+//-----------------------------------------------------------------------------
+static int LPAPI Parse(const wchar_t* path, Metadata* meta)
+{
+	if (g_meta_cache.Lookup(path, meta)) {
+		return true;
+	}
+
+	void* decoder = CreateParser();
+	if (!decoder) {
+		return false;
+	}
+
+	int result = ParseWith(decoder, path, meta);
+	DeleteParser(decoder);
+
+	if (!result) {
+		return false;
+	}
+
+	g_meta_cache.Store(path, meta);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// 一括解析
+//-----------------------------------------------------------------------------
+static int LPAPI ParseBatch(const wchar_t* const* paths, int count, ParseCallback callback, void* user)
+{
+	return g_batch_parser.Run(paths, count, callback, user);
+}
+
+//-----------------------------------------------------------------------------
+// 再生するデータを開く（ahead_timeミリ秒分を先読みする）
+//-----------------------------------------------------------------------------
+static Handle OpenContext(const wchar_t* path, Output* out, int ahead_time)
 {
-	HANDLE file = CreateFile(path, GENERIC_READ,
-		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
-		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-	if (file == INVALID_HANDLE_VALUE) {
+	FileStream* file = new FileStream();
+	if (!file) {
+		return NULL;
+	}
+
+	if (!file->Open(path)) {
+		delete file;
 		return NULL;
 	}
 
 	FLAC__StreamDecoder* decoder = FLAC__stream_decoder_new();
 	if (!decoder) {
-		CloseHandle(file);
+		delete file;
 		return NULL;
 	}
 
@@ -180,7 +277,7 @@ static Handle LPAPI Open(const wchar_t* path, Output* out)
 	Context* cxt = new Context();
 	if (!cxt) {
 		FLAC__stream_decoder_delete(decoder);
-		CloseHandle(file);
+		delete file;
 		return NULL;
 	}
 
@@ -192,13 +289,23 @@ static Handle LPAPI Open(const wchar_t* path, Output* out)
 	cxt->size = 0;
 	cxt->used = 0;
 	cxt->proc = NULL;
+	cxt->align = 0;
+	cxt->rest_buf = NULL;
+	cxt->rest_size = 0;
+	cxt->rest_used = 0;
+	cxt->position = 0;
+	cxt->planes = NULL;
+	cxt->scale = 0.0f;
+	cxt->bits = 0;
+	cxt->channels = 0;
+	cxt->ahead_base = 0;
 
 	FLAC__StreamDecoderInitStatus status = FLAC__stream_decoder_init_stream(decoder,
 		ReadData, FileSeek, FileTell, FileLength, FileIsEof, WriteData, MetaData, OnError, cxt);
 	if (status != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
 		delete cxt;
 		FLAC__stream_decoder_delete(decoder);
-		CloseHandle(file);
+		delete file;
 		return NULL;
 	}
 
@@ -206,7 +313,7 @@ static Handle LPAPI Open(const wchar_t* path, Output* out)
 		delete cxt;
 		FLAC__stream_decoder_finish(decoder);
 		FLAC__stream_decoder_delete(decoder);
-		CloseHandle(file);
+		delete file;
 		return NULL;
 	}
 
@@ -222,23 +329,64 @@ static Handle LPAPI Open(const wchar_t* path, Output* out)
 		delete cxt;
 		FLAC__stream_decoder_finish(decoder);
 		FLAC__stream_decoder_delete(decoder);
-		CloseHandle(file);
+		delete file;
 		return NULL;
 	}
 
+	// float出力は、元のビット数を基準にする
+	cxt->scale = 1.0f / static_cast<float>(1U << (out->sample_bits - 1));
+
 	// 20bitは24bitとして処理
 	if (out->sample_bits == 20) {
 		out->sample_bits = 24;
 	}
 
 	// 最終的なブロックサイズを設定
-	out->unit_length *= (out->num_channels * out->sample_bits / 8);
+	cxt->bits = out->sample_bits;
+	cxt->channels = out->num_channels;
+	cxt->align = out->num_channels * out->sample_bits / 8;
+	out->unit_length *= cxt->align;
+
+	// フレームの途中にシークした場合、出力がフレーム境界からずれるので、１フレーム分の退避先を用意
+	cxt->rest_buf = new BYTE[out->unit_length];
 
 	cxt->out = NULL;
 	cxt->samples = out->sample_rate;
+
+	// 先読みは、フレーム単位でデコードする
+	if (ahead_time > 0) {
+		int size = MulDiv(out->sample_rate * cxt->align, ahead_time, 1000);
+		int chunk = (AHEAD_CHUNK_SIZE / out->unit_length + 1) * out->unit_length;
+		if (cxt->ahead.Init(DecodePcm, cxt, size, chunk, cxt->align)) {
+			StartAhead(cxt);
+		}
+	}
+
 	return cxt;
 }
 
+//-----------------------------------------------------------------------------
+// 再生するデータを開く（事前準備していれば、それを返す）
+//-----------------------------------------------------------------------------
+static Handle LPAPI Open(const wchar_t* path, Output* out)
+{
+	Handle handle = g_pre_open.Take(path, out);
+	if (handle) {
+		return handle;
+	}
+
+	return OpenContext(path, out, g_ahead_time);
+}
+
+//-----------------------------------------------------------------------------
+// 事前準備で開く（先読みしない設定でも、先頭はデコードしておく）
+//-----------------------------------------------------------------------------
+static Handle PrepareContext(const wchar_t* path, Output* out)
+{
+	int ahead_time = (g_ahead_time > 0)? g_ahead_time : PreOpen::PREROLL_TIME;
+	return OpenContext(path, out, ahead_time);
+}
+
 //-----------------------------------------------------------------------------
 // 再生するデータを閉じる
 //-----------------------------------------------------------------------------
@@ -246,15 +394,16 @@ static void LPAPI Close(Handle handle)
 {
 	Context* cxt = static_cast<Context*>(handle);
 	if (cxt) {
+		cxt->ahead.Release();
+
 		if (cxt->decoder) {
 			FLAC__stream_decoder_finish(cxt->decoder);
 			FLAC__stream_decoder_delete(cxt->decoder);
 		}
 
-		if (cxt->file != INVALID_HANDLE_VALUE) {
-			CloseHandle(cxt->file);
-		}
+		delete cxt->file;
 
+		delete [] cxt->rest_buf;
 		delete cxt;
 	}
 }
@@ -269,18 +418,69 @@ static int LPAPI Render(Handle handle, void* buffer, int size)
 		return 0;
 	}
 
-	if (FLAC__stream_decoder_get_state(cxt->decoder) == FLAC__STREAM_DECODER_END_OF_STREAM) {
-		return 0;
+	if (cxt->ahead.IsActive()) {
+		return cxt->ahead.Read(buffer, size);
 	}
 
+	return DecodePcm(cxt, buffer, size);
+}
+
+//-----------------------------------------------------------------------------
+// 整数PCMでのデコード
+//-----------------------------------------------------------------------------
+int DecodePcm(void* context, void* buffer, int size)
+{
+	Context* cxt = static_cast<Context*>(context);
+
 	cxt->buffer = buffer;
 	cxt->size = size;
 	cxt->used = 0;
 
-	if (!FLAC__stream_decoder_process_single(cxt->decoder)) {
-		return cxt->used;
+	FillOutput(cxt);
+
+	cxt->buffer = NULL;
+	cxt->position += cxt->used / cxt->align;
+	return cxt->used;
+}
+
+//-----------------------------------------------------------------------------
+// float形式での読み取り
+//-----------------------------------------------------------------------------
+static int LPAPI RenderFloat(Handle handle, float** planes, int frames)
+{
+	Context* cxt = static_cast<Context*>(handle);
+	if (!cxt || !planes) {
+		return 0;
+	}
+
+	// 先読みしている場合は、整数PCMからfloatに戻す
+	if (cxt->ahead.IsActive()) {
+		BYTE temp[4096];
+		const int chunk = sizeof(temp) / cxt->align;
+
+		int used = 0;
+		while (used < frames) {
+			int count = (chunk > frames - used)? (frames - used) : chunk;
+			int readed = cxt->ahead.Read(temp, count * cxt->align) / cxt->align;
+			if (readed <= 0) {
+				break;
+			}
+
+			UnpackFloat32(temp, cxt->bits, cxt->channels, readed, planes, used);
+			used += readed;
+		}
+
+		return used;
 	}
 
+	cxt->planes = planes;
+	cxt->size = frames;
+	cxt->used = 0;
+
+	FillOutput(cxt);
+
+	cxt->planes = NULL;
+	cxt->position += cxt->used;
 	return cxt->used;
 }
 
@@ -292,7 +492,7 @@ static int LPAPI Seek(Handle handle, int time_ms)
 	Context* cxt = static_cast<Context*>(handle);
 	if (cxt) {
 		int sample = MulDiv(time_ms, cxt->samples, 1000);
-		if (FLAC__stream_decoder_seek_absolute(cxt->decoder, sample)) {
+		if (SeekFrame(cxt, sample) >= 0) {
 			return time_ms;
 		}
 	}
@@ -300,18 +500,112 @@ static int LPAPI Seek(Handle handle, int time_ms)
 	return 0;
 }
 
+//-----------------------------------------------------------------------------
+// サンプル単位のシーク
+//-----------------------------------------------------------------------------
+static __int64 LPAPI SeekFrame(Handle handle, __int64 frame)
+{
+	Context* cxt = static_cast<Context*>(handle);
+	if (!cxt || frame < 0) {
+		return -1;
+	}
+
+	// デコーダを操作するので、先読みを止める
+	cxt->ahead.Stop();
+
+	// 終端へは、最後のサンプルへシークして、そのサンプルを捨てる
+	FLAC__uint64 total = FLAC__stream_decoder_get_total_samples(cxt->decoder);
+	bool at_end = (total > 0 && static_cast<FLAC__uint64>(frame) >= total);
+	if (at_end) {
+		frame = total - 1;
+	}
+
+	// シーク先を含むフレームは、先頭を削った状態で書き込まれるので、退避先に受ける
+	cxt->buffer = NULL;
+	cxt->planes = NULL;
+	cxt->rest_size = 0;
+	cxt->rest_used = 0;
+
+	if (!FLAC__stream_decoder_seek_absolute(cxt->decoder, frame)) {
+		// 失敗した場合は、デコーダを戻さないと続きを読めない
+		FLAC__stream_decoder_flush(cxt->decoder);
+		StartAhead(cxt);
+		return -1;
+	}
+
+	if (at_end) {
+		cxt->rest_used = cxt->rest_size;
+		frame = total;
+	}
+
+	cxt->position = frame;
+	StartAhead(cxt);
+	return frame;
+}
+
+//-----------------------------------------------------------------------------
+// 現在のサンプル位置取得
+//-----------------------------------------------------------------------------
+static __int64 LPAPI TellFrame(Handle handle)
+{
+	Context* cxt = static_cast<Context*>(handle);
+	if (!cxt) {
+		return -1;
+	}
+
+	// 先読み中は、positionは先読みスレッドが進めている
+	if (cxt->ahead.IsActive()) {
+		return cxt->ahead_base + cxt->ahead.GetReadFrames();
+	}
+
+	return cxt->position;
+}
+
+//-----------------------------------------------------------------------------
+// 先読みを（再）開始
+//-----------------------------------------------------------------------------
+void StartAhead(Context* cxt)
+{
+	cxt->ahead_base = cxt->position;
+	cxt->ahead.Start();
+}
+
+//-----------------------------------------------------------------------------
+// 次の曲の事前準備
+//-----------------------------------------------------------------------------
+static int LPAPI Prepare(const wchar_t* path)
+{
+	return g_pre_open.Start(path, PrepareContext, Close);
+}
+
+//-----------------------------------------------------------------------------
+// プラグイン解放
+//-----------------------------------------------------------------------------
+static void LPAPI Release()
+{
+	g_pre_open.Cancel();
+	g_meta_cache.Close();
+}
+
 //-----------------------------------------------------------------------------
 // プラグインエクスポート関数
 //-----------------------------------------------------------------------------
-LPEXPORT LunaPlugin* GetLunaPlugin(HINSTANCE /*instance*/)
+LPEXPORT LunaPlugin* GetLunaPlugin(HINSTANCE instance)
 {
-	static LunaPlugin plugin;
+	g_ahead_time = GetDecodeAheadTime(instance);
+	g_batch_parser.Init(GetParseThreadNum(instance), ParseWith, CreateParser, DeleteParser, &g_meta_cache);
+
+	LunaPlugin& plugin = g_plugin.base;
 
 	plugin.plugin_kind = KIND_PLUGIN;
 	plugin.plugin_name = L"FLAC plugin v1.03";
 	plugin.support_type = L"*.flac";
 
-	plugin.Release	= NULL;
+	if (IsMetaCacheEnabled(instance)) {
+		g_meta_cache.Open(instance, plugin.plugin_name, PARSER_VERSION);
+	}
+
+	plugin.Release	= Release;
 	plugin.Property	= Property;
 	plugin.Parse	= Parse;
 	plugin.Open		= Open;
@@ -322,6 +616,25 @@ LPEXPORT LunaPlugin* GetLunaPlugin(HINSTANCE /*instance*/)
 	return &plugin;
 }
 
+//-----------------------------------------------------------------------------
+// 拡張プラグインエクスポート関数
+//-----------------------------------------------------------------------------
+LPEXPORT LunaPlugin2* GetLunaPlugin2(HINSTANCE instance)
+{
+	if (!GetLunaPlugin(instance)) {
+		return NULL;
+	}
+
+	g_plugin.version	= LUNA_PLUGIN2_VERSION;
+	g_plugin.SeekFrame	= SeekFrame;
+	g_plugin.TellFrame	= TellFrame;
+	g_plugin.RenderFloat	= RenderFloat;
+	g_plugin.Prepare	= Prepare;
+	g_plugin.ParseBatch	= ParseBatch;
+
+	return &g_plugin;
+}
+
 //-----------------------------------------------------------------------------
 // ファイル読み取り
 //-----------------------------------------------------------------------------
@@ -330,10 +643,8 @@ FLAC__StreamDecoderReadStatus ReadInfo(
 {
 	MediaData* md = static_cast<MediaData*>(client_data);
 
-	DWORD readed = 0;
-	if (!ReadFile(md->file, buffer, *bytes, &readed, NULL)) {
-		return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
-	}
+	// 読み取りエラーも、終端として扱う
+	DWORD readed = md->file->Read(buffer, static_cast<DWORD>(*bytes));
 
 	*bytes = readed;
 	if (readed == 0) {
@@ -375,7 +686,7 @@ void MetaInfo(const FLAC__StreamDecoder* decoder, const FLAC__StreamMetadata* me
 		meta->seekable = true;
 
 		wsprintf(meta->extra, L"FLAC %dkbps",
-			MulDiv(GetFileSize(md->file, NULL), 8, meta->duration));
+			MulDiv(md->file->GetSize(), 8, meta->duration));
 		md->ret = true;
 	}
 
@@ -395,10 +706,8 @@ FLAC__StreamDecoderReadStatus ReadData(
 {
 	Context* cxt = static_cast<Context*>(client_data);
 
-	DWORD readed = 0;
-	if (!ReadFile(cxt->file, buffer, *bytes, &readed, NULL)) {
-		return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
-	}
+	// 読み取りエラーも、終端として扱う
+	DWORD readed = cxt->file->Read(buffer, static_cast<DWORD>(*bytes));
 
 	*bytes = readed;
 	if (readed == 0) {
@@ -416,7 +725,7 @@ FLAC__StreamDecoderSeekStatus FileSeek(
 {
 	Context* cxt = static_cast<Context*>(client_data);
 
-	SetFilePointer(cxt->file, static_cast<LONG>(absolute_byte_offset), NULL, FILE_BEGIN);
+	cxt->file->Seek(static_cast<DWORD>(absolute_byte_offset));
 	return FLAC__STREAM_DECODER_SEEK_STATUS_OK;
 }
 
@@ -428,7 +737,7 @@ FLAC__StreamDecoderTellStatus FileTell(
 {
 	Context* cxt = static_cast<Context*>(client_data);
 
-	*absolute_byte_offset = SetFilePointer(cxt->file, 0, NULL, FILE_CURRENT);
+	*absolute_byte_offset = cxt->file->Tell();
 	return FLAC__STREAM_DECODER_TELL_STATUS_OK;
 }
 
@@ -440,7 +749,7 @@ FLAC__StreamDecoderLengthStatus FileLength(
 {
 	Context* cxt = static_cast<Context*>(client_data);
 
-	*stream_length = GetFileSize(cxt->file, NULL);
+	*stream_length = cxt->file->GetSize();
 	return FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
 }
 
@@ -452,7 +761,7 @@ FLAC__bool FileIsEof(const FLAC__StreamDecoder* decoder, void* client_data)
 	Context* cxt = static_cast<Context*>(client_data);
 
 	// ファイルサイズ以上の位置にファイルポインタがあればEOFがtrue
-	return SetFilePointer(cxt->file, 0, NULL, FILE_CURRENT) >= GetFileSize(cxt->file, NULL);
+	return cxt->file->Tell() >= cxt->file->GetSize();
 }
 
 //-----------------------------------------------------------------------------
@@ -462,14 +771,84 @@ FLAC__StreamDecoderWriteStatus WriteData(const FLAC__StreamDecoder* decoder,
 	const FLAC__Frame* frame, const FLAC__int32* const buffer[], void* client_data)
 {
 	Context* cxt = static_cast<Context*>(client_data);
-	if (cxt->buffer) {
+	if (!cxt->proc) {
+		return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+	}
+
+	const UINT blocksize = frame->header.blocksize;
+	const UINT channels = frame->header.channels;
+
+	// 丸ごと入る場合は、出力先へ直接書き込む
+	const int bytes = blocksize * cxt->align;
+	if (cxt->buffer && cxt->used + bytes <= cxt->size) {
 		BYTE* dest = static_cast<BYTE*>(cxt->buffer) + cxt->used;
-		cxt->used += cxt->proc(frame->header.blocksize, frame->header.channels, buffer, dest);
+		cxt->used += cxt->proc(blocksize, channels, buffer, dest);
+		return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
 	}
 
+	if (cxt->planes && cxt->used + static_cast<int>(blocksize) <= cxt->size) {
+		RenderFloat32(blocksize, channels, buffer, cxt->planes, cxt->used, cxt->scale);
+		cxt->used += blocksize;
+		return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+	}
+
+	// 入りきらない分は、次回に回す
+	cxt->rest_size = cxt->proc(blocksize, channels, buffer, cxt->rest_buf);
+	cxt->rest_used = 0;
+
+	DrainRest(cxt);
 	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
 }
 
+//-----------------------------------------------------------------------------
+// 出力先が一杯になるまでデコード
+//-----------------------------------------------------------------------------
+void FillOutput(Context* cxt)
+{
+	// 前回入りきらなかった分
+	DrainRest(cxt);
+
+	while (cxt->used < cxt->size) {
+		if (FLAC__stream_decoder_get_state(cxt->decoder) == FLAC__STREAM_DECODER_END_OF_STREAM) {
+			break;
+		}
+
+		if (!FLAC__stream_decoder_process_single(cxt->decoder)) {
+			break;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// 退避先に残っている分を出力先へ移す
+//-----------------------------------------------------------------------------
+void DrainRest(Context* cxt)
+{
+	int copy = cxt->rest_size - cxt->rest_used;
+	if (copy <= 0) {
+		return;
+	}
+
+	const BYTE* src = cxt->rest_buf + cxt->rest_used;
+
+	if (cxt->buffer) {
+		copy = (copy > cxt->size - cxt->used)? (cxt->size - cxt->used) : copy;
+
+		CopyMemory(static_cast<BYTE*>(cxt->buffer) + cxt->used, src, copy);
+		cxt->rest_used += copy;
+		cxt->used += copy;
+	}
+	else if (cxt->planes) {
+		// 退避先は整数PCMなので、floatに戻す
+		int frames = copy / cxt->align;
+		frames = (frames > cxt->size - cxt->used)? (cxt->size - cxt->used) : frames;
+
+		UnpackFloat32(src, cxt->bits, cxt->channels, frames, cxt->planes, cxt->used);
+		cxt->rest_used += frames * cxt->align;
+		cxt->used += frames;
+	}
+}
+
 //-----------------------------------------------------------------------------
 // メタデータ発見時
 //-----------------------------------------------------------------------------
@@ -612,3 +991,42 @@ UINT Render32(UINT blocksize, UINT channels, const FLAC__int32* const data[], vo
 
 	return i * sizeof(int);
 }
+
+//-----------------------------------------------------------------------------
+// floatレンダリング
+//-----------------------------------------------------------------------------
+void RenderFloat32(UINT blocksize, UINT channels, const FLAC__int32* const data[], float* const planes[], int offset, float scale)
+{
+	for (UINT ch = 0; ch < channels; ++ch) {
+		const FLAC__int32* src = data[ch];
+		float* dest = planes[ch] + offset;
+		for (UINT s = 0; s < blocksize; ++s) {
+			dest[s] = static_cast<float>(src[s]) * scale;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// レンダリング済みの整数PCMをfloatに戻す
+//-----------------------------------------------------------------------------
+void UnpackFloat32(const BYTE* src, int bits, int channels, int frames, float* const planes[], int offset)
+{
+	// 上位ビットに詰めて、32bit整数として扱う
+	const float scale = 1.0f / 2147483648.0f;
+	const int bytes = bits / 8;
+
+	for (int s = 0; s < frames; ++s) {
+		for (int ch = 0; ch < channels; ++ch) {
+			int value = 0;
+			switch (bytes) {
+			case 1: value = static_cast<signed char>(src[0]) << 24; break;
+			case 2: value = (src[0] << 16) | (src[1] << 24); break;
+			case 3: value = (src[0] << 8) | (src[1] << 16) | (src[2] << 24); break;
+			case 4: value = src[0] | (src[1] << 8) | (src[2] << 16) | (src[3] << 24); break;
+			}
+
+			planes[ch][offset + s] = static_cast<float>(value) * scale;
+			src += bytes;
+		}
+	}
+}
@@ -0,0 +1,379 @@
+﻿//=============================================================================
+// ファイル読み取りストリーム (2016/10/08版)
+//                                                Copyright (c) 2006-2016 MAYO.
+//=============================================================================
+#pragma once
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else //defined(_WIN32)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef unsigned char		BYTE;
+typedef unsigned int		DWORD;
+typedef int					LONG;
+typedef long long			LONGLONG;
+typedef unsigned long long	ULONGLONG;
+#endif //defined(_WIN32)
+
+//-----------------------------------------------------------------------------
+// ファイル読み取りストリーム
+// ・デコーダからのファイル読み取りは、全てこのクラスを通す。
+// ・Windowsでは Win32 API、それ以外では POSIX (pread/mmap/posix_fadvise) を使う。
+// ・読み取り位置はクラス側で持ち、読み取りは全て位置指定で行う。
+//   Seek/Skip/Tellはシステムコールを呼ばない。
+// ・位置・サイズは32bitで扱う。4GB以上のファイルを扱う場合は、
+//   Seek64/Tell64/GetSize64を使う（読み取り位置は、内部では64bitで持つ）。
+// ・CRTは使用しない（Windows）。
+//-----------------------------------------------------------------------------
+class FileStream
+{
+public:
+	FileStream()
+#if defined(_WIN32)
+		: m_file(INVALID_HANDLE_VALUE)
+		, m_map(NULL)
+#else //defined(_WIN32)
+		: m_fd(-1)
+#endif //defined(_WIN32)
+		, m_pos(0)
+		, m_view(NULL)
+		, m_view_size(0)
+	{
+	}
+
+	~FileStream()
+	{
+		Close();
+	}
+
+	//-------------------------------------------------------------------------
+	// 開く（読み取り専用、先頭から順に読むものとして扱う）
+	//-------------------------------------------------------------------------
+	bool Open(const wchar_t* path)
+	{
+		Close();
+
+#if defined(_WIN32)
+		m_file = CreateFileW(path, GENERIC_READ,
+			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (m_file == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+#else //defined(_WIN32)
+		size_t length = wcstombs(NULL, path, 0);
+		if (length == static_cast<size_t>(-1)) {
+			return false;
+		}
+
+		char* name = static_cast<char*>(malloc(length + 1));
+		if (!name) {
+			return false;
+		}
+
+		wcstombs(name, path, length + 1);
+		m_fd = open(name, O_RDONLY);
+		free(name);
+
+		if (m_fd < 0) {
+			return false;
+		}
+
+		posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif //defined(_WIN32)
+
+		m_pos = 0;
+		return true;
+	}
+
+	//-------------------------------------------------------------------------
+	// 閉じる
+	//-------------------------------------------------------------------------
+	void Close()
+	{
+		Unmap();
+
+#if defined(_WIN32)
+		if (m_file != INVALID_HANDLE_VALUE) {
+			CloseHandle(m_file);
+			m_file = INVALID_HANDLE_VALUE;
+		}
+#else //defined(_WIN32)
+		if (m_fd >= 0) {
+			close(m_fd);
+			m_fd = -1;
+		}
+#endif //defined(_WIN32)
+
+		m_pos = 0;
+	}
+
+	//-------------------------------------------------------------------------
+	// 開いているか？
+	//-------------------------------------------------------------------------
+	bool IsOpen() const
+	{
+#if defined(_WIN32)
+		return (m_file != INVALID_HANDLE_VALUE);
+#else //defined(_WIN32)
+		return (m_fd >= 0);
+#endif //defined(_WIN32)
+	}
+
+	//-------------------------------------------------------------------------
+	// 現在位置から読み取り、読み取ったバイト数を返す（エラー時は0）
+	//-------------------------------------------------------------------------
+	DWORD Read(void* buffer, DWORD size)
+	{
+		DWORD readed = ReadAt(m_pos, buffer, size);
+		m_pos += readed;
+		return readed;
+	}
+
+	//-------------------------------------------------------------------------
+	// 位置を指定して読み取る（現在位置は変えない）
+	//-------------------------------------------------------------------------
+	DWORD ReadAt(ULONGLONG pos, void* buffer, DWORD size) const
+	{
+		if (!IsOpen() || size == 0) {
+			return 0;
+		}
+
+#if defined(_WIN32)
+		// 同期ハンドルでも、OVERLAPPEDで位置を指定できる
+		// （CRTなしでmemsetを呼ばないように、個別に初期化する）
+		OVERLAPPED ov;
+		ov.Internal = 0;
+		ov.InternalHigh = 0;
+		ov.Offset = static_cast<DWORD>(pos);
+		ov.OffsetHigh = static_cast<DWORD>(pos >> 32);
+		ov.hEvent = NULL;
+
+		DWORD readed = 0;
+		if (!ReadFile(m_file, buffer, size, &readed, &ov)) {
+			return 0;
+		}
+
+		return readed;
+#else //defined(_WIN32)
+		BYTE* dest = static_cast<BYTE*>(buffer);
+		DWORD done = 0;
+		while (done < size) {
+			ssize_t readed = pread(m_fd, dest + done, size - done, static_cast<off_t>(pos) + done);
+			if (readed <= 0) {
+				break;
+			}
+
+			done += static_cast<DWORD>(readed);
+		}
+
+		return done;
+#endif //defined(_WIN32)
+	}
+
+	//-------------------------------------------------------------------------
+	// 読み取り位置を設定（先頭から）
+	//-------------------------------------------------------------------------
+	void Seek(DWORD pos)
+	{
+		m_pos = pos;
+	}
+
+	//-------------------------------------------------------------------------
+	// 読み取り位置を進める（負なら戻す）
+	//-------------------------------------------------------------------------
+	void Skip(LONG offset)
+	{
+		m_pos += offset;
+	}
+
+	//-------------------------------------------------------------------------
+	// 読み取り位置を取得
+	//-------------------------------------------------------------------------
+	DWORD Tell() const
+	{
+		return static_cast<DWORD>(m_pos);
+	}
+
+	//-------------------------------------------------------------------------
+	// 読み取り位置を設定（先頭から、64bit）
+	//-------------------------------------------------------------------------
+	void Seek64(ULONGLONG pos)
+	{
+		m_pos = pos;
+	}
+
+	//-------------------------------------------------------------------------
+	// 読み取り位置を取得（64bit）
+	//-------------------------------------------------------------------------
+	ULONGLONG Tell64() const
+	{
+		return m_pos;
+	}
+
+	//-------------------------------------------------------------------------
+	// ファイルサイズ取得（録音中のファイル等のため、毎回問い合わせる）
+	//-------------------------------------------------------------------------
+	DWORD GetSize() const
+	{
+		if (!IsOpen()) {
+			return 0;
+		}
+
+#if defined(_WIN32)
+		DWORD size = GetFileSize(m_file, NULL);
+		return (size == INVALID_FILE_SIZE)? 0 : size;
+#else //defined(_WIN32)
+		struct stat st;
+		if (fstat(m_fd, &st) != 0) {
+			return 0;
+		}
+
+		return static_cast<DWORD>(st.st_size);
+#endif //defined(_WIN32)
+	}
+
+	//-------------------------------------------------------------------------
+	// ファイルサイズ取得（64bit、取得できなければ0）
+	//-------------------------------------------------------------------------
+	ULONGLONG GetSize64() const
+	{
+		if (!IsOpen()) {
+			return 0;
+		}
+
+#if defined(_WIN32)
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(m_file, &size)) {
+			return 0;
+		}
+
+		return static_cast<ULONGLONG>(size.QuadPart);
+#else //defined(_WIN32)
+		struct stat st;
+		if (fstat(m_fd, &st) != 0) {
+			return 0;
+		}
+
+		return static_cast<ULONGLONG>(st.st_size);
+#endif //defined(_WIN32)
+	}
+
+	//-------------------------------------------------------------------------
+	// 指定時間（ミリ秒）以内に更新されたか？（録音中のファイルの判定用）
+	//-------------------------------------------------------------------------
+	bool IsWrittenWithin(DWORD ms) const
+	{
+		if (!IsOpen()) {
+			return false;
+		}
+
+#if defined(_WIN32)
+		FILETIME write_time, now;
+		if (!GetFileTime(m_file, NULL, NULL, &write_time)) {
+			return false;
+		}
+
+		GetSystemTimeAsFileTime(&now);
+
+		ULARGE_INTEGER t1, t2;
+		t1.LowPart = write_time.dwLowDateTime;
+		t1.HighPart = write_time.dwHighDateTime;
+		t2.LowPart = now.dwLowDateTime;
+		t2.HighPart = now.dwHighDateTime;
+
+		return (t2.QuadPart <= t1.QuadPart + ULONGLONG(ms) * 10000);
+#else //defined(_WIN32)
+		struct stat st;
+		if (fstat(m_fd, &st) != 0) {
+			return false;
+		}
+
+		return (time(NULL) <= st.st_mtime + static_cast<time_t>((ms + 999) / 1000));
+#endif //defined(_WIN32)
+	}
+
+	//-------------------------------------------------------------------------
+	// ファイル全体を読み取り専用でマップする（できなければNULL）
+	// ・サイズは、マップした時点のGetSize()。
+	//-------------------------------------------------------------------------
+	const BYTE* Map()
+	{
+		if (m_view) {
+			return m_view;
+		}
+
+		DWORD size = GetSize();
+		if (size == 0) {
+			return NULL;
+		}
+
+#if defined(_WIN32)
+		m_map = CreateFileMappingW(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (!m_map) {
+			return NULL;
+		}
+
+		m_view = static_cast<BYTE*>(MapViewOfFile(m_map, FILE_MAP_READ, 0, 0, 0));
+		if (!m_view) {
+			CloseHandle(m_map);
+			m_map = NULL;
+			return NULL;
+		}
+#else //defined(_WIN32)
+		void* view = mmap(NULL, size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+		if (view == MAP_FAILED) {
+			return NULL;
+		}
+
+		m_view = static_cast<BYTE*>(view);
+#endif //defined(_WIN32)
+
+		m_view_size = size;
+		return m_view;
+	}
+
+	//-------------------------------------------------------------------------
+	// マップを解除
+	//-------------------------------------------------------------------------
+	void Unmap()
+	{
+		if (!m_view) {
+			return;
+		}
+
+#if defined(_WIN32)
+		UnmapViewOfFile(m_view);
+		CloseHandle(m_map);
+		m_map = NULL;
+#else //defined(_WIN32)
+		munmap(m_view, m_view_size);
+#endif //defined(_WIN32)
+
+		m_view = NULL;
+		m_view_size = 0;
+	}
+
+private:
+	FileStream(const FileStream&);
+	FileStream& operator=(const FileStream&);
+
+private:
+#if defined(_WIN32)
+	HANDLE		m_file;
+	HANDLE		m_map;
+#else //defined(_WIN32)
+	int			m_fd;
+#endif //defined(_WIN32)
+	ULONGLONG	m_pos;			// 読み取り位置
+	BYTE*		m_view;			// マップしたファイル
+	DWORD		m_view_size;
+};
@@ -0,0 +1,564 @@
+﻿//=============================================================================
+// メタデータキャッシュ (2016/10/01版)
+//                                                Copyright (c) 2006-2016 MAYO.
+//=============================================================================
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "luna_pi.h"
+#include "plugin_ini.h"
+
+//-----------------------------------------------------------------------------
+// メタデータキャッシュ
+// ・解析結果を、DLLと同じ場所の拡張子を.cacheにしたファイルに保存する。
+// ・パスのハッシュ値、ファイルサイズ、更新日時、プラグインと解析結果のバージョンが
+//   一致すれば、ファイルを開かずにメタデータを返す。
+// ・ファイルはメモリマップして、ハッシュ表で検索する。
+//   登録は末尾への追加のみで、ハッシュ表を広げる時も末尾に作り直す。
+// ・CRTなしでも使えるように、コンストラクタは持たない（static変数で使用する）。
+//   CRTなしでビルドする場合は、先にCopyMemoryを再定義しておくこと。
+// ・64bitの演算はCRTが必要になるので、ハッシュ値等は32bit２つで扱う。
+//-----------------------------------------------------------------------------
+class MetaCache
+{
+public:
+	//-------------------------------------------------------------------------
+	// 開く
+	// ・plugin_nameは、バージョンを含むプラグイン名（変わると全て無効になる）。
+	// ・parser_versionは、解析結果の版（解析結果が変わる変更をしたら上げる。
+	//   プラグインのバージョンを変えなくても、全て無効になる）。
+	// ・開けなければ、キャッシュなしで動作する。
+	//-------------------------------------------------------------------------
+	bool Open(HINSTANCE instance, const wchar_t* plugin_name, DWORD parser_version)
+	{
+		if (m_file) {
+			return true;
+		}
+
+		wchar_t path[MAX_PATH];
+		if (!GetPluginFilePath(instance, L".cache", path)) {
+			return false;
+		}
+
+		// 他のプロセスと同時には更新できないので、共有しない
+		m_file = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+			OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (m_file == INVALID_HANDLE_VALUE) {
+			m_file = NULL;
+			return false;
+		}
+
+		DWORD file_size = GetFileSize(m_file, NULL);
+		if (file_size == INVALID_FILE_SIZE || file_size > MAX_FILE_SIZE) {
+			file_size = 0;
+		}
+
+		if (!Map(file_size < INITIAL_SIZE? INITIAL_SIZE : file_size)) {
+			CloseHandle(m_file);
+			m_file = NULL;
+			return false;
+		}
+
+		// 壊れている、形式が違う、無効な部分が多すぎる場合は作り直す
+		if (!IsValid(file_size) || GetHeader()->garbage > GetHeader()->used / 2) {
+			Reset();
+		}
+
+		DWORD name_hash = 0;
+		Hash(plugin_name, m_version, name_hash);
+		m_version ^= parser_version;
+
+		InitializeCriticalSection(&m_lock);
+		return true;
+	}
+
+	//-------------------------------------------------------------------------
+	// 閉じる（プラグイン解放時に呼ぶこと）
+	//-------------------------------------------------------------------------
+	void Close()
+	{
+		if (!m_file) {
+			return;
+		}
+
+		Unmap();
+		CloseHandle(m_file);
+		m_file = NULL;
+
+		DeleteCriticalSection(&m_lock);
+	}
+
+	//-------------------------------------------------------------------------
+	// 検索（見つかればmetaに設定する）
+	//-------------------------------------------------------------------------
+	bool Lookup(const wchar_t* path, Metadata* meta)
+	{
+		if (!m_file) {
+			return false;
+		}
+
+		Key key;
+		if (!MakeKey(path, key)) {
+			return false;
+		}
+
+		bool result = false;
+
+		EnterCriticalSection(&m_lock);
+
+		DWORD* bucket = m_view? FindBucket(key) : NULL;
+		if (bucket && *bucket) {
+			const Entry* entry = GetEntry(*bucket);
+			if (entry && IsSame(*entry, key)) {
+				Unpack(*entry, meta);
+				result = true;
+			}
+		}
+
+		LeaveCriticalSection(&m_lock);
+		return result;
+	}
+
+	//-------------------------------------------------------------------------
+	// 登録（同じパスが登録済みなら、置き換える）
+	//-------------------------------------------------------------------------
+	void Store(const wchar_t* path, const Metadata* meta)
+	{
+		if (!m_file) {
+			return;
+		}
+
+		Key key;
+		if (!MakeKey(path, key)) {
+			return;
+		}
+
+		WORD length[TEXT_NUM];
+		const wchar_t* text[TEXT_NUM];
+		GetTexts(meta, text);
+
+		DWORD size = sizeof(Entry);
+		for (int i = 0; i < TEXT_NUM; ++i) {
+			length[i] = static_cast<WORD>(lstrlenW(text[i]));
+			size += length[i] * sizeof(wchar_t);
+		}
+
+		size = (size + 3) & ~3;
+
+		EnterCriticalSection(&m_lock);
+
+		// 使用率が半分を超えたら、ハッシュ表を広げる
+		if (m_view && (GetHeader()->count + 1) * 2 > GetHeader()->table_size) {
+			GrowTable();
+		}
+
+		// 広げられずに再マップにも失敗した場合は、m_viewがNULLになっている
+		DWORD* bucket = m_view? FindBucket(key) : NULL;
+		if (bucket && Reserve(GetHeader()->used + size)) {
+			// Reserveで再マップされるので、探し直す
+			bucket = FindBucket(key);
+
+			Header* header = GetHeader();
+			if (*bucket) {
+				header->garbage += GetEntrySize(*GetEntry(*bucket));
+			}
+			else {
+				++header->count;
+			}
+
+			Entry* entry = reinterpret_cast<Entry*>(m_view + header->used);
+			entry->key = key;
+			entry->key.version = m_version;
+			entry->duration = meta->duration;
+			entry->seekable = meta->seekable;
+
+			wchar_t* dest = reinterpret_cast<wchar_t*>(entry + 1);
+			for (int i = 0; i < TEXT_NUM; ++i) {
+				entry->length[i] = length[i];
+				CopyMemory(dest, text[i], length[i] * sizeof(wchar_t));
+				dest += length[i];
+			}
+
+			// エントリを書き終えてから、ハッシュ表に登録する
+			DWORD offset = header->used;
+			header->used += size;
+			*bucket = offset;
+		}
+
+		LeaveCriticalSection(&m_lock);
+	}
+
+private:
+	// 定数
+	enum
+	{
+		MAGIC			= 0x31434D4C,	// 'LMC1'
+		FORMAT			= 1,			// ファイル構造のバージョン
+		INITIAL_SIZE	= 0x100000,		// 最初のファイルサイズ
+		GROW_UNIT		= 0x10000,		// ファイルを広げる単位
+		MAX_FILE_SIZE	= 0x10000000,	// ファイルサイズの上限
+		INITIAL_TABLE	= 4096,			// 最初のハッシュ表のバケット数
+		TEXT_NUM		= 4,			// 保存する文字列の数
+	};
+
+	// ファイルヘッダ
+	struct Header
+	{
+		DWORD	magic;
+		DWORD	format;
+		DWORD	used;		// 使用済みバイト数（ヘッダを含む）
+		DWORD	garbage;	// 置き換え等で使われなくなったバイト数
+		DWORD	table;		// ハッシュ表の位置
+		DWORD	table_size;	// ハッシュ表のバケット数（２のべき乗）
+		DWORD	count;		// 登録数
+		DWORD	reserved;
+	};
+
+	// 検索キー
+	struct Key
+	{
+		DWORD		hash[2];	// パスのハッシュ値（大文字小文字は区別しない）
+		DWORD		size[2];	// ファイルサイズ（下位、上位）
+		FILETIME	mtime;		// 更新日時
+		DWORD		version;	// プラグインのバージョン
+	};
+
+	// エントリ（続けて、終端なしの文字列が並ぶ）
+	struct Entry
+	{
+		Key		key;
+		int		duration;
+		int		seekable;
+		WORD	length[TEXT_NUM];	// title, artist, album, extraの文字数
+	};
+
+	//-------------------------------------------------------------------------
+	// ファイルをsizeバイトにしてマップする
+	//-------------------------------------------------------------------------
+	bool Map(DWORD size)
+	{
+		m_map = CreateFileMappingW(m_file, NULL, PAGE_READWRITE, 0, size, NULL);
+		if (!m_map) {
+			return false;
+		}
+
+		m_view = static_cast<BYTE*>(MapViewOfFile(m_map, FILE_MAP_WRITE, 0, 0, size));
+		if (!m_view) {
+			CloseHandle(m_map);
+			m_map = NULL;
+			return false;
+		}
+
+		m_view_size = size;
+		return true;
+	}
+
+	//-------------------------------------------------------------------------
+	// マップを解除する
+	//-------------------------------------------------------------------------
+	void Unmap()
+	{
+		if (m_view) {
+			UnmapViewOfFile(m_view);
+			m_view = NULL;
+		}
+
+		if (m_map) {
+			CloseHandle(m_map);
+			m_map = NULL;
+		}
+
+		m_view_size = 0;
+	}
+
+	//-------------------------------------------------------------------------
+	// sizeバイトまで使えるようにする（広げる場合は再マップする）
+	//-------------------------------------------------------------------------
+	bool Reserve(DWORD size)
+	{
+		if (size <= m_view_size) {
+			return true;
+		}
+
+		if (size > MAX_FILE_SIZE) {
+			return false;
+		}
+
+		DWORD new_size = m_view_size * 2;
+		if (new_size < size) {
+			new_size = (size + GROW_UNIT - 1) & ~(GROW_UNIT - 1);
+		}
+
+		if (new_size > MAX_FILE_SIZE) {
+			new_size = MAX_FILE_SIZE;
+		}
+
+		DWORD old_size = m_view_size;
+		Unmap();
+
+		if (!Map(new_size)) {
+			// 元のサイズで戻せなければ、キャッシュなしで動作する
+			Map(old_size);
+			return false;
+		}
+
+		return true;
+	}
+
+	//-------------------------------------------------------------------------
+	// ヘッダ取得
+	//-------------------------------------------------------------------------
+	Header* GetHeader() const
+	{
+		return reinterpret_cast<Header*>(m_view);
+	}
+
+	//-------------------------------------------------------------------------
+	// 開いたファイルの内容が正しいか？
+	//-------------------------------------------------------------------------
+	bool IsValid(DWORD file_size) const
+	{
+		const Header* header = GetHeader();
+		if (file_size < sizeof(Header) || header->magic != MAGIC || header->format != FORMAT) {
+			return false;
+		}
+
+		if (header->used > file_size || header->table_size == 0) {
+			return false;
+		}
+
+		if ((header->table_size & (header->table_size - 1)) != 0) {
+			return false;
+		}
+
+		return (header->table >= sizeof(Header)
+			&& header->table_size <= (header->used - header->table) / sizeof(DWORD));
+	}
+
+	//-------------------------------------------------------------------------
+	// 空にする
+	//-------------------------------------------------------------------------
+	void Reset()
+	{
+		Header* header = GetHeader();
+		header->magic = MAGIC;
+		header->format = FORMAT;
+		header->table = sizeof(Header);
+		header->table_size = INITIAL_TABLE;
+		header->used = header->table + INITIAL_TABLE * sizeof(DWORD);
+		header->garbage = 0;
+		header->count = 0;
+		header->reserved = 0;
+
+		DWORD* table = reinterpret_cast<DWORD*>(m_view + header->table);
+		for (DWORD i = 0; i < INITIAL_TABLE; ++i) {
+			table[i] = 0;
+		}
+	}
+
+	//-------------------------------------------------------------------------
+	// ハッシュ表を２倍にして、末尾に作り直す
+	//-------------------------------------------------------------------------
+	void GrowTable()
+	{
+		DWORD old_size = GetHeader()->table_size;
+		DWORD new_size = old_size * 2;
+		DWORD new_table = GetHeader()->used;
+		if (!Reserve(new_table + new_size * sizeof(DWORD))) {
+			return;
+		}
+
+		Header* header = GetHeader();
+		const DWORD* src = reinterpret_cast<const DWORD*>(m_view + header->table);
+		DWORD* dest = reinterpret_cast<DWORD*>(m_view + new_table);
+		for (DWORD i = 0; i < new_size; ++i) {
+			dest[i] = 0;
+		}
+
+		DWORD mask = new_size - 1;
+		for (DWORD i = 0; i < old_size; ++i) {
+			const Entry* entry = src[i]? GetEntry(src[i]) : NULL;
+			if (entry) {
+				DWORD pos = entry->key.hash[0] & mask;
+				while (dest[pos]) {
+					pos = (pos + 1) & mask;
+				}
+
+				dest[pos] = src[i];
+			}
+		}
+
+		header->garbage += old_size * sizeof(DWORD);
+		header->table = new_table;
+		header->table_size = new_size;
+		header->used = new_table + new_size * sizeof(DWORD);
+	}
+
+	//-------------------------------------------------------------------------
+	// キーのバケットを探す（なければ空きバケット、表が一杯ならNULL）
+	//-------------------------------------------------------------------------
+	DWORD* FindBucket(const Key& key) const
+	{
+		const Header* header = GetHeader();
+		DWORD* table = reinterpret_cast<DWORD*>(m_view + header->table);
+		DWORD mask = header->table_size - 1;
+		DWORD pos = key.hash[0] & mask;
+
+		for (DWORD i = 0; i < header->table_size; ++i) {
+			if (!table[pos]) {
+				return &table[pos];
+			}
+
+			const Entry* entry = GetEntry(table[pos]);
+			if (!entry) {
+				return NULL;
+			}
+
+			if (entry->key.hash[0] == key.hash[0] && entry->key.hash[1] == key.hash[1]) {
+				return &table[pos];
+			}
+
+			pos = (pos + 1) & mask;
+		}
+
+		return NULL;
+	}
+
+	//-------------------------------------------------------------------------
+	// エントリ取得（範囲外ならNULL）
+	//-------------------------------------------------------------------------
+	const Entry* GetEntry(DWORD offset) const
+	{
+		const Header* header = GetHeader();
+		if (offset < sizeof(Header) || offset > header->used - sizeof(Entry)) {
+			return NULL;
+		}
+
+		const Entry* entry = reinterpret_cast<const Entry*>(m_view + offset);
+		if (offset + GetEntrySize(*entry) > header->used) {
+			return NULL;
+		}
+
+		return entry;
+	}
+
+	//-------------------------------------------------------------------------
+	// エントリのバイト数
+	//-------------------------------------------------------------------------
+	static DWORD GetEntrySize(const Entry& entry)
+	{
+		DWORD size = sizeof(Entry);
+		for (int i = 0; i < TEXT_NUM; ++i) {
+			size += entry.length[i] * sizeof(wchar_t);
+		}
+
+		return (size + 3) & ~3;
+	}
+
+	//-------------------------------------------------------------------------
+	// 検索キー作成（ファイルは開かずに、属性だけ取得する）
+	//-------------------------------------------------------------------------
+	static bool MakeKey(const wchar_t* path, Key& key)
+	{
+		WIN32_FILE_ATTRIBUTE_DATA data;
+		if (!GetFileAttributesExW(path, GetFileExInfoStandard, &data)) {
+			return false;
+		}
+
+		if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			return false;
+		}
+
+		Hash(path, key.hash[0], key.hash[1]);
+
+		key.size[0] = data.nFileSizeLow;
+		key.size[1] = data.nFileSizeHigh;
+		key.mtime = data.ftLastWriteTime;
+		key.version = 0;
+		return true;
+	}
+
+	//-------------------------------------------------------------------------
+	// 登録済みのキーと一致するか？
+	//-------------------------------------------------------------------------
+	bool IsSame(const Entry& entry, const Key& key) const
+	{
+		return (entry.key.size[0] == key.size[0]
+			&& entry.key.size[1] == key.size[1]
+			&& entry.key.mtime.dwLowDateTime == key.mtime.dwLowDateTime
+			&& entry.key.mtime.dwHighDateTime == key.mtime.dwHighDateTime
+			&& entry.key.version == m_version);
+	}
+
+	//-------------------------------------------------------------------------
+	// 文字列のハッシュ値（FNV-1aとDJBを、大文字小文字を区別せずに）
+	//-------------------------------------------------------------------------
+	static void Hash(const wchar_t* str, DWORD& hash1, DWORD& hash2)
+	{
+		DWORD h1 = 2166136261U;
+		DWORD h2 = 5381;
+		for (; *str; ++str) {
+			DWORD c = *str;
+			if (c >= L'A' && c <= L'Z') {
+				c += L'a' - L'A';
+			}
+
+			h1 = (h1 ^ c) * 16777619U;
+			h2 = h2 * 33 + c;
+		}
+
+		hash1 = h1;
+		hash2 = h2;
+	}
+
+	//-------------------------------------------------------------------------
+	// Metadataの文字列の位置
+	//-------------------------------------------------------------------------
+	static void GetTexts(const Metadata* meta, const wchar_t* text[TEXT_NUM])
+	{
+		text[0] = meta->title;
+		text[1] = meta->artist;
+		text[2] = meta->album;
+		text[3] = meta->extra;
+	}
+
+	//-------------------------------------------------------------------------
+	// エントリからMetadataに展開する
+	//-------------------------------------------------------------------------
+	static void Unpack(const Entry& entry, Metadata* meta)
+	{
+		wchar_t* text[TEXT_NUM] =
+		{
+			meta->title, meta->artist, meta->album, meta->extra,
+		};
+
+		meta->duration = entry.duration;
+		meta->seekable = entry.seekable;
+
+		const wchar_t* src = reinterpret_cast<const wchar_t*>(&entry + 1);
+		for (int i = 0; i < TEXT_NUM; ++i) {
+			int length = (entry.length[i] > META_MAXLEN)? META_MAXLEN : entry.length[i];
+			CopyMemory(text[i], src, length * sizeof(wchar_t));
+			text[i][length] = L'\0';
+			src += entry.length[i];
+		}
+	}
+
+private:
+	HANDLE				m_file;			// 開いていなければNULL
+	HANDLE				m_map;
+	BYTE*				m_view;			// マップしたファイル（NULLならキャッシュなし）
+	DWORD				m_view_size;	// マップしたバイト数
+	DWORD				m_version;		// プラグイン名のハッシュ値と、解析結果の版
+	CRITICAL_SECTION	m_lock;			// Open()で初期化する
+};
+
+//-----------------------------------------------------------------------------
+// メタデータキャッシュを使うか？
+// ・[Config]MetaCacheを読む。1（既定値）なら使う。
+//-----------------------------------------------------------------------------
+inline bool IsMetaCacheEnabled(HINSTANCE instance)
+{
+	return (GetPluginIniInt(instance, L"MetaCache", 1) != 0);
+}
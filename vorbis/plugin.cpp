@@ -5,6 +5,11 @@
 #include <windows.h>
 #include "vorbis/vorbisfile.h"
 #include "luna_pi.h"
+#include "file_stream.h"
+#include "decode_ahead.h"
+#include "pre_open.h"
+#include "batch_parser.h"
+#include "meta_cache.h"
 
 //-----------------------------------------------------------------------------
 // 定義
@@ -15,6 +20,9 @@ namespace {
 const UINT DECODE_SIZE = 4096;
 const UINT DECODE_BITS = 16;
 
+// 解析結果の版（Parseの結果が変わる変更をしたら上げて、メタデータキャッシュを無効にする）
+const DWORD PARSER_VERSION = 1;
+
 // 再生時コンテキスト
 struct Context
 {
@@ -22,15 +30,36 @@ struct Context
 	char			data[DECODE_SIZE];	// デコード用バッファ
 	int				size;				// データサイズ
 	int				used;				// データ使用量
+	int				align;				// １サンプルのバイト数
+	DecodeAhead		ahead;				// 先読み（有効時は、ovfは先読みスレッドだけが操作する）
+	__int64			ahead_base;			// 先読み開始時のサンプル位置
 };
 
 } //namespace
 
+// プラグイン構造体（GetLunaPluginは、baseの部分を返す）
+static LunaPlugin2 g_plugin;
+
+// 先読みする時間（ミリ秒、0なら先読みしない）
+static int g_ahead_time = 0;
+
+// 次の曲の事前準備
+static PreOpen g_pre_open;
+
+// 一括解析
+static BatchParser g_batch_parser;
+
+// メタデータキャッシュ
+static MetaCache g_meta_cache;
+
 // プロトタイプ宣言
 static int FileClose(void* datasource);
 static size_t FileRead(void* ptr, size_t size, size_t nmemb, void* datasource);
 static int FileSeek(void* datasource, ogg_int64_t offset, int whence);
 static long FileTell(void* datasource);
+static int DecodePcm(void* context, void* buffer, int size);
+static __int64 GetPosition(Context* cxt);
+static void StartAhead(Context* cxt);
 
 //-----------------------------------------------------------------------------
 // Dll Entry Point
@@ -58,9 +87,9 @@ static void LPAPI Property(HINSTANCE inst, HWND parent)
 }
 
 //-----------------------------------------------------------------------------
-// 解析
+// ファイルを解析（一括解析では、スレッド毎に使い回すオブジェクトはない）
 //-----------------------------------------------------------------------------
-static int LPAPI Parse(const wchar_t* path, Metadata* meta)
+static int ParseFile(void* /*worker*/, const wchar_t* path, Metadata* meta)
 {
 	OggVorbis_File ovf;
 	ov_callbacks ovc;
@@ -70,15 +99,18 @@ static int LPAPI Parse(const wchar_t* path, Metadata* meta)
 	ovc.close_func = FileClose;
 	ovc.tell_func  = FileTell;
 
-	HANDLE file = CreateFile(path, GENERIC_READ,
-		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
-		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-	if (file == INVALID_HANDLE_VALUE) {
+	FileStream* file = new FileStream();
+	if (!file) {
+		return false;
+	}
+
+	if (!file->Open(path)) {
+		delete file;
 		return false;
 	}
 
 	if (ov_open_callbacks(file, &ovf, NULL, -1, ovc) < 0) {
-		CloseHandle(file);
+		delete file;
 		return false;
 	}
 
@@ -111,25 +143,54 @@ static int LPAPI Parse(const wchar_t* path, Metadata* meta)
 }
 
 //-----------------------------------------------------------------------------
-// 再生するデータを開く
+// 解析（キャッシュにあれば、ファイルは開かない）
 //-----------------------------------------------------------------------------
-static Handle LPAPI Open(const wchar_t* path, Output* out)
+static int LPAPI Parse(const wchar_t* path, Metadata* meta)
+{
+	if (g_meta_cache.Lookup(path, meta)) {
+		return true;
+	}
+
+	if (!ParseFile(NULL, path, meta)) {
+		return false;
+	}
+
+	g_meta_cache.Store(path, meta);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// 一括解析
+//-----------------------------------------------------------------------------
+static int LPAPI ParseBatch(const wchar_t* const* paths, int count, ParseCallback callback, void* user)
+{
+	return g_batch_parser.Run(paths, count, callback, user);
+}
+
+//-----------------------------------------------------------------------------
+// 再生するデータを開く（ahead_timeミリ秒分を先読みする）
+//-----------------------------------------------------------------------------
+static Handle OpenContext(const wchar_t* path, Output* out, int ahead_time)
 {
-	HANDLE file = CreateFile(path, GENERIC_READ,
-		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
-		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-	if (file == INVALID_HANDLE_VALUE) {
+	FileStream* file = new FileStream();
+	if (!file) {
+		return NULL;
+	}
+
+	if (!file->Open(path)) {
+		delete file;
 		return NULL;
 	}
 
 	Context* cxt = new Context();
 	if (!cxt) {
-		CloseHandle(file);
+		delete file;
 		return NULL;
 	}
 
 	cxt->size = 0;
 	cxt->used = 0;
+	cxt->ahead_base = 0;
 
 	ov_callbacks ovc;
 
@@ -140,7 +201,7 @@ static Handle LPAPI Open(const wchar_t* path, Output* out)
 
 	if (ov_open_callbacks(file, &cxt->ovf, NULL, -1, ovc) < 0) {
 		delete cxt;
-		CloseHandle(file);
+		delete file;
 		return NULL;
 	}
 
@@ -151,13 +212,45 @@ static Handle LPAPI Open(const wchar_t* path, Output* out)
 		return NULL;
 	}
 
+	cxt->align = vi->channels * DECODE_BITS / 8;
+
 	out->sample_rate	= vi->rate;
 	out->sample_bits	= DECODE_BITS;
 	out->num_channels	= vi->channels;
 	out->unit_length	= DECODE_SIZE;
+
+	if (ahead_time > 0) {
+		int size = MulDiv(vi->rate * cxt->align, ahead_time, 1000);
+		if (cxt->ahead.Init(DecodePcm, cxt, size, DECODE_SIZE * 4, cxt->align)) {
+			StartAhead(cxt);
+		}
+	}
+
 	return cxt;
 }
 
+//-----------------------------------------------------------------------------
+// 再生するデータを開く（事前準備していれば、それを返す）
+//-----------------------------------------------------------------------------
+static Handle LPAPI Open(const wchar_t* path, Output* out)
+{
+	Handle handle = g_pre_open.Take(path, out);
+	if (handle) {
+		return handle;
+	}
+
+	return OpenContext(path, out, g_ahead_time);
+}
+
+//-----------------------------------------------------------------------------
+// 事前準備で開く（先読みしない設定でも、先頭はデコードしておく）
+//-----------------------------------------------------------------------------
+static Handle PrepareContext(const wchar_t* path, Output* out)
+{
+	int ahead_time = (g_ahead_time > 0)? g_ahead_time : PreOpen::PREROLL_TIME;
+	return OpenContext(path, out, ahead_time);
+}
+
 //-----------------------------------------------------------------------------
 // 再生するデータを閉じる
 //-----------------------------------------------------------------------------
@@ -165,6 +258,7 @@ static void LPAPI Close(Handle handle)
 {
 	Context* cxt = static_cast<Context*>(handle);
 	if (cxt) {
+		cxt->ahead.Release();
 		ov_clear(&cxt->ovf);
 		delete cxt;
 	}
@@ -180,6 +274,20 @@ static int LPAPI Render(Handle handle, void* buffer, int size)
 		return 0;
 	}
 
+	if (cxt->ahead.IsActive()) {
+		return cxt->ahead.Read(buffer, size);
+	}
+
+	return DecodePcm(cxt, buffer, size);
+}
+
+//-----------------------------------------------------------------------------
+// 16bit PCMでのデコード（先読みスレッドからも呼ぶ）
+//-----------------------------------------------------------------------------
+int DecodePcm(void* context, void* buffer, int size)
+{
+	Context* cxt = static_cast<Context*>(context);
+
 	int used = cxt->size - cxt->used;
 	if (used > 0) {
 		CopyMemory(buffer, cxt->data + cxt->used, used);
@@ -208,6 +316,76 @@ static int LPAPI Render(Handle handle, void* buffer, int size)
 	return used;
 }
 
+//-----------------------------------------------------------------------------
+// float形式での読み取り
+//-----------------------------------------------------------------------------
+static int LPAPI RenderFloat(Handle handle, float** planes, int frames)
+{
+	Context* cxt = static_cast<Context*>(handle);
+	if (!cxt || !planes) {
+		return 0;
+	}
+
+	const int channels = cxt->align / (DECODE_BITS / 8);
+
+	// 先読みしている場合は、16bitからfloatに戻す
+	if (cxt->ahead.IsActive()) {
+		short temp[DECODE_SIZE / sizeof(short)];
+		const int chunk = sizeof(temp) / cxt->align;
+
+		int used = 0;
+		while (used < frames) {
+			int count = (chunk > frames - used)? (frames - used) : chunk;
+			int readed = cxt->ahead.Read(temp, count * cxt->align) / cxt->align;
+			if (readed <= 0) {
+				break;
+			}
+
+			const short* src = temp;
+			for (int i = 0; i < readed; ++i) {
+				for (int ch = 0; ch < channels; ++ch) {
+					planes[ch][used + i] = static_cast<float>(*src++) * (1.0f / 32768.0f);
+				}
+			}
+
+			used += readed;
+		}
+
+		return used;
+	}
+
+	// Render()でデコード済みの残りがあれば、16bitからfloatに戻す
+	const short* rest = reinterpret_cast<const short*>(cxt->data + cxt->used);
+
+	int used = (cxt->size - cxt->used) / cxt->align;
+	used = (used > frames)? frames : used;
+	for (int i = 0; i < used; ++i) {
+		for (int ch = 0; ch < channels; ++ch) {
+			planes[ch][i] = static_cast<float>(*rest++) * (1.0f / 32768.0f);
+		}
+	}
+
+	cxt->used += used * cxt->align;
+
+	// 以降は、量子化せずにそのまま渡す
+	while (used < frames) {
+		float** pcm = NULL;
+		int bitstream = 0;
+		long count = ov_read_float(&cxt->ovf, &pcm, frames - used, &bitstream);
+		if (count <= 0) {
+			break;
+		}
+
+		for (int ch = 0; ch < channels; ++ch) {
+			CopyMemory(planes[ch] + used, pcm[ch], count * sizeof(float));
+		}
+
+		used += count;
+	}
+
+	return used;
+}
+
 //-----------------------------------------------------------------------------
 // シーク
 //-----------------------------------------------------------------------------
@@ -215,25 +393,126 @@ static int LPAPI Seek(Handle handle, int time_ms)
 {
 	Context* cxt = static_cast<Context*>(handle);
 	if (cxt) {
+		cxt->ahead.Stop();
 		ov_time_seek(&cxt->ovf, double(time_ms) / 1000.0);
+
+		// デコード済みの残りは、シーク前のデータ
+		cxt->size = 0;
+		cxt->used = 0;
+
+		StartAhead(cxt);
 		return time_ms;
 	}
 
 	return 0;
 }
 
+//-----------------------------------------------------------------------------
+// サンプル単位のシーク
+//-----------------------------------------------------------------------------
+static __int64 LPAPI SeekFrame(Handle handle, __int64 frame)
+{
+	Context* cxt = static_cast<Context*>(handle);
+	if (!cxt || frame < 0) {
+		return -1;
+	}
+
+	cxt->ahead.Stop();
+
+	ogg_int64_t total = ov_pcm_total(&cxt->ovf, -1);
+	if (total >= 0 && frame > total) {
+		frame = total;
+	}
+
+	if (ov_pcm_seek(&cxt->ovf, frame) != 0) {
+		StartAhead(cxt);
+		return -1;
+	}
+
+	cxt->size = 0;
+	cxt->used = 0;
+
+	StartAhead(cxt);
+	return cxt->ahead_base;
+}
+
+//-----------------------------------------------------------------------------
+// 現在のサンプル位置取得
+//-----------------------------------------------------------------------------
+static __int64 LPAPI TellFrame(Handle handle)
+{
+	Context* cxt = static_cast<Context*>(handle);
+	if (!cxt) {
+		return -1;
+	}
+
+	// 先読み中は、ovfは先読みスレッドが進めている
+	if (cxt->ahead.IsActive()) {
+		return cxt->ahead_base + cxt->ahead.GetReadFrames();
+	}
+
+	return GetPosition(cxt);
+}
+
+//-----------------------------------------------------------------------------
+// デコーダ側のサンプル位置取得
+//-----------------------------------------------------------------------------
+__int64 GetPosition(Context* cxt)
+{
+	// デコード済みで、まだ渡していない分を差し引く
+	ogg_int64_t pos = ov_pcm_tell(&cxt->ovf);
+	if (pos < 0) {
+		return -1;
+	}
+
+	return pos - (cxt->size - cxt->used) / cxt->align;
+}
+
+//-----------------------------------------------------------------------------
+// 先読みを（再）開始
+//-----------------------------------------------------------------------------
+void StartAhead(Context* cxt)
+{
+	cxt->ahead_base = GetPosition(cxt);
+	cxt->ahead.Start();
+}
+
+//-----------------------------------------------------------------------------
+// 次の曲の事前準備
+//-----------------------------------------------------------------------------
+static int LPAPI Prepare(const wchar_t* path)
+{
+	return g_pre_open.Start(path, PrepareContext, Close);
+}
+
+//-----------------------------------------------------------------------------
+// プラグイン解放
+//-----------------------------------------------------------------------------
+static void LPAPI Release()
+{
+	g_pre_open.Cancel();
+	g_meta_cache.Close();
+}
+
 //-----------------------------------------------------------------------------
 // プラグインエクスポート関数
 //-----------------------------------------------------------------------------
-LPEXPORT LunaPlugin* GetLunaPlugin(HINSTANCE /*instance*/)
+LPEXPORT LunaPlugin* GetLunaPlugin(HINSTANCE instance)
 {
-	static LunaPlugin plugin;
+	g_ahead_time = GetDecodeAheadTime(instance);
+	g_batch_parser.Init(GetParseThreadNum(instance), ParseFile, NULL, NULL, &g_meta_cache);
+
+	LunaPlugin& plugin = g_plugin.base;
 
 	plugin.plugin_kind = KIND_PLUGIN;
 	plugin.plugin_name = L"Ogg Vorbis plugin v1.05";
 	plugin.support_type = L"*.ogg;*.oga";
 
-	plugin.Release	= NULL;
+	if (IsMetaCacheEnabled(instance)) {
+		g_meta_cache.Open(instance, plugin.plugin_name, PARSER_VERSION);
+	}
+
+	plugin.Release	= Release;
 	plugin.Property	= Property;
 	plugin.Parse	= Parse;
 	plugin.Open		= Open;
@@ -244,14 +523,33 @@ LPEXPORT LunaPlugin* GetLunaPlugin(HINSTANCE /*instance*/)
 	return &plugin;
 }
 
+//-----------------------------------------------------------------------------
+// 拡張プラグインエクスポート関数
+//-----------------------------------------------------------------------------
+LPEXPORT LunaPlugin2* GetLunaPlugin2(HINSTANCE instance)
+{
+	if (!GetLunaPlugin(instance)) {
+		return NULL;
+	}
+
+	g_plugin.version	= LUNA_PLUGIN2_VERSION;
+	g_plugin.SeekFrame	= SeekFrame;
+	g_plugin.TellFrame	= TellFrame;
+	g_plugin.RenderFloat	= RenderFloat;
+	g_plugin.Prepare	= Prepare;
+	g_plugin.ParseBatch	= ParseBatch;
+
+	return &g_plugin;
+}
+
 //-----------------------------------------------------------------------------
 // クローズ関数
 //-----------------------------------------------------------------------------
 int FileClose(void* datasource)
 {
-	HANDLE file = reinterpret_cast<HANDLE>(datasource);
+	FileStream* file = static_cast<FileStream*>(datasource);
 
-	CloseHandle(file);
+	delete file;
 	return 0;
 }
 
@@ -260,14 +558,13 @@ int FileClose(void* datasource)
 //-----------------------------------------------------------------------------
 size_t FileRead(void* ptr, size_t size, size_t nmemb, void* datasource)
 {
-	HANDLE file = reinterpret_cast<HANDLE>(datasource);
-
-	DWORD readed = 0;
-	if (!ReadFile(file, ptr, static_cast<DWORD>(size * nmemb), &readed, NULL)) {
+	FileStream* file = static_cast<FileStream*>(datasource);
+	if (size == 0) {
 		return 0;
 	}
 
-	return static_cast<size_t>(nmemb);
+	DWORD readed = file->Read(ptr, static_cast<DWORD>(size * nmemb));
+	return static_cast<size_t>(readed / size);
 }
 
 //-----------------------------------------------------------------------------
@@ -275,15 +572,22 @@ size_t FileRead(void* ptr, size_t size, size_t nmemb, void* datasource)
 //-----------------------------------------------------------------------------
 int FileSeek(void* datasource, ogg_int64_t offset, int whence)
 {
-	HANDLE file = reinterpret_cast<HANDLE>(datasource);
+	FileStream* file = static_cast<FileStream*>(datasource);
+
+	// 4GB以上のファイルもあるので、位置は64bitで扱う
+	ogg_int64_t base = 0;
+	switch (whence) {
+	case SEEK_SET: base = 0; break;
+	case SEEK_CUR: base = file->Tell64(); break;
+	case SEEK_END: base = file->GetSize64(); break;
+	default: return -1;
+	}
 
-	DWORD low  = static_cast<DWORD>(offset & 0x00000000FFFFFFFF);
-	LONG  high = static_cast<LONG>((offset >> 32) & 0x00000000FFFFFFFF);
-	if (high > 0 && offset < 0) {
-		high = -high;
+	if (base + offset < 0) {
+		return -1;
 	}
 
-	DWORD ret = SetFilePointer(file, low, &high, whence);
+	file->Seek64(base + offset);
 	return 0;
 }
 
@@ -292,8 +596,6 @@ int FileSeek(void* datasource, ogg_int64_t offset, int whence)
 //-----------------------------------------------------------------------------
 long FileTell(void* datasource)
 {
-	HANDLE file = reinterpret_cast<HANDLE>(datasource);
-
-	DWORD pos = SetFilePointer(file, 0, NULL, FILE_CURRENT);
-	return static_cast<long>(pos);
+	FileStream* file = static_cast<FileStream*>(datasource);
+	return static_cast<long>(file->Tell());
 }
@@ -0,0 +1,195 @@
+﻿//=============================================================================
+// 複数ファイルの一括解析 (2016/10/01版)
+//                                                Copyright (c) 2006-2016 MAYO.
+//=============================================================================
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "luna_pi.h"
+#include "plugin_ini.h"
+#include "meta_cache.h"
+
+//-----------------------------------------------------------------------------
+// 複数ファイルの一括解析
+// ・パスのリストを、複数のスレッドで分担して解析し、結果をコールバックで返す。
+// ・デコーダ等は、スレッド毎に作成して使い回す（不要ならNULLでよい）。
+// ・キャッシュを指定した場合は、キャッシュにないファイルだけを解析する。
+// ・CRTなしでも使えるように、コンストラクタは持たない（static変数で使用する）。
+//   CRTなしでビルドする場合は、先にZeroMemoryを再定義しておくこと。
+//-----------------------------------------------------------------------------
+class BatchParser
+{
+public:
+	// 解析関数（workerは、CreateProcで作成したスレッド毎のオブジェクト）
+	typedef int (*ParseProc)(void* worker, const wchar_t* path, Metadata* meta);
+
+	// スレッド毎のオブジェクトの作成・削除
+	typedef void* (*CreateProc)();
+	typedef void (*DeleteProc)(void* worker);
+
+	// 最大スレッド数
+	enum { MAX_THREADS = 16 };
+
+public:
+	//-------------------------------------------------------------------------
+	// 初期化
+	// ・threadsが0なら、CPU数の２倍にする（ファイルを開く待ち時間を重ねるため）。
+	// ・cacheは、使わない場合はNULLにする。
+	//-------------------------------------------------------------------------
+	void Init(int threads, ParseProc parse, CreateProc create, DeleteProc destroy, MetaCache* cache)
+	{
+		if (threads <= 0) {
+			SYSTEM_INFO si;
+			GetSystemInfo(&si);
+			threads = static_cast<int>(si.dwNumberOfProcessors) * 2;
+		}
+
+		m_threads = (threads > MAX_THREADS)? MAX_THREADS : threads;
+		m_parse = parse;
+		m_create = create;
+		m_delete = destroy;
+		m_cache = cache;
+	}
+
+	//-------------------------------------------------------------------------
+	// 一括解析（全て終わるまで戻らない）
+	// ・callbackは解析スレッドから呼び出すが、同時には呼び出さない。
+	// ・解析できたファイル数を返す。
+	//-------------------------------------------------------------------------
+	int Run(const wchar_t* const* paths, int count, ParseCallback callback, void* user) const
+	{
+		if (!m_parse || !paths || count <= 0) {
+			return 0;
+		}
+
+		Job job;
+		job.parser = this;
+		job.paths = paths;
+		job.count = count;
+		job.callback = callback;
+		job.user = user;
+		job.next = 0;
+		job.parsed = 0;
+		InitializeCriticalSection(&job.lock);
+
+		// 呼び出したスレッドも解析するので、追加するのは１つ少なく
+		int threads = (m_threads > count)? count : m_threads;
+
+		HANDLE thread[MAX_THREADS];
+		int thread_num = 0;
+		for (int i = 1; i < threads; ++i) {
+			DWORD id = 0;
+			thread[thread_num] = CreateThread(NULL, 0, ThreadProc, &job, 0, &id);
+			if (thread[thread_num]) {
+				++thread_num;
+			}
+		}
+
+		Work(&job);
+
+		if (thread_num > 0) {
+			WaitForMultipleObjects(thread_num, thread, TRUE, INFINITE);
+			for (int i = 0; i < thread_num; ++i) {
+				CloseHandle(thread[i]);
+			}
+		}
+
+		DeleteCriticalSection(&job.lock);
+		return job.parsed;
+	}
+
+private:
+	// 一括解析１回分の状態
+	struct Job
+	{
+		const BatchParser*		parser;
+		const wchar_t* const*	paths;
+		int						count;
+		ParseCallback			callback;
+		void*					user;
+		volatile LONG			next;	// 次に解析するインデックス
+		volatile LONG			parsed;	// 解析できたファイル数
+		CRITICAL_SECTION		lock;	// コールバック呼び出しの排他
+	};
+
+	//-------------------------------------------------------------------------
+	// スレッド関数
+	//-------------------------------------------------------------------------
+	static DWORD WINAPI ThreadProc(void* param)
+	{
+		Work(static_cast<Job*>(param));
+		return 0;
+	}
+
+	//-------------------------------------------------------------------------
+	// リストが空になるまで、１つずつ取り出して解析する
+	//-------------------------------------------------------------------------
+	static void Work(Job* job)
+	{
+		const BatchParser* parser = job->parser;
+		MetaCache* cache = parser->m_cache;
+
+		// キャッシュで済む場合は作らないように、最初に解析する時に作る
+		void* worker = NULL;
+		bool created = false;
+
+		Metadata meta;
+		for (;;) {
+			int index = InterlockedIncrement(&job->next) - 1;
+			if (index >= job->count) {
+				break;
+			}
+
+			const wchar_t* path = job->paths[index];
+			ZeroMemory(&meta, sizeof(meta));
+
+			int result = 0;
+			if (cache && cache->Lookup(path, &meta)) {
+				result = 1;
+			}
+			else {
+				if (!created) {
+					worker = parser->m_create? parser->m_create() : NULL;
+					created = true;
+				}
+
+				result = parser->m_parse(worker, path, &meta)? 1 : 0;
+				if (result && cache) {
+					cache->Store(path, &meta);
+				}
+			}
+
+			if (result) {
+				InterlockedIncrement(&job->parsed);
+			}
+
+			if (job->callback) {
+				EnterCriticalSection(&job->lock);
+				job->callback(job->user, index, result, result? &meta : NULL);
+				LeaveCriticalSection(&job->lock);
+			}
+		}
+
+		if (worker && parser->m_delete) {
+			parser->m_delete(worker);
+		}
+	}
+
+private:
+	int			m_threads;
+	ParseProc	m_parse;
+	CreateProc	m_create;
+	DeleteProc	m_delete;
+	MetaCache*	m_cache;
+};
+
+//-----------------------------------------------------------------------------
+// 一括解析のスレッド数を取得する
+// ・[Config]ParseThreadsを読む。0（既定値）なら自動。
+//-----------------------------------------------------------------------------
+inline int GetParseThreadNum(HINSTANCE instance)
+{
+	UINT threads = GetPluginIniInt(instance, L"ParseThreads", 0);
+	return (threads > BatchParser::MAX_THREADS)? BatchParser::MAX_THREADS : static_cast<int>(threads);
+}
@@ -0,0 +1,500 @@
+﻿//=============================================================================
+// レンダリング済みPCMのキャッシュ
+//=============================================================================
+
+#define _CRT_SECURE_NO_WARNINGS
+#define NOMINMAX
+
+#include "pcm_cache.h"
+#include "vsti_host.h"
+#include <vector>
+#include <algorithm>
+
+// 内部定義
+namespace {
+
+// １回に読み書きするフレーム数
+const int BUF_FRAMES = VstiHost::MAX_SAMPLES;
+
+// チャンネル数（ステレオ固定）
+const int CHANNELS = 2;
+
+// １フレームのバイト数
+const DWORD FRAME_SIZE = CHANNELS * sizeof(float);
+
+// WAVE_FORMAT_IEEE_FLOAT
+const WORD FORMAT_FLOAT = 0x0003;
+
+// WAVヘッダ（fmtとdataだけの、44バイトの固定形式）
+struct WaveHeader
+{
+	char	riff_id[4];
+	DWORD	riff_size;
+	char	wave_id[4];
+	char	fmt_id[4];
+	DWORD	fmt_size;
+	WORD	format_tag;
+	WORD	channels;
+	DWORD	sample_rate;
+	DWORD	byte_rate;
+	WORD	block_align;
+	WORD	bits;
+	char	data_id[4];
+	DWORD	data_size;
+};
+
+// ヘッダを作る
+void MakeHeader(WaveHeader& header, int sample_rate, DWORD data_size)
+{
+	memcpy(header.riff_id, "RIFF", 4);
+	header.riff_size	= sizeof(WaveHeader) - 8 + data_size;
+	memcpy(header.wave_id, "WAVE", 4);
+	memcpy(header.fmt_id, "fmt ", 4);
+	header.fmt_size		= 16;
+	header.format_tag	= FORMAT_FLOAT;
+	header.channels		= CHANNELS;
+	header.sample_rate	= sample_rate;
+	header.byte_rate	= sample_rate * FRAME_SIZE;
+	header.block_align	= static_cast<WORD>(FRAME_SIZE);
+	header.bits			= 32;
+	memcpy(header.data_id, "data", 4);
+	header.data_size	= data_size;
+}
+
+// 削除候補のキャッシュファイル
+struct CacheFile
+{
+	FILETIME	time;
+	ULONGLONG	size;
+	wchar_t		name[MAX_PATH];
+};
+
+// 更新日時の古い順
+bool IsOlder(const CacheFile& a, const CacheFile& b)
+{
+	return CompareFileTime(&a.time, &b.time) < 0;
+}
+
+// データのハッシュ値（FNV-1aとDJB）
+void Hash(const BYTE* data, DWORD size, DWORD& hash1, DWORD& hash2)
+{
+	DWORD h1 = hash1;
+	DWORD h2 = hash2;
+	for (DWORD i = 0; i < size; ++i) {
+		h1 = (h1 ^ data[i]) * 16777619U;
+		h2 = h2 * 33 + data[i];
+	}
+
+	hash1 = h1;
+	hash2 = h2;
+}
+
+} //namespace
+
+//-----------------------------------------------------------------------------
+// キャッシュファイルのパスを作成する
+//-----------------------------------------------------------------------------
+bool GetPcmCachePath(const wchar_t* cache_dir, const wchar_t* smf_path, DWORD vsti_id, DWORD settings_id, int sample_rate, wchar_t* cache_path)
+{
+	// 同じ内容なら、別の場所にあるファイルでもキャッシュを共有する
+	FileStream file;
+	if (!file.Open(smf_path)) {
+		return false;
+	}
+
+	const BYTE* data = file.Map();
+	if (!data) {
+		return false;
+	}
+
+	DWORD hash1 = 2166136261U;
+	DWORD hash2 = 5381;
+	DWORD size = file.GetSize();
+	Hash(data, size, hash1, hash2);
+
+	// "\\" + 16文字 + ("-" + 8文字) * 4 + ".wav"
+	if (lstrlenW(cache_dir) + 1 + 16 + 9 * 4 + 4 >= MAX_PATH) {
+		return false;
+	}
+
+	// 設定エディタで音色を変えたら、別のキャッシュになる
+	wsprintfW(cache_path, L"%s\\%08X%08X-%08X-%08X-%08X-%08X.wav", cache_dir, hash1, hash2, size, vsti_id, settings_id, sample_rate);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// キャッシュファイルを使ったことを記録する
+//-----------------------------------------------------------------------------
+void TouchPcmCache(const wchar_t* cache_path)
+{
+	HANDLE file = CreateFileW(cache_path, FILE_WRITE_ATTRIBUTES,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return;
+	}
+
+	FILETIME now;
+	GetSystemTimeAsFileTime(&now);
+	SetFileTime(file, NULL, NULL, &now);
+	CloseHandle(file);
+}
+
+//-----------------------------------------------------------------------------
+// キャッシュフォルダの合計サイズを制限する
+//-----------------------------------------------------------------------------
+void TrimPcmCache(const wchar_t* cache_dir, ULONGLONG max_bytes)
+{
+	// "\\" + "*.wav"
+	wchar_t pattern[MAX_PATH];
+	if (lstrlenW(cache_dir) + 1 + 1 + 4 >= MAX_PATH) {
+		return;
+	}
+
+	wsprintfW(pattern, L"%s\\*.wav", cache_dir);
+
+	WIN32_FIND_DATAW data;
+	HANDLE find = FindFirstFileW(pattern, &data);
+	if (find == INVALID_HANDLE_VALUE) {
+		return;
+	}
+
+	std::vector<CacheFile> files;
+	ULONGLONG total = 0;
+
+	do {
+		if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			continue;
+		}
+
+		if (lstrlenW(cache_dir) + 1 + lstrlenW(data.cFileName) >= MAX_PATH) {
+			continue;
+		}
+
+		CacheFile file;
+		file.time = data.ftLastWriteTime;
+		file.size = (static_cast<ULONGLONG>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+		wsprintfW(file.name, L"%s\\%s", cache_dir, data.cFileName);
+
+		files.push_back(file);
+		total += file.size;
+	}
+	while (FindNextFileW(find, &data));
+
+	FindClose(find);
+
+	if (total <= max_bytes) {
+		return;
+	}
+
+	// 再生中のファイルも削除できる（閉じた時に消える）
+	std::sort(files.begin(), files.end(), IsOlder);
+	for (size_t i = 0; i < files.size() && total > max_bytes; ++i) {
+		if (DeleteFileW(files[i].name)) {
+			total -= files[i].size;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// VSTiの識別値を取得する
+//-----------------------------------------------------------------------------
+DWORD GetVstiIdentity(const wchar_t* vsti_path)
+{
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesExW(vsti_path, GetFileExInfoStandard, &data)) {
+		return 0;
+	}
+
+	DWORD hash1 = 2166136261U;
+	DWORD hash2 = 5381;
+
+	const wchar_t* name = vsti_path;
+	for (const wchar_t* p = vsti_path; *p; ++p) {
+		if (*p == L'\\') {
+			name = p + 1;
+		}
+	}
+
+	Hash(reinterpret_cast<const BYTE*>(name), lstrlenW(name) * sizeof(wchar_t), hash1, hash2);
+	Hash(reinterpret_cast<const BYTE*>(&data.nFileSizeLow), sizeof(data.nFileSizeLow), hash1, hash2);
+	Hash(reinterpret_cast<const BYTE*>(&data.ftLastWriteTime), sizeof(data.ftLastWriteTime), hash1, hash2);
+	return hash1;
+}
+
+//-----------------------------------------------------------------------------
+// コンストラクタ
+//-----------------------------------------------------------------------------
+PcmCacheWriter::PcmCacheWriter()
+	: m_file(INVALID_HANDLE_VALUE)
+	, m_sample_rate(0)
+	, m_data_size(0)
+	, m_buffer(NULL)
+{
+	m_path[0] = L'\0';
+	m_temp_path[0] = L'\0';
+}
+
+//-----------------------------------------------------------------------------
+// デストラクタ
+//-----------------------------------------------------------------------------
+PcmCacheWriter::~PcmCacheWriter()
+{
+	Abort();
+}
+
+//-----------------------------------------------------------------------------
+// 書き込み開始
+//-----------------------------------------------------------------------------
+bool PcmCacheWriter::Create(const wchar_t* path, int sample_rate)
+{
+	Abort();
+
+	if (lstrlenW(path) + 4 >= MAX_PATH) {
+		return false;
+	}
+
+	lstrcpyW(m_path, path);
+	lstrcpyW(m_temp_path, path);
+	lstrcatW(m_temp_path, L".tmp");
+
+	m_buffer = new float[CHANNELS * BUF_FRAMES];
+	if (!m_buffer) {
+		return false;
+	}
+
+	m_file = CreateFileW(m_temp_path, GENERIC_WRITE, 0, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (m_file == INVALID_HANDLE_VALUE) {
+		Abort();
+		return false;
+	}
+
+	// ヘッダは、サイズが決まってから書き直す
+	WaveHeader header;
+	MakeHeader(header, sample_rate, 0);
+
+	DWORD written = 0;
+	if (!WriteFile(m_file, &header, sizeof(header), &written, NULL) || written != sizeof(header)) {
+		Abort();
+		return false;
+	}
+
+	m_sample_rate = sample_rate;
+	m_data_size = 0;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// PCMデータを追加する
+//-----------------------------------------------------------------------------
+bool PcmCacheWriter::Write(const float* ch0, const float* ch1, int frames)
+{
+	if (m_file == INVALID_HANDLE_VALUE || frames < 0 || frames > BUF_FRAMES) {
+		return false;
+	}
+
+	DWORD size = frames * FRAME_SIZE;
+
+	// RIFFのサイズに収まらなくなる場合は、キャッシュしない
+	if (m_data_size + size < m_data_size || m_data_size + size > 0xFFFFFFFFU - sizeof(WaveHeader)) {
+		return false;
+	}
+
+	for (int i = 0, j = 0; i < frames; ++i) {
+		m_buffer[j++] = ch0[i];
+		m_buffer[j++] = ch1[i];
+	}
+
+	DWORD written = 0;
+	if (!WriteFile(m_file, m_buffer, size, &written, NULL) || written != size) {
+		return false;
+	}
+
+	m_data_size += size;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// 書き込みを完了して、キャッシュファイルにする
+//-----------------------------------------------------------------------------
+bool PcmCacheWriter::Commit()
+{
+	if (m_file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	WaveHeader header;
+	MakeHeader(header, m_sample_rate, m_data_size);
+
+	DWORD written = 0;
+	if (SetFilePointer(m_file, 0, NULL, FILE_BEGIN) != 0
+		|| !WriteFile(m_file, &header, sizeof(header), &written, NULL) || written != sizeof(header)) {
+		Abort();
+		return false;
+	}
+
+	CloseHandle(m_file);
+	m_file = INVALID_HANDLE_VALUE;
+
+	if (!MoveFileExW(m_temp_path, m_path, MOVEFILE_REPLACE_EXISTING)) {
+		Abort();
+		return false;
+	}
+
+	m_temp_path[0] = L'\0';
+	Abort();
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// 書き込みを中止して、一時ファイルを削除する
+//-----------------------------------------------------------------------------
+void PcmCacheWriter::Abort()
+{
+	if (m_file != INVALID_HANDLE_VALUE) {
+		CloseHandle(m_file);
+		m_file = INVALID_HANDLE_VALUE;
+	}
+
+	if (m_temp_path[0] != L'\0') {
+		DeleteFileW(m_temp_path);
+		m_temp_path[0] = L'\0';
+	}
+
+	if (m_buffer) {
+		delete [] m_buffer;
+		m_buffer = NULL;
+	}
+
+	m_data_size = 0;
+}
+
+//-----------------------------------------------------------------------------
+// コンストラクタ
+//-----------------------------------------------------------------------------
+PcmCacheReader::PcmCacheReader()
+	: m_frames(0)
+	, m_frame(0)
+	, m_buffer(NULL)
+{
+}
+
+//-----------------------------------------------------------------------------
+// デストラクタ
+//-----------------------------------------------------------------------------
+PcmCacheReader::~PcmCacheReader()
+{
+	Close();
+}
+
+//-----------------------------------------------------------------------------
+// 開く
+//-----------------------------------------------------------------------------
+bool PcmCacheReader::Open(const wchar_t* path, int sample_rate)
+{
+	Close();
+
+	if (!m_file.Open(path)) {
+		return false;
+	}
+
+	// 自分で書いたファイルなので、44バイトの固定形式以外は受け付けない
+	WaveHeader header;
+	WaveHeader expect;
+	if (m_file.Read(&header, sizeof(header)) != sizeof(header)) {
+		Close();
+		return false;
+	}
+
+	MakeHeader(expect, sample_rate, header.data_size);
+	if (memcmp(&header, &expect, sizeof(header)) != 0
+		|| m_file.GetSize() - sizeof(header) < header.data_size) {
+		Close();
+		return false;
+	}
+
+	m_buffer = new float[CHANNELS * BUF_FRAMES];
+	if (!m_buffer) {
+		Close();
+		return false;
+	}
+
+	m_frames = header.data_size / FRAME_SIZE;
+	m_frame = 0;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// 閉じる
+//-----------------------------------------------------------------------------
+void PcmCacheReader::Close()
+{
+	m_file.Close();
+
+	if (m_buffer) {
+		delete [] m_buffer;
+		m_buffer = NULL;
+	}
+
+	m_frames = 0;
+	m_frame = 0;
+}
+
+//-----------------------------------------------------------------------------
+// PCMデータを、チャンネル毎に読み取る
+//-----------------------------------------------------------------------------
+int PcmCacheReader::Read(float* ch0, float* ch1, int frames)
+{
+	int done = 0;
+	while (done < frames && m_frame < m_frames) {
+		DWORD count = frames - done;
+		if (count > static_cast<DWORD>(BUF_FRAMES)) {
+			count = BUF_FRAMES;
+		}
+
+		if (count > m_frames - m_frame) {
+			count = m_frames - m_frame;
+		}
+
+		DWORD readed = m_file.Read(m_buffer, count * FRAME_SIZE) / FRAME_SIZE;
+		if (readed == 0) {
+			break;
+		}
+
+		for (DWORD i = 0, j = 0; i < readed; ++i) {
+			ch0[done + i] = m_buffer[j++];
+			ch1[done + i] = m_buffer[j++];
+		}
+
+		m_frame += readed;
+		done += readed;
+	}
+
+	return done;
+}
+
+//-----------------------------------------------------------------------------
+// フレーム単位でシークする
+//-----------------------------------------------------------------------------
+DWORD PcmCacheReader::Seek(DWORD frame)
+{
+	m_frame = (frame > m_frames)? m_frames : frame;
+	m_file.Seek(sizeof(WaveHeader) + m_frame * FRAME_SIZE);
+	return m_frame;
+}
+
+//-----------------------------------------------------------------------------
+// 現在のフレーム位置を取得する
+//-----------------------------------------------------------------------------
+DWORD PcmCacheReader::Tell() const
+{
+	return m_frame;
+}
+
+//-----------------------------------------------------------------------------
+// 総フレーム数を取得する
+//-----------------------------------------------------------------------------
+DWORD PcmCacheReader::GetFrames() const
+{
+	return m_frames;
+}
@@ -0,0 +1,98 @@
+﻿//=============================================================================
+// レンダリング済みPCMのキャッシュ
+//=============================================================================
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "file_stream.h"
+
+//! @brief	キャッシュファイルのパスを作成する
+//! @note	SMFの内容のハッシュ値、VSTiの識別値、VSTiの設定のハッシュ値、サンプルレートを
+//!			ファイル名にする。cache_pathは、MAX_PATH文字分を用意すること。
+bool GetPcmCachePath(const wchar_t* cache_dir, const wchar_t* smf_path, DWORD vsti_id, DWORD settings_id, int sample_rate, wchar_t* cache_path);
+
+//! @brief	キャッシュファイルを使ったことを記録する
+//! @note	更新日時を現在にして、TrimPcmCacheで最後に消されるようにする。
+void TouchPcmCache(const wchar_t* cache_path);
+
+//! @brief	キャッシュフォルダの合計サイズを制限する
+//! @note	max_bytesを超えている間、更新日時の古いキャッシュファイルから削除する。
+void TrimPcmCache(const wchar_t* cache_dir, ULONGLONG max_bytes);
+
+//! @brief	VSTiの識別値を取得する
+//! @note	DLLのファイル名・サイズ・更新日時から作るので、VSTiを更新すると変わる。
+DWORD GetVstiIdentity(const wchar_t* vsti_path);
+
+//! @brief	キャッシュファイルの書き込み
+//! @note	32bit floatのステレオWAVで書き込む。
+//!			書き込み中は一時ファイルに書いて、Commitで置き換えるので、
+//!			途中で止めた場合に、不完全なキャッシュは残らない。
+class PcmCacheWriter
+{
+public:
+	PcmCacheWriter();
+	~PcmCacheWriter();
+
+	//! @brief	書き込み開始
+	bool Create(const wchar_t* path, int sample_rate);
+
+	//! @brief	PCMデータを追加する（framesは、VstiHost::MAX_SAMPLES以下）
+	bool Write(const float* ch0, const float* ch1, int frames);
+
+	//! @brief	書き込みを完了して、キャッシュファイルにする
+	bool Commit();
+
+	//! @brief	書き込みを中止して、一時ファイルを削除する
+	void Abort();
+
+private:
+	PcmCacheWriter(const PcmCacheWriter&);
+	PcmCacheWriter& operator=(const PcmCacheWriter&);
+
+private:
+	HANDLE		m_file;
+	wchar_t		m_path[MAX_PATH];
+	wchar_t		m_temp_path[MAX_PATH];
+	int			m_sample_rate;
+	DWORD		m_data_size;
+	float*		m_buffer;		// インターリーブしたPCM
+};
+
+//! @brief	キャッシュファイルの読み取り
+class PcmCacheReader
+{
+public:
+	PcmCacheReader();
+	~PcmCacheReader();
+
+	//! @brief	開く（サンプルレートが違う場合は失敗する）
+	bool Open(const wchar_t* path, int sample_rate);
+
+	//! @brief	閉じる
+	void Close();
+
+	//! @brief	PCMデータを、チャンネル毎に読み取る
+	//! @return	読み取ったフレーム数（最後まで読んだら0）
+	int Read(float* ch0, float* ch1, int frames);
+
+	//! @brief	フレーム単位でシークする
+	//! @return	シークしたフレーム位置（最後を越える場合は、最後になる）
+	DWORD Seek(DWORD frame);
+
+	//! @brief	現在のフレーム位置を取得する
+	DWORD Tell() const;
+
+	//! @brief	総フレーム数を取得する
+	DWORD GetFrames() const;
+
+private:
+	PcmCacheReader(const PcmCacheReader&);
+	PcmCacheReader& operator=(const PcmCacheReader&);
+
+private:
+	FileStream	m_file;
+	DWORD		m_frames;
+	DWORD		m_frame;
+	float*		m_buffer;		// インターリーブしたPCM
+};
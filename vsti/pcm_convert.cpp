@@ -0,0 +1,209 @@
+﻿//=============================================================================
+// float PCMから整数PCMへの変換
+//=============================================================================
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include <emmintrin.h>
+#include "pcm_convert.h"
+
+namespace {
+
+// ビット数毎の設定（倍率は、従来の固定値）
+struct FormatInfo
+{
+	int		bits;
+	float	full_scale;		// ±1.0に対応する値
+	float	default_scale;	// gainを指定しない場合の倍率
+	float	max;
+	float	min;
+};
+
+const FormatInfo FORMAT_LIST[] =
+{
+	{ 16,      32768.0f,      20000.0f,      32767.0f,      -32768.0f },	// 60%
+	{ 24,    8388608.0f,    6000000.0f,    8388607.0f,    -8388608.0f },	// 71%
+	{ 32, 2147483648.0f, 1503192678.0f, 2147418112.0f, -2147418112.0f },	// 70%
+};
+
+// ノイズシェーピングの誤差の上限（クリップした時に、誤差が暴れないように）
+const float ERROR_LIMIT = 2.0f;
+
+// 32bit乱数を±0.5にする倍率
+const float RANDOM_SCALE = 1.0f / 4294967296.0f;
+
+//-----------------------------------------------------------------------------
+// xorshiftで、レーン毎の次の乱数を作る
+//-----------------------------------------------------------------------------
+inline __m128i NextRandom(__m128i& state)
+{
+	__m128i x = state;
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+	state = x;
+	return x;
+}
+
+//-----------------------------------------------------------------------------
+// 三角分布のディザ（±1LSB、２つの一様乱数の和）
+//-----------------------------------------------------------------------------
+inline __m128 Tpdf(__m128i& state)
+{
+	__m128 r0 = _mm_cvtepi32_ps(NextRandom(state));
+	__m128 r1 = _mm_cvtepi32_ps(NextRandom(state));
+	return _mm_mul_ps(_mm_add_ps(r0, r1), _mm_set1_ps(RANDOM_SCALE));
+}
+
+//-----------------------------------------------------------------------------
+// 32bit整数の下位24bitを詰める（４サンプル→12バイト、上位４バイトは0）
+//-----------------------------------------------------------------------------
+inline __m128i Pack24(__m128i value)
+{
+	// 64bit毎に、２サンプルを下位48bitに詰める
+	const __m128i mask0 = _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF);
+	const __m128i mask1 = _mm_set_epi32(0x0000FFFF, 0xFF000000, 0x0000FFFF, 0xFF000000);
+	__m128i packed = _mm_or_si128(_mm_and_si128(value, mask0), _mm_and_si128(_mm_srli_epi64(value, 8), mask1));
+
+	// 上位64bitの６バイトを、下位の６バイトの後ろに詰める
+	__m128i high = _mm_unpackhi_epi64(packed, _mm_setzero_si128());
+	return _mm_or_si128(_mm_move_epi64(packed), _mm_slli_si128(high, 6));
+}
+
+//-----------------------------------------------------------------------------
+// (L, R, L, R)の２つ分（８サンプル）を書き込む
+//-----------------------------------------------------------------------------
+inline void Store4Frames(int bits, BYTE* dest, __m128i v0, __m128i v1)
+{
+	if (bits == 16) {
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest), _mm_packs_epi32(v0, v1));
+	}
+	else if (bits == 24) {
+		__m128i p0 = Pack24(v0);
+		__m128i p1 = Pack24(v1);
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(dest), p0);
+		*reinterpret_cast<int*>(dest + 8) = _mm_cvtsi128_si32(_mm_srli_si128(p0, 8));
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(dest + 12), p1);
+		*reinterpret_cast<int*>(dest + 20) = _mm_cvtsi128_si32(_mm_srli_si128(p1, 8));
+	}
+	else {
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest), v0);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 16), v1);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// (L, R, -, -)の１フレームを書き込む
+//-----------------------------------------------------------------------------
+inline void Store1Frame(int bits, BYTE* dest, __m128i value)
+{
+	if (bits == 16) {
+		*reinterpret_cast<int*>(dest) = _mm_cvtsi128_si32(_mm_packs_epi32(value, value));
+	}
+	else if (bits == 24) {
+		__m128i packed = Pack24(value);
+		*reinterpret_cast<int*>(dest) = _mm_cvtsi128_si32(packed);
+		*reinterpret_cast<short*>(dest + 4) = static_cast<short>(_mm_extract_epi16(packed, 2));
+	}
+	else {
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(dest), value);
+	}
+}
+
+} //namespace
+
+//-----------------------------------------------------------------------------
+// 初期化
+//-----------------------------------------------------------------------------
+void PcmConverter::Init(int bits, float gain, DitherType dither, unsigned int seed)
+{
+	m_bits = 0;
+	m_dither = DITHER_NONE;
+
+	for (int i = 0; i < sizeof(FORMAT_LIST) / sizeof(FORMAT_LIST[0]); ++i) {
+		const FormatInfo& info = FORMAT_LIST[i];
+		if (info.bits == bits) {
+			m_bits = bits;
+			m_scale = (gain > 0.0f)? (info.full_scale * gain) : info.default_scale;
+			m_max = info.max;
+			m_min = info.min;
+
+			// 32bitでは、ディザは聞こえないので使わない
+			m_dither = (bits < 32)? dither : DITHER_NONE;
+			break;
+		}
+	}
+
+	// xorshiftの状態は0にできないので、レーン毎に種をずらす
+	for (int i = 0; i < 4; ++i) {
+		unsigned int x = seed + 0x9E3779B9U * (i + 1);
+		m_random[i] = (x != 0)? x : 0x6C078965U;
+		m_error[i] = 0.0f;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// 変換する
+// ・ノイズシェーピングは、前のフレームの誤差を使うので、１フレームずつ（L, Rを並列に）処理する。
+//-----------------------------------------------------------------------------
+int PcmConverter::Convert(const float* ch0, const float* ch1, void* buffer, int samples)
+{
+	if (m_bits == 0) {
+		return 0;
+	}
+
+	const int frame_size = m_bits / 8 * 2;
+	BYTE* dest = static_cast<BYTE*>(buffer);
+
+	const __m128 scale = _mm_set1_ps(m_scale);
+	const __m128 max = _mm_set1_ps(m_max);
+	const __m128 min = _mm_set1_ps(m_min);
+	__m128i random = _mm_loadu_si128(reinterpret_cast<const __m128i*>(m_random));
+
+	int i = 0;
+	if (m_dither != DITHER_SHAPED) {
+		const bool tpdf = (m_dither == DITHER_TPDF);
+		for (; i + 4 <= samples; i += 4, dest += frame_size * 4) {
+			__m128 l = _mm_mul_ps(_mm_loadu_ps(ch0 + i), scale);
+			__m128 r = _mm_mul_ps(_mm_loadu_ps(ch1 + i), scale);
+			if (tpdf) {
+				l = _mm_add_ps(l, Tpdf(random));
+				r = _mm_add_ps(r, Tpdf(random));
+			}
+
+			__m128 v0 = _mm_max_ps(_mm_min_ps(_mm_unpacklo_ps(l, r), max), min);
+			__m128 v1 = _mm_max_ps(_mm_min_ps(_mm_unpackhi_ps(l, r), max), min);
+			Store4Frames(m_bits, dest, _mm_cvtps_epi32(v0), _mm_cvtps_epi32(v1));
+		}
+	}
+
+	// 残り（ノイズシェーピングの場合は全部）は、１フレームずつ
+	__m128 error = _mm_loadu_ps(m_error);
+	const __m128 limit = _mm_set1_ps(ERROR_LIMIT);
+	for (; i < samples; ++i, dest += frame_size) {
+		__m128 value = _mm_mul_ps(_mm_unpacklo_ps(_mm_load_ss(ch0 + i), _mm_load_ss(ch1 + i)), scale);
+		__m128 target = value;
+		if (m_dither != DITHER_NONE) {
+			if (m_dither == DITHER_SHAPED) {
+				target = _mm_sub_ps(value, error);
+			}
+
+			// 上位２レーンの乱数を下位に足して、L, Rの三角分布にする
+			__m128 noise = _mm_mul_ps(_mm_cvtepi32_ps(NextRandom(random)), _mm_set1_ps(RANDOM_SCALE));
+			value = _mm_add_ps(target, _mm_add_ps(noise, _mm_movehl_ps(noise, noise)));
+		}
+
+		__m128i result = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(value, max), min));
+		if (m_dither == DITHER_SHAPED) {
+			error = _mm_sub_ps(_mm_cvtepi32_ps(result), target);
+			error = _mm_max_ps(_mm_min_ps(error, limit), _mm_sub_ps(_mm_setzero_ps(), limit));
+		}
+
+		Store1Frame(m_bits, dest, result);
+	}
+
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(m_random), random);
+	_mm_storeu_ps(m_error, error);
+	return samples * frame_size;
+}
@@ -0,0 +1,43 @@
+﻿//=============================================================================
+// float PCMから整数PCMへの変換
+//=============================================================================
+#pragma once
+
+//! @brief	float PCMを、インターリーブした整数PCMに変換する
+//! @note	SSE2で４フレームずつ、クリップ・変換・インターリーブを行う。
+//!			ディザの乱数とノイズシェーピングの誤差を持つので、ハンドル毎に使うこと。
+//!			new Context()で値初期化されるように、コンストラクタは持たない（Initで初期化する）。
+class PcmConverter
+{
+public:
+	//! @brief	ディザの種類
+	enum DitherType
+	{
+		DITHER_NONE,	//!< なし（最も近い値に丸める）
+		DITHER_TPDF,	//!< 三角分布（±1LSB）
+		DITHER_SHAPED,	//!< 三角分布＋１次のノイズシェーピング（量子化誤差を高域に寄せる）
+	};
+
+public:
+	//! @brief	初期化
+	//! @param	bits	出力ビット数（16/24/32）
+	//! @param	gain	±1.0に対する倍率（0以下なら、ビット数毎の従来の倍率）
+	//! @param	dither	ディザの種類（32bitでは使わない）
+	//! @param	seed	ディザの乱数の種
+	void Init(int bits, float gain, DitherType dither, unsigned int seed);
+
+	//! @brief	変換する
+	//! @return	出力したバイト数（未対応のビット数なら0）
+	int Convert(const float* ch0, const float* ch1, void* buffer, int samples);
+
+private:
+	int		m_bits;
+	int		m_dither;
+	float	m_scale;
+	float	m_max;
+	float	m_min;
+
+	// SSE2のレジスタにそのまま読み込む値（operator newは16バイト境界を保証しないので、__m128では持たない）
+	unsigned int	m_random[4];	// xorshiftの状態（レーン毎）
+	float			m_error[4];		// ノイズシェーピングの前回の誤差（L, R, -, -）
+};
@@ -9,28 +9,57 @@
 #include <ks.h>
 #include <mmreg.h>
 #include <shlwapi.h>
-#include <vector>
 #include "luna_pi.h"
 #include "smf_loader.h"
 #include "vsti_host.h"
+#include "vsti_pool.h"
+#include "pcm_cache.h"
+#include "pcm_convert.h"
+#include "pre_open.h"
+#include "batch_parser.h"
+#include "meta_cache.h"
 
 //-----------------------------------------------------------------------------
 // 定義
 //-----------------------------------------------------------------------------
 namespace {
 
-// １回のRenderで再生する時間。
+// 標準の、１回のRenderで再生する時間。
+// ・ブロック内のメッセージは、サンプル単位の位置を指定して、まとめてVSTiに渡す。
 const int BLOCK_TIME = 50;
 
-// 何分割してRenderするか。
-const int DIVIDE_NUM = 5;
+// ブロックの大きさの決め方（[Config]BlockMode）
+enum BlockMode
+{
+	BLOCK_MODE_STANDARD,	// BLOCK_TIME分
+	BLOCK_MODE_THROUGHPUT,	// 大きなブロックで、VSTiの呼び出し回数を減らす
+	BLOCK_MODE_LATENCY,		// 小さなブロックで、シーク等の反応を早くする
+};
+
+// モード毎のブロックのサンプル数
+const int THROUGHPUT_BLOCK = 4096;
+const int LATENCY_BLOCK = 256;
+
+// 指定できるブロックのサンプル数の下限
+const int MIN_BLOCK = 32;
 
 // デフォルト設定。
 const int DEFAULT_RATE = 44100;
 const int DEFAULT_BITS = 16;
 
-// メッセージリスト
-typedef std::vector<int> MsgList;
+// 指定できるサンプルレートの範囲
+const int MIN_RATE = 8000;
+const int MAX_RATE = 192000;
+
+// 解析結果の版（Parseの結果が変わる変更をしたら上げて、メタデータキャッシュを無効にする）
+// 2: テンポ変化を含む曲の演奏時間の計算を変更
+const DWORD PARSER_VERSION = 2;
+
+// float出力時の倍率の既定値（32bit整数出力と同じ70%）
+const float FLOAT_MUL = 0.7f;
+
+// キャッシュフォルダの合計サイズの上限の既定値（MB）
+const int DEFAULT_CACHE_SIZE = 2048;
 
 // 再生時コンテキスト
 struct Context
@@ -38,26 +67,74 @@ struct Context
 	SmfLoader	loader;
 	int			midx;
 	int			mnum;
-	int			time;
-	int			tend;
+	__int64		pos;	// 演奏位置（サンプル）。レンダリング済みのブロックの終わり。
+	__int64		pend;	// 演奏の終わり（サンプル）。
 	int			bits;	// レンダリング時のビット数。
-};
+	int			rate;	// レンダリング時のサンプルレート。
+	int			block;	// １ブロックのサンプル数。
+	int			rest;	// 渡しきれなかった、１ブロックの残りサンプル数。
+	float		gain;	// float出力時の倍率。
+	int			chase[SmfLoader::CHASE_MAX_MESSAGES];	// シーク先の状態を復元するメッセージ。
 
-// グローバルオブジェクト
-VstiHost	g_vsti;
-bool		g_playing = false;
+	// 整数PCMへの変換（ディザの状態を持つので、ハンドル毎）
+	PcmConverter	convert;
 
-// クランプ
-inline float Clamp(float x, float min, float max)
+	// 再生に使うVSTi（プールから借りて、ハンドル毎に専有する）
+	VstiHost*	vsti;
+
+	// レンダリング済みのキャッシュから再生する場合（VSTiは使わない）
+	PcmCacheReader*	cache;
+	float*			cache_pcm;	// キャッシュから読んだ１ブロック（ch0、ch1の順）。
+};
+
+// MIDIメッセージの演奏位置（サンプル）
+inline __int64 GetMessageFrame(const Context* cxt, const SmfLoader::MidiMessage& message)
 {
-	return (x < min)? min : ((x > max)? max : x);
+	return (static_cast<__int64>(message.time) * 1000 + message.usec) * cxt->rate / 1000000;
 }
 
+// グローバルオブジェクト
+VstiPool	g_vsti_pool;
+
+// 出力形式と、１ブロックのサンプル数
+int			g_sample_rate = DEFAULT_RATE;
+int			g_sample_bits = DEFAULT_BITS;
+int			g_block_size = 0;
+
+// 出力の倍率（0なら出力形式毎の既定値）とディザ
+float		g_output_gain = 0.0f;
+int			g_dither = PcmConverter::DITHER_NONE;
+
+// レンダリング済みPCMのキャッシュ
+bool		g_render_cache = false;
+wchar_t		g_cache_dir[MAX_PATH];
+DWORD		g_vsti_id = 0;
+ULONGLONG	g_cache_limit = 0;	// フォルダの合計サイズの上限（バイト、0なら制限しない）
+
+// キャッシュを作るスレッド（一度に１曲ずつ、再生とは別のVSTiでレンダリングする）
+CRITICAL_SECTION	g_bounce_lock;
+HANDLE				g_bounce_thread = NULL;
+volatile LONG		g_bounce_abort = FALSE;
+wchar_t				g_bounce_path[MAX_PATH];
+
 } //namespace
 
+// プラグイン構造体（GetLunaPluginは、baseの部分を返す）
+static LunaPlugin2 g_plugin;
+
+// 一括解析
+static BatchParser g_batch_parser;
+
+// メタデータキャッシュ
+static MetaCache g_meta_cache;
+
+// 次の曲の事前準備
+static PreOpen g_pre_open;
+
 // プロトタイプ宣言
-static int RenderMidi(const MsgList& msg, int out_bits, void* buffer, int size);
-static int PlayMidi(Context* cxt, void* buffer, int size);
+static bool PlayMidi(Context* cxt, int samples);
+static bool OpenCache(Context* cxt, const wchar_t* path);
+static bool StopBounce();
 
 //-----------------------------------------------------------------------------
 // Dll Entry Point
@@ -76,7 +153,15 @@ BOOL WINAPI DllMain(HINSTANCE instance, DWORD call_reason, void* /*reserved*/)
 //-----------------------------------------------------------------------------
 static void LPAPI Release()
 {
-	g_vsti.Term();
+	g_pre_open.Cancel();
+
+	if (g_render_cache) {
+		StopBounce();
+		DeleteCriticalSection(&g_bounce_lock);
+	}
+
+	g_vsti_pool.Term();
+	g_meta_cache.Close();
 }
 
 //-----------------------------------------------------------------------------
@@ -84,19 +169,26 @@ static void LPAPI Release()
 //-----------------------------------------------------------------------------
 static void LPAPI Property(HINSTANCE inst, HWND parent)
 {
-	g_vsti.ShowEditor(inst, parent);
+	DWORD settings_hash = g_vsti_pool.GetSettingsHash();
+	g_vsti_pool.ShowEditor(inst, parent);
+
+	// 設定を変えたら、作成中のキャッシュは前の設定なので止める（次に開いた時に作り直す）
+	if (g_render_cache && g_vsti_pool.GetSettingsHash() != settings_hash) {
+		StopBounce();
+	}
 }
 
 //-----------------------------------------------------------------------------
-// 解析
+// 解析（一括解析では、loaderをスレッド毎に使い回す）
 //-----------------------------------------------------------------------------
-static int LPAPI Parse(const wchar_t* path, Metadata* meta)
+static int ParseWith(void* worker, const wchar_t* path, Metadata* meta)
 {
-	SmfLoader loader;
+	SmfLoader& loader = *static_cast<SmfLoader*>(worker);
 
 	SmfLoader::LoadOption option;
 	option.ignore_bank_select = false;
 	option.detect_reset_type = true;
+	option.build_seek_index = false;
 
 	if (!loader.Load(path, option)) {
 		return false;
@@ -119,15 +211,49 @@ static int LPAPI Parse(const wchar_t* path, Metadata* meta)
 }
 
 //-----------------------------------------------------------------------------
-// 再生するデータを開く
+// 解析用ローダーの作成・削除
 //-----------------------------------------------------------------------------
-static Handle Open(const wchar_t* path, Output* out)
+static void* CreateParser()
 {
-	// ２重再生は不可
-	if (g_playing) {
-		return NULL;
+	return new SmfLoader();
+}
+
+static void DeleteParser(void* worker)
+{
+	delete static_cast<SmfLoader*>(worker);
+}
+
+//-----------------------------------------------------------------------------
+// 解析（キャッシュにあれば、ファイルは開かない）
+//-----------------------------------------------------------------------------
+static int LPAPI Parse(const wchar_t* path, Metadata* meta)
+{
+	if (g_meta_cache.Lookup(path, meta)) {
+		return true;
+	}
+
+	SmfLoader loader;
+	if (!ParseWith(&loader, path, meta)) {
+		return false;
 	}
 
+	g_meta_cache.Store(path, meta);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// 一括解析
+//-----------------------------------------------------------------------------
+static int LPAPI ParseBatch(const wchar_t* const* paths, int count, ParseCallback callback, void* user)
+{
+	return g_batch_parser.Run(paths, count, callback, user);
+}
+
+//-----------------------------------------------------------------------------
+// SMFを読み込んで、コンテキストを作成する（VSTiは、まだ割り当てない）
+//-----------------------------------------------------------------------------
+static Context* CreateContext(const wchar_t* path)
+{
 	Context* cxt = new Context();
 	if (!cxt) {
 		return NULL;
@@ -136,6 +262,7 @@ static Handle Open(const wchar_t* path, Output* out)
 	SmfLoader::LoadOption option;
 	option.ignore_bank_select = true;
 	option.detect_reset_type = true;
+	option.build_seek_index = true;
 
 	if (!cxt->loader.Load(path, option)) {
 		delete cxt;
@@ -144,39 +271,108 @@ static Handle Open(const wchar_t* path, Output* out)
 
 	cxt->midx = 0;
 	cxt->mnum = cxt->loader.GetMidiMessageNum();
-	cxt->time = 0;
-	cxt->tend = cxt->loader.GetDuration();
-	cxt->bits = DEFAULT_BITS;
+	cxt->pos = 0;
+	cxt->pend = static_cast<__int64>(cxt->loader.GetDuration()) * g_sample_rate / 1000;
+	cxt->bits = g_sample_bits;
+	cxt->gain = (g_output_gain > 0.0f)? g_output_gain : FLOAT_MUL;
+	cxt->rate = g_sample_rate;
+	cxt->block = g_block_size;
+	cxt->rest = 0;
+	cxt->vsti = NULL;
+	cxt->cache = NULL;
+	cxt->cache_pcm = NULL;
+
+	cxt->convert.Init(cxt->bits, g_output_gain, static_cast<PcmConverter::DitherType>(g_dither), GetTickCount());
+	return cxt;
+}
 
-	out->sample_rate	= DEFAULT_RATE;
-	out->sample_bits	= DEFAULT_BITS;
+//-----------------------------------------------------------------------------
+// 再生するデータを開く
+//-----------------------------------------------------------------------------
+static Handle OpenContext(const wchar_t* path, Output* out)
+{
+	Context* cxt = CreateContext(path);
+	if (!cxt) {
+		return NULL;
+	}
+
+	out->sample_rate	= cxt->rate;
+	out->sample_bits	= cxt->bits;
 	out->num_channels	= 2;
-	out->unit_length	= MulDiv(out->sample_rate * out->sample_bits / 8 * out->num_channels, BLOCK_TIME, 1000);
+	out->unit_length	= cxt->block * (out->sample_bits / 8) * out->num_channels;
+
+	// キャッシュから再生する場合は、VSTiを使わない
+	if (g_render_cache && OpenCache(cxt, path)) {
+		return cxt;
+	}
+
+	// 空いているVSTiがなければ、キャッシュの作成を止めて、そのVSTiを使う
+	cxt->vsti = g_vsti_pool.Acquire();
+	if (!cxt->vsti && g_render_cache && StopBounce()) {
+		cxt->vsti = g_vsti_pool.Acquire();
+	}
+
+	// それでもなければ、再生できない
+	if (!cxt->vsti) {
+		delete cxt;
+		return NULL;
+	}
 
-	if (!g_vsti.Start(out->sample_rate)) {
+	if (!cxt->vsti->Start(cxt->rate, cxt->block)) {
+		g_vsti_pool.Release(cxt->vsti);
 		delete cxt;
 		return NULL;
 	}
 
-	g_vsti.Reset(cxt->loader.GetResetMessageData(), cxt->loader.GetResetMessageSize());
+	cxt->vsti->Reset(cxt->loader.GetResetMessageData(), cxt->loader.GetResetMessageSize());
+	return cxt;
+}
+
+//-----------------------------------------------------------------------------
+// 再生するデータを開く（事前準備していれば、それを返す）
+//-----------------------------------------------------------------------------
+static Handle Open(const wchar_t* path, Output* out)
+{
+	Handle handle = g_pre_open.Take(path, out);
+	if (handle) {
+		return handle;
+	}
+
+	return OpenContext(path, out);
+}
+
+//-----------------------------------------------------------------------------
+// 事前準備で開く（リセットと最初のブロックのレンダリングを済ませておく）
+//-----------------------------------------------------------------------------
+static Handle PrepareContext(const wchar_t* path, Output* out)
+{
+	Context* cxt = static_cast<Context*>(OpenContext(path, out));
+	if (cxt && cxt->vsti && PlayMidi(cxt, cxt->block)) {
+		cxt->pos += cxt->block;
+		cxt->rest = cxt->block;
+	}
 
-	g_playing = true;
 	return cxt;
 }
 
 //-----------------------------------------------------------------------------
 // 再生するデータを閉じる
 //-----------------------------------------------------------------------------
-static void Close(Handle handle)
+static void LPAPI Close(Handle handle)
 {
-	g_vsti.Stop();
-
 	Context* cxt = static_cast<Context*>(handle);
-	if (cxt) {
-		delete cxt;
+	if (!cxt) {
+		return;
+	}
+
+	if (cxt->vsti) {
+		cxt->vsti->Stop();
+		g_vsti_pool.Release(cxt->vsti);
 	}
 
-	g_playing = false;
+	delete cxt->cache;
+	delete [] cxt->cache_pcm;
+	delete cxt;
 }
 
 //-----------------------------------------------------------------------------
@@ -189,21 +385,109 @@ static int Render(Handle handle, void* buffer, int length)
 		return 0;
 	}
 
-	char* outbuf = static_cast<char*>(buffer);
-	int bsize = length / DIVIDE_NUM;
-	int bused = 0;
-	for (int i = 0; i < DIVIDE_NUM; ++i) {
-		if (!PlayMidi(cxt, outbuf, bsize)) {
-			return bused;
+	// 通常はブロック単位で呼ばれるので、１回のレンダリングで済む
+	int samples = length / (cxt->bits / 8) / 2;
+	if (samples > cxt->block) {
+		samples = cxt->block;
+	}
+
+	if (cxt->cache) {
+		float* ch0 = cxt->cache_pcm;
+		float* ch1 = cxt->cache_pcm + cxt->block;
+
+		samples = cxt->cache->Read(ch0, ch1, samples);
+		return cxt->convert.Convert(ch0, ch1, buffer, samples);
+	}
+
+	// 事前準備やfloat形式でのレンダリングの残りがあれば、先に渡す
+	if (cxt->rest > 0) {
+		int offset = cxt->block - cxt->rest;
+		if (samples > cxt->rest) {
+			samples = cxt->rest;
 		}
 
-		cxt->time += (BLOCK_TIME / DIVIDE_NUM);
+		cxt->rest -= samples;
+		return cxt->convert.Convert(cxt->vsti->GetChannel0() + offset, cxt->vsti->GetChannel1() + offset, buffer, samples);
+	}
 
-		outbuf += bsize;
-		bused += bsize;
+	if (!PlayMidi(cxt, samples)) {
+		return 0;
 	}
 
-	return bused;
+	cxt->pos += samples;
+	return cxt->convert.Convert(cxt->vsti->GetChannel0(), cxt->vsti->GetChannel1(), buffer, samples);
+}
+
+//-----------------------------------------------------------------------------
+// float形式でのレンダリング
+//-----------------------------------------------------------------------------
+static int LPAPI RenderFloat(Handle handle, float** planes, int frames)
+{
+	Context* cxt = static_cast<Context*>(handle);
+	if (!cxt || !planes) {
+		return 0;
+	}
+
+	if (cxt->cache) {
+		int readed = cxt->cache->Read(planes[0], planes[1], frames);
+		for (int i = 0; i < readed; ++i) {
+			planes[0][i] *= cxt->gain;
+			planes[1][i] *= cxt->gain;
+		}
+
+		return readed;
+	}
+
+	int used = 0;
+	while (used < frames) {
+		// 前回の残りを使い切ったら、次のブロックをレンダリング
+		if (cxt->rest == 0) {
+			if (!PlayMidi(cxt, cxt->block)) {
+				break;
+			}
+
+			cxt->pos += cxt->block;
+			cxt->rest = cxt->block;
+		}
+
+		int count = (cxt->rest > frames - used)? (frames - used) : cxt->rest;
+		int offset = cxt->block - cxt->rest;
+
+		const float* ch0 = cxt->vsti->GetChannel0() + offset;
+		const float* ch1 = cxt->vsti->GetChannel1() + offset;
+		for (int i = 0; i < count; ++i) {
+			planes[0][used + i] = ch0[i] * cxt->gain;
+			planes[1][used + i] = ch1[i] * cxt->gain;
+		}
+
+		cxt->rest -= count;
+		used += count;
+	}
+
+	return used;
+}
+
+//-----------------------------------------------------------------------------
+// 指定したサンプル位置へシーク
+//-----------------------------------------------------------------------------
+static void SeekContext(Context* cxt, __int64 frame)
+{
+	// リセットは要求だけで、次のレンダリングの先頭で行われるので、ここでは待たない
+	cxt->vsti->Reset(cxt->loader.GetResetMessageData(), cxt->loader.GetResetMessageSize());
+
+	// シーク先までのメッセージは、コントロール等の状態だけをまとめて送る（ノートは送らない）
+	// ・シーク先と同じミリ秒内のメッセージは、最初のブロックの先頭で送る。
+	int count = 0;
+	int time_ms = static_cast<int>(frame * 1000 / cxt->rate);
+	cxt->midx = cxt->loader.Chase(time_ms, cxt->chase, count);
+	for (int i = 0; i < count; ++i) {
+		cxt->vsti->PushEvent(cxt->chase[i], 0);
+	}
+
+	cxt->vsti->Render(0);
+
+	cxt->pos = frame;
+	cxt->rest = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -216,16 +500,63 @@ static int Seek(Handle handle, int time_ms)
 		return 0;
 	}
 
-	g_vsti.Reset(cxt->loader.GetResetMessageData(), cxt->loader.GetResetMessageSize());
+	__int64 frame = static_cast<__int64>(time_ms) * cxt->rate / 1000;
+	if (cxt->cache) {
+		cxt->cache->Seek(static_cast<DWORD>(frame));
+	}
+	else {
+		SeekContext(cxt, frame);
+	}
 
-	if (time_ms < cxt->time) {
-		cxt->midx = 0;
+	return time_ms;
+}
+
+//-----------------------------------------------------------------------------
+// サンプル単位のシーク
+//-----------------------------------------------------------------------------
+static __int64 LPAPI SeekFrame(Handle handle, __int64 frame)
+{
+	Context* cxt = static_cast<Context*>(handle);
+	if (!cxt || frame < 0) {
+		return -1;
 	}
 
-	cxt->time = time_ms;
+	if (cxt->cache) {
+		return cxt->cache->Seek((frame > 0xFFFFFFFF)? 0xFFFFFFFF : static_cast<DWORD>(frame));
+	}
 
-	PlayMidi(cxt, NULL, 0);
-	return time_ms;
+	if (frame > cxt->pend) {
+		frame = cxt->pend;
+	}
+
+	SeekContext(cxt, frame);
+	return frame;
+}
+
+//-----------------------------------------------------------------------------
+// 現在のサンプル位置取得
+//-----------------------------------------------------------------------------
+static __int64 LPAPI TellFrame(Handle handle)
+{
+	Context* cxt = static_cast<Context*>(handle);
+	if (!cxt) {
+		return -1;
+	}
+
+	if (cxt->cache) {
+		return cxt->cache->Tell();
+	}
+
+	return cxt->pos - cxt->rest;
+}
+
+//-----------------------------------------------------------------------------
+// 次の曲の事前準備
+// ・空いているVSTiがない場合（MaxInstances=1で再生中等）は、準備できない。
+//-----------------------------------------------------------------------------
+static int LPAPI Prepare(const wchar_t* path)
+{
+	return g_pre_open.Start(path, PrepareContext, Close);
 }
 
 //-----------------------------------------------------------------------------
@@ -242,19 +573,83 @@ LPEXPORT LunaPlugin* LPAPI GetLunaPlugin(HINSTANCE instance)
 	PathRenameExtension(ini_path, L".ini");
 	bool reset_on_start = (GetPrivateProfileInt(L"Config", L"ResetOnStart", 0, ini_path) != 0);
 
-	if (!g_vsti.Init(vsti_path, reset_on_start)) {
+	int settle_time = GetPrivateProfileInt(L"Config", L"ResetSettleTime", 50, ini_path);
+	int max_instances = GetPrivateProfileInt(L"Config", L"MaxInstances", 1, ini_path);
+
+	// 出力形式（対応していない値なら、既定値にする）
+	g_sample_rate = GetPrivateProfileInt(L"Config", L"SampleRate", DEFAULT_RATE, ini_path);
+	if (g_sample_rate < MIN_RATE || g_sample_rate > MAX_RATE) {
+		g_sample_rate = DEFAULT_RATE;
+	}
+
+	g_sample_bits = GetPrivateProfileInt(L"Config", L"SampleBits", DEFAULT_BITS, ini_path);
+	if (g_sample_bits != 16 && g_sample_bits != 24 && g_sample_bits != 32) {
+		g_sample_bits = DEFAULT_BITS;
+	}
+
+	// ブロックのサンプル数（BlockSizeを指定すれば、BlockModeより優先する）
+	g_block_size = GetPrivateProfileInt(L"Config", L"BlockSize", 0, ini_path);
+	if (g_block_size <= 0) {
+		switch (GetPrivateProfileInt(L"Config", L"BlockMode", BLOCK_MODE_STANDARD, ini_path)) {
+		case BLOCK_MODE_THROUGHPUT:	g_block_size = THROUGHPUT_BLOCK; break;
+		case BLOCK_MODE_LATENCY:	g_block_size = LATENCY_BLOCK; break;
+		default:					g_block_size = MulDiv(g_sample_rate, BLOCK_TIME, 1000); break;
+		}
+	}
+
+	if (g_block_size < MIN_BLOCK) {
+		g_block_size = MIN_BLOCK;
+	}
+	else if (g_block_size > VstiHost::MAX_SAMPLES) {
+		g_block_size = VstiHost::MAX_SAMPLES;
+	}
+
+	g_output_gain = GetPrivateProfileInt(L"Config", L"OutputGain", 0, ini_path) / 100.0f;
+	g_dither = GetPrivateProfileInt(L"Config", L"Dither", PcmConverter::DITHER_NONE, ini_path);
+	if (g_dither > PcmConverter::DITHER_SHAPED) {
+		g_dither = PcmConverter::DITHER_NONE;
+	}
+
+	// キャッシュは、DLLと同じ場所の、拡張子を.pcmにしたフォルダに置く
+	g_render_cache = (GetPrivateProfileInt(L"Config", L"RenderCache", 0, ini_path) != 0);
+	if (g_render_cache) {
+		g_render_cache = GetPluginFilePath(instance, L".pcm", g_cache_dir);
+		g_vsti_id = GetVstiIdentity(vsti_path);
+	}
+
+	if (g_render_cache) {
+		int cache_size = GetPrivateProfileInt(L"Config", L"RenderCacheSize", DEFAULT_CACHE_SIZE, ini_path);
+		g_cache_limit = (cache_size > 0)? static_cast<ULONGLONG>(cache_size) * 1024 * 1024 : 0;
+		InitializeCriticalSection(&g_bounce_lock);
+
+		// 再生中にキャッシュを作るので、インスタンスを１つ余分に使う
+		max_instances = ((max_instances < 1)? 1 : max_instances) + 1;
+	}
+
+	if (!g_vsti_pool.Init(vsti_path, reset_on_start, settle_time, max_instances)) {
+		if (g_render_cache) {
+			DeleteCriticalSection(&g_bounce_lock);
+			g_render_cache = false;
+		}
+
 		return false;
 	}
 
+	g_batch_parser.Init(GetParseThreadNum(instance), ParseWith, CreateParser, DeleteParser, &g_meta_cache);
+
 	static TCHAR name[MAX_PATH];
 	wsprintf(name, TEXT("VSTi[%s] MIDI plugin v1.00"), PathFindFileName(vsti_path));
 	
-	static LunaPlugin plugin;
+	LunaPlugin& plugin = g_plugin.base;
 
 	plugin.plugin_kind = KIND_PLUGIN;
 	plugin.plugin_name = name;
 	plugin.support_type = L"*.mid";
 
+	if (IsMetaCacheEnabled(instance)) {
+		g_meta_cache.Open(instance, plugin.plugin_name, PARSER_VERSION);
+	}
+
 	plugin.Release	= Release;
 	plugin.Property	= Property;
 	plugin.Parse	= Parse;
@@ -267,124 +662,235 @@ LPEXPORT LunaPlugin* LPAPI GetLunaPlugin(HINSTANCE instance)
 }
 
 //-----------------------------------------------------------------------------
-// MIDIメッセージを送信し、PCMデータを生成する
+// 拡張プラグインエクスポート関数
 //-----------------------------------------------------------------------------
-int RenderMidi(const MsgList& msg, int out_bits, void* buffer, int size)
+LPEXPORT LunaPlugin2* LPAPI GetLunaPlugin2(HINSTANCE instance)
 {
-	int samples = size / (out_bits / 8) / 2;
-	int msg_num = static_cast<int>(msg.size());
-	const int* msg_data = (msg_num != 0)? &msg[0] : NULL;
+	if (!GetLunaPlugin(instance)) {
+		return NULL;
+	}
 
-	if (!g_vsti.Render(msg_data, msg_num, samples)) {
-		return 0;
+	g_plugin.version	= LUNA_PLUGIN2_VERSION;
+	g_plugin.SeekFrame	= SeekFrame;
+	g_plugin.TellFrame	= TellFrame;
+	g_plugin.RenderFloat	= RenderFloat;
+	g_plugin.Prepare	= Prepare;
+	g_plugin.ParseBatch	= ParseBatch;
+
+	return &g_plugin;
+}
+
+//-----------------------------------------------------------------------------
+// MIDI再生
+// ・現在の演奏位置からsamples分の間にあるメッセージを、サンプル位置付きで送信する。
+// ・位置はサンプル単位で持つので、ブロックのサンプル数がミリ秒単位でなくてもずれない。
+// ・メッセージはVSTiホストのイベントに直接積むので、ここでは確保しない。
+//-----------------------------------------------------------------------------
+bool PlayMidi(Context* cxt, int samples)
+{
+	// 最後までいっている場合は、残りのサンプルを取得するだけ。
+	if (cxt->midx == cxt->mnum) {
+		if (cxt->pos < cxt->pend) {
+			return cxt->vsti->Render(samples);
+		}
+
+		return false;
 	}
 
-	const float* ch0 = g_vsti.GetChannel0();
-	const float* ch1 = g_vsti.GetChannel1();
+	// ブロックの終わりまでのメッセージを全て送信する（samplesが0なら、現在の演奏位置まで）
+	const __int64 start = cxt->pos;
+	const __int64 end = start + ((samples > 0)? samples : 1);
 
-	// 32bit PCM
-	if (out_bits == 32) {
-		const float S32_MUL =  1503192678.0f;	// 70%
-		const float S32_MAX =  2147418112.0f;
-		const float S32_MIN = -2147418112.0f;
+	while (cxt->midx < cxt->mnum) {
+		const SmfLoader::MidiMessage& message = cxt->loader.GetMidiMessage(cxt->midx);
+		__int64 frame = GetMessageFrame(cxt, message);
+		if (frame >= end) {
+			break;
+		}
 
-		int* pcm = static_cast<int*>(buffer);
-		for (int i = 0, j = 0; i < samples; ++i) {
-			float v0 = Clamp(ch0[i] * S32_MUL, S32_MIN, S32_MAX);
-			float v1 = Clamp(ch1[i] * S32_MUL, S32_MIN, S32_MAX);
+		int msg = message.data;
+		if (msg != SmfLoader::END_OF_TRACK) {
+			int type = (msg & 0xF0);
+			int mval = ((msg >> 8) & 0xFF);
 
-			pcm[j++] = static_cast<int>(v0);
-			pcm[j++] = static_cast<int>(v1);
+			// バンクセレクトを無視(0x00:bank select MSB/0x20:bank select LSB)
+			if (type != 0xB0 || (mval != 0x00 && mval != 0x20)) {
+				// シーク直後などで、既に過ぎているメッセージは先頭で送る
+				int offset = (frame > start)? static_cast<int>(frame - start) : 0;
+				cxt->vsti->PushEvent(msg, (offset < samples)? offset : ((samples > 0)? samples - 1 : 0));
+			}
 		}
+
+		++cxt->midx;
 	}
-	// 24bit PCM
-	else if (out_bits == 24) {
-		const float S24_MUL =  6000000.0f;	// 71%
-		const float S24_MAX =  8388607.0f;
-		const float S24_MIN = -8388608.0f;
-
-		union Int4Byte
-		{
-			int		i;
-			char	b[4];
-		};
-
-		Int4Byte ib;
-		char* pcm = static_cast<char*>(buffer);
-		for (int i = 0, j = 0; i < samples; ++i) {
-			float v0 = Clamp(ch0[i] * S24_MUL, S24_MIN, S24_MAX);
-			float v1 = Clamp(ch1[i] * S24_MUL, S24_MIN, S24_MAX);
-
-			ib.i = static_cast<int>(v0);
-			pcm[j++] = ib.b[0];
-			pcm[j++] = ib.b[1];
-			pcm[j++] = ib.b[2];
-
-			ib.i = static_cast<int>(v1);
-			pcm[j++] = ib.b[0];
-			pcm[j++] = ib.b[1];
-			pcm[j++] = ib.b[2];
-		}
+
+	return cxt->vsti->Render(samples);
+}
+
+//-----------------------------------------------------------------------------
+// SMFを最後までレンダリングして、キャッシュファイルに書き出す
+// ・再生と違って時間に合わせる必要はないので、大きなブロックで、VSTiが処理できる速さで回す。
+// ・キャッシュを作るスレッドで呼ぶ。中止は、ブロック毎に確認する。
+//-----------------------------------------------------------------------------
+static bool Bounce(Context* cxt, const wchar_t* cache_path)
+{
+	PcmCacheWriter writer;
+	if (!writer.Create(cache_path, cxt->rate)) {
+		return false;
+	}
+
+	cxt->vsti = g_vsti_pool.Acquire();
+	if (!cxt->vsti) {
+		return false;
 	}
-	// 16bit PCM
-	else if (out_bits == 16) {
-		const float S16_MUL =  20000.0f;	// 60%
-		const float S16_MAX =  32767.0f;
-		const float S16_MIN = -32768.0f;
 
-		short* pcm = static_cast<short*>(buffer);
-		for (int i = 0, j = 0; i < samples; ++i) {
-			float v0 = Clamp(ch0[i] * S16_MUL, S16_MIN, S16_MAX);
-			float v1 = Clamp(ch1[i] * S16_MUL, S16_MIN, S16_MAX);
+	const int samples = VstiHost::MAX_SAMPLES;
+	if (!cxt->vsti->Start(cxt->rate, samples)) {
+		g_vsti_pool.Release(cxt->vsti);
+		cxt->vsti = NULL;
+		return false;
+	}
+
+	cxt->vsti->Reset(cxt->loader.GetResetMessageData(), cxt->loader.GetResetMessageSize());
+
+	bool result = true;
+	while (PlayMidi(cxt, samples)) {
+		cxt->pos += samples;
 
-			pcm[j++] = static_cast<short>(v0);
-			pcm[j++] = static_cast<short>(v1);
+		if (g_bounce_abort) {
+			result = false;
+			break;
+		}
+
+		if (!writer.Write(cxt->vsti->GetChannel0(), cxt->vsti->GetChannel1(), samples)) {
+			result = false;
+			break;
 		}
 	}
-	// unsupported
-	else {
-		size = 0;
+
+	cxt->vsti->Stop();
+	g_vsti_pool.Release(cxt->vsti);
+	cxt->vsti = NULL;
+
+	return result && writer.Commit();
+}
+
+//-----------------------------------------------------------------------------
+// キャッシュを作るスレッド
+//-----------------------------------------------------------------------------
+static DWORD WINAPI BounceThread(void* /*param*/)
+{
+	wchar_t cache_path[MAX_PATH];
+	if (!GetPcmCachePath(g_cache_dir, g_bounce_path, g_vsti_id, g_vsti_pool.GetSettingsHash(), g_sample_rate, cache_path)) {
+		return 0;
+	}
+
+	Context* cxt = CreateContext(g_bounce_path);
+	if (!cxt) {
+		return 0;
+	}
+
+	CreateDirectoryW(g_cache_dir, NULL);
+
+	// 増えすぎないように、作る度に古いものを消す
+	if (Bounce(cxt, cache_path) && g_cache_limit > 0) {
+		TrimPcmCache(g_cache_dir, g_cache_limit);
 	}
 
-	return size;
+	delete cxt;
+	return 0;
 }
 
 //-----------------------------------------------------------------------------
-// MIDI再生
+// キャッシュの作成を始める
+// ・作成中なら、今回は作らない（次に開いた時に作る）。
+// ・空いているVSTiがなければ、スレッドの中で何もせずに終わる。
 //-----------------------------------------------------------------------------
-int PlayMidi(Context* cxt, void* buffer, int size)
+static void StartBounce(const wchar_t* path)
 {
-	MsgList msglist;
+	if (lstrlenW(path) >= MAX_PATH) {
+		return;
+	}
 
-	// 最後までいっている場合は、残りのサンプルを取得するだけ。
-	if (cxt->midx == cxt->mnum) {
-		if (cxt->time < cxt->tend) {
-			return RenderMidi(msglist, cxt->bits, buffer, size);
-		}
+	EnterCriticalSection(&g_bounce_lock);
 
-		return 0;
+	if (g_bounce_thread && WaitForSingleObject(g_bounce_thread, 0) == WAIT_TIMEOUT) {
+		LeaveCriticalSection(&g_bounce_lock);
+		return;
 	}
 
-	msglist.reserve(128);
+	if (g_bounce_thread) {
+		CloseHandle(g_bounce_thread);
+		g_bounce_thread = NULL;
+	}
 
-	// 現在の演奏時間までのメッセージを全て送信する
-	int time = cxt->loader.GetMidiMessage(cxt->midx).time;
-	while ((cxt->midx < cxt->mnum) && (time <= cxt->time)) {
-		int msg = cxt->loader.GetMidiMessage(cxt->midx).data;
-		if (msg != SmfLoader::END_OF_TRACK) {
-			int type = (msg & 0xF0);
-			int mval = ((msg >> 8) & 0xFF);
+	lstrcpyW(g_bounce_path, path);
+	InterlockedExchange(&g_bounce_abort, FALSE);
 
-			// バンクセレクトを無視(0x00:bank select MSB/0x20:bank select LSB)
-			if (type != 0xB0 || (mval != 0x00 && mval != 0x20)) {
-				msglist.push_back(msg);
-			}
-		}
+	DWORD id = 0;
+	g_bounce_thread = CreateThread(NULL, 0, BounceThread, NULL, 0, &id);
+	if (g_bounce_thread) {
+		// 再生中の曲より優先しないように、優先度を下げる
+		SetThreadPriority(g_bounce_thread, THREAD_PRIORITY_LOWEST);
+	}
 
-		if (++cxt->midx < cxt->mnum) {
-			time = cxt->loader.GetMidiMessage(cxt->midx).time;
-		}
+	LeaveCriticalSection(&g_bounce_lock);
+}
+
+//-----------------------------------------------------------------------------
+// キャッシュの作成を中止する（作りかけのファイルは残らない）
+// ・中止はブロック毎に確認するので、待つのは最大でも１ブロックのレンダリング分。
+// ・作成中だった場合は、trueを返す。
+//-----------------------------------------------------------------------------
+bool StopBounce()
+{
+	bool stopped = false;
+
+	EnterCriticalSection(&g_bounce_lock);
+
+	if (g_bounce_thread) {
+		stopped = (WaitForSingleObject(g_bounce_thread, 0) == WAIT_TIMEOUT);
+
+		InterlockedExchange(&g_bounce_abort, TRUE);
+		WaitForSingleObject(g_bounce_thread, INFINITE);
+		CloseHandle(g_bounce_thread);
+		g_bounce_thread = NULL;
 	}
 
-	return RenderMidi(msglist, cxt->bits, buffer, size);
+	LeaveCriticalSection(&g_bounce_lock);
+	return stopped;
+}
+
+//-----------------------------------------------------------------------------
+// レンダリング済みのキャッシュを開く
+// ・なければ、別スレッドで作り始めてfalseを返す（今回はVSTiで再生し、次からキャッシュを使う）。
+//-----------------------------------------------------------------------------
+bool OpenCache(Context* cxt, const wchar_t* path)
+{
+	wchar_t cache_path[MAX_PATH];
+	if (!GetPcmCachePath(g_cache_dir, path, g_vsti_id, g_vsti_pool.GetSettingsHash(), cxt->rate, cache_path)) {
+		return false;
+	}
+
+	PcmCacheReader* reader = new PcmCacheReader();
+	if (!reader) {
+		return false;
+	}
+
+	if (!reader->Open(cache_path, cxt->rate)) {
+		delete reader;
+		StartBounce(path);
+		return false;
+	}
+
+	TouchPcmCache(cache_path);
+
+	cxt->cache_pcm = new float[cxt->block * 2];
+	if (!cxt->cache_pcm) {
+		delete reader;
+		return false;
+	}
+
+	cxt->cache = reader;
+	return true;
 }
@@ -0,0 +1,151 @@
+﻿//=============================================================================
+// 次の曲の事前準備 (2016/09/17版)
+//                                                Copyright (c) 2006-2016 MAYO.
+//=============================================================================
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "luna_pi.h"
+
+//-----------------------------------------------------------------------------
+// 次の曲の事前準備
+// ・Prepare()で渡されたパスを、別スレッドで開いておき、Open()で引き渡す。
+// ・準備できるのは１つだけ。新たに準備すると、前の準備は閉じる。
+// ・CRTなしでも使えるように、コンストラクタは持たない（static変数で使用する）。
+//-----------------------------------------------------------------------------
+class PreOpen
+{
+public:
+	// 開く関数と閉じる関数
+	typedef Handle (*OpenProc)(const wchar_t* path, Output* out);
+	typedef void (LPAPI* CloseProc)(Handle handle);
+
+	// 先読みしない設定の場合に、事前準備でデコードしておく時間（ミリ秒）
+	enum { PREROLL_TIME = 1000 };
+
+	// 準備中の場合に、Take()で開き終わるのを待つ最大時間（ミリ秒）
+	enum { TAKE_TIMEOUT = 1000 };
+
+public:
+	//-------------------------------------------------------------------------
+	// 準備開始
+	// ・pathがNULLなら、前の準備を閉じるだけ。
+	//-------------------------------------------------------------------------
+	bool Start(const wchar_t* path, OpenProc open, CloseProc close)
+	{
+		Lock();
+		Discard();
+
+		bool result = false;
+		if (path && open && close && lstrlenW(path) < MAX_PATH) {
+			lstrcpyW(m_path, path);
+			m_open = open;
+			m_close = close;
+			m_handle = NULL;
+
+			DWORD id = 0;
+			m_thread = CreateThread(NULL, 0, ThreadProc, this, 0, &id);
+			if (m_thread) {
+				// 再生中の曲より優先しないように、少し優先度を下げる
+				SetThreadPriority(m_thread, THREAD_PRIORITY_BELOW_NORMAL);
+				result = true;
+			}
+		}
+
+		Unlock();
+		return result;
+	}
+
+	//-------------------------------------------------------------------------
+	// 準備したハンドルを引き取る
+	// ・同じパスを準備していなければ、NULLを返す（準備はそのまま残す）。
+	// ・準備中なら、TAKE_TIMEOUTまで開き終わるのを待つ。間に合わなければNULLを返すので、
+	//   呼び出し側で普通に開くこと（準備は、次のStart()かCancel()で閉じる）。
+	//-------------------------------------------------------------------------
+	Handle Take(const wchar_t* path, Output* out)
+	{
+		Handle handle = NULL;
+
+		Lock();
+		if (m_thread && path && lstrcmpiW(m_path, path) == 0
+			&& WaitForSingleObject(m_thread, TAKE_TIMEOUT) == WAIT_OBJECT_0) {
+			CloseHandle(m_thread);
+			m_thread = NULL;
+
+			handle = m_handle;
+			m_handle = NULL;
+
+			if (handle) {
+				*out = m_out;
+			}
+		}
+
+		Unlock();
+		return handle;
+	}
+
+	//-------------------------------------------------------------------------
+	// 準備を閉じる（プラグイン解放時にも呼ぶこと）
+	//-------------------------------------------------------------------------
+	void Cancel()
+	{
+		Lock();
+		Discard();
+		Unlock();
+	}
+
+private:
+	//-------------------------------------------------------------------------
+	// スレッド関数
+	//-------------------------------------------------------------------------
+	static DWORD WINAPI ThreadProc(void* param)
+	{
+		PreOpen* self = static_cast<PreOpen*>(param);
+		self->m_handle = self->m_open(self->m_path, &self->m_out);
+		return 0;
+	}
+
+	//-------------------------------------------------------------------------
+	// 準備中・準備済みのハンドルを閉じる（ロック中に呼ぶ）
+	//-------------------------------------------------------------------------
+	void Discard()
+	{
+		if (!m_thread) {
+			return;
+		}
+
+		WaitForSingleObject(m_thread, INFINITE);
+		CloseHandle(m_thread);
+		m_thread = NULL;
+
+		if (m_handle) {
+			m_close(m_handle);
+			m_handle = NULL;
+		}
+	}
+
+	//-------------------------------------------------------------------------
+	// 排他（CRITICAL_SECTIONは初期化が必要なので、簡易的なスピンロック）
+	//-------------------------------------------------------------------------
+	void Lock()
+	{
+		while (InterlockedExchange(&m_lock, TRUE)) {
+			Sleep(1);
+		}
+	}
+
+	void Unlock()
+	{
+		InterlockedExchange(&m_lock, FALSE);
+	}
+
+private:
+	wchar_t			m_path[MAX_PATH];	// 準備しているパス
+	OpenProc		m_open;
+	CloseProc		m_close;
+	HANDLE			m_thread;			// 準備スレッド（引き取るまで保持）
+	Handle			m_handle;			// 準備したハンドル
+	Output			m_out;				// 準備したハンドルの出力設定
+	volatile LONG	m_lock;
+};
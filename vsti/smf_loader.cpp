@@ -12,12 +12,17 @@
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
 #include <windows.h>
+#include "file_stream.h"
 
 // 内部定義
 namespace {
 
 // 定数系定義
 
+// 解析は、不正なデータではトラックの末尾を越えて読むことがあるので、
+// ファイルの後ろに0を埋めた領域を付けて読み込む（メタイベントのテキストのコピーが最長）
+const DWORD READ_MARGIN = 256;
+
 // GMリセットバイトシーケンス
 const unsigned char DATA_GM1[] = {0xF0, 0x7E, 0x7F, 0x09, 0x01, 0xF7};
 const unsigned char DATA_GM2[] = {0xF0, 0x7E, 0x7F, 0x09, 0x03, 0xF7};
@@ -56,11 +61,210 @@ int Swap32(const unsigned char* value)
 		 | (static_cast<int>(value[0]) << 24);
 }
 
-// 64bit割り算
-int Mul64Div32(int a, int b, int c)
+// 初期テンポ（四分音符あたりのマイクロ秒、120BPM）
+const int DEFAULT_TEMPO = 500000;
+
+// テンポが一定の区間
+struct TempoSegment
+{
+	int		tick;	// 区間の開始位置（絶対デルタタイム）
+	int		tempo;	// 四分音符あたりのマイクロ秒
+	__int64	usec;	// 区間の開始時間（マイクロ秒）
+};
+
+// トラックの読み取り位置（トラック間のマージ用）
+struct TrackCursor
+{
+	int		tick;	// 次のメッセージの絶対デルタタイム
+	int		track;	// トラック番号（同じ時間なら、番号の小さいトラックを先にする）
+	int		pos;	// 次のメッセージのインデックス
+	int		end;	// トラックの終わりのインデックス
+};
+
+// ヒープの先頭に、最も早いトラックが来るようにする
+struct TrackCursorCompare
+{
+	bool operator()(const TrackCursor& lhs, const TrackCursor& rhs) const
+	{
+		return (lhs.tick != rhs.tick)? (lhs.tick > rhs.tick) : (lhs.track > rhs.track);
+	}
+};
+
+// チャンネル数
+const int CHANNEL_NUM = 16;
+
+// シーク用の状態スナップショットを作る間隔（ミリ秒）
+const int SEEK_INTERVAL = 5000;
+
+// 状態を復元するRPNの数（0:ピッチベンドセンシティビティ、1:ファインチューン、2:コースチューン）
+const int RPN_NUM = 3;
+
+// 未設定の値
+const unsigned char NO_VALUE = 0xFF;
+const unsigned short NO_VALUE16 = 0xFFFF;
+
+// 最後に選択したパラメータの種類
+enum ParamType
+{
+	PARAM_NONE,
+	PARAM_RPN,
+	PARAM_NRPN,
+};
+
+// チャンネル毎の状態（シーク時に復元する）
+struct ChannelState
+{
+	unsigned char	control[128];	// コントロールチェンジの値
+	unsigned char	program;		// プログラムチェンジ
+	unsigned char	pressure;		// チャネルプレッシャー
+	unsigned char	param_type;		// 最後に選択したパラメータ（ParamType）
+	unsigned short	bend;			// ピッチベンド
+	unsigned short	rpn[RPN_NUM];	// RPNの値（MSB << 7 | LSB）
+};
+
+// 状態を未設定にする
+void InitChannelState(ChannelState* state)
+{
+	for (int i = 0; i < CHANNEL_NUM; ++i) {
+		memset(&state[i], NO_VALUE, sizeof(state[i]));
+		state[i].param_type = PARAM_NONE;
+	}
+}
+
+// コントロールチェンジを状態に反映する
+void ApplyControl(ChannelState& state, int number, int value)
+{
+	switch (number) {
+	case 0x06:	// データエントリ
+	case 0x26:
+		if (state.param_type == PARAM_RPN && state.control[0x65] == 0 && state.control[0x64] < RPN_NUM) {
+			unsigned short& rpn = state.rpn[state.control[0x64]];
+			if (rpn == NO_VALUE16) {
+				rpn = 0;
+			}
+
+			rpn = (number == 0x06)? ((value << 7) | (rpn & 0x7F)) : ((rpn & ~0x7F) | value);
+		}
+		return;
+
+	case 0x60:	// インクリメント・デクリメントは復元しない
+	case 0x61:
+		return;
+
+	case 0x62:	// NRPN
+	case 0x63:
+		state.param_type = PARAM_NRPN;
+		break;
+
+	case 0x64:	// RPN
+	case 0x65:
+		state.param_type = PARAM_RPN;
+		break;
+
+	case 0x79:	// リセットオールコントローラー（音量・パン・エフェクト等は残る）
+		state.control[0x01] = NO_VALUE;
+		state.control[0x0B] = NO_VALUE;
+		for (int i = 0x40; i <= 0x43; ++i) {
+			state.control[i] = NO_VALUE;
+		}
+
+		for (int i = 0x62; i <= 0x65; ++i) {
+			state.control[i] = NO_VALUE;
+		}
+
+		state.pressure = NO_VALUE;
+		state.param_type = PARAM_NONE;
+		state.bend = NO_VALUE16;
+		return;
+	}
+
+	// チャンネルモードメッセージは復元しない
+	if (number < 0x78) {
+		state.control[number] = static_cast<unsigned char>(value);
+	}
+}
+
+// MIDIメッセージを状態に反映する（ノート等、状態を持たないメッセージは無視する）
+void ApplyMessage(ChannelState* state, int message)
+{
+	int channel = (message & 0x0F);
+	int data1 = ((message >> 8) & 0x7F);
+	int data2 = ((message >> 16) & 0x7F);
+
+	switch (message & 0xF0) {
+	case 0xB0: ApplyControl(state[channel], data1, data2); break;
+	case 0xC0: state[channel].program = static_cast<unsigned char>(data1); break;
+	case 0xD0: state[channel].pressure = static_cast<unsigned char>(data1); break;
+	case 0xE0: state[channel].bend = static_cast<unsigned short>(data1 | (data2 << 7)); break;
+	}
+}
+
+// 状態を復元するMIDIメッセージを作る
+int EmitChannelState(const ChannelState* state, int* messages)
 {
-	//return static_cast<int>(long long(a) * long long(b) / long long(c));
-	return MulDiv(a, b, c);
+	int count = 0;
+
+	for (int ch = 0; ch < CHANNEL_NUM; ++ch) {
+		const ChannelState& st = state[ch];
+		const int control = 0xB0 | ch;
+
+		// バンクセレクトは、プログラムチェンジの前に送る
+		if (st.control[0x00] != NO_VALUE) {
+			messages[count++] = control | (0x00 << 8) | (st.control[0x00] << 16);
+		}
+
+		if (st.control[0x20] != NO_VALUE) {
+			messages[count++] = control | (0x20 << 8) | (st.control[0x20] << 16);
+		}
+
+		if (st.program != NO_VALUE) {
+			messages[count++] = (0xC0 | ch) | (st.program << 8);
+		}
+
+		// パラメータの選択は、RPNの後で戻す
+		for (int i = 0x01; i < 0x78; ++i) {
+			if (i == 0x06 || i == 0x20 || i == 0x26 || (0x60 <= i && i <= 0x65)) {
+				continue;
+			}
+
+			if (st.control[i] != NO_VALUE) {
+				messages[count++] = control | (i << 8) | (st.control[i] << 16);
+			}
+		}
+
+		bool rpn_sent = false;
+		for (int i = 0; i < RPN_NUM; ++i) {
+			if (st.rpn[i] != NO_VALUE16) {
+				messages[count++] = control | (0x65 << 8);
+				messages[count++] = control | (0x64 << 8) | (i << 16);
+				messages[count++] = control | (0x06 << 8) | ((st.rpn[i] >> 7) << 16);
+				messages[count++] = control | (0x26 << 8) | ((st.rpn[i] & 0x7F) << 16);
+				rpn_sent = true;
+			}
+		}
+
+		int select_msb = (st.param_type == PARAM_NRPN)? 0x63 : 0x65;
+		int select_lsb = (st.param_type == PARAM_NRPN)? 0x62 : 0x64;
+		if (st.param_type != PARAM_NONE && st.control[select_msb] != NO_VALUE && st.control[select_lsb] != NO_VALUE) {
+			messages[count++] = control | (select_msb << 8) | (st.control[select_msb] << 16);
+			messages[count++] = control | (select_lsb << 8) | (st.control[select_lsb] << 16);
+		}
+		else if (rpn_sent) {
+			// RPNヌル
+			messages[count++] = control | (0x65 << 8) | (0x7F << 16);
+			messages[count++] = control | (0x64 << 8) | (0x7F << 16);
+		}
+
+		if (st.bend != NO_VALUE16) {
+			messages[count++] = (0xE0 | ch) | ((st.bend & 0x7F) << 8) | ((st.bend >> 7) << 16);
+		}
+
+		if (st.pressure != NO_VALUE) {
+			messages[count++] = (0xD0 | ch) | (st.pressure << 8);
+		}
+	}
+
+	return count;
 }
 
 // ブランク文字列消し
@@ -92,12 +296,21 @@ void TrimBlank(char (&buf)[LEN])
 
 } //namespace
 
+// シーク用の状態スナップショット
+struct SmfSeekPoint
+{
+	int				index;					// 次に再生するMIDIメッセージのインデックス
+	ChannelState	channel[CHANNEL_NUM];	// indexより前のメッセージを反映した状態
+};
+
 // SMFデータ解析
 class SmfParser
 {
 public:
 	typedef std::vector<SmfLoader::MidiMessage>	MidiMessageVector;
 	typedef std::map<int, int>					TempoMap;
+	typedef std::vector<TempoSegment>			TempoList;
+	typedef std::vector<int>					TrackList;
 
 public:
 	SmfParser(const unsigned char* data, int size, const SmfLoader::LoadOption& option);
@@ -106,8 +319,11 @@ public:
 	// 解析
 	void ParseSmf();
 
+	// 全トラックのMIDIメッセージを時間順に並べて、destに書き込む（destはGetMidiMessageNum()個分）
+	void MergeMessages(SmfLoader::MidiMessage* dest);
+
 	// MIDI演奏データアクセサ
-	const MidiMessageVector& GetMidiMessageData() const { return messages_; }
+	int GetMidiMessageNum() const { return static_cast<int>(messages_.size()); }
 	SmfLoader::ResetType GetResetType() const { return m_reset_type; }
 	SmfLoader::SmfFormat GetSmfFormat() const { return m_smf_format; }
 	int GetTrackNum() const { return m_track_num; }
@@ -124,7 +340,7 @@ private:
 
 	int ParseExMessage(const unsigned char* data);
 	int ParseMetaEvent(const unsigned char* data, int delta_time);
-	int CalcPlayTime(int delta_time) const;
+	void ConvertPlayTime(SmfLoader::MidiMessage* messages, int count);
 
 	int ParseNumber(const unsigned char* data, int& used);
 	int ParseMessage(const unsigned char* data, int& used, int prev_msg, bool& ignore);
@@ -135,8 +351,9 @@ public:
 	SmfLoader::LoadOption	option_;		// 読み込みオプション
 
 	// MIDI演奏データ
-	MidiMessageVector		messages_;		// 再生時間・チャンネル順に並べたMIDIメッセージ
-	TempoMap				tempo_map_;		// テンポリスト
+	MidiMessageVector		messages_;		// トラック順に並べたMIDIメッセージ（時間は絶対デルタタイム）
+	TrackList				track_start_;	// 各トラックの先頭のインデックス
+	TempoMap				tempo_map_;		// テンポ変更（デルタタイム→四分音符あたりのマイクロ秒）
 	SmfLoader::ResetType	m_reset_type;	// 音源リセットタイプ
 	SmfLoader::SmfFormat	m_smf_format;	// SMFフォーマット
 	int						m_track_num;		// Format1のトラック数（0は1固定）
@@ -159,6 +376,8 @@ SmfLoader::SmfLoader()
 	, m_track_num(0)
 	, m_time_base(1)
 	, m_duration(0)
+	, m_seek_points(NULL)
+	, m_seek_num(0)
 {
 	memset(m_title, 0, sizeof(m_title));
 	memset(m_copyright, 0, sizeof(m_copyright));
@@ -177,30 +396,34 @@ SmfLoader::~SmfLoader()
 //-----------------------------------------------------------------------------
 bool SmfLoader::Load(const wchar_t* path, const LoadOption& option)
 {
-	HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
-		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-	if (file == INVALID_HANDLE_VALUE) {
+	FileStream file;
+	if (!file.Open(path)) {
 		return false;
 	}
 
-	DWORD size = GetFileSize(file, NULL);
+	DWORD size = file.GetSize();
 
 	// 最低、以下のバイト数ないときは、エラーとする
 	const DWORD REQUIRE_BYTES = 256;
 	if (size < REQUIRE_BYTES) {
-		CloseHandle(file);
 		return false;
 	}
 
-	void* buffer = HeapAlloc(GetProcessHeap(), 0, size);
+	// マップしたファイルを直接解析すると、末尾を越えて読んだ時にページ境界で落ちるので、
+	// 余白を付けたバッファに読み込む
+	if (size > 0x7FFFFFFF - READ_MARGIN) {
+		return false;
+	}
+
+	BYTE* buffer = static_cast<BYTE*>(HeapAlloc(GetProcessHeap(), 0, size + READ_MARGIN));
 	if (!buffer) {
-		CloseHandle(file);
 		return false;
 	}
 
-	DWORD readed = 0;
-	ReadFile(file, buffer, size, &readed, NULL);
-	CloseHandle(file);
+	ZeroMemory(buffer + size, READ_MARGIN);
+
+	DWORD readed = file.Read(buffer, size);
+	file.Close();
 
 	if (readed != size) {
 		HeapFree(GetProcessHeap(), 0, buffer);
@@ -223,21 +446,20 @@ bool SmfLoader::Load(const void* data, int size, const LoadOption& option)
 	SmfParser parser(static_cast<const unsigned char*>(data), size, option);
 	parser.ParseSmf();
 
-	const SmfParser::MidiMessageVector& msg = parser.GetMidiMessageData();
-	if (msg.empty()) {
+	int message_num = parser.GetMidiMessageNum();
+	if (message_num == 0) {
 		return false;
 	}
 
-	m_message_num = static_cast<int>(msg.size());
-	m_message_data = new MidiMessage[m_message_num];
+	m_message_data = new MidiMessage[message_num];
 	if (!m_message_data) {
 		Clear();
 		return false;
 	}
 
-	for (int i = 0; i < m_message_num; ++i) {
-		m_message_data[i] = msg[i];
-	}
+	// 各トラックは時間順に並んでいるので、マージするだけで済む
+	m_message_num = message_num;
+	parser.MergeMessages(m_message_data);
 
 	m_reset_type = parser.GetResetType();
 	m_smf_format = parser.GetSmfFormat();
@@ -247,6 +469,11 @@ bool SmfLoader::Load(const void* data, int size, const LoadOption& option)
 
 	parser.GetTitle(m_title);
 	parser.GetCopyright(m_copyright);
+
+	if (option.build_seek_index) {
+		BuildSeekIndex();
+	}
+
 	return true;
 }
 
@@ -265,10 +492,78 @@ void SmfLoader::Clear()
 	m_time_base = 1;
 	m_duration = 0;
 
+	delete [] m_seek_points;
+	m_seek_points = NULL;
+	m_seek_num = 0;
+
 	memset(m_title, 0, sizeof(m_title));
 	memset(m_copyright, 0, sizeof(m_copyright));
 }
 
+//-----------------------------------------------------------------------------
+// シーク先の状態を復元するメッセージを取得する
+// ・シーク先の手前のスナップショットから、シーク先までのメッセージを状態に反映する。
+//-----------------------------------------------------------------------------
+int SmfLoader::Chase(int time, int* messages, int& count) const
+{
+	ChannelState state[CHANNEL_NUM];
+	int index = 0;
+
+	int point = (time > 0)? (time / SEEK_INTERVAL) : 0;
+	if (point < m_seek_num) {
+		memcpy(state, m_seek_points[point].channel, sizeof(state));
+		index = m_seek_points[point].index;
+	}
+	else if (0 < m_seek_num) {
+		memcpy(state, m_seek_points[m_seek_num - 1].channel, sizeof(state));
+		index = m_seek_points[m_seek_num - 1].index;
+	}
+	else {
+		InitChannelState(state);
+	}
+
+	while (index < m_message_num && m_message_data[index].time < time) {
+		ApplyMessage(state, m_message_data[index].data);
+		++index;
+	}
+
+	count = EmitChannelState(state, messages);
+	return index;
+}
+
+//-----------------------------------------------------------------------------
+// シーク用の状態スナップショットを作成する
+//-----------------------------------------------------------------------------
+void SmfLoader::BuildSeekIndex()
+{
+	int num = m_duration / SEEK_INTERVAL + 1;
+	m_seek_points = new SmfSeekPoint[num];
+	if (!m_seek_points) {
+		return;
+	}
+
+	ChannelState state[CHANNEL_NUM];
+	InitChannelState(state);
+
+	int point = 0;
+	for (int i = 0; i < m_message_num; ++i) {
+		while (point < num && m_message_data[i].time >= point * SEEK_INTERVAL) {
+			m_seek_points[point].index = i;
+			memcpy(m_seek_points[point].channel, state, sizeof(state));
+			++point;
+		}
+
+		ApplyMessage(state, m_message_data[i].data);
+	}
+
+	for (; point < num; ++point) {
+		m_seek_points[point].index = m_message_num;
+		memcpy(m_seek_points[point].channel, state, sizeof(state));
+	}
+
+	m_seek_num = num;
+}
+
 //-----------------------------------------------------------------------------
 // 再生するMIDIメッセージ数取得
 //-----------------------------------------------------------------------------
@@ -422,8 +717,13 @@ void SmfParser::ParseSmf()
 	data += used;
 	size -= used;
 
+	// メッセージは最短でも数バイトなので、おおよその数を確保しておく
+	messages_.reserve(raw_size_ / 4);
+	track_start_.reserve(m_track_num);
+
 	for (int i = 0; (i < m_track_num) && (0 < size); ++i) {
 		used = 0;
+		track_start_.push_back(static_cast<int>(messages_.size()));
 
 		// 各トラックを解析する
 		if (!ParseTrack(data, size, used)) {
@@ -433,18 +733,52 @@ void SmfParser::ParseSmf()
 		data += used;
 		size -= used;
 	}
+}
 
-	struct MessageSortFunctor
-	{
-		// 時間基準でソートする
-		bool operator()( const SmfLoader::MidiMessage& lhs, const SmfLoader::MidiMessage& rhs) const
-		{
-			return (lhs.time < rhs.time);
+//-----------------------------------------------------------------------------
+// 全トラックのMIDIメッセージを時間順に並べる
+// ・各トラック内は時間順なので、トラックの先頭をヒープに入れてマージする。
+// ・同じ時間のメッセージは、トラック順・トラック内の順に並べる。
+//-----------------------------------------------------------------------------
+void SmfParser::MergeMessages(SmfLoader::MidiMessage* dest)
+{
+	const int track_num = static_cast<int>(track_start_.size());
+	const int message_num = static_cast<int>(messages_.size());
+
+	std::vector<TrackCursor> heap;
+	heap.reserve(track_num);
+
+	for (int i = 0; i < track_num; ++i) {
+		int end = (i + 1 < track_num)? track_start_[i + 1] : message_num;
+		if (track_start_[i] < end) {
+			TrackCursor cursor = {messages_[track_start_[i]].time, i, track_start_[i], end};
+			heap.push_back(cursor);
+		}
+	}
+
+	std::make_heap(heap.begin(), heap.end(), TrackCursorCompare());
+
+	int count = 0;
+	while (!heap.empty()) {
+		std::pop_heap(heap.begin(), heap.end(), TrackCursorCompare());
+
+		TrackCursor& cursor = heap.back();
+		dest[count++] = messages_[cursor.pos];
+
+		if (++cursor.pos < cursor.end) {
+			cursor.tick = messages_[cursor.pos].time;
+			std::push_heap(heap.begin(), heap.end(), TrackCursorCompare());
+		}
+		else {
+			heap.pop_back();
 		}
-	};
+	}
+
+	// マージ後は不要なので、先に解放しておく
+	MidiMessageVector().swap(messages_);
 
-	// 安定ソートにて、絶対時間順に並べる
-	std::stable_sort(messages_.begin(), messages_.end(), MessageSortFunctor());
+	// 全トラックのテンポ変更が揃ってから、時間に変換する
+	ConvertPlayTime(dest, count);
 }
 
 //-----------------------------------------------------------------------------
@@ -479,13 +813,16 @@ bool SmfParser::ParseHeader(const unsigned char* data, int size, int& used)
 	m_track_num = Swap16(data);
 	data += 2;
 	m_time_base = Swap16(data);
+	if (m_time_base == 0) {
+		return false;
+	}
 
 	// 追加のヘッダ領域を無視する
 	used += (header_size + 14);
 
 	// 初期テンポ設定
 	tempo_map_.clear();
-	tempo_map_[0] = 120;
+	tempo_map_[0] = DEFAULT_TEMPO;
 	return true;
 }
 
@@ -540,17 +877,11 @@ bool SmfParser::ParseTrack(const unsigned char* data, int size, int& used)
 		result = ParseMetaEvent(data, delta_time);
 		// トラック終了検出（ここまで処理しないといけない）
 		if (result == SmfLoader::END_OF_TRACK) {
-			int play_time = CalcPlayTime(delta_time);
-			SmfLoader::MidiMessage msg = {play_time, SmfLoader::END_OF_TRACK};
+			SmfLoader::MidiMessage msg = {delta_time, SmfLoader::END_OF_TRACK, 0};
 
-			// 最後のメッセージを追加
+			// 最後のメッセージを追加（曲長は、時間に変換する時に求める）
 			messages_.push_back(msg);
 
-			// 曲長を更新
-			if (m_duration < play_time) {
-				m_duration = play_time;
-			}
-
 			track_size -= 3;
 			data += 3;
 			used += 3;
@@ -571,9 +902,8 @@ bool SmfParser::ParseTrack(const unsigned char* data, int size, int& used)
 		data += result;
 		used += result;
 
-		// 絶対時間を計算する
-		int play_time = CalcPlayTime(delta_time);
-		SmfLoader::MidiMessage msg = {play_time, message};
+		// 時間は、全トラックを解析してから求めるので、ここでは絶対デルタタイムを入れておく
+		SmfLoader::MidiMessage msg = {delta_time, message, 0};
 
 		if (message != 0) {
 			if (!ignore) {
@@ -672,8 +1002,9 @@ int SmfParser::ParseMetaEvent(const unsigned char* data, int delta_time)
 	case 0x51:	// テンポ変更
 		{
 			int tttttt = Swap24(&data[used + 2]);
-			int tempo = Mul64Div32(60, 1000000, tttttt);
-			tempo_map_[delta_time] = tempo;
+			if (0 < tttttt) {
+				tempo_map_[delta_time] = tttttt;
+			}
 		}
 		break;
 
@@ -688,29 +1019,46 @@ int SmfParser::ParseMetaEvent(const unsigned char* data, int delta_time)
 }
 
 //-----------------------------------------------------------------------------
-// 現在のデルタタイムに対する絶対的な再生時間を計算する
+// 絶対デルタタイム順に並んだメッセージの時間を、ミリ秒（＋マイクロ秒）に変換する
+// ・テンポ変更ごとの区間の開始時間を先に求めておき、メッセージと並行して進める。
 //-----------------------------------------------------------------------------
-int SmfParser::CalcPlayTime(int delta_time) const
+void SmfParser::ConvertPlayTime(SmfLoader::MidiMessage* messages, int count)
 {
-	int play_time = 0, dtime = 0, ptime = 0, tempo = 0;
+	TempoList tempo_list;
+	tempo_list.reserve(tempo_map_.size());
+
+	__int64 usec = 0;
 	for (TempoMap::const_iterator it = tempo_map_.begin(); it != tempo_map_.end(); ++it) {
-		// デルタタイムが過ぎている場合は、ループを抜ける
-		if (delta_time < it->first) {
-			break;
+		if (!tempo_list.empty()) {
+			const TempoSegment& prev = tempo_list.back();
+			usec += static_cast<__int64>(it->first - prev.tick) * prev.tempo / m_time_base;
 		}
 
-		dtime = it->first - ptime;
-		if (0 < dtime) {
-			play_time += Mul64Div32(dtime, 60 * 1000, tempo * m_time_base);
+		TempoSegment segment = {it->first, it->second, usec};
+		tempo_list.push_back(segment);
+	}
+
+	const int segment_num = static_cast<int>(tempo_list.size());
+	int index = 0;
+
+	for (int i = 0; i < count; ++i) {
+		SmfLoader::MidiMessage* it = &messages[i];
+		int tick = it->time;
+		while (index + 1 < segment_num && tempo_list[index + 1].tick <= tick) {
+			++index;
 		}
 
-		ptime = it->first;
-		tempo = it->second;
-	}
+		const TempoSegment& segment = tempo_list[index];
+		__int64 play_time = segment.usec + static_cast<__int64>(tick - segment.tick) * segment.tempo / m_time_base;
+
+		it->time = static_cast<int>(play_time / 1000);
+		it->usec = static_cast<int>(play_time % 1000);
 
-	dtime = delta_time - ptime;
-	play_time += Mul64Div32(dtime, 60 * 1000, tempo * m_time_base);
-	return play_time;
+		// 曲長を更新
+		if (m_duration < it->time) {
+			m_duration = it->time;
+		}
+	}
 }
 
 //-----------------------------------------------------------------------------
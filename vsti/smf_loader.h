@@ -3,6 +3,8 @@
 //=============================================================================
 #pragma once
 
+struct SmfSeekPoint;
+
 //! @brief	SMFデータ読み込み
 class SmfLoader
 {
@@ -13,6 +15,9 @@ public:
 	//! @brief	トラック終了MIDIメッセージ
 	static const int END_OF_TRACK = -1;
 
+	//! @brief	シーク時に送信する状態復元メッセージの最大数
+	static const int CHASE_MAX_MESSAGES = 16 * 160;
+
 	//! @brief	フォーマット
 	enum SmfFormat
 	{
@@ -36,6 +41,7 @@ public:
 	{
 		bool	ignore_bank_select;		//!< バンクセレクトを無視する
 		bool	detect_reset_type;		//!< 音源リセットタイプを確定する
+		bool	build_seek_index;		//!< シーク用の状態スナップショットを作成する
 	};
 
 	//! @brief	MIDIメッセージ
@@ -43,6 +49,7 @@ public:
 	{
 		int	time;	// ミリ秒単位の絶対時間
 		int	data;	// メッセージデータ
+		int	usec;	// timeより細かい部分（マイクロ秒、0～999）
 	};
 
 public:
@@ -58,6 +65,11 @@ public:
 	//! @breif	読み込んだデータをクリアする
 	void Clear();
 
+	//! @brief	シーク先の状態を復元するメッセージを取得する
+	//! @note	ノートは含まない。messagesはCHASE_MAX_MESSAGES個分必要
+	//! @return	シーク先から再生する、最初のMIDIメッセージのインデックス
+	int Chase(int time, int* messages, int& count) const;
+
 	//! @brief	再生するMIDIメッセージ数取得
 	int GetMidiMessageNum() const;
 
@@ -92,6 +104,9 @@ public:
 	//! @brief	メタデータに設定された権利情報取得
 	const char* GetCopyright() const;
 
+private:
+	void BuildSeekIndex();
+
 private:
 	MidiMessage*	m_message_data;	// MIDIメッセージデータ
 	int				m_message_num;	// MIDIメッセージ数
@@ -100,6 +115,8 @@ private:
 	int				m_track_num;	// Format1のトラック数（SMF0は1固定）
 	int				m_time_base;	// タイムベース
 	int				m_duration;		// ミリ秒単位の時間
+	SmfSeekPoint*	m_seek_points;	// 一定時間毎の状態スナップショット
+	int				m_seek_num;		// スナップショット数
 
 	// メタデータ
 	char			m_title[METATEXT_MAXLEN + 1];
@@ -19,9 +19,11 @@ namespace {
 const char VENDOR[] = "YAMAHA";
 const char PRODUCT[] = "Cubase VST";
 
-// バッファするサンプル数
-// １回に10ms分レンダリングするとして96kHzなら960サンプル、なのでそれ以上の数値
-const int BUF_SAMPLES = 1024;
+// 最初に確保しておくイベント数（足りなければ倍々で増やす）
+const int INIT_EVENTS = 256;
+
+// リセット後に、音源を落ち着かせるためにレンダリングして捨てる時間（ミリ秒）の既定値
+const int DEFAULT_SETTLE_TIME = 50;
 
 } //namespace
 
@@ -35,11 +37,14 @@ public:
 	bool Init(const wchar_t* vsti_path, bool reset_on_start);
 	void Term();
 
-	bool Start(int sample_rate);
+	bool Start(int sample_rate, int block_size);
 	void Stop();
 
+	void SetSettleTime(int settle_time) { m_settle_time = settle_time; }
+
 	void Reset(const void* reset_data, int data_size);
-	bool Render(const int* message_data, int message_num, int samples);
+	void PushEvent(int message, int frame);
+	bool Render(int samples);
 
 	const float* GetChannel0() const { return m_output[0]; }
 	const float* GetChannel1() const { return m_output[1]; }
@@ -48,12 +53,22 @@ public:
 
 	void ShowEditor(HINSTANCE inst, HWND hwnd);
 
+	int GetSettings(void* buffer, int size, bool& is_chunk);
+	bool SetSettings(const void* data, int size, bool is_chunk);
+
 private:
 	static VstIntPtr VSTCALLBACK HostCallback(AEffect* effect, VstInt32 opcode, VstInt32 index, VstIntPtr value, void* ptr, float opt);
 	VstIntPtr Dispatcher(VstInt32 opcode, VstInt32 index, VstIntPtr value, void* ptr, float opt);
 
 	static INT_PTR CALLBACK DlgProc(HWND dlg, UINT msg, WPARAM wp, LPARAM lp);
 
+	bool ReserveBuffer(int block_size);
+	bool ReserveEvents(int capacity);
+	void FreeEvents();
+
+	void Settle();
+	void ApplySettings();
+
 private:
 	static const int OUTPUT_NUM = 2;
 
@@ -64,8 +79,29 @@ private:
 	AEffect*	m_effect;
 	float*		m_output[OUTPUT_NUM];
 	float*		m_buffer;
+	int			m_buffer_cap;	// m_bufferの１チャンネルあたりのサンプル数
+	int			m_block_size;	// 演奏開始時に指定した、１回にレンダリングする最大サンプル数
 	bool		m_reset_on_start;
 	bool		m_playing;
+
+	// 送信するイベント（使い回して、レンダリング中は確保しない）
+	VstEvents*		m_events;
+	VstMidiEvent*	m_midi_events;
+	int				m_event_num;
+	int				m_event_cap;
+
+	// リセット（Resetでは要求だけ行い、次に出力する時に送信して、無音をレンダリングする）
+	const void*		m_reset_data;
+	int				m_reset_size;
+	bool			m_reset_pending;
+	int				m_settle_time;		// ミリ秒
+	int				m_settle_frames;	// m_settle_timeを、サンプルレートで換算したもの
+
+	// 演奏開始時に反映する設定（設定エディタで変更した、他のインスタンスの設定）
+	BYTE*			m_settings;
+	int				m_settings_size;
+	bool			m_settings_chunk;	// trueならチャンク、falseならパラメータ値の配列
+	bool			m_settings_pending;	// まだ反映していない
 };
 
 
@@ -77,8 +113,23 @@ VstiHost::Impl::Impl()
 	, m_e_proc(NULL)
 	, m_effect(NULL)
 	, m_buffer(NULL)
+	, m_buffer_cap(0)
+	, m_block_size(0)
 	, m_reset_on_start(false)
 	, m_playing(false)
+	, m_events(NULL)
+	, m_midi_events(NULL)
+	, m_event_num(0)
+	, m_event_cap(0)
+	, m_reset_data(NULL)
+	, m_reset_size(0)
+	, m_reset_pending(false)
+	, m_settle_time(DEFAULT_SETTLE_TIME)
+	, m_settle_frames(0)
+	, m_settings(NULL)
+	, m_settings_size(0)
+	, m_settings_chunk(false)
+	, m_settings_pending(false)
 {
 	m_output[0] = NULL;
 	m_output[1] = NULL;
@@ -117,16 +168,11 @@ bool VstiHost::Impl::Init(const wchar_t* vsti_path, bool reset_on_start)
 		return false;
 	}
 
-	m_buffer = new float[OUTPUT_NUM * BUF_SAMPLES];
-	if (!m_buffer) {
+	if (!ReserveEvents(INIT_EVENTS)) {
 		Term();
 		return false;
 	}
 
-	for (int i = 0; i < OUTPUT_NUM; ++i) 	{
-		m_output[i] = &m_buffer[i * BUF_SAMPLES];
-	}
-
 	if (!reset_on_start) {
 		m_effect = m_e_proc(HostCallback);
 		if (!m_effect) {
@@ -147,6 +193,19 @@ void VstiHost::Impl::Term()
 		m_buffer = NULL;
 	}
 
+	m_buffer_cap = 0;
+	m_block_size = 0;
+
+	FreeEvents();
+
+	if (m_settings) {
+		delete [] m_settings;
+		m_settings = NULL;
+	}
+
+	m_settings_size = 0;
+	m_settings_pending = false;
+
 	if (m_module) {
 		FreeLibrary(m_module);
 		m_module = NULL;
@@ -162,8 +221,12 @@ void VstiHost::Impl::Term()
 //-----------------------------------------------------------------------------
 // 演奏開始
 //-----------------------------------------------------------------------------
-bool VstiHost::Impl::Start(int sample_rate)
+bool VstiHost::Impl::Start(int sample_rate, int block_size)
 {
+	if (block_size <= 0 || block_size > MAX_SAMPLES || !ReserveBuffer(block_size)) {
+		return false;
+	}
+
 	if (m_reset_on_start) {
 		m_effect = m_e_proc(HostCallback);
 		if (!m_effect) {
@@ -177,10 +240,16 @@ bool VstiHost::Impl::Start(int sample_rate)
 
 	Dispatcher(effSetProgram, 0, 0, NULL, 0.0f);
 	Dispatcher(effSetSampleRate, 0, 0, NULL, rate_param);
-	Dispatcher(effSetBlockSize, 0, BUF_SAMPLES, NULL, 0.0f);
+	Dispatcher(effSetBlockSize, 0, block_size, NULL, 0.0f);
+	ApplySettings();
 	Dispatcher(effMainsChanged, 0, 1, NULL, 0.0f);
 	Dispatcher(effSetProgram, 0, 0, NULL, 0.0f);
 
+	m_block_size = block_size;
+	m_settle_frames = MulDiv(sample_rate, m_settle_time, 1000);
+	m_reset_pending = false;
+	m_event_num = 0;
+
 	m_playing = true;
 	return true;
 }
@@ -198,13 +267,94 @@ void VstiHost::Impl::Stop()
 		m_effect = NULL;
 	}
 
+	m_reset_pending = false;
+	m_event_num = 0;
+
 	m_playing = false;
 }
 
 //-----------------------------------------------------------------------------
 // MIDIリセット
+// ・ここでは処理を止めて再開し、リセットを要求するだけで、待たずに戻る。
+// ・リセットのSysEx送信と、音源を落ち着かせるための無音のレンダリングは、
+//   次に出力するRenderの先頭で行う（Settle）。
+// ・reset_dataは、次に出力するまで有効なこと。
 //-----------------------------------------------------------------------------
 void VstiHost::Impl::Reset(const void* reset_data, int data_size)
+{
+	Dispatcher(effStopProcess, 0, 0, NULL, 0.0f);
+	Dispatcher(effMainsChanged, 0, 0, NULL, 0.0f);
+	Dispatcher(effMainsChanged, 0, 1, NULL, 0.0f);
+	Dispatcher(effSetProgram, 0, 0, NULL, 0.0f);
+
+	// リセット前に積んだメッセージは、リセットで消えるので捨てる
+	m_event_num = 0;
+
+	m_reset_data = reset_data;
+	m_reset_size = data_size;
+	m_reset_pending = true;
+
+	memset(m_buffer, 0, OUTPUT_NUM * m_buffer_cap * sizeof(float));
+}
+
+//-----------------------------------------------------------------------------
+// 次のレンダリングで送信するMIDIメッセージを追加
+//-----------------------------------------------------------------------------
+void VstiHost::Impl::PushEvent(int message, int frame)
+{
+	// 足りない場合だけ確保する（確保できなければ、そのメッセージは捨てる）
+	if (m_event_num == m_event_cap && !ReserveEvents(m_event_cap * 2)) {
+		return;
+	}
+
+	int type = (message & 0xF0);
+
+	VstMidiEvent* e = &m_midi_events[m_event_num++];
+	e->deltaFrames = frame;
+	e->noteLength = ((type == 0xC0) || (type == 0xD0))? 2 : 3;
+	memcpy(e->midiData, &message, sizeof(message));
+}
+
+//-----------------------------------------------------------------------------
+// シンセ実行（samples==0なら出力なしで処理）
+//-----------------------------------------------------------------------------
+bool VstiHost::Impl::Render(int samples)
+{
+	if (samples > m_block_size) {
+		m_event_num = 0;
+		return false;
+	}
+
+	// リセット直後は、出力する時まで送信を遅らせる（シーク等で待たないように）
+	if (m_reset_pending) {
+		if (samples == 0) {
+			return true;
+		}
+
+		Settle();
+	}
+
+	if (0 < m_event_num) {
+		m_events->numEvents = m_event_num;
+		Dispatcher(effProcessEvents, 0, 0, m_events, 0.0f);
+		m_event_num = 0;
+	}
+
+	if (0 < samples) {
+		for (int i = 0; i < OUTPUT_NUM; ++i) {
+			memset(m_output[i], 0, samples * sizeof(float));
+		}
+
+		m_effect->processReplacing(m_effect, NULL, m_output, samples);
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// リセットのSysExを送信して、m_settle_frames分の無音をレンダリングして捨てる
+//-----------------------------------------------------------------------------
+void VstiHost::Impl::Settle()
 {
 	VstEvents event;
 	VstMidiSysexEvent sysex;
@@ -218,67 +368,114 @@ void VstiHost::Impl::Reset(const void* reset_data, int data_size)
 
 	sysex.type = kVstSysExType;
 	sysex.byteSize = sizeof(sysex);
-	sysex.dumpBytes = data_size;
-	sysex.sysexDump = const_cast<char*>(static_cast<const char*>(reset_data));
+	sysex.dumpBytes = m_reset_size;
+	sysex.sysexDump = const_cast<char*>(static_cast<const char*>(m_reset_data));
 
-	Dispatcher(effStopProcess, 0, 0, NULL, 0.0f);
-	Dispatcher(effMainsChanged, 0, 0, NULL, 0.0f);
 	Dispatcher(effProcessEvents, 0, 0, &event, 0.0f);
-	Sleep(50);
 
-	Dispatcher(effMainsChanged, 0, 1, NULL, 0.0f);
-	Dispatcher(effSetProgram, 0, 0, NULL, 0.0f);
+	for (int rest = m_settle_frames; rest > 0; ) {
+		int frames = (rest < m_block_size)? rest : m_block_size;
+		for (int i = 0; i < OUTPUT_NUM; ++i) {
+			memset(m_output[i], 0, frames * sizeof(float));
+		}
 
-	memset(m_buffer, 0, OUTPUT_NUM * BUF_SAMPLES * sizeof(float));
+		m_effect->processReplacing(m_effect, NULL, m_output, frames);
+		rest -= frames;
+	}
+
+	m_reset_pending = false;
 }
 
 //-----------------------------------------------------------------------------
-// シンセ実行（buffer==NULLなら出力なしで処理）
+// 出力バッファを確保（足りている場合は、そのまま使う）
 //-----------------------------------------------------------------------------
-bool VstiHost::Impl::Render(const int* message_data, int message_num, int samples)
+bool VstiHost::Impl::ReserveBuffer(int block_size)
 {
-	const size_t SEND_EVENT_SIZE = sizeof(VstEvents) + sizeof(VstEvent*) * message_num;
-	const size_t MIDI_EVENT_SIZE = sizeof(VstEvent) * message_num + 4;
+	if (block_size <= m_buffer_cap) {
+		return true;
+	}
 
-	HANDLE heap = GetProcessHeap();
-	VstEvents* send_event = static_cast<VstEvents*>(HeapAlloc(heap, HEAP_ZERO_MEMORY, SEND_EVENT_SIZE));
-	if (!send_event) {
+	float* buffer = new float[OUTPUT_NUM * block_size];
+	if (!buffer) {
 		return false;
 	}
 
-	VstMidiEvent* midi_event = static_cast<VstMidiEvent*>(HeapAlloc(heap, HEAP_ZERO_MEMORY, MIDI_EVENT_SIZE));
-	if (!midi_event) {
-		HeapFree(heap, 0, send_event);
-		return false;
+	delete [] m_buffer;
+	m_buffer = buffer;
+	m_buffer_cap = block_size;
+
+	for (int i = 0; i < OUTPUT_NUM; ++i) {
+		m_output[i] = &m_buffer[i * block_size];
 	}
 
-	send_event->numEvents = message_num;
-	send_event->reserved = 0xBAADF00D;
+	return true;
+}
 
-	for (int i = 0; i < message_num; ++i) {
-		int mmsg = message_data[i];
-		int type = (mmsg & 0xF0);
+//-----------------------------------------------------------------------------
+// イベントの領域を確保（確保済みのイベントは引き継ぐ）
+//-----------------------------------------------------------------------------
+bool VstiHost::Impl::ReserveEvents(int capacity)
+{
+	if (capacity <= m_event_cap) {
+		return true;
+	}
 
-		VstMidiEvent* e = &midi_event[i];
-		send_event->events[i] = reinterpret_cast<VstEvent*>(e);
+	HANDLE heap = GetProcessHeap();
+	VstEvents* events = static_cast<VstEvents*>(HeapAlloc(heap, HEAP_ZERO_MEMORY,
+		sizeof(VstEvents) + sizeof(VstEvent*) * capacity));
+	if (!events) {
+		return false;
+	}
+
+	VstMidiEvent* midi_events = static_cast<VstMidiEvent*>(HeapAlloc(heap, HEAP_ZERO_MEMORY,
+		sizeof(VstMidiEvent) * capacity));
+	if (!midi_events) {
+		HeapFree(heap, 0, events);
+		return false;
+	}
+
+	if (m_midi_events) {
+		memcpy(midi_events, m_midi_events, sizeof(VstMidiEvent) * m_event_num);
+	}
 
+	// 変わらない部分は、ここで設定しておく
+	events->reserved = 0xBAADF00D;
+	for (int i = 0; i < capacity; ++i) {
+		VstMidiEvent* e = &midi_events[i];
 		e->type = kVstMidiType;
 		e->byteSize = sizeof(VstMidiEvent);
-		e->noteLength = ((type == 0xC0) || (type == 0xD0))? 2 : 3;
-
-		memcpy(e->midiData, &mmsg, sizeof(mmsg));
+		events->events[i] = reinterpret_cast<VstEvent*>(e);
 	}
 
-	Dispatcher(effProcessEvents, 0, 0, send_event, 0.0f);
+	int event_num = m_event_num;
+	FreeEvents();
 
-	if (0 < samples) {
-		memset(m_buffer, 0, OUTPUT_NUM * BUF_SAMPLES * sizeof(float));
-		m_effect->processReplacing(m_effect, NULL, m_output, samples);
+	m_events = events;
+	m_midi_events = midi_events;
+	m_event_num = event_num;
+	m_event_cap = capacity;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// イベントの領域を解放
+//-----------------------------------------------------------------------------
+void VstiHost::Impl::FreeEvents()
+{
+	HANDLE heap = GetProcessHeap();
+
+	if (m_midi_events) {
+		HeapFree(heap, 0, m_midi_events);
+		m_midi_events = NULL;
 	}
 
-	HeapFree(heap, 0, midi_event);
-	HeapFree(heap, 0, send_event);
-	return true;
+	if (m_events) {
+		HeapFree(heap, 0, m_events);
+		m_events = NULL;
+	}
+
+	m_event_num = 0;
+	m_event_cap = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -304,6 +501,94 @@ void VstiHost::Impl::ShowEditor(HINSTANCE inst, HWND hwnd)
 	}
 }
 
+//-----------------------------------------------------------------------------
+// 設定を取得する
+//-----------------------------------------------------------------------------
+int VstiHost::Impl::GetSettings(void* buffer, int size, bool& is_chunk)
+{
+	if (!m_effect) {
+		return 0;
+	}
+
+	// チャンクに対応していれば、バンク全体をまとめて取得する
+	if (m_effect->flags & effFlagsProgramChunks) {
+		void* chunk = NULL;
+		int chunk_size = static_cast<int>(Dispatcher(effGetChunk, 0, 0, &chunk, 0.0f));
+		if (chunk && 0 < chunk_size) {
+			if (buffer && chunk_size <= size) {
+				memcpy(buffer, chunk, chunk_size);
+			}
+
+			is_chunk = true;
+			return chunk_size;
+		}
+	}
+
+	// 対応していなければ、全パラメータの値を取得する
+	int param_size = m_effect->numParams * static_cast<int>(sizeof(float));
+	if (buffer && param_size <= size) {
+		float* values = static_cast<float*>(buffer);
+		for (int i = 0; i < m_effect->numParams; ++i) {
+			values[i] = m_effect->getParameter(m_effect, i);
+		}
+	}
+
+	is_chunk = false;
+	return param_size;
+}
+
+//-----------------------------------------------------------------------------
+// 次の演奏開始時に反映する設定を指定する
+//-----------------------------------------------------------------------------
+bool VstiHost::Impl::SetSettings(const void* data, int size, bool is_chunk)
+{
+	if (!data || size <= 0) {
+		return false;
+	}
+
+	if (size > m_settings_size) {
+		BYTE* buffer = new BYTE[size];
+		if (!buffer) {
+			return false;
+		}
+
+		delete [] m_settings;
+		m_settings = buffer;
+	}
+
+	memcpy(m_settings, data, size);
+	m_settings_size = size;
+	m_settings_chunk = is_chunk;
+	m_settings_pending = true;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// 指定された設定を反映する（演奏開始時、処理を止めている間に呼ぶ）
+// ・演奏開始毎にVSTiを作り直す場合は、毎回反映する。
+//-----------------------------------------------------------------------------
+void VstiHost::Impl::ApplySettings()
+{
+	if (!m_settings || (!m_settings_pending && !m_reset_on_start)) {
+		return;
+	}
+
+	if (m_settings_chunk) {
+		if (m_effect->flags & effFlagsProgramChunks) {
+			Dispatcher(effSetChunk, 0, m_settings_size, m_settings, 0.0f);
+		}
+	}
+	else {
+		const float* values = reinterpret_cast<const float*>(m_settings);
+		int num = m_settings_size / static_cast<int>(sizeof(float));
+		for (int i = 0; i < num && i < m_effect->numParams; ++i) {
+			m_effect->setParameter(m_effect, i, values[i]);
+		}
+	}
+
+	m_settings_pending = false;
+}
+
 //-----------------------------------------------------------------------------
 // VSTi側からのコールバック
 //-----------------------------------------------------------------------------
@@ -405,9 +690,9 @@ void VstiHost::Term()
 	m_impl->Term();
 }
 
-bool VstiHost::Start(int sample_rate)
+bool VstiHost::Start(int sample_rate, int block_size)
 {
-	return m_impl->Start(sample_rate);
+	return m_impl->Start(sample_rate, block_size);
 }
 
 void VstiHost::Stop()
@@ -415,14 +700,24 @@ void VstiHost::Stop()
 	m_impl->Stop();
 }
 
+void VstiHost::SetSettleTime(int settle_time)
+{
+	m_impl->SetSettleTime(settle_time);
+}
+
 void VstiHost::Reset(const void* reset_data, int data_size)
 {
 	m_impl->Reset(reset_data, data_size);
 }
 
-bool VstiHost::Render(const int* message_data, int message_num, int samples)
+void VstiHost::PushEvent(int message, int frame)
 {
-	return m_impl->Render(message_data, message_num, samples);
+	m_impl->PushEvent(message, frame);
+}
+
+bool VstiHost::Render(int samples)
+{
+	return m_impl->Render(samples);
 }
 
 const float* VstiHost::GetChannel0() const
@@ -444,3 +739,13 @@ void VstiHost::ShowEditor(void* inst, void* hwnd)
 {
 	m_impl->ShowEditor(static_cast<HINSTANCE>(inst), static_cast<HWND>(hwnd));
 }
+
+int VstiHost::GetSettings(void* buffer, int size, bool& is_chunk)
+{
+	return m_impl->GetSettings(buffer, size, is_chunk);
+}
+
+bool VstiHost::SetSettings(const void* data, int size, bool is_chunk)
+{
+	return m_impl->SetSettings(data, size, is_chunk);
+}
@@ -7,6 +7,10 @@
 //! @brief	VSTiホスト
 class VstiHost
 {
+public:
+	//! @brief	演奏開始時に指定できる、１回にレンダリングする最大サンプル数
+	static const int MAX_SAMPLES = 8192;
+
 public:
 	VstiHost();
 	~VstiHost();
@@ -18,16 +22,29 @@ public:
 	void Term();
 
 	//! @brief	演奏開始
-	bool Start(int sample_rate);
+	//! @note	block_sizeは、１回にレンダリングする最大サンプル数（MAX_SAMPLES以下）
+	//!			出力バッファは、これに合わせて確保する
+	bool Start(int sample_rate, int block_size);
 
 	//! @brief	演奏停止
 	void Stop();
 
+	//! @brief	リセット後に、無音をレンダリングして捨てる時間（ミリ秒）を設定する
+	//! @note	Startより前に設定すること
+	void SetSettleTime(int settle_time);
+
 	//! @brief	MIDIリセット
+	//! @note	待たずに戻り、リセットは次に出力するRenderの先頭で行う
+	//!			reset_dataは、その時まで有効なこと
 	void Reset(const void* reset_data, int data_size);
 
-	//! @brief	MIDIメッセージをレンダリングする
-	bool Render(const int* message_data, int message_num, int samples);
+	//! @brief	次のレンダリングで送信するMIDIメッセージを追加する
+	//! @note	frameはレンダリング先頭からのサンプル位置で、昇順に追加すること
+	void PushEvent(int message, int frame);
+
+	//! @brief	追加したMIDIメッセージを送信し、レンダリングする
+	//! @note	samplesが0なら、送信だけ行う（リセット直後は、次に出力する時まで送信しない）
+	bool Render(int samples);
 
 	//! @brief	チャンネル０のPCMデータを取得する
 	const float* GetChannel0() const;
@@ -41,6 +58,15 @@ public:
 	//! @brief	設定エディタを開く
 	void ShowEditor(void* inst, void* hwnd);
 
+	//! @brief	設定を取得する
+	//! @return	設定のバイト数（bufferがNULLか、sizeが足りない場合はコピーしない）
+	//! @note	チャンクに対応していればバンクのチャンク、なければ全パラメータの値（floatの配列）
+	int GetSettings(void* buffer, int size, bool& is_chunk);
+
+	//! @brief	次の演奏開始時に反映する設定を指定する（GetSettingsで取得したもの）
+	//! @note	データはコピーするので、呼び出し後に解放してよい
+	bool SetSettings(const void* data, int size, bool is_chunk);
+
 private:
 	class Impl;
 	Impl* m_impl;
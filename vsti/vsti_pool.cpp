@@ -0,0 +1,251 @@
+﻿//=============================================================================
+// VST Instruments インスタンスプール
+//=============================================================================
+
+#define NOMINMAX
+
+#include "vsti_pool.h"
+
+// 内部定義
+namespace {
+
+// 設定のハッシュ値（FNV-1a、0は未変更を表すので使わない）
+DWORD HashSettings(const BYTE* data, int size, bool is_chunk)
+{
+	DWORD hash = 2166136261U ^ (is_chunk? 1 : 0);
+	for (int i = 0; i < size; ++i) {
+		hash = (hash ^ data[i]) * 16777619U;
+	}
+
+	return hash? hash : 1;
+}
+
+} //namespace
+
+
+//-----------------------------------------------------------------------------
+// コンストラクタ
+//-----------------------------------------------------------------------------
+VstiPool::VstiPool()
+	: m_host_num(0)
+	, m_max_instances(1)
+	, m_reset_on_start(false)
+	, m_settle_time(0)
+	, m_settings(NULL)
+	, m_settings_size(0)
+	, m_settings_chunk(false)
+	, m_settings_gen(0)
+	, m_settings_hash(0)
+{
+	InitializeCriticalSection(&m_lock);
+
+	for (int i = 0; i < MAX_INSTANCES; ++i) {
+		m_hosts[i] = NULL;
+		m_used[i] = false;
+		m_applied_gen[i] = 0;
+	}
+
+	m_vsti_path[0] = L'\0';
+}
+
+//-----------------------------------------------------------------------------
+// デストラクタ
+//-----------------------------------------------------------------------------
+VstiPool::~VstiPool()
+{
+	Term();
+	DeleteCriticalSection(&m_lock);
+}
+
+//-----------------------------------------------------------------------------
+// 初期化
+//-----------------------------------------------------------------------------
+bool VstiPool::Init(const wchar_t* vsti_path, bool reset_on_start, int settle_time, int max_instances)
+{
+	Term();
+
+	if (lstrlenW(vsti_path) >= MAX_PATH) {
+		return false;
+	}
+
+	lstrcpyW(m_vsti_path, vsti_path);
+	m_reset_on_start = reset_on_start;
+	m_settle_time = settle_time;
+
+	if (max_instances < 1) {
+		max_instances = 1;
+	}
+
+	m_max_instances = (max_instances > MAX_INSTANCES)? MAX_INSTANCES : max_instances;
+
+	// 読み込めないVSTiなら、プラグインとして使えないので、最初の１つは作っておく
+	EnterCriticalSection(&m_lock);
+	bool result = (Create() != NULL);
+	LeaveCriticalSection(&m_lock);
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// 全インスタンスを破棄
+//-----------------------------------------------------------------------------
+void VstiPool::Term()
+{
+	EnterCriticalSection(&m_lock);
+
+	for (int i = 0; i < m_host_num; ++i) {
+		m_hosts[i]->Term();
+		delete m_hosts[i];
+		m_hosts[i] = NULL;
+		m_used[i] = false;
+		m_applied_gen[i] = 0;
+	}
+
+	m_host_num = 0;
+	FreeSettings();
+
+	LeaveCriticalSection(&m_lock);
+}
+
+//-----------------------------------------------------------------------------
+// 使っていないインスタンスを借りる
+//-----------------------------------------------------------------------------
+VstiHost* VstiPool::Acquire()
+{
+	EnterCriticalSection(&m_lock);
+
+	int index = -1;
+	for (int i = 0; i < m_host_num; ++i) {
+		if (!m_used[i]) {
+			index = i;
+			break;
+		}
+	}
+
+	if (index < 0 && m_host_num < m_max_instances && Create()) {
+		index = m_host_num - 1;
+	}
+
+	VstiHost* host = NULL;
+	if (0 <= index) {
+		m_used[index] = true;
+		host = m_hosts[index];
+
+		// 設定エディタで変更した後、まだ反映していなければ反映する（実際には演奏開始時）
+		if (m_settings && m_applied_gen[index] != m_settings_gen) {
+			host->SetSettings(m_settings, m_settings_size, m_settings_chunk);
+			m_applied_gen[index] = m_settings_gen;
+		}
+	}
+
+	LeaveCriticalSection(&m_lock);
+	return host;
+}
+
+//-----------------------------------------------------------------------------
+// 借りたインスタンスを返す
+//-----------------------------------------------------------------------------
+void VstiPool::Release(VstiHost* host)
+{
+	EnterCriticalSection(&m_lock);
+
+	for (int i = 0; i < m_host_num; ++i) {
+		if (m_hosts[i] == host) {
+			m_used[i] = false;
+			break;
+		}
+	}
+
+	LeaveCriticalSection(&m_lock);
+}
+
+//-----------------------------------------------------------------------------
+// 設定エディタを開く
+//-----------------------------------------------------------------------------
+void VstiPool::ShowEditor(void* inst, void* hwnd)
+{
+	if (m_host_num <= 0) {
+		return;
+	}
+
+	// エディタはモーダルなので、閉じるまではロックしない
+	VstiHost* editor = m_hosts[0];
+	editor->ShowEditor(inst, hwnd);
+
+	EnterCriticalSection(&m_lock);
+
+	bool is_chunk = false;
+	int size = editor->GetSettings(NULL, 0, is_chunk);
+	if (0 < size) {
+		BYTE* settings = new BYTE[size];
+		if (settings && editor->GetSettings(settings, size, is_chunk) <= size) {
+			FreeSettings();
+			m_settings = settings;
+			m_settings_size = size;
+			m_settings_chunk = is_chunk;
+			++m_settings_gen;
+			m_applied_gen[0] = m_settings_gen;
+			m_settings_hash = HashSettings(settings, size, is_chunk);
+		}
+		else {
+			delete [] settings;
+		}
+	}
+
+	LeaveCriticalSection(&m_lock);
+}
+
+//-----------------------------------------------------------------------------
+// 設定エディタで変更した設定のハッシュ値を取得する
+//-----------------------------------------------------------------------------
+DWORD VstiPool::GetSettingsHash()
+{
+	EnterCriticalSection(&m_lock);
+	DWORD hash = m_settings_hash;
+	LeaveCriticalSection(&m_lock);
+	return hash;
+}
+
+//-----------------------------------------------------------------------------
+// インスタンスを作成する（ロック中に呼ぶ）
+// ・DLLは参照カウントが増えるだけで、エントリポイントからAEffectを新たに作る。
+//-----------------------------------------------------------------------------
+VstiHost* VstiPool::Create()
+{
+	if (m_host_num >= m_max_instances) {
+		return NULL;
+	}
+
+	VstiHost* host = new VstiHost();
+	if (!host) {
+		return NULL;
+	}
+
+	if (!host->Init(m_vsti_path, m_reset_on_start)) {
+		host->Term();
+		delete host;
+		return NULL;
+	}
+
+	host->SetSettleTime(m_settle_time);
+
+	m_hosts[m_host_num] = host;
+	m_used[m_host_num] = false;
+	m_applied_gen[m_host_num] = 0;
+	++m_host_num;
+	return host;
+}
+
+//-----------------------------------------------------------------------------
+// 設定エディタで変更した設定を解放する（ロック中に呼ぶ）
+//-----------------------------------------------------------------------------
+void VstiPool::FreeSettings()
+{
+	if (m_settings) {
+		delete [] m_settings;
+		m_settings = NULL;
+	}
+
+	m_settings_size = 0;
+	m_settings_hash = 0;
+}
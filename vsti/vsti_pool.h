@@ -0,0 +1,70 @@
+﻿//=============================================================================
+// VST Instruments インスタンスプール
+//=============================================================================
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "vsti_host.h"
+
+//! @brief	VSTiホストのプール
+//! @note	再生するハンドル毎に、VSTiのインスタンスを１つずつ貸し出す。
+//!			インスタンスは、足りなくなった時に上限まで作成し、返却後は再利用する。
+//!			設定エディタで変更した設定は、貸し出す時に各インスタンスに反映する。
+class VstiPool
+{
+public:
+	//! @brief	インスタンス数の上限
+	static const int MAX_INSTANCES = 8;
+
+public:
+	VstiPool();
+	~VstiPool();
+
+	//! @brief	初期化（最初のインスタンスを作成する）
+	bool Init(const wchar_t* vsti_path, bool reset_on_start, int settle_time, int max_instances);
+
+	//! @brief	全インスタンスを破棄
+	void Term();
+
+	//! @brief	使っていないインスタンスを借りる
+	//! @return	全て使用中で、上限まで作成済みならNULL
+	VstiHost* Acquire();
+
+	//! @brief	借りたインスタンスを返す（演奏は停止しておくこと）
+	void Release(VstiHost* host);
+
+	//! @brief	設定エディタを開く（最初のインスタンスの設定を変更する）
+	//! @note	閉じた後に設定を取得して、他のインスタンスにも、次に貸し出す時に反映する
+	void ShowEditor(void* inst, void* hwnd);
+
+	//! @brief	設定エディタで変更した設定のハッシュ値を取得する
+	//! @note	一度も変更していなければ0。設定の違うレンダリング結果を区別するのに使う。
+	DWORD GetSettingsHash();
+
+private:
+	VstiPool(const VstiPool&);
+	VstiPool& operator=(const VstiPool&);
+
+	VstiHost* Create();
+	void FreeSettings();
+
+private:
+	CRITICAL_SECTION	m_lock;
+	VstiHost*			m_hosts[MAX_INSTANCES];
+	bool				m_used[MAX_INSTANCES];
+	int					m_host_num;
+	int					m_max_instances;
+
+	wchar_t				m_vsti_path[MAX_PATH];
+	bool				m_reset_on_start;
+	int					m_settle_time;
+
+	// 設定エディタで変更した設定（m_settings_genは変更毎に増やし、反映した時の値と比べる）
+	BYTE*				m_settings;
+	int					m_settings_size;
+	bool				m_settings_chunk;
+	int					m_settings_gen;
+	DWORD				m_settings_hash;
+	int					m_applied_gen[MAX_INSTANCES];
+};
@@ -0,0 +1,434 @@
+﻿//=============================================================================
+// ADPCM(IMA/Microsoft)展開
+//=============================================================================
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include <mmsystem.h>
+#include <mmreg.h>
+#include "reader.h"
+#include "adpcm.h"
+
+namespace {
+
+// 一括展開時、１スレッドに割り当てる最低ブロック数
+const int MIN_BLOCKS_PER_THREAD = 64;
+
+// 一括展開の最大スレッド数
+const int MAX_THREADS = 16;
+
+//-----------------------------------------------------------------------------
+// IMA ADPCMのテーブル
+//-----------------------------------------------------------------------------
+const int IMA_INDEX_TABLE[16] =
+{
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8,
+};
+
+const int IMA_STEP_TABLE[89] =
+{
+	    7,     8,     9,    10,    11,    12,    13,    14,    16,    17,
+	   19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
+	   50,    55,    60,    66,    73,    80,    88,    97,   107,   118,
+	  130,   143,   157,   173,   190,   209,   230,   253,   279,   307,
+	  337,   371,   408,   449,   494,   544,   598,   658,   724,   796,
+	  876,   963,  1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
+	 2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,
+	 5894,  6484,  7132,  7845,  8630,  9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767,
+};
+
+//-----------------------------------------------------------------------------
+// MS ADPCMのテーブル
+//-----------------------------------------------------------------------------
+const int MS_ADAPT_TABLE[16] =
+{
+	230, 230, 230, 230, 307, 409, 512, 614,
+	768, 614, 512, 409, 307, 230, 230, 230,
+};
+
+const short MS_DEFAULT_COEF[7][2] =
+{
+	{ 256,    0 }, { 512, -256 }, {   0,    0 }, { 192,   64 },
+	{ 240,    0 }, { 460, -208 }, { 392, -232 },
+};
+
+//-----------------------------------------------------------------------------
+// リトルエンディアンの値を取得する
+//-----------------------------------------------------------------------------
+inline short GetInt16(const BYTE* data)
+{
+	return static_cast<short>(data[0] | (data[1] << 8));
+}
+
+//-----------------------------------------------------------------------------
+// 16bitに収める
+//-----------------------------------------------------------------------------
+inline int Clamp16(int value)
+{
+	return (value < -32768)? -32768 : ((value > 32767)? 32767 : value);
+}
+
+//-----------------------------------------------------------------------------
+// 指定バイト数のブロックに含まれるフレーム数を計算する
+//-----------------------------------------------------------------------------
+int CalcFrames(AdpcmType type, int channels, int size)
+{
+	if (type == ADPCM_IMA && size >= 4 * channels) {
+		return 1 + ((size - 4 * channels) / (4 * channels)) * 8;
+	}
+
+	if (type == ADPCM_MS && size >= 7 * channels) {
+		return 2 + ((size - 7 * channels) * 2) / channels;
+	}
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// 指定バイト数のブロックに含まれるフレーム数を取得する
+//-----------------------------------------------------------------------------
+int GetBlockFrames(const AdpcmFormat& format, int size)
+{
+	int frames = CalcFrames(format.type, format.channels, size);
+	return (frames > format.samples_per_block)? format.samples_per_block : frames;
+}
+
+//-----------------------------------------------------------------------------
+// IMA ADPCMの１サンプルを展開する
+//-----------------------------------------------------------------------------
+inline short ImaExpand(int nibble, int& predictor, int& index)
+{
+	int step = IMA_STEP_TABLE[index];
+
+	int diff = step >> 3;
+	if (nibble & 1) diff += step >> 2;
+	if (nibble & 2) diff += step >> 1;
+	if (nibble & 4) diff += step;
+
+	predictor = Clamp16((nibble & 8)? (predictor - diff) : (predictor + diff));
+
+	index += IMA_INDEX_TABLE[nibble];
+	index = (index < 0)? 0 : ((index > 88)? 88 : index);
+
+	return static_cast<short>(predictor);
+}
+
+//-----------------------------------------------------------------------------
+// IMA ADPCMの１ブロックを展開する
+// ・チャンネル毎に４バイトのヘッダ(predictor/step index)
+// ・以降、チャンネル毎に４バイト(８サンプル)ずつ交互に並ぶ
+//-----------------------------------------------------------------------------
+int DecodeIma(const AdpcmFormat& format, const BYTE* src, int src_size, short* dest)
+{
+	const int channels = format.channels;
+	const int header_size = 4 * channels;
+	const int frames = GetBlockFrames(format, src_size);
+	if (frames == 0) {
+		return 0;
+	}
+
+	for (int ch = 0; ch < channels; ++ch) {
+		const BYTE* header = &src[ch * 4];
+		int predictor = GetInt16(header);
+		int index = header[2];
+		index = (index > 88)? 88 : index;
+
+		dest[ch] = static_cast<short>(predictor);
+
+		// ８サンプル単位で、チャンネル毎のデータを展開する
+		const BYTE* data = &src[header_size + ch * 4];
+		short* out = &dest[channels + ch];
+		for (int i = 1; i < frames; i += 8) {
+			int count = frames - i;
+			if (count > 8) {
+				count = 8;
+			}
+
+			for (int j = 0; j < count; ++j) {
+				int nibble = (data[j >> 1] >> ((j & 1) * 4)) & 0x0F;
+				out[j * channels] = ImaExpand(nibble, predictor, index);
+			}
+
+			data += header_size;
+			out += 8 * channels;
+		}
+	}
+
+	return frames;
+}
+
+//-----------------------------------------------------------------------------
+// MS ADPCMの１ブロックを展開する
+// ・ヘッダは、予測係数番号(1byte)、delta、sample1、sample2(各2byte)がチャンネル数分
+// ・以降は、上位ニブルから順にチャンネル交互に並ぶ
+//-----------------------------------------------------------------------------
+int DecodeMs(const AdpcmFormat& format, const BYTE* src, int src_size, short* dest)
+{
+	const int MAX_CHANNELS = 8;
+
+	const int channels = format.channels;
+	const int header_size = 7 * channels;
+	const int frames = GetBlockFrames(format, src_size);
+	if (channels > MAX_CHANNELS || frames == 0) {
+		return 0;
+	}
+
+	int coef1[MAX_CHANNELS], coef2[MAX_CHANNELS];
+	int delta[MAX_CHANNELS], sample1[MAX_CHANNELS], sample2[MAX_CHANNELS];
+
+	for (int ch = 0; ch < channels; ++ch) {
+		int predictor = src[ch];
+		if (predictor >= format.num_coef) {
+			predictor = 0;
+		}
+
+		coef1[ch] = format.coef[predictor][0];
+		coef2[ch] = format.coef[predictor][1];
+		delta[ch] = GetInt16(&src[channels + ch * 2]);
+		sample1[ch] = GetInt16(&src[channels * 3 + ch * 2]);
+		sample2[ch] = GetInt16(&src[channels * 5 + ch * 2]);
+
+		// 先頭の２サンプルは、sample2、sample1の順
+		dest[ch] = static_cast<short>(sample2[ch]);
+		dest[channels + ch] = static_cast<short>(sample1[ch]);
+	}
+
+	const BYTE* data = &src[header_size];
+	const int nibbles = (frames - 2) * channels;
+	short* out = &dest[channels * 2];
+
+	for (int i = 0; i < nibbles; ++i) {
+		int ch = i % channels;
+		int nibble = (i & 1)? (data[i >> 1] & 0x0F) : (data[i >> 1] >> 4);
+		int signed_nibble = (nibble & 0x08)? (nibble - 16) : nibble;
+
+		int predictor = ((sample1[ch] * coef1[ch]) + (sample2[ch] * coef2[ch])) >> 8;
+		predictor = Clamp16(predictor + signed_nibble * delta[ch]);
+
+		sample2[ch] = sample1[ch];
+		sample1[ch] = predictor;
+
+		delta[ch] = (MS_ADAPT_TABLE[nibble] * delta[ch]) >> 8;
+		if (delta[ch] < 16) {
+			delta[ch] = 16;
+		}
+
+		out[i] = static_cast<short>(predictor);
+	}
+
+	return frames;
+}
+
+//-----------------------------------------------------------------------------
+// 一括展開の単位
+//-----------------------------------------------------------------------------
+struct DecodeJob
+{
+	const AdpcmFormat*	format;
+	const BYTE*			src;
+	int					blocks;
+	short*				dest;
+};
+
+//-----------------------------------------------------------------------------
+// 一括展開スレッド
+//-----------------------------------------------------------------------------
+DWORD WINAPI DecodeThread(void* param)
+{
+	const DecodeJob& job = *static_cast<const DecodeJob*>(param);
+	AdpcmDecodeBlocks(*job.format, job.src, job.blocks, job.dest);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// CPU数を取得する
+//-----------------------------------------------------------------------------
+int GetProcessorCount()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return static_cast<int>(info.dwNumberOfProcessors);
+}
+
+} //namespace
+
+//-----------------------------------------------------------------------------
+// ADPCMフォーマットを取得する
+//-----------------------------------------------------------------------------
+bool AdpcmGetFormat(const BYTE* fmt_data, DWORD fmt_size, AdpcmFormat& format)
+{
+	if (fmt_size < sizeof(WAVEFORMATEX)) {
+		return false;
+	}
+
+	WAVEFORMATEX wfx;
+	CopyMemory(&wfx, fmt_data, sizeof(wfx));
+
+	format.type = ADPCM_NONE;
+	format.channels = wfx.nChannels;
+	format.block_align = wfx.nBlockAlign;
+	format.samples_per_block = 0;
+	format.num_coef = 0;
+
+	if (wfx.wBitsPerSample != 4 || wfx.nChannels == 0 || wfx.nBlockAlign == 0) {
+		return false;
+	}
+
+	// cbSizeの後ろに、wSamplesPerBlockが続く
+	const BYTE* extra = fmt_data + sizeof(WAVEFORMATEX);
+	const DWORD extra_size = fmt_size - sizeof(WAVEFORMATEX);
+
+	if (wfx.wFormatTag == WAVE_FORMAT_IMA_ADPCM) {
+		format.type = ADPCM_IMA;
+	}
+	else if (wfx.wFormatTag == WAVE_FORMAT_ADPCM) {
+		format.type = ADPCM_MS;
+	}
+	else {
+		return false;
+	}
+
+	// wSamplesPerBlockがブロックサイズから求めた値より小さければ、そちらに従う
+	format.samples_per_block = CalcFrames(format.type, format.channels, format.block_align);
+	if (extra_size >= 2) {
+		int samples_per_block = static_cast<WORD>(GetInt16(extra));
+		if (0 < samples_per_block && samples_per_block < format.samples_per_block) {
+			format.samples_per_block = samples_per_block;
+		}
+	}
+
+	if (format.samples_per_block == 0) {
+		format.type = ADPCM_NONE;
+		return false;
+	}
+
+	if (format.type == ADPCM_MS) {
+
+		// wSamplesPerBlock、wNumCoef、aCoef[]
+		int num_coef = 0;
+		if (extra_size >= 4) {
+			num_coef = GetInt16(&extra[2]);
+		}
+
+		if (0 < num_coef && extra_size >= 4 + static_cast<DWORD>(num_coef) * 4) {
+			if (num_coef > AdpcmFormat::MAX_COEF) {
+				num_coef = AdpcmFormat::MAX_COEF;
+			}
+
+			for (int i = 0; i < num_coef; ++i) {
+				format.coef[i][0] = GetInt16(&extra[4 + i * 4]);
+				format.coef[i][1] = GetInt16(&extra[6 + i * 4]);
+			}
+
+			format.num_coef = num_coef;
+		}
+		else {
+			CopyMemory(format.coef, MS_DEFAULT_COEF, sizeof(MS_DEFAULT_COEF));
+			format.num_coef = 7;
+		}
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// １ブロックを展開する
+//-----------------------------------------------------------------------------
+int AdpcmDecodeBlock(const AdpcmFormat& format, const BYTE* src, int src_size, short* dest)
+{
+	if (format.type == ADPCM_IMA) {
+		return DecodeIma(format, src, src_size, dest);
+	}
+
+	if (format.type == ADPCM_MS) {
+		return DecodeMs(format, src, src_size, dest);
+	}
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// データ部のフレーム数を取得する
+//-----------------------------------------------------------------------------
+DWORD AdpcmCountFrames(const AdpcmFormat& format, DWORD data_size)
+{
+	DWORD blocks = data_size / format.block_align;
+	DWORD rest = data_size % format.block_align;
+	return blocks * format.samples_per_block + GetBlockFrames(format, rest);
+}
+
+//-----------------------------------------------------------------------------
+// 複数ブロックを展開する
+//-----------------------------------------------------------------------------
+void AdpcmDecodeBlocks(const AdpcmFormat& format, const BYTE* src, int blocks, short* dest)
+{
+	// １回のReadで展開するブロック数は少ないので、このスレッドで順に展開する
+	const int frame_samples = format.samples_per_block * format.channels;
+
+	for (int i = 0; i < blocks; ++i) {
+		AdpcmDecodeBlock(format, src + i * format.block_align, format.block_align, dest + i * frame_samples);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// 複数ブロックを、複数スレッドで一括展開する
+//-----------------------------------------------------------------------------
+void AdpcmDecodeBatch(const AdpcmFormat& format, const BYTE* src, int blocks, short* dest, int max_threads)
+{
+	int threads = blocks / MIN_BLOCKS_PER_THREAD;
+	if (max_threads <= 0) {
+		max_threads = GetProcessorCount();
+	}
+
+	threads = (threads > max_threads)? max_threads : threads;
+	threads = (threads > MAX_THREADS)? MAX_THREADS : threads;
+
+	// 少ない場合は、このスレッドで展開する
+	if (threads <= 1) {
+		AdpcmDecodeBlocks(format, src, blocks, dest);
+		return;
+	}
+
+	DecodeJob jobs[MAX_THREADS];
+	HANDLE handles[MAX_THREADS];
+
+	const int frame_samples = format.samples_per_block * format.channels;
+
+	// ブロックを均等に割り振る、先頭の分はこのスレッドで展開する
+	int started = 0;
+	int offset = 0;
+	for (int i = 0; i < threads; ++i) {
+		int count = blocks / threads + ((i < blocks % threads)? 1 : 0);
+
+		jobs[i].format = &format;
+		jobs[i].src = src + offset * format.block_align;
+		jobs[i].blocks = count;
+		jobs[i].dest = dest + offset * frame_samples;
+		offset += count;
+
+		if (i == 0) {
+			continue;
+		}
+
+		handles[started] = CreateThread(NULL, 0, DecodeThread, &jobs[i], 0, NULL);
+		if (!handles[started]) {
+			// スレッドが作れなければ、ここで展開する
+			AdpcmDecodeBlocks(format, jobs[i].src, jobs[i].blocks, jobs[i].dest);
+			continue;
+		}
+
+		++started;
+	}
+
+	AdpcmDecodeBlocks(format, jobs[0].src, jobs[0].blocks, jobs[0].dest);
+
+	if (0 < started) {
+		WaitForMultipleObjects(started, handles, TRUE, INFINITE);
+		for (int i = 0; i < started; ++i) {
+			CloseHandle(handles[i]);
+		}
+	}
+}
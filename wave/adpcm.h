@@ -0,0 +1,62 @@
+﻿//=============================================================================
+// ADPCM(IMA/Microsoft)展開
+//=============================================================================
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+
+//-----------------------------------------------------------------------------
+// ADPCMの種類
+//-----------------------------------------------------------------------------
+enum AdpcmType
+{
+	ADPCM_NONE,		// ADPCMではない
+	ADPCM_IMA,		// IMA ADPCM (WAVE_FORMAT_IMA_ADPCM)
+	ADPCM_MS,		// Microsoft ADPCM (WAVE_FORMAT_ADPCM)
+};
+
+//-----------------------------------------------------------------------------
+// ADPCMフォーマット
+//-----------------------------------------------------------------------------
+struct AdpcmFormat
+{
+	static const int MAX_COEF = 32;
+
+	AdpcmType	type;				// 種類
+	int			channels;			// チャンネル数
+	int			block_align;		// １ブロックのバイト数
+	int			samples_per_block;	// １ブロックのフレーム数
+	int			num_coef;			// 係数の数（MS ADPCMのみ）
+	short		coef[MAX_COEF][2];	// 予測係数（MS ADPCMのみ）
+};
+
+//-----------------------------------------------------------------------------
+// fmtチャンクのデータからADPCMフォーマットを取得する
+//-----------------------------------------------------------------------------
+bool AdpcmGetFormat(const BYTE* fmt_data, DWORD fmt_size, AdpcmFormat& format);
+
+//-----------------------------------------------------------------------------
+// データ部のフレーム数を取得する（最終ブロックが欠けている場合も考慮する）
+//-----------------------------------------------------------------------------
+DWORD AdpcmCountFrames(const AdpcmFormat& format, DWORD data_size);
+
+//-----------------------------------------------------------------------------
+// １ブロックを16bit PCMに展開し、展開したフレーム数を返す
+// ・src_sizeがブロックサイズに満たない場合（最終ブロック）は、ある分だけ展開する。
+//-----------------------------------------------------------------------------
+int AdpcmDecodeBlock(const AdpcmFormat& format, const BYTE* src, int src_size, short* dest);
+
+//-----------------------------------------------------------------------------
+// 複数の完全なブロックを16bit PCMに展開する
+//-----------------------------------------------------------------------------
+void AdpcmDecodeBlocks(const AdpcmFormat& format, const BYTE* src, int blocks, short* dest);
+
+//-----------------------------------------------------------------------------
+// 複数の完全なブロックを、複数スレッドで16bit PCMに一括展開する
+// ・各ブロックは独立しているので、ファイル全体の書き出しや解析用に分割して展開する。
+// ・呼ぶ度にスレッドを作るので、再生中のReadからは使わずにAdpcmDecodeBlocksを使うこと。
+// ・max_threadsが0以下なら、CPU数まで使う。
+//-----------------------------------------------------------------------------
+void AdpcmDecodeBatch(const AdpcmFormat& format, const BYTE* src, int blocks, short* dest, int max_threads);
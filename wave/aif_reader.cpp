@@ -9,9 +9,17 @@
 #include <mmreg.h>
 #include <algorithm>
 #include "aif_reader.h"
+#include "chunk_index.h"
+#include "float_pcm.h"
 
 namespace {
 
+// FORMヘッダ("FORM" + サイズ + "AIFF")のバイト数
+const DWORD FORM_HEADER_SIZE = 12;
+
+// fl64の読み込み単位
+const DWORD FLOAT64_READ_SIZE = 64 * 1024;
+
 //-----------------------------------------------------------------------------
 // ビットスワップ
 //-----------------------------------------------------------------------------
@@ -25,6 +33,19 @@ unsigned int Swap32(unsigned int value)
 	return ((value & 0xFF) << 24) | (((value >> 8) & 0xFF) << 16) | (((value >> 16) & 0xFF) << 8) | ((value >> 24) & 0xFF);
 }
 
+//-----------------------------------------------------------------------------
+// ビッグエンディアンの値を取得する
+//-----------------------------------------------------------------------------
+WORD GetInt16(const BYTE* data)
+{
+	return Swap16(*reinterpret_cast<const WORD*>(data));
+}
+
+DWORD GetInt32(const BYTE* data)
+{
+	return Swap32(*reinterpret_cast<const DWORD*>(data));
+}
+
 //-----------------------------------------------------------------------------
 // Float80をInt32に変換する
 //-----------------------------------------------------------------------------
@@ -50,127 +71,78 @@ static int Unpack80(int exp, int fract)
 //-----------------------------------------------------------------------------
 // FourCCを読み込む
 //-----------------------------------------------------------------------------
-FOURCC ReadFourCC(HANDLE file)
+FOURCC ReadFourCC(FileStream& file)
 {
 	FOURCC value = 0;
-	DWORD readed = 0;
-
-	if (!ReadFile(file, &value, sizeof(value), &readed, NULL)) {
+	if (file.Read(&value, sizeof(value)) != sizeof(value)) {
 		return 0;
 	}
 
 	return value;
 }
 
-//-----------------------------------------------------------------------------
-// 整数２バイト読み込む
-//-----------------------------------------------------------------------------
-WORD ReadInt16(HANDLE file)
-{
-	WORD value = 0;
-	DWORD readed = 0;
-
-	if (!ReadFile(file, &value, sizeof(value), &readed, NULL)) {
-		return 0;
-	}
-
-	return Swap16(value);
-}
-
 //-----------------------------------------------------------------------------
 // 整数４バイト読み込む
 //-----------------------------------------------------------------------------
-DWORD ReadInt32(HANDLE file)
+DWORD ReadInt32(FileStream& file)
 {
 	DWORD value = 0;
-	DWORD readed = 0;
-
-	if (!ReadFile(file, &value, sizeof(value), &readed, NULL)) {
+	if (file.Read(&value, sizeof(value)) != sizeof(value)) {
 		return 0;
 	}
 
 	return Swap32(value);
 }
 
-//-----------------------------------------------------------------------------
-// four_ccで指定されたチャンクへシークする
-//-----------------------------------------------------------------------------
-bool SeekToChunk(HANDLE file, const char* four_cc, DWORD& size)
-{
-	FOURCC target_cc = mmioFOURCC(four_cc[0], four_cc[1], four_cc[2], four_cc[3]);
-	while (true) {
-		FOURCC data_cc = ReadFourCC(file);
-		size = ReadInt32(file);
-
-		if (data_cc == target_cc) {
-			return true;
-		}
-
-		// サイズは、最低WORDアラインメントがいる
-		if ((size & 1) == 1) {
-			++size;
-		}
-
-		SetFilePointer(file, size, NULL, FILE_CURRENT);
-		if (GetLastError() != NO_ERROR) {
-			return false;
-		}
-	}
-
-	return false;
-}
-
 //-----------------------------------------------------------------------------
 // .aifを開く
 //-----------------------------------------------------------------------------
-HANDLE OpenSource(const wchar_t* path)
+bool OpenSource(FileStream& file, const wchar_t* path, bool& is_aifc)
 {
-	HANDLE file = CreateFile(path, GENERIC_READ,
-		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
-		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-	if (file == INVALID_HANDLE_VALUE) {
-		return INVALID_HANDLE_VALUE;
+	if (!file.Open(path)) {
+		return false;
 	}
 
 	FOURCC form_cc = ReadFourCC(file);
 	if (form_cc != mmioFOURCC('F', 'O', 'R', 'M')) {
-		CloseHandle(file);
-		return INVALID_HANDLE_VALUE;
+		file.Close();
+		return false;
 	}
 
 	DWORD size = ReadInt32(file);
 	FOURCC aiff_cc = ReadFourCC(file);
-	if (aiff_cc != mmioFOURCC('A', 'I', 'F', 'F')) {
-		CloseHandle(file);
-		return INVALID_HANDLE_VALUE;
+	if (aiff_cc != mmioFOURCC('A', 'I', 'F', 'F') && aiff_cc != mmioFOURCC('A', 'I', 'F', 'C')) {
+		file.Close();
+		return false;
 	}
 
-	return file;
+	is_aifc = (aiff_cc == mmioFOURCC('A', 'I', 'F', 'C'));
+
+	return true;
 }
 
 //-----------------------------------------------------------------------------
 // PCMフォーマットを取得する
 //-----------------------------------------------------------------------------
-bool GetPcmFormat(HANDLE file, WAVEFORMATEX& wfx)
+bool GetPcmFormat(FileStream& file, const ChunkIndex& index, bool is_aifc, WAVEFORMATEX& wfx,
+	AifReader::SampleType& type, DWORD& align)
 {
-	DWORD readed = 0;
-	FOURCC data_cc = 0;
-
-	DWORD size = 0;
-	if (!SeekToChunk(file, "COMM", size)) {
+	const ChunkEntry* entry = index.Find(mmioFOURCC('C', 'O', 'M', 'M'));
+	if (!entry) {
 		return false;
 	}
 
-	// AIFFのCOMMチャンクは、18バイト以上あるはず
-	if (size < 18) {
+	// AIFFのCOMMチャンクは18バイト、AIFCは圧縮形式が続くので22バイト以上あるはず
+	BYTE comm[22];
+	if (!index.Read(file, entry, comm, is_aifc? 22 : 18)) {
 		return false;
 	}
 
-	WORD num_channels = ReadInt16(file);
-	DWORD sample_frames = ReadInt32(file);
-	WORD sample_bits = ReadInt16(file);
-	WORD exp = ReadInt16(file);
-	WORD fract = ReadInt16(file);
+	WORD num_channels = GetInt16(&comm[0]);
+	DWORD sample_frames = GetInt32(&comm[2]);
+	WORD sample_bits = GetInt16(&comm[6]);
+	WORD exp = GetInt16(&comm[8]);
+	WORD fract = GetInt16(&comm[10]);
 	DWORD sample_rate = Unpack80(exp, fract);
 
 	// 8k/11.25kの倍数以外は対応しない
@@ -178,6 +150,41 @@ bool GetPcmFormat(HANDLE file, WAVEFORMATEX& wfx)
 		return false;
 	}
 
+	type = AifReader::SAMPLE_PCM_BE;
+	align = num_channels * ((sample_bits + 7) / 8);
+
+	if (is_aifc) {
+		FOURCC compression = *reinterpret_cast<const FOURCC*>(&comm[18]);
+		switch (compression) {
+		case mmioFOURCC('N', 'O', 'N', 'E'):
+		case mmioFOURCC('t', 'w', 'o', 's'):
+			break;
+
+		// sowtはリトルエンディアンなので、そのまま渡せる
+		case mmioFOURCC('s', 'o', 'w', 't'):
+			type = AifReader::SAMPLE_PCM_LE;
+			break;
+
+		// floatは、32bit整数に変換する
+		case mmioFOURCC('f', 'l', '3', '2'):
+		case mmioFOURCC('F', 'L', '3', '2'):
+			type = AifReader::SAMPLE_FLOAT32;
+			sample_bits = 32;
+			align = num_channels * 4;
+			break;
+
+		case mmioFOURCC('f', 'l', '6', '4'):
+		case mmioFOURCC('F', 'L', '6', '4'):
+			type = AifReader::SAMPLE_FLOAT64;
+			sample_bits = 32;
+			align = num_channels * 8;
+			break;
+
+		default:
+			return false;
+		}
+	}
+
 	wfx.wFormatTag		= WAVE_FORMAT_PCM;
 	wfx.nChannels		= num_channels;
 	wfx.nSamplesPerSec	= sample_rate;
@@ -185,8 +192,6 @@ bool GetPcmFormat(HANDLE file, WAVEFORMATEX& wfx)
 	wfx.nBlockAlign		= wfx.nChannels * wfx.wBitsPerSample / 8;
 	wfx.nAvgBytesPerSec	= wfx.nSamplesPerSec * wfx.nBlockAlign;
 	wfx.cbSize			= 0;
-
-	SetFilePointer(file, size - 12, NULL, FILE_CURRENT);
 	return true;
 }
 
@@ -203,11 +208,19 @@ bool AifReader::Parse(const wchar_t* path, Metadata* meta)
 		return false;
 	}
 
-	meta->duration = MulDiv(reader.m_size, 1000, reader.m_format.nAvgBytesPerSec);
+	const WAVEFORMATEX& wfx = reader.m_format;
+
+	meta->duration = MulDiv(reader.m_size, 1000, wfx.nSamplesPerSec * reader.m_align);
 	meta->seekable = true;
 
-	wsprintf(meta->extra, L"AIFF, %d Hz, %d bit, %d ch",
-		reader.m_format.nSamplesPerSec, reader.m_format.wBitsPerSample, reader.m_format.nChannels);
+	if (reader.m_type == SAMPLE_FLOAT32 || reader.m_type == SAMPLE_FLOAT64) {
+		wsprintf(meta->extra, L"AIFC, %d Hz, %d bit float, %d ch",
+			wfx.nSamplesPerSec, reader.m_align * 8 / wfx.nChannels, wfx.nChannels);
+	}
+	else {
+		wsprintf(meta->extra, L"%s, %d Hz, %d bit, %d ch", (reader.m_type == SAMPLE_PCM_LE)? L"AIFC" : L"AIFF",
+			wfx.nSamplesPerSec, wfx.wBitsPerSample, wfx.nChannels);
+	}
 
 	reader.Close();
 	return true;
@@ -217,10 +230,13 @@ bool AifReader::Parse(const wchar_t* path, Metadata* meta)
 // コンストラクタ
 //-----------------------------------------------------------------------------
 AifReader::AifReader()
-	: m_file(INVALID_HANDLE_VALUE)
+	: m_file()
 	, m_format()
 	, m_size(0)
 	, m_fptr(0)
+	, m_align(0)
+	, m_type(SAMPLE_PCM_BE)
+	, m_temp(NULL)
 {
 }
 
@@ -237,28 +253,52 @@ AifReader::~AifReader()
 //-----------------------------------------------------------------------------
 bool AifReader::Open(const wchar_t* path)
 {
-	HANDLE file = OpenSource(path);
-	if (file == INVALID_HANDLE_VALUE) {
+	bool is_aifc = false;
+	FileStream& file = m_file;
+	if (!OpenSource(file, path, is_aifc)) {
 		return false;
 	}
 
-	if (!GetPcmFormat(file, m_format)) {
-		CloseHandle(file);
+	// SSNDより後ろのチャンクは不要
+	const FOURCC ssnd_cc = mmioFOURCC('S', 'S', 'N', 'D');
+
+	ChunkIndex index;
+	if (!index.Build(file, FORM_HEADER_SIZE, ChunkIndex::LAYOUT_IFF, ssnd_cc)) {
+		Close();
 		return false;
 	}
 
-	DWORD size = 0;
-	if (!SeekToChunk(file, "SSND", size)) {
-		CloseHandle(file);
+	if (!GetPcmFormat(file, index, is_aifc, m_format, m_type, m_align)) {
+		Close();
 		return false;
 	}
 
-	DWORD data_offset = ReadInt32(file);
-	DWORD block_size = ReadInt32(file);
+	// SSNDの先頭は、offset/blockSizeの８バイト
+	const ChunkEntry* ssnd = index.Find(ssnd_cc);
+	BYTE header[8];
+	if (!index.Read(file, ssnd, header, sizeof(header))) {
+		Close();
+		return false;
+	}
 
-	m_file = file;
-	m_size = size - data_offset;
-	m_fptr = SetFilePointer(file, 0, NULL, FILE_CURRENT);
+	DWORD data_offset = GetInt32(&header[0]);
+	if (ssnd->size < sizeof(header) + data_offset) {
+		Close();
+		return false;
+	}
+
+	m_size = ssnd->size - sizeof(header) - data_offset;
+	m_fptr = ssnd->offset + sizeof(header) + data_offset;
+
+	if (m_type == SAMPLE_FLOAT64) {
+		m_temp = static_cast<BYTE*>(HeapAlloc(GetProcessHeap(), 0, FLOAT64_READ_SIZE));
+		if (!m_temp) {
+			Close();
+			return false;
+		}
+	}
+
+	file.Seek(m_fptr);
 	return true;
 }
 
@@ -267,10 +307,15 @@ bool AifReader::Open(const wchar_t* path)
 //-----------------------------------------------------------------------------
 void AifReader::Close()
 {
-	if (m_file != INVALID_HANDLE_VALUE) {
-		CloseHandle(m_file);
-		m_file = INVALID_HANDLE_VALUE;
+	m_file.Close();
+
+	if (m_temp) {
+		HeapFree(GetProcessHeap(), 0, m_temp);
+		m_temp = NULL;
 	}
+
+	m_pos = 0;
+	m_sample = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -286,15 +331,31 @@ const WAVEFORMATEX& AifReader::GetFormat() const
 //-----------------------------------------------------------------------------
 int AifReader::Read(void* buffer, int size)
 {
-	DWORD end = m_fptr + m_size;
-	DWORD cur = SetFilePointer(m_file, 0, NULL, FILE_CURRENT);
-	if (cur + size >= end) {
-		size = end - cur;
+	// fl64は、ファイル上のサイズが出力の２倍になる
+	if (m_type == SAMPLE_FLOAT64) {
+		size = (size / m_format.nBlockAlign) * m_align;
+	}
+
+	if (m_pos + size >= m_size) {
+		size = m_size - m_pos;
+	}
+
+	if (m_type == SAMPLE_FLOAT64) {
+		return ReadFloat64(buffer, size);
 	}
 
-	DWORD readed = 0;
-	if (ReadFile(m_file, buffer, size, &readed, NULL)) {
-		if (m_format.wBitsPerSample == 16) {
+	DWORD readed = m_file.Read(buffer, size);
+	if (0 < readed) {
+		m_pos += readed;
+		m_sample = m_pos / m_align;
+
+		if (m_type == SAMPLE_PCM_LE) {
+			// none
+		}
+		else if (m_type == SAMPLE_FLOAT32) {
+			Float32ToInt32(static_cast<BYTE*>(buffer), static_cast<int*>(buffer), readed / 4, true);
+		}
+		else if (m_format.wBitsPerSample == 16) {
 			unsigned short* data = static_cast<unsigned short*>(buffer);
 			for (int i = 0; i < size / 2; ++i) {
 				data[i] = Swap16(data[i]);
@@ -324,14 +385,50 @@ int AifReader::Read(void* buffer, int size)
 //-----------------------------------------------------------------------------
 // シーク
 //-----------------------------------------------------------------------------
-int AifReader::Seek(int time_ms)
+DWORD AifReader::SeekSample(DWORD sample)
 {
-	DWORD fp = MulDiv(time_ms, m_format.nAvgBytesPerSec, 1000);
-	fp -= (fp % m_format.nBlockAlign);
+	DWORD samples = m_size / m_align;
+	if (sample > samples) {
+		sample = samples;
+	}
+
+	DWORD fp = sample * m_align;
+	m_file.Seek(m_fptr + fp);
 
-	if (SetFilePointer(m_file, m_fptr + fp, 0, FILE_BEGIN)) {
-		return time_ms;
+	m_pos = fp;
+	m_sample = sample;
+	return sample;
+}
+
+//-----------------------------------------------------------------------------
+// fl64読み取り
+//-----------------------------------------------------------------------------
+int AifReader::ReadFloat64(void* buffer, DWORD size)
+{
+	int* dest = static_cast<int*>(buffer);
+	int written = 0;
+
+	while (0 < size) {
+		DWORD bytes = (size > FLOAT64_READ_SIZE)? FLOAT64_READ_SIZE : size;
+
+		DWORD readed = m_file.Read(m_temp, bytes);
+		if (readed == 0) {
+			break;
+		}
+
+		m_pos += readed;
+		m_sample = m_pos / m_align;
+
+		int count = readed / 8;
+		Float64ToInt32(m_temp, dest, count, true);
+		dest += count;
+		written += count * 4;
+		size -= readed;
+
+		if (readed < bytes) {
+			break;
+		}
 	}
 
-	return 0;
+	return written;
 }
@@ -7,6 +7,7 @@
 
 #include <windows.h>
 #include "luna_pi.h"
+#include "file_stream.h"
 #include "reader.h"
 
 //-----------------------------------------------------------------------------
@@ -27,11 +28,26 @@ public:
 	virtual const WAVEFORMATEX& GetFormat() const;
 
 	virtual int Read(void* buffer, int length);
-	virtual int Seek(int time_ms);
+	virtual DWORD SeekSample(DWORD sample);
+
+	// サンプルの格納形式
+	enum SampleType
+	{
+		SAMPLE_PCM_BE,		// 整数、ビッグエンディアン(AIFF、AIFC NONE/twos)
+		SAMPLE_PCM_LE,		// 整数、リトルエンディアン(AIFC sowt)
+		SAMPLE_FLOAT32,		// 32bit float(AIFC fl32)
+		SAMPLE_FLOAT64,		// 64bit float(AIFC fl64)
+	};
+
+private:
+	int ReadFloat64(void* buffer, DWORD size);
 
 private:
-	HANDLE			m_file;
+	FileStream		m_file;
 	WAVEFORMATEX	m_format;
 	DWORD			m_size;
 	DWORD			m_fptr;
+	DWORD			m_align;	// ファイル上の１フレームのバイト数
+	SampleType		m_type;
+	BYTE*			m_temp;		// fl64の読み込みバッファ
 };
@@ -9,9 +9,13 @@
 #include <mmreg.h>
 #include <algorithm>
 #include "caf_reader.h"
+#include "chunk_index.h"
 
 namespace {
 
+// ファイルヘッダ("caff" + mFileVersion + mFileFlags)のバイト数
+const DWORD CAF_HEADER_SIZE = 8;
+
 //-----------------------------------------------------------------------------
 // ビットスワップ
 //-----------------------------------------------------------------------------
@@ -25,6 +29,19 @@ unsigned int Swap32(unsigned int value)
 	return ((value & 0xFF) << 24) | (((value >> 8) & 0xFF) << 16) | (((value >> 16) & 0xFF) << 8) | ((value >> 24) & 0xFF);
 }
 
+//-----------------------------------------------------------------------------
+// ビッグエンディアンの値を取得する
+//-----------------------------------------------------------------------------
+WORD GetInt16(const BYTE* data)
+{
+	return Swap16(*reinterpret_cast<const WORD*>(data));
+}
+
+DWORD GetInt32(const BYTE* data)
+{
+	return Swap32(*reinterpret_cast<const DWORD*>(data));
+}
+
 //-----------------------------------------------------------------------------
 // Float64をInt32に変換する
 //-----------------------------------------------------------------------------
@@ -65,133 +82,61 @@ static int Unpack64(int exp, int fract)
 //-----------------------------------------------------------------------------
 // FourCCを読み込む
 //-----------------------------------------------------------------------------
-FOURCC ReadFourCC(HANDLE file)
+FOURCC ReadFourCC(FileStream& file)
 {
 	FOURCC value = 0;
-	DWORD readed = 0;
-
-	if (!ReadFile(file, &value, sizeof(value), &readed, NULL)) {
+	if (file.Read(&value, sizeof(value)) != sizeof(value)) {
 		return 0;
 	}
 
 	return value;
 }
 
-//-----------------------------------------------------------------------------
-// 整数２バイト読み込む
-//-----------------------------------------------------------------------------
-WORD ReadInt16(HANDLE file)
-{
-	WORD value = 0;
-	DWORD readed = 0;
-
-	if (!ReadFile(file, &value, sizeof(value), &readed, NULL)) {
-		return 0;
-	}
-
-	return Swap16(value);
-}
-
-//-----------------------------------------------------------------------------
-// 整数４バイト読み込む
-//-----------------------------------------------------------------------------
-DWORD ReadInt32(HANDLE file)
-{
-	DWORD value = 0;
-	DWORD readed = 0;
-
-	if (!ReadFile(file, &value, sizeof(value), &readed, NULL)) {
-		return 0;
-	}
-
-	return Swap32(value);
-}
-
-//-----------------------------------------------------------------------------
-// four_ccで指定されたチャンクへシークする
-//-----------------------------------------------------------------------------
-bool SeekToChunk(HANDLE file, const char* four_cc, DWORD& size)
-{
-	FOURCC target_cc = mmioFOURCC(four_cc[0], four_cc[1], four_cc[2], four_cc[3]);
-	while (true) {
-		FOURCC data_cc = ReadFourCC(file);
-		DWORD size_hi = ReadInt32(file);
-		DWORD size_lo = ReadInt32(file);
-
-		size = size_lo;
-
-		// サイズは、最低WORDアラインメントがいる
-		if ((size & 1) == 1) {
-			++size;
-		}
-
-		if (data_cc == target_cc) {
-			return true;
-		}
-
-		SetFilePointer(file, size, NULL, FILE_CURRENT);
-		if (GetLastError() != NO_ERROR) {
-			return false;
-		}
-	}
-
-	return false;
-}
-
 //-----------------------------------------------------------------------------
 // .cafを開く
 //-----------------------------------------------------------------------------
-HANDLE OpenSource(const wchar_t* path)
+bool OpenSource(FileStream& file, const wchar_t* path)
 {
-	HANDLE file = CreateFile(path, GENERIC_READ,
-		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
-		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-	if (file == INVALID_HANDLE_VALUE) {
-		return INVALID_HANDLE_VALUE;
+	if (!file.Open(path)) {
+		return false;
 	}
 
 	FOURCC form_cc = ReadFourCC(file);
 	if (form_cc != mmioFOURCC('c', 'a', 'f', 'f')) {
-		CloseHandle(file);
-		return INVALID_HANDLE_VALUE;
+		file.Close();
+		return false;
 	}
 
-	DWORD mFileVersion = ReadInt16(file);	// must be 1
-	DWORD mFileFlags = ReadInt16(file);		// must be 0
-
-	return file;
+	// mFileVersion(=1)とmFileFlags(=0)は、チャンク走査時に読み飛ばす
+	return true;
 }
 
 //-----------------------------------------------------------------------------
 // PCMフォーマットを取得する
 //-----------------------------------------------------------------------------
-bool GetPcmFormat(HANDLE file, WAVEFORMATEX& wfx, bool& is_little_endian)
+bool GetPcmFormat(FileStream& file, const ChunkIndex& index, WAVEFORMATEX& wfx, bool& is_little_endian)
 {
-	DWORD readed = 0;
-	FOURCC data_cc = 0;
-
-	DWORD size = 0;
-	if (!SeekToChunk(file, "desc", size)) {
+	const ChunkEntry* entry = index.Find(mmioFOURCC('d', 'e', 's', 'c'));
+	if (!entry) {
 		return false;
 	}
 
-	// AIFFのCOMMチャンクは、32バイト以上あるはず
-	if (size < 32) {
+	// CAFのdescチャンクは、32バイト以上あるはず
+	BYTE desc[32];
+	if (!index.Read(file, entry, desc, sizeof(desc))) {
 		return false;
 	}
 
-	WORD exp = ReadInt16(file);
-	WORD fract = ReadInt16(file);
-	WORD dummy = ReadInt16(file);
-	(void)ReadInt16(file);
+	WORD exp = GetInt16(&desc[0]);
+	WORD fract = GetInt16(&desc[2]);
 	DWORD sample_rate = Unpack64(exp, fract);
 
-	FOURCC format_id = ReadFourCC(file);
-	DWORD format_flag = ReadInt32(file);
-	DWORD bytes_per_packet = ReadInt32(file);
-	DWORD frames_per_packet = ReadInt32(file);
-	WORD num_channels = static_cast<WORD>(ReadInt32(file));
-	WORD sample_bits = static_cast<WORD>(ReadInt32(file));
+	FOURCC format_id = *reinterpret_cast<const FOURCC*>(&desc[8]);
+	DWORD format_flag = GetInt32(&desc[12]);
+	DWORD bytes_per_packet = GetInt32(&desc[16]);
+	DWORD frames_per_packet = GetInt32(&desc[20]);
+	WORD num_channels = static_cast<WORD>(GetInt32(&desc[24]));
+	WORD sample_bits = static_cast<WORD>(GetInt32(&desc[28]));
 
 	// 8k/11.25kの倍数以外は対応しない
 	if (0 < (sample_rate % 8000) && 0 < (sample_rate % 11025)) {
@@ -257,7 +202,7 @@ bool CafReader::Parse(const wchar_t* path, Metadata* meta)
 // コンストラクタ
 //-----------------------------------------------------------------------------
 CafReader::CafReader()
-	: m_file(INVALID_HANDLE_VALUE)
+	: m_file()
 	, m_format()
 	, m_size(0)
 	, m_fptr(0)
@@ -278,29 +223,38 @@ CafReader::~CafReader()
 //-----------------------------------------------------------------------------
 bool CafReader::Open(const wchar_t* path)
 {
-	HANDLE file = OpenSource(path);
-	if (file == INVALID_HANDLE_VALUE) {
+	FileStream& file = m_file;
+	if (!OpenSource(file, path)) {
 		return false;
 	}
 
-	bool is_little_endian = false;
-	if (!GetPcmFormat(file, m_format, is_little_endian)) {
-		CloseHandle(file);
+	// dataより後ろのチャンクは不要
+	const FOURCC data_cc = mmioFOURCC('d', 'a', 't', 'a');
+
+	ChunkIndex index;
+	if (!index.Build(file, CAF_HEADER_SIZE, ChunkIndex::LAYOUT_CAF, data_cc)) {
+		Close();
 		return false;
 	}
 
-	DWORD size = 0;
-	if (!SeekToChunk(file, "data", size)) {
-		CloseHandle(file);
+	bool is_little_endian = false;
+	if (!GetPcmFormat(file, index, m_format, is_little_endian)) {
+		Close();
 		return false;
 	}
 
-	DWORD edit_count = ReadInt32(file);
+	// dataの先頭は、mEditCountの４バイト
+	const ChunkEntry* data = index.Find(data_cc);
+	if (!data || data->size < 4) {
+		Close();
+		return false;
+	}
 
-	m_file = file;
-	m_size = size - 4;
-	m_fptr = SetFilePointer(file, 0, NULL, FILE_CURRENT) + 4;
+	m_size = data->size - 4;
+	m_fptr = data->offset + 4;
 	m_isle = is_little_endian;
+
+	file.Seek(m_fptr);
 	return true;
 }
 
@@ -309,10 +263,10 @@ bool CafReader::Open(const wchar_t* path)
 //-----------------------------------------------------------------------------
 void CafReader::Close()
 {
-	if (m_file != INVALID_HANDLE_VALUE) {
-		CloseHandle(m_file);
-		m_file = INVALID_HANDLE_VALUE;
-	}
+	m_file.Close();
+
+	m_pos = 0;
+	m_sample = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -328,14 +282,15 @@ const WAVEFORMATEX& CafReader::GetFormat() const
 //-----------------------------------------------------------------------------
 int CafReader::Read(void* buffer, int size)
 {
-	DWORD end = m_fptr + m_size;
-	DWORD cur = SetFilePointer(m_file, 0, NULL, FILE_CURRENT);
-	if (cur + size >= end) {
-		size = end - cur;
+	if (m_pos + size >= m_size) {
+		size = m_size - m_pos;
 	}
 
-	DWORD readed = 0;
-	if (ReadFile(m_file, buffer, size, &readed, NULL)) {
+	DWORD readed = m_file.Read(buffer, size);
+	if (0 < readed) {
+		m_pos += readed;
+		m_sample = m_pos / m_format.nBlockAlign;
+
 		if (m_isle) {
 			// none
 		}
@@ -369,14 +324,17 @@ int CafReader::Read(void* buffer, int size)
 //-----------------------------------------------------------------------------
 // シーク
 //-----------------------------------------------------------------------------
-int CafReader::Seek(int time_ms)
+DWORD CafReader::SeekSample(DWORD sample)
 {
-	DWORD fp = MulDiv(time_ms, m_format.nAvgBytesPerSec, 1000);
-	fp -= (fp % m_format.nBlockAlign);
-
-	if (SetFilePointer(m_file, m_fptr + fp, 0, FILE_BEGIN)) {
-		return time_ms;
+	DWORD samples = m_size / m_format.nBlockAlign;
+	if (sample > samples) {
+		sample = samples;
 	}
 
-	return 0;
+	DWORD fp = sample * m_format.nBlockAlign;
+	m_file.Seek(m_fptr + fp);
+
+	m_pos = fp;
+	m_sample = sample;
+	return sample;
 }
@@ -7,6 +7,7 @@
 
 #include <windows.h>
 #include "luna_pi.h"
+#include "file_stream.h"
 #include "reader.h"
 
 //-----------------------------------------------------------------------------
@@ -27,10 +28,10 @@ public:
 	virtual const WAVEFORMATEX& GetFormat() const;
 
 	virtual int Read(void* buffer, int length);
-	virtual int Seek(int time_ms);
+	virtual DWORD SeekSample(DWORD sample);
 
 private:
-	HANDLE			m_file;
+	FileStream		m_file;
 	WAVEFORMATEX	m_format;
 	DWORD			m_size;
 	DWORD			m_fptr;
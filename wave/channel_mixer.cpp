@@ -0,0 +1,413 @@
+﻿//=============================================================================
+// チャンネル配置の変換
+// ・CRTなしでビルドするため、floatから整数への変換はSSE2の組込み関数で行う。
+//=============================================================================
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include <mmsystem.h>
+#include <mmreg.h>
+#include <emmintrin.h>
+#include "reader.h"
+#include "channel_mixer.h"
+
+namespace {
+
+// -3dB
+const float MINUS_3DB = 0.70710678f;
+
+// -6dB
+const float MINUS_6DB = 0.5f;
+
+//-----------------------------------------------------------------------------
+// スピーカー毎のダウンミックス係数
+//-----------------------------------------------------------------------------
+struct SpeakerInfo
+{
+	DWORD	speaker;	// SPEAKER_xxx
+	DWORD	substitute;	// 並べ替え時、出力先にない場合の代わり
+	float	left;
+	float	right;
+};
+
+const SpeakerInfo SPEAKER_TABLE[] =
+{
+	{ SPEAKER_FRONT_LEFT,				0,						1.0f,		0.0f		},
+	{ SPEAKER_FRONT_RIGHT,				0,						0.0f,		1.0f		},
+	{ SPEAKER_FRONT_CENTER,				0,						MINUS_3DB,	MINUS_3DB	},
+	{ SPEAKER_LOW_FREQUENCY,			0,						0.0f,		0.0f		},
+	{ SPEAKER_BACK_LEFT,				SPEAKER_SIDE_LEFT,		MINUS_3DB,	0.0f		},
+	{ SPEAKER_BACK_RIGHT,				SPEAKER_SIDE_RIGHT,		0.0f,		MINUS_3DB	},
+	{ SPEAKER_FRONT_LEFT_OF_CENTER,		0,						1.0f,		0.0f		},
+	{ SPEAKER_FRONT_RIGHT_OF_CENTER,	0,						0.0f,		1.0f		},
+	{ SPEAKER_BACK_CENTER,				0,						MINUS_6DB,	MINUS_6DB	},
+	{ SPEAKER_SIDE_LEFT,				SPEAKER_BACK_LEFT,		MINUS_3DB,	0.0f		},
+	{ SPEAKER_SIDE_RIGHT,				SPEAKER_BACK_RIGHT,		0.0f,		MINUS_3DB	},
+	{ SPEAKER_TOP_CENTER,				0,						MINUS_6DB,	MINUS_6DB	},
+	{ SPEAKER_TOP_FRONT_LEFT,			0,						MINUS_3DB,	0.0f		},
+	{ SPEAKER_TOP_FRONT_CENTER,			0,						MINUS_6DB,	MINUS_6DB	},
+	{ SPEAKER_TOP_FRONT_RIGHT,			0,						0.0f,		MINUS_3DB	},
+	{ SPEAKER_TOP_BACK_LEFT,			0,						MINUS_6DB,	0.0f		},
+	{ SPEAKER_TOP_BACK_CENTER,			0,						0.25f,		0.25f		},
+	{ SPEAKER_TOP_BACK_RIGHT,			0,						0.0f,		MINUS_6DB	},
+};
+
+const int SPEAKER_COUNT = sizeof(SPEAKER_TABLE) / sizeof(SPEAKER_TABLE[0]);
+
+//-----------------------------------------------------------------------------
+// チャンネル数に応じた標準の配置（出力先はこの並びを前提とする）
+//-----------------------------------------------------------------------------
+DWORD GetDefaultMask(int channels)
+{
+	switch (channels) {
+	case 1:
+		return SPEAKER_FRONT_CENTER;
+	case 2:
+		return SPEAKER_FRONT_LEFT | SPEAKER_FRONT_RIGHT;
+	case 3:
+		return SPEAKER_FRONT_LEFT | SPEAKER_FRONT_RIGHT | SPEAKER_FRONT_CENTER;
+	case 4:
+		return SPEAKER_FRONT_LEFT | SPEAKER_FRONT_RIGHT | SPEAKER_BACK_LEFT | SPEAKER_BACK_RIGHT;
+	case 5:
+		return SPEAKER_FRONT_LEFT | SPEAKER_FRONT_RIGHT | SPEAKER_FRONT_CENTER | SPEAKER_BACK_LEFT | SPEAKER_BACK_RIGHT;
+	case 6:
+		return SPEAKER_FRONT_LEFT | SPEAKER_FRONT_RIGHT | SPEAKER_FRONT_CENTER | SPEAKER_LOW_FREQUENCY |
+			SPEAKER_BACK_LEFT | SPEAKER_BACK_RIGHT;
+	case 7:
+		return SPEAKER_FRONT_LEFT | SPEAKER_FRONT_RIGHT | SPEAKER_FRONT_CENTER | SPEAKER_LOW_FREQUENCY |
+			SPEAKER_BACK_LEFT | SPEAKER_BACK_RIGHT | SPEAKER_BACK_CENTER;
+	case 8:
+		return SPEAKER_FRONT_LEFT | SPEAKER_FRONT_RIGHT | SPEAKER_FRONT_CENTER | SPEAKER_LOW_FREQUENCY |
+			SPEAKER_BACK_LEFT | SPEAKER_BACK_RIGHT | SPEAKER_SIDE_LEFT | SPEAKER_SIDE_RIGHT;
+	}
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// チャンネル毎のスピーカーを取得する（マスクのビットが足りないチャンネルは0）
+//-----------------------------------------------------------------------------
+void GetSpeakers(DWORD mask, int channels, DWORD* speakers)
+{
+	DWORD bit = 1;
+	for (int ch = 0; ch < channels; ++ch) {
+		while (bit != 0 && (mask & bit) == 0) {
+			bit <<= 1;
+		}
+
+		speakers[ch] = bit;
+		if (bit != 0) {
+			bit <<= 1;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// スピーカー情報を検索する
+//-----------------------------------------------------------------------------
+const SpeakerInfo* FindSpeaker(DWORD speaker)
+{
+	for (int i = 0; i < SPEAKER_COUNT; ++i) {
+		if (SPEAKER_TABLE[i].speaker == speaker) {
+			return &SPEAKER_TABLE[i];
+		}
+	}
+
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// １フレーム分のサンプルを整数で読み込む
+//-----------------------------------------------------------------------------
+inline void LoadFrame(const BYTE* src, int* dest, int channels, int bytes)
+{
+	if (bytes == 2) {
+		const short* data = reinterpret_cast<const short*>(src);
+		for (int ch = 0; ch < channels; ++ch) {
+			dest[ch] = data[ch];
+		}
+	}
+	else if (bytes == 3) {
+		for (int ch = 0; ch < channels; ++ch, src += 3) {
+			dest[ch] = static_cast<int>((src[0] << 8) | (src[1] << 16) | (src[2] << 24)) >> 8;
+		}
+	}
+	else {
+		const int* data = reinterpret_cast<const int*>(src);
+		for (int ch = 0; ch < channels; ++ch) {
+			dest[ch] = data[ch];
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// (L, R, L, R)をクリップして書き込む、countは書き込むサンプル数(2 or 4)
+//-----------------------------------------------------------------------------
+inline void StoreSamples(__m128 value, BYTE* dest, int count, int bytes)
+{
+	if (bytes == 2) {
+		value = _mm_max_ps(_mm_min_ps(value, _mm_set1_ps(32767.0f)), _mm_set1_ps(-32768.0f));
+		__m128i data = _mm_cvtps_epi32(value);
+		data = _mm_packs_epi32(data, data);
+		if (count == 4) {
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(dest), data);
+		}
+		else {
+			*reinterpret_cast<int*>(dest) = _mm_cvtsi128_si32(data);
+		}
+	}
+	else if (bytes == 3) {
+		value = _mm_max_ps(_mm_min_ps(value, _mm_set1_ps(8388607.0f)), _mm_set1_ps(-8388608.0f));
+
+		int data[4];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(data), _mm_cvtps_epi32(value));
+		for (int i = 0; i < count; ++i, dest += 3) {
+			dest[0] = static_cast<BYTE>(data[i]);
+			dest[1] = static_cast<BYTE>(data[i] >> 8);
+			dest[2] = static_cast<BYTE>(data[i] >> 16);
+		}
+	}
+	else {
+		// 範囲外は0x80000000になるので、上限を超えた分だけ反転して0x7FFFFFFFにする
+		__m128 limit = _mm_set1_ps(2147483648.0f);
+		__m128i over = _mm_castps_si128(_mm_cmpge_ps(value, limit));
+		__m128i data = _mm_xor_si128(_mm_cvtps_epi32(value), over);
+		if (count == 4) {
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dest), data);
+		}
+		else {
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(dest), data);
+		}
+	}
+}
+
+} //namespace
+
+
+//-----------------------------------------------------------------------------
+// コンストラクタ
+//-----------------------------------------------------------------------------
+ChannelMixer::ChannelMixer()
+	: m_active(false)
+	, m_permute(false)
+	, m_channels(0)
+	, m_groups(0)
+	, m_bytes(0)
+	, m_format()
+{
+}
+
+//-----------------------------------------------------------------------------
+// 初期化
+//-----------------------------------------------------------------------------
+bool ChannelMixer::Init(MixLayout layout, const WAVEFORMATEX& wfx, DWORD channel_mask)
+{
+	m_active = false;
+
+	if (layout == MIX_PASSTHROUGH || wfx.wFormatTag != WAVE_FORMAT_PCM) {
+		return false;
+	}
+
+	const int channels = wfx.nChannels;
+	const int bytes = wfx.wBitsPerSample / 8;
+	if (channels < 1 || MAX_CHANNELS < channels || bytes < 2 || 4 < bytes || wfx.nBlockAlign != channels * bytes) {
+		return false;
+	}
+
+	// マスクがなければ、標準の並びとみなす
+	const DWORD default_mask = GetDefaultMask(channels);
+	if (channel_mask == 0) {
+		channel_mask = default_mask;
+	}
+
+	DWORD speakers[MAX_CHANNELS];
+	GetSpeakers(channel_mask, channels, speakers);
+
+	int out_channels = 0;
+
+	if (layout == MIX_REORDER) {
+		if (channel_mask == default_mask) {
+			return false;
+		}
+
+		DWORD targets[MAX_CHANNELS];
+		GetSpeakers(default_mask, channels, targets);
+
+		// 同じスピーカー、なければ代わりのスピーカーのチャンネルを割り当てる
+		bool identity = true;
+		for (int out = 0; out < channels; ++out) {
+			m_map[out] = -1;
+
+			const SpeakerInfo* info = FindSpeaker(targets[out]);
+			for (int in = 0; in < channels && m_map[out] < 0; ++in) {
+				if (targets[out] != 0 && speakers[in] == targets[out]) {
+					m_map[out] = in;
+				}
+			}
+
+			for (int in = 0; in < channels && m_map[out] < 0; ++in) {
+				if (info && info->substitute != 0 && speakers[in] == info->substitute) {
+					m_map[out] = in;
+				}
+			}
+
+			if (m_map[out] != out) {
+				identity = false;
+			}
+		}
+
+		if (identity) {
+			return false;
+		}
+
+		m_permute = true;
+		out_channels = channels;
+	}
+	else {
+		if (channels <= 2) {
+			return false;
+		}
+
+		// 各チャンネルの係数を求め、合計が1を超える場合は全体を下げる
+		float sum_left = 0.0f;
+		float sum_right = 0.0f;
+
+		ZeroMemory(m_matrix, sizeof(m_matrix));
+		for (int in = 0; in < channels; ++in) {
+			const SpeakerInfo* info = FindSpeaker(speakers[in]);
+			if (info) {
+				m_matrix[in][0] = m_matrix[in][2] = info->left;
+				m_matrix[in][1] = m_matrix[in][3] = info->right;
+				sum_left += info->left;
+				sum_right += info->right;
+			}
+		}
+
+		float sum = (sum_left > sum_right)? sum_left : sum_right;
+		if (sum > 1.0f) {
+			for (int in = 0; in < channels; ++in) {
+				for (int i = 0; i < 4; ++i) {
+					m_matrix[in][i] /= sum;
+				}
+			}
+		}
+
+		m_permute = false;
+		out_channels = 2;
+	}
+
+	m_channels	= channels;
+	m_groups	= (channels + 3) / 4;
+	m_bytes		= bytes;
+	m_active	= true;
+
+	m_format = wfx;
+	m_format.nChannels			= static_cast<WORD>(out_channels);
+	m_format.nBlockAlign		= static_cast<WORD>(out_channels * bytes);
+	m_format.nAvgBytesPerSec	= m_format.nSamplesPerSec * m_format.nBlockAlign;
+	m_format.cbSize				= 0;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// 変換が有効か？
+//-----------------------------------------------------------------------------
+bool ChannelMixer::IsActive() const
+{
+	return m_active;
+}
+
+//-----------------------------------------------------------------------------
+// 出力フォーマット取得
+//-----------------------------------------------------------------------------
+const WAVEFORMATEX& ChannelMixer::GetFormat() const
+{
+	return m_format;
+}
+
+//-----------------------------------------------------------------------------
+// 変換
+//-----------------------------------------------------------------------------
+void ChannelMixer::Process(const BYTE* src, BYTE* dest, int frames) const
+{
+	if (m_permute) {
+		Permute(src, dest, frames);
+	}
+	else {
+		Downmix(src, dest, frames);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// 並べ替え（サンプルはそのままコピーする）
+//-----------------------------------------------------------------------------
+void ChannelMixer::Permute(const BYTE* src, BYTE* dest, int frames) const
+{
+	const int align = m_channels * m_bytes;
+
+	for (int f = 0; f < frames; ++f, src += align) {
+		for (int out = 0; out < m_channels; ++out, dest += m_bytes) {
+			const int in = m_map[out];
+			if (in < 0) {
+				ZeroMemory(dest, m_bytes);
+			}
+			else if (m_bytes == 2) {
+				*reinterpret_cast<short*>(dest) = *reinterpret_cast<const short*>(&src[in * 2]);
+			}
+			else if (m_bytes == 3) {
+				dest[0] = src[in * 3 + 0];
+				dest[1] = src[in * 3 + 1];
+				dest[2] = src[in * 3 + 2];
+			}
+			else {
+				*reinterpret_cast<int*>(dest) = *reinterpret_cast<const int*>(&src[in * 4]);
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// ステレオへのダウンミックス
+// ・２フレームずつ、入力チャンネルiを(x0[i], x0[i], x1[i], x1[i])に並べて、
+//   係数(L, R, L, R)を掛けて足し込むと、出力の並び(L0, R0, L1, R1)になる。
+//-----------------------------------------------------------------------------
+void ChannelMixer::Downmix(const BYTE* src, BYTE* dest, int frames) const
+{
+	__m128i row0[MAX_CHANNELS / 4];
+	__m128i row1[MAX_CHANNELS / 4];
+	for (int g = 0; g < m_groups; ++g) {
+		row0[g] = _mm_setzero_si128();
+		row1[g] = _mm_setzero_si128();
+	}
+
+	int* in0 = reinterpret_cast<int*>(row0);
+	int* in1 = reinterpret_cast<int*>(row1);
+
+	const int align = m_channels * m_bytes;
+
+	for (int f = 0; f < frames; f += 2) {
+		// 最後の１フレームが余る場合、同じフレームを２つ並べて前半だけ書き込む
+		const int count = (f + 1 < frames)? 4 : 2;
+
+		LoadFrame(src, in0, m_channels, m_bytes);
+		LoadFrame((count == 4)? src + align : src, in1, m_channels, m_bytes);
+
+		__m128 acc = _mm_setzero_ps();
+		for (int g = 0; g < m_groups; ++g) {
+			__m128 v0 = _mm_cvtepi32_ps(row0[g]);
+			__m128 v1 = _mm_cvtepi32_ps(row1[g]);
+
+			const int i = g * 4;
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(0, 0, 0, 0)), _mm_loadu_ps(m_matrix[i + 0])));
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(1, 1, 1, 1)), _mm_loadu_ps(m_matrix[i + 1])));
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(2, 2, 2, 2)), _mm_loadu_ps(m_matrix[i + 2])));
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(3, 3, 3, 3)), _mm_loadu_ps(m_matrix[i + 3])));
+		}
+
+		StoreSamples(acc, dest, count, m_bytes);
+
+		src += align * 2;
+		dest += m_bytes * count;
+	}
+}
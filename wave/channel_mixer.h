@@ -0,0 +1,60 @@
+﻿//=============================================================================
+// チャンネル配置の変換
+//=============================================================================
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include <mmsystem.h>
+
+//-----------------------------------------------------------------------------
+// 出力するチャンネル配置
+//-----------------------------------------------------------------------------
+enum MixLayout
+{
+	MIX_PASSTHROUGH	= 0,	// ファイルの並びのまま
+	MIX_REORDER		= 1,	// チャンネル数に応じた標準の並びに入れ替える
+	MIX_STEREO		= 2,	// ステレオにダウンミックスする
+};
+
+//-----------------------------------------------------------------------------
+// チャンネル配置の変換
+// ・16/24/32bitの整数PCMのみ扱う。
+// ・並べ替えはサンプルをそのままコピーし、ダウンミックスはfloatの行列演算で行う。
+//-----------------------------------------------------------------------------
+class ChannelMixer
+{
+public:
+	// 扱える最大チャンネル数
+	static const int MAX_CHANNELS = 16;
+
+public:
+	ChannelMixer();
+
+	// 変換が不要な場合は、falseを返す
+	bool Init(MixLayout layout, const WAVEFORMATEX& wfx, DWORD channel_mask);
+	bool IsActive() const;
+
+	const WAVEFORMATEX& GetFormat() const;
+
+	// srcのframesフレームを変換してdestに書き込む
+	void Process(const BYTE* src, BYTE* dest, int frames) const;
+
+private:
+	void Permute(const BYTE* src, BYTE* dest, int frames) const;
+	void Downmix(const BYTE* src, BYTE* dest, int frames) const;
+
+private:
+	bool			m_active;
+	bool			m_permute;		// 入れ替えのみ
+	int				m_channels;		// 入力チャンネル数
+	int				m_groups;		// 入力チャンネルを４つずつに分けた数
+	int				m_bytes;		// １サンプルのバイト数
+	WAVEFORMATEX	m_format;		// 出力フォーマット
+	int				m_map[MAX_CHANNELS];	// 出力チャンネル毎の入力チャンネル（-1なら無音）
+
+	// ダウンミックス係数、入力チャンネル毎に(L, R, L, R)
+	// （operator newは16バイト境界を保証しないので、__m128では持たない）
+	float			m_matrix[MAX_CHANNELS][4];
+};
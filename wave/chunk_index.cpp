@@ -0,0 +1,170 @@
+﻿//=============================================================================
+// チャンク一覧
+//=============================================================================
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include <mmsystem.h>
+#include "reader.h"
+#include "chunk_index.h"
+
+namespace {
+
+//-----------------------------------------------------------------------------
+// ビッグエンディアンの４バイトを取得する
+//-----------------------------------------------------------------------------
+DWORD GetInt32BE(const BYTE* data)
+{
+	return (DWORD(data[0]) << 24) | (DWORD(data[1]) << 16) | (DWORD(data[2]) << 8) | DWORD(data[3]);
+}
+
+//-----------------------------------------------------------------------------
+// リトルエンディアンの４バイトを取得する
+//-----------------------------------------------------------------------------
+DWORD GetInt32LE(const BYTE* data)
+{
+	return (DWORD(data[3]) << 24) | (DWORD(data[2]) << 16) | (DWORD(data[1]) << 8) | DWORD(data[0]);
+}
+
+} //namespace
+
+
+//-----------------------------------------------------------------------------
+// コンストラクタ
+//-----------------------------------------------------------------------------
+ChunkIndex::ChunkIndex()
+	: m_count(0)
+	, m_head_pos(0)
+	, m_head_len(0)
+{
+}
+
+//-----------------------------------------------------------------------------
+// チャンクを走査する
+//-----------------------------------------------------------------------------
+bool ChunkIndex::Build(const FileStream& file, DWORD start, Layout layout, FOURCC stop_cc)
+{
+	m_count = 0;
+	m_head_pos = start;
+	m_head_len = 0;
+
+	DWORD file_size = file.GetSize();
+	if (file_size <= start) {
+		return false;
+	}
+
+	// 大抵のファイルは、先頭の数KBに必要なチャンクが揃っている
+	m_head_len = file.ReadAt(start, m_head, HEAD_SIZE);
+	if (m_head_len == 0) {
+		return false;
+	}
+
+	const DWORD header_size = (layout == LAYOUT_CAF || layout == LAYOUT_DFF)? 12 : 8;
+
+	DWORD pos = start;
+	while ((m_count < MAX_CHUNKS) && (pos + header_size <= file_size)) {
+		BYTE header[12];
+		if (!ReadAt(file, pos, header, header_size)) {
+			break;
+		}
+
+		ChunkEntry& entry = m_list[m_count];
+		entry.four_cc = *reinterpret_cast<const FOURCC*>(header);
+		entry.offset = pos + header_size;
+
+		DWORD pad = 0;
+		if (layout == LAYOUT_RIFF) {
+			entry.size = GetInt32LE(&header[4]);
+			pad = (entry.size & 1);
+		}
+		else if (layout == LAYOUT_IFF) {
+			entry.size = GetInt32BE(&header[4]);
+			pad = (entry.size & 1);
+		}
+		else {
+			DWORD size_hi = GetInt32BE(&header[4]);
+			DWORD size_lo = GetInt32BE(&header[8]);
+
+			// サイズ-1(未確定)や4GB以上は、ファイル終端までとする
+			entry.size = size_lo;
+			if (size_hi != 0) {
+				entry.size = file_size - entry.offset;
+			}
+
+			if (layout == LAYOUT_DFF) {
+				pad = (entry.size & 1);
+			}
+		}
+
+		++m_count;
+
+		if (entry.four_cc == stop_cc) {
+			return true;
+		}
+
+		DWORD next = entry.offset + entry.size + pad;
+		if (next <= pos) {
+			break;
+		}
+
+		pos = next;
+	}
+
+	return (0 < m_count);
+}
+
+//-----------------------------------------------------------------------------
+// チャンクを検索する
+//-----------------------------------------------------------------------------
+const ChunkEntry* ChunkIndex::Find(FOURCC four_cc) const
+{
+	for (int i = 0; i < m_count; ++i) {
+		if (m_list[i].four_cc == four_cc) {
+			return &m_list[i];
+		}
+	}
+
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// チャンクのデータ部を読み込む
+//-----------------------------------------------------------------------------
+bool ChunkIndex::Read(const FileStream& file, const ChunkEntry* entry, void* buffer, DWORD size) const
+{
+	if (!entry || entry->size < size) {
+		return false;
+	}
+
+	return ReadAt(file, entry->offset, buffer, size);
+}
+
+//-----------------------------------------------------------------------------
+// チャンク数取得
+//-----------------------------------------------------------------------------
+int ChunkIndex::GetCount() const
+{
+	return m_count;
+}
+
+//-----------------------------------------------------------------------------
+// チャンク情報取得
+//-----------------------------------------------------------------------------
+const ChunkEntry& ChunkIndex::GetEntry(int index) const
+{
+	return m_list[index];
+}
+
+//-----------------------------------------------------------------------------
+// 指定位置から読み込む（先読み範囲内ならファイルを読まない）
+//-----------------------------------------------------------------------------
+bool ChunkIndex::ReadAt(const FileStream& file, DWORD pos, void* buffer, DWORD size) const
+{
+	if (m_head_pos <= pos && pos - m_head_pos <= m_head_len && size <= m_head_len - (pos - m_head_pos)) {
+		CopyMemory(buffer, &m_head[pos - m_head_pos], size);
+		return true;
+	}
+
+	return (file.ReadAt(pos, buffer, size) == size);
+}
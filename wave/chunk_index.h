@@ -0,0 +1,69 @@
+﻿//=============================================================================
+// チャンク一覧
+//=============================================================================
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include <mmsystem.h>
+#include "file_stream.h"
+
+//-----------------------------------------------------------------------------
+// チャンク情報
+//-----------------------------------------------------------------------------
+struct ChunkEntry
+{
+	FOURCC	four_cc;	// チャンクID
+	DWORD	offset;		// データ部のファイル位置
+	DWORD	size;		// データ部のバイト数
+};
+
+//-----------------------------------------------------------------------------
+// チャンク一覧
+// ・ヘッダを１回だけ走査し、各チャンクの位置とサイズを記録する。
+// ・先頭部分はまとめて読み込んでおき、そこに収まるチャンクはファイルを読まない。
+//-----------------------------------------------------------------------------
+class ChunkIndex
+{
+public:
+	// チャンクヘッダの形式
+	enum Layout
+	{
+		LAYOUT_RIFF,	// FourCC + 32bitサイズ(LE)、WORDアラインメント
+		LAYOUT_IFF,		// FourCC + 32bitサイズ(BE)、WORDアラインメント
+		LAYOUT_CAF,		// FourCC + 64bitサイズ(BE)
+		LAYOUT_DFF,		// FourCC + 64bitサイズ(BE)、WORDアラインメント
+	};
+
+	// 記録できるチャンクの最大数
+	static const int MAX_CHUNKS = 64;
+
+	// 先読みするバイト数
+	static const DWORD HEAD_SIZE = 4096;
+
+public:
+	ChunkIndex();
+
+	// startの位置からチャンクを走査する、stop_ccが見つかった時点で終了（0なら終端まで）
+	bool Build(const FileStream& file, DWORD start, Layout layout, FOURCC stop_cc);
+
+	// チャンクを検索する、見つからなければNULL
+	const ChunkEntry* Find(FOURCC four_cc) const;
+
+	// チャンクのデータ部を先頭から読み込む
+	bool Read(const FileStream& file, const ChunkEntry* entry, void* buffer, DWORD size) const;
+
+	int GetCount() const;
+	const ChunkEntry& GetEntry(int index) const;
+
+private:
+	bool ReadAt(const FileStream& file, DWORD pos, void* buffer, DWORD size) const;
+
+private:
+	ChunkEntry	m_list[MAX_CHUNKS];
+	int			m_count;
+	BYTE		m_head[HEAD_SIZE];	// 先読みデータ
+	DWORD		m_head_pos;			// 先読みデータのファイル位置
+	DWORD		m_head_len;			// 先読みデータのバイト数
+};
@@ -0,0 +1,373 @@
+﻿//=============================================================================
+// DFF(DSDIFF)読み取り
+//=============================================================================
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include <mmsystem.h>
+#include <mmreg.h>
+#include "dff_reader.h"
+#include "chunk_index.h"
+
+namespace {
+
+// FRM8ヘッダ("FRM8" + 64bitサイズ + "DSD ")のバイト数
+const DWORD FRM8_HEADER_SIZE = 16;
+
+// シーク時、フィルタを落ち着かせるために手前から変換するバイト数
+const DWORD PREROLL_BYTES = 512;
+
+//-----------------------------------------------------------------------------
+// ビットスワップ
+//-----------------------------------------------------------------------------
+unsigned short Swap16(unsigned short value)
+{
+	return ((value & 0xFF) << 8) | ((value >> 8) & 0xFF);
+}
+
+unsigned int Swap32(unsigned int value)
+{
+	return ((value & 0xFF) << 24) | (((value >> 8) & 0xFF) << 16) | (((value >> 16) & 0xFF) << 8) | ((value >> 24) & 0xFF);
+}
+
+//-----------------------------------------------------------------------------
+// ビッグエンディアンの値を取得する
+//-----------------------------------------------------------------------------
+WORD GetInt16(const BYTE* data)
+{
+	return Swap16(*reinterpret_cast<const WORD*>(data));
+}
+
+DWORD GetInt32(const BYTE* data)
+{
+	return Swap32(*reinterpret_cast<const DWORD*>(data));
+}
+
+//-----------------------------------------------------------------------------
+// FourCCを読み込む
+//-----------------------------------------------------------------------------
+FOURCC ReadFourCC(FileStream& file)
+{
+	FOURCC value = 0;
+	if (file.Read(&value, sizeof(value)) != sizeof(value)) {
+		return 0;
+	}
+
+	return value;
+}
+
+//-----------------------------------------------------------------------------
+// .dffを開く
+//-----------------------------------------------------------------------------
+bool OpenSource(FileStream& file, const wchar_t* path)
+{
+	if (!file.Open(path)) {
+		return false;
+	}
+
+	FOURCC frm8_cc = ReadFourCC(file);
+	if (frm8_cc != mmioFOURCC('F', 'R', 'M', '8')) {
+		file.Close();
+		return false;
+	}
+
+	// FRM8サイズ（64bit）は、チェックしない
+	file.Skip(8);
+
+	FOURCC dsd_cc = ReadFourCC(file);
+	if (dsd_cc != mmioFOURCC('D', 'S', 'D', ' ')) {
+		file.Close();
+		return false;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// DSDのフォーマットを取得する
+//-----------------------------------------------------------------------------
+bool GetDsdFormat(FileStream& file, const ChunkIndex& index, DWORD& sample_rate, DWORD& num_channels)
+{
+	// PROPの下に、FS/CHNL/CMPRなどが並ぶ
+	BYTE fs[4];
+	if (!index.Read(file, index.Find(mmioFOURCC('F', 'S', ' ', ' ')), fs, sizeof(fs))) {
+		return false;
+	}
+
+	BYTE chnl[2];
+	if (!index.Read(file, index.Find(mmioFOURCC('C', 'H', 'N', 'L')), chnl, sizeof(chnl))) {
+		return false;
+	}
+
+	// DST圧縮には対応しない
+	FOURCC compression = 0;
+	if (!index.Read(file, index.Find(mmioFOURCC('C', 'M', 'P', 'R')), &compression, sizeof(compression))) {
+		return false;
+	}
+
+	if (compression != mmioFOURCC('D', 'S', 'D', ' ')) {
+		return false;
+	}
+
+	sample_rate = GetInt32(fs);
+	num_channels = GetInt16(chnl);
+	return true;
+}
+
+} //namespace
+
+
+//-----------------------------------------------------------------------------
+// 解析
+//-----------------------------------------------------------------------------
+bool DffReader::Parse(const wchar_t* path, Metadata* meta)
+{
+	DffReader reader;
+	if (!reader.Open(path)) {
+		return false;
+	}
+
+	meta->duration = MulDiv(reader.m_bytes, 8000, reader.m_dsd_rate);
+	meta->seekable = true;
+
+	wsprintf(meta->extra, L"DSDIFF, DSD%d, %d ch -> %d Hz, 24 bit",
+		reader.m_dsd_rate / 44100, reader.m_format.nChannels, reader.m_format.nSamplesPerSec);
+
+	reader.Close();
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// コンストラクタ
+//-----------------------------------------------------------------------------
+DffReader::DffReader()
+	: m_file()
+	, m_format()
+	, m_decoder()
+	, m_dsd_rate(0)
+	, m_fptr(0)
+	, m_bytes(0)
+	, m_raw(NULL)
+	, m_plane(NULL)
+	, m_temp(NULL)
+{
+}
+
+//-----------------------------------------------------------------------------
+// デストラクタ
+//-----------------------------------------------------------------------------
+DffReader::~DffReader()
+{
+	Close();
+}
+
+//-----------------------------------------------------------------------------
+// 開く
+//-----------------------------------------------------------------------------
+bool DffReader::Open(const wchar_t* path)
+{
+	FileStream& file = m_file;
+	if (!OpenSource(file, path)) {
+		return false;
+	}
+
+	// PROPまでを走査する
+	const FOURCC prop_cc = mmioFOURCC('P', 'R', 'O', 'P');
+
+	ChunkIndex index;
+	if (!index.Build(file, FRM8_HEADER_SIZE, ChunkIndex::LAYOUT_DFF, prop_cc)) {
+		Close();
+		return false;
+	}
+
+	// PROPの先頭は"SND "、以降はサブチャンクが並び、その後ろにDSDチャンクが続く
+	const ChunkEntry* prop = index.Find(prop_cc);
+	FOURCC snd_cc = 0;
+	if (!index.Read(file, prop, &snd_cc, sizeof(snd_cc)) || snd_cc != mmioFOURCC('S', 'N', 'D', ' ')) {
+		Close();
+		return false;
+	}
+
+	const FOURCC dsd_cc = mmioFOURCC('D', 'S', 'D', ' ');
+
+	ChunkIndex prop_index;
+	if (!prop_index.Build(file, prop->offset + sizeof(snd_cc), ChunkIndex::LAYOUT_DFF, dsd_cc)) {
+		Close();
+		return false;
+	}
+
+	DWORD sample_rate = 0;
+	DWORD num_channels = 0;
+	if (!GetDsdFormat(file, prop_index, sample_rate, num_channels)) {
+		Close();
+		return false;
+	}
+
+	const ChunkEntry* data = prop_index.Find(dsd_cc);
+	if (!data || num_channels == 0 || data->size < num_channels) {
+		Close();
+		return false;
+	}
+
+	// DSDIFFは、バイト内でMSBが先
+	if (!m_decoder.Init(num_channels, sample_rate, false)) {
+		Close();
+		return false;
+	}
+
+	m_raw = static_cast<BYTE*>(HeapAlloc(GetProcessHeap(), 0, DsdDecoder::MAX_BYTES * num_channels));
+	m_plane = static_cast<BYTE*>(HeapAlloc(GetProcessHeap(), 0, DsdDecoder::MAX_BYTES * num_channels));
+	if (!m_raw || !m_plane) {
+		Close();
+		return false;
+	}
+
+	m_format.wFormatTag			= WAVE_FORMAT_PCM;
+	m_format.nChannels			= static_cast<WORD>(num_channels);
+	m_format.nSamplesPerSec		= m_decoder.GetSampleRate();
+	m_format.wBitsPerSample		= 24;
+	m_format.nBlockAlign		= m_format.nChannels * m_format.wBitsPerSample / 8;
+	m_format.nAvgBytesPerSec	= m_format.nSamplesPerSec * m_format.nBlockAlign;
+	m_format.cbSize				= 0;
+
+	m_temp = static_cast<BYTE*>(HeapAlloc(GetProcessHeap(), 0,
+		(PREROLL_BYTES / m_decoder.GetBytesPerFrame()) * m_format.nBlockAlign));
+	if (!m_temp) {
+		Close();
+		return false;
+	}
+
+	m_dsd_rate = sample_rate;
+	m_fptr = data->offset;
+	m_bytes = data->size / num_channels;
+
+	file.Seek(m_fptr);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// 閉じる
+//-----------------------------------------------------------------------------
+void DffReader::Close()
+{
+	m_file.Close();
+
+	if (m_raw) {
+		HeapFree(GetProcessHeap(), 0, m_raw);
+		m_raw = NULL;
+	}
+
+	if (m_plane) {
+		HeapFree(GetProcessHeap(), 0, m_plane);
+		m_plane = NULL;
+	}
+
+	if (m_temp) {
+		HeapFree(GetProcessHeap(), 0, m_temp);
+		m_temp = NULL;
+	}
+
+	m_decoder.Release();
+	m_pos = 0;
+	m_sample = 0;
+}
+
+//-----------------------------------------------------------------------------
+// フォーマット取得
+//-----------------------------------------------------------------------------
+const WAVEFORMATEX& DffReader::GetFormat() const
+{
+	return m_format;
+}
+
+//-----------------------------------------------------------------------------
+// 読み取り
+//-----------------------------------------------------------------------------
+int DffReader::Read(void* buffer, int size)
+{
+	const DWORD bytes_per_frame = m_decoder.GetBytesPerFrame();
+
+	DWORD bytes = (size / m_format.nBlockAlign) * bytes_per_frame;
+	if (bytes > m_bytes - m_pos) {
+		bytes = m_bytes - m_pos;
+		bytes -= bytes % bytes_per_frame;
+	}
+
+	return Decode(static_cast<BYTE*>(buffer), bytes) * m_format.nBlockAlign;
+}
+
+//-----------------------------------------------------------------------------
+// シーク
+//-----------------------------------------------------------------------------
+DWORD DffReader::SeekSample(DWORD sample)
+{
+	const DWORD bytes_per_frame = m_decoder.GetBytesPerFrame();
+
+	DWORD samples = m_bytes / bytes_per_frame;
+	if (sample > samples) {
+		sample = samples;
+	}
+
+	DWORD target = sample * bytes_per_frame;
+
+	// 少し手前から読み直す
+	DWORD start = (target > PREROLL_BYTES)? (target - PREROLL_BYTES) : 0;
+
+	DWORD fp = m_fptr + start * m_format.nChannels;
+	m_file.Seek(fp);
+
+	m_pos = start;
+	m_decoder.Reset();
+
+	// 手前の分は、変換して捨てる
+	Decode(m_temp, target - start);
+	return m_sample;
+}
+
+//-----------------------------------------------------------------------------
+// 変換
+//-----------------------------------------------------------------------------
+int DffReader::Decode(BYTE* dest, DWORD bytes)
+{
+	const DWORD bytes_per_frame = m_decoder.GetBytesPerFrame();
+	const int channels = m_format.nChannels;
+
+	const BYTE* src[DsdDecoder::MAX_CHANNELS];
+	for (int ch = 0; ch < channels; ++ch) {
+		src[ch] = &m_plane[ch * DsdDecoder::MAX_BYTES];
+	}
+
+	int frames = 0;
+	while (0 < bytes) {
+		DWORD count = (bytes > DsdDecoder::MAX_BYTES)? DsdDecoder::MAX_BYTES : bytes;
+
+		DWORD readed = m_file.Read(m_raw, count * channels);
+		if (readed == 0) {
+			break;
+		}
+
+		count = readed / channels;
+		count -= count % bytes_per_frame;
+		if (count == 0) {
+			break;
+		}
+
+		// チャンネル交互に並んでいるバイトを、チャンネル毎に並べ替える
+		for (int ch = 0; ch < channels; ++ch) {
+			const BYTE* in = &m_raw[ch];
+			BYTE* out = &m_plane[ch * DsdDecoder::MAX_BYTES];
+			for (DWORD i = 0; i < count; ++i) {
+				out[i] = in[i * channels];
+			}
+		}
+
+		frames += m_decoder.Process(src, count, dest + frames * m_format.nBlockAlign);
+		m_pos += count;
+		bytes -= count;
+	}
+
+	// DSDでは、m_posはチャンネル毎のバイト数
+	m_sample = m_pos / bytes_per_frame;
+	return frames;
+}
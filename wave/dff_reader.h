@@ -0,0 +1,47 @@
+﻿//=============================================================================
+// DFF読み取り
+//=============================================================================
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include "luna_pi.h"
+#include "file_stream.h"
+#include "reader.h"
+#include "dsd_decoder.h"
+
+//-----------------------------------------------------------------------------
+// DFF読み取り
+//-----------------------------------------------------------------------------
+class DffReader : public Reader
+{
+public:
+	static bool Parse(const wchar_t* path, Metadata* meta);
+
+public:
+	DffReader();
+	virtual ~DffReader();
+
+	virtual bool Open(const wchar_t* path);
+	virtual void Close();
+
+	virtual const WAVEFORMATEX& GetFormat() const;
+
+	virtual int Read(void* buffer, int length);
+	virtual DWORD SeekSample(DWORD sample);
+
+private:
+	int Decode(BYTE* dest, DWORD bytes);
+
+private:
+	FileStream		m_file;
+	WAVEFORMATEX	m_format;
+	DsdDecoder		m_decoder;
+	DWORD			m_dsd_rate;		// DSDのサンプリング周波数
+	DWORD			m_fptr;			// データの先頭位置
+	DWORD			m_bytes;		// チャンネル毎のDSDバイト数
+	BYTE*			m_raw;			// ファイルから読んだデータ（チャンネル交互）
+	BYTE*			m_plane;		// チャンネル毎に並べ替えたデータ
+	BYTE*			m_temp;			// シーク時の読み捨て用
+};
@@ -0,0 +1,383 @@
+﻿//=============================================================================
+// DSD→PCM変換
+//=============================================================================
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include <mmsystem.h>
+#include <emmintrin.h>
+#include "reader.h"
+#include "dsd_decoder.h"
+
+namespace {
+
+//-----------------------------------------------------------------------------
+// フィルタ係数（等リプル、DCゲイン1）
+// ・STAGE1_COEF : DSDレートで通過域0.0125、阻止域0.1125以上、1/8に間引く
+// ・HALF_COEF   : 通過域0.1、阻止域0.4以上、途中の1/2間引き
+// ・FINAL_COEF  : 通過域0.2、阻止域0.3以上、最後の1/2間引き
+//-----------------------------------------------------------------------------
+const int STAGE1_TAPS = 96;
+const float STAGE1_COEF[STAGE1_TAPS] =
+{
+	 1.951867193e-08f,  1.080425633e-07f,  3.781538700e-07f,  1.028419444e-06f,
+	 2.346150544e-06f,  4.655910629e-06f,  8.179882534e-06f,  1.278660023e-05f,
+	 1.763680389e-05f,  2.079020039e-05f,  1.890750475e-05f,  7.249485749e-06f,
+	-1.979056196e-05f, -6.741687625e-05f, -1.383482163e-04f, -2.300804429e-04f,
+	-3.319706804e-04f, -4.229565064e-04f, -4.709806333e-04f, -4.352468761e-04f,
+	-2.721752233e-04f,  5.471000032e-05f,  5.617096331e-04f,  1.230645377e-03f,
+	 1.996430615e-03f,  2.740418929e-03f,  3.293519415e-03f,  3.452186168e-03f,
+	 3.008453178e-03f,  1.792355201e-03f, -2.782186358e-04f, -3.148289564e-03f,
+	-6.587349447e-03f, -1.017232431e-02f, -1.330079996e-02f, -1.523936292e-02f,
+	-1.520607226e-02f, -1.247932187e-02f, -6.518953041e-03f,  2.919174325e-03f,
+	 1.569563167e-02f,  3.124535811e-02f,  4.859378889e-02f,  6.643511477e-02f,
+	 8.326626924e-02f,  9.756020393e-02f,  1.079542366e-01f,  1.134253653e-01f,
+	 1.134253653e-01f,  1.079542366e-01f,  9.756020393e-02f,  8.326626924e-02f,
+	 6.643511477e-02f,  4.859378889e-02f,  3.124535811e-02f,  1.569563167e-02f,
+	 2.919174325e-03f, -6.518953041e-03f, -1.247932187e-02f, -1.520607226e-02f,
+	-1.523936292e-02f, -1.330079996e-02f, -1.017232431e-02f, -6.587349447e-03f,
+	-3.148289564e-03f, -2.782186358e-04f,  1.792355201e-03f,  3.008453178e-03f,
+	 3.452186168e-03f,  3.293519415e-03f,  2.740418929e-03f,  1.996430615e-03f,
+	 1.230645377e-03f,  5.617096331e-04f,  5.471000032e-05f, -2.721752233e-04f,
+	-4.352468761e-04f, -4.709806333e-04f, -4.229565064e-04f, -3.319706804e-04f,
+	-2.300804429e-04f, -1.383482163e-04f, -6.741687625e-05f, -1.979056196e-05f,
+	 7.249485749e-06f,  1.890750475e-05f,  2.079020039e-05f,  1.763680389e-05f,
+	 1.278660023e-05f,  8.179882534e-06f,  4.655910629e-06f,  2.346150544e-06f,
+	 1.028419444e-06f,  3.781538700e-07f,  1.080425633e-07f,  1.951867193e-08f,
+};
+
+const int HALF_TAPS = 24;
+const float HALF_COEF[HALF_TAPS] =
+{
+	-6.141295056e-05f,  5.882074134e-05f,  9.111040781e-04f,  5.236058178e-05f,
+	-5.241115457e-03f, -2.381422490e-03f,  1.884723029e-02f,  1.388938990e-02f,
+	-5.250263890e-02f, -5.636183442e-02f,  1.550169773e-01f,  4.277725413e-01f,
+	 4.277725413e-01f,  1.550169773e-01f, -5.636183442e-02f, -5.250263890e-02f,
+	 1.388938990e-02f,  1.884723029e-02f, -2.381422490e-03f, -5.241115457e-03f,
+	 5.236058178e-05f,  9.111040781e-04f,  5.882074134e-05f, -6.141295056e-05f,
+};
+
+const int FINAL_TAPS = 80;
+const float FINAL_COEF[FINAL_TAPS] =
+{
+	 1.292958622e-06f,  4.573467591e-06f,  1.469905714e-06f, -1.393697412e-05f,
+	-1.239455771e-05f,  3.236183152e-05f,  4.317563699e-05f, -6.232958118e-05f,
+	-1.126149685e-04f,  1.041003663e-04f,  2.493625789e-04f, -1.528413734e-04f,
+	-4.938033042e-04f,  1.950908745e-04f,  8.992616482e-04f, -2.045530436e-04f,
+	-1.532426000e-03f,  1.373933461e-04f,  2.473105437e-03f,  7.288558771e-05f,
+	-3.814069973e-03f, -5.213614250e-04f,  5.662599670e-03f,  1.339805515e-03f,
+	-8.146972393e-03f, -2.710596921e-03f,  1.143449787e-02f,  4.895335589e-03f,
+	-1.577573998e-02f, -8.300725284e-03f,  2.161262760e-02f,  1.364623510e-02f,
+	-2.986654770e-02f, -2.245523082e-02f,  4.285791045e-02f,  3.887595660e-02f,
+	-6.837096469e-02f, -8.027269921e-02f,  1.561927078e-01f,  4.420880584e-01f,
+	 4.420880584e-01f,  1.561927078e-01f, -8.027269921e-02f, -6.837096469e-02f,
+	 3.887595660e-02f,  4.285791045e-02f, -2.245523082e-02f, -2.986654770e-02f,
+	 1.364623510e-02f,  2.161262760e-02f, -8.300725284e-03f, -1.577573998e-02f,
+	 4.895335589e-03f,  1.143449787e-02f, -2.710596921e-03f, -8.146972393e-03f,
+	 1.339805515e-03f,  5.662599670e-03f, -5.213614250e-04f, -3.814069973e-03f,
+	 7.288558771e-05f,  2.473105437e-03f,  1.373933461e-04f, -1.532426000e-03f,
+	-2.045530436e-04f,  8.992616482e-04f,  1.950908745e-04f, -4.938033042e-04f,
+	-1.528413734e-04f,  2.493625789e-04f,  1.041003663e-04f, -1.126149685e-04f,
+	-6.232958118e-05f,  4.317563699e-05f,  3.236183152e-05f, -1.239455771e-05f,
+	-1.393697412e-05f,  1.469905714e-06f,  4.573467591e-06f,  1.292958622e-06f,
+};
+
+// 1段目のタップ数（バイト単位）
+const int STAGE1_BYTES = STAGE1_TAPS / 8;
+
+// 1段目のテーブルの１行（前後に3要素ずつ0を置き、4出力分をまとめて読めるようにする）
+const int TABLE_PAD = 3;
+const int TABLE_ROW = STAGE1_BYTES + TABLE_PAD * 2;
+
+// 無音のDSDパターン
+const BYTE DSD_SILENCE = 0x69;
+
+// 24bitの倍率と範囲
+const float INT24_SCALE = 8388608.0f;
+const float INT24_MAX = 8388607.0f;
+const float INT24_MIN = -8388608.0f;
+
+//-----------------------------------------------------------------------------
+// 内積
+//-----------------------------------------------------------------------------
+inline float Dot(const float* data, const float* coef, int taps)
+{
+	__m128 sum0 = _mm_setzero_ps();
+	__m128 sum1 = _mm_setzero_ps();
+
+	int i = 0;
+	for (; i + 8 <= taps; i += 8) {
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(data + i), _mm_loadu_ps(coef + i)));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(data + i + 4), _mm_loadu_ps(coef + i + 4)));
+	}
+
+	if (i < taps) {
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(data + i), _mm_loadu_ps(coef + i)));
+	}
+
+	sum0 = _mm_add_ps(sum0, sum1);
+	sum0 = _mm_add_ps(sum0, _mm_movehl_ps(sum0, sum0));
+	sum0 = _mm_add_ss(sum0, _mm_shuffle_ps(sum0, sum0, 1));
+	return _mm_cvtss_f32(sum0);
+}
+
+} //namespace
+
+
+//-----------------------------------------------------------------------------
+// コンストラクタ
+//-----------------------------------------------------------------------------
+DsdDecoder::DsdDecoder()
+	: m_channels(0)
+	, m_num_stages(0)
+	, m_sample_rate(0)
+	, m_memory(NULL)
+	, m_table(NULL)
+	, m_work(NULL)
+	, m_input(NULL)
+{
+}
+
+//-----------------------------------------------------------------------------
+// デストラクタ
+//-----------------------------------------------------------------------------
+DsdDecoder::~DsdDecoder()
+{
+	Release();
+}
+
+//-----------------------------------------------------------------------------
+// 初期化
+//-----------------------------------------------------------------------------
+bool DsdDecoder::Init(int channels, DWORD dsd_rate, bool lsb_first)
+{
+	Release();
+
+	if (channels <= 0 || MAX_CHANNELS < channels) {
+		return false;
+	}
+
+	// 1/2間引きは最低2段、出力が192kHz以下になるまで重ねる
+	DWORD sample_rate = dsd_rate / 8;
+	int num_stages = 0;
+	while (num_stages < 2 || 192000 < sample_rate) {
+		if (num_stages == MAX_STAGES || (sample_rate & 1) != 0) {
+			return false;
+		}
+
+		sample_rate /= 2;
+		++num_stages;
+	}
+
+	// 必要なメモリをまとめて確保する
+	DWORD floats = 256 * TABLE_ROW + MAX_BYTES;
+	for (int i = 0; i < num_stages; ++i) {
+		int taps = (i + 1 < num_stages)? HALF_TAPS : FINAL_TAPS;
+		floats += channels * (taps - 1 + (MAX_BYTES >> i));
+	}
+
+	DWORD bytes = floats * sizeof(float) + (MAX_BYTES + STAGE1_BYTES) + channels * STAGE1_BYTES;
+	m_memory = static_cast<BYTE*>(HeapAlloc(GetProcessHeap(), 0, bytes));
+	if (!m_memory) {
+		return false;
+	}
+
+	float* ptr = reinterpret_cast<float*>(m_memory);
+	m_table = ptr;
+	ptr += 256 * TABLE_ROW;
+	m_work = ptr;
+	ptr += MAX_BYTES;
+
+	for (int i = 0; i < num_stages; ++i) {
+		HalfStage& stage = m_stages[i];
+		if (i + 1 < num_stages) {
+			stage.coef = HALF_COEF;
+			stage.taps = HALF_TAPS;
+		}
+		else {
+			stage.coef = FINAL_COEF;
+			stage.taps = FINAL_TAPS;
+		}
+
+		for (int ch = 0; ch < channels; ++ch) {
+			stage.history[ch] = ptr;
+			ptr += stage.taps - 1 + (MAX_BYTES >> i);
+		}
+	}
+
+	BYTE* byte_ptr = reinterpret_cast<BYTE*>(ptr);
+	m_input = byte_ptr;
+	byte_ptr += MAX_BYTES + STAGE1_BYTES;
+
+	for (int ch = 0; ch < channels; ++ch) {
+		m_history[ch] = byte_ptr;
+		byte_ptr += STAGE1_BYTES;
+	}
+
+	// 1段目のテーブル、バイトbが出力のk個前に入力された時の寄与をrow[k + TABLE_PAD]に置く
+	// ・バイト内のj番目(時間順)のビットは、係数[8k + 7 - j]に掛かる
+	for (int b = 0; b < 256; ++b) {
+		float* row = &m_table[b * TABLE_ROW];
+		ZeroMemory(row, TABLE_ROW * sizeof(float));
+
+		for (int k = 0; k < STAGE1_BYTES; ++k) {
+			float sum = 0.0f;
+			for (int j = 0; j < 8; ++j) {
+				int bit = lsb_first? ((b >> j) & 1) : ((b >> (7 - j)) & 1);
+				float coef = STAGE1_COEF[8 * k + 7 - j];
+				sum += bit? coef : -coef;
+			}
+
+			row[k + TABLE_PAD] = sum;
+		}
+	}
+
+	m_channels = channels;
+	m_num_stages = num_stages;
+	m_sample_rate = sample_rate;
+
+	Reset();
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// 解放
+//-----------------------------------------------------------------------------
+void DsdDecoder::Release()
+{
+	if (m_memory) {
+		HeapFree(GetProcessHeap(), 0, m_memory);
+		m_memory = NULL;
+	}
+
+	m_channels = 0;
+	m_num_stages = 0;
+	m_sample_rate = 0;
+	m_table = NULL;
+	m_work = NULL;
+	m_input = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// フィルタの状態を初期化する
+//-----------------------------------------------------------------------------
+void DsdDecoder::Reset()
+{
+	for (int ch = 0; ch < m_channels; ++ch) {
+		FillMemory(m_history[ch], STAGE1_BYTES, DSD_SILENCE);
+
+		for (int i = 0; i < m_num_stages; ++i) {
+			ZeroMemory(m_stages[i].history[ch], (m_stages[i].taps - 1) * sizeof(float));
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// 出力のサンプリング周波数
+//-----------------------------------------------------------------------------
+DWORD DsdDecoder::GetSampleRate() const
+{
+	return m_sample_rate;
+}
+
+//-----------------------------------------------------------------------------
+// 出力１フレームに必要なバイト数
+//-----------------------------------------------------------------------------
+int DsdDecoder::GetBytesPerFrame() const
+{
+	return 1 << m_num_stages;
+}
+
+//-----------------------------------------------------------------------------
+// 変換
+//-----------------------------------------------------------------------------
+int DsdDecoder::Process(const BYTE* const* src, int bytes, BYTE* dest)
+{
+	if (bytes > MAX_BYTES) {
+		bytes = MAX_BYTES;
+	}
+
+	bytes -= bytes % GetBytesPerFrame();
+
+	int count = 0;
+	for (int ch = 0; ch < m_channels; ++ch) {
+		// 直前のバイトに続けて、今回のバイトを並べる
+		const int history = STAGE1_BYTES - 1;
+		CopyMemory(m_input, m_history[ch], history);
+		CopyMemory(m_input + history, src[ch], bytes);
+		CopyMemory(m_history[ch], m_input + bytes, history);
+
+		// 1段目：４出力分をレジスタ上で足し込む
+		// ・出力nには、入力m_input[n]～m_input[n + history]が掛かる
+		for (int n = 0; n < bytes; n += 4) {
+			const BYTE* input = &m_input[n];
+			__m128 sum = _mm_setzero_ps();
+
+			for (int j = 0; j < STAGE1_BYTES + 3; ++j) {
+				const float* row = &m_table[input[j] * TABLE_ROW];
+				sum = _mm_add_ps(sum, _mm_loadu_ps(row + (STAGE1_BYTES + 2 - j)));
+			}
+
+			_mm_storeu_ps(&m_work[n], sum);
+		}
+
+		// 以降は1/2ずつ間引く
+		count = bytes;
+		for (int i = 0; i < m_num_stages; ++i) {
+			Decimate(m_stages[i], ch, m_work, count);
+			count /= 2;
+		}
+
+		Store(m_work, count, ch, dest);
+	}
+
+	return count;
+}
+
+//-----------------------------------------------------------------------------
+// 1/2間引き（dataに上書きする）
+//-----------------------------------------------------------------------------
+void DsdDecoder::Decimate(HalfStage& stage, int ch, float* data, int count)
+{
+	float* history = stage.history[ch];
+	const int taps = stage.taps;
+
+	CopyMemory(history + taps - 1, data, count * sizeof(float));
+
+	for (int i = 0; i < count / 2; ++i) {
+		data[i] = Dot(history + i * 2, stage.coef, taps);
+	}
+
+	MoveMemory(history, history + count, (taps - 1) * sizeof(float));
+}
+
+//-----------------------------------------------------------------------------
+// 24bitに変換して、インターリーブで書き込む
+//-----------------------------------------------------------------------------
+void DsdDecoder::Store(const float* data, int count, int ch, BYTE* dest) const
+{
+	const int frame_bytes = m_channels * 3;
+	BYTE* out = dest + ch * 3;
+
+	const __m128 scale = _mm_set1_ps(INT24_SCALE);
+	const __m128 max_value = _mm_set1_ps(INT24_MAX);
+	const __m128 min_value = _mm_set1_ps(INT24_MIN);
+
+	for (int i = 0; i < count; i += 4) {
+		__m128 value = _mm_mul_ps(_mm_loadu_ps(data + i), scale);
+		value = _mm_max_ps(_mm_min_ps(value, max_value), min_value);
+		__m128i sample = _mm_cvtps_epi32(value);
+
+		int num = (count - i < 4)? (count - i) : 4;
+		for (int j = 0; j < num; ++j) {
+			int s = _mm_cvtsi128_si32(sample);
+			sample = _mm_srli_si128(sample, 4);
+
+			out[0] = static_cast<BYTE>(s);
+			out[1] = static_cast<BYTE>(s >> 8);
+			out[2] = static_cast<BYTE>(s >> 16);
+			out += frame_bytes;
+		}
+	}
+}
@@ -0,0 +1,71 @@
+﻿//=============================================================================
+// DSD→PCM変換
+//=============================================================================
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+
+//-----------------------------------------------------------------------------
+// DSD→PCM変換
+// ・1段目でバイト単位のテーブルを使って1/8に間引き、以降は1/2ずつ間引く。
+// ・出力は、DSD64で88.2kHz、DSD128以上で176.4kHzの24bit PCMとなる。
+//-----------------------------------------------------------------------------
+class DsdDecoder
+{
+public:
+	// 対応する最大チャンネル数
+	static const int MAX_CHANNELS = 8;
+
+	// Process()に一度に渡せる、チャンネル毎の最大バイト数
+	static const int MAX_BYTES = 4096;
+
+public:
+	DsdDecoder();
+	~DsdDecoder();
+
+	// dsd_rateは１bitのサンプリング周波数、lsb_firstはバイト内で時間的に先のビットが下位側か
+	bool Init(int channels, DWORD dsd_rate, bool lsb_first);
+	void Release();
+
+	// フィルタの状態を初期化する（シーク時）
+	void Reset();
+
+	// 出力のサンプリング周波数
+	DWORD GetSampleRate() const;
+
+	// 出力１フレームに必要な、チャンネル毎のDSDバイト数
+	int GetBytesPerFrame() const;
+
+	// チャンネル毎のDSDデータ(bytesはGetBytesPerFrame()の倍数)を、
+	// 24bit PCM(インターリーブ)に変換し、出力したフレーム数を返す
+	int Process(const BYTE* const* src, int bytes, BYTE* dest);
+
+private:
+	// 1/2間引きの段
+	struct HalfStage
+	{
+		const float*	coef;
+		int				taps;
+		float*			history[MAX_CHANNELS];	// 直前の入力(taps-1)＋今回の入力
+	};
+
+	// 1/2間引きの最大段数
+	static const int MAX_STAGES = 4;
+
+private:
+	void Decimate(HalfStage& stage, int ch, float* data, int count);
+	void Store(const float* data, int count, int ch, BYTE* dest) const;
+
+private:
+	int			m_channels;
+	int			m_num_stages;
+	DWORD		m_sample_rate;
+	BYTE*		m_memory;
+	float*		m_table;						// 1段目のバイト→係数テーブル
+	float*		m_work;							// 1段目以降の作業領域
+	BYTE*		m_input;						// 1段目の入力（直前のバイト＋今回のバイト）
+	BYTE*		m_history[MAX_CHANNELS];		// 1段目の直前のバイト
+	HalfStage	m_stages[MAX_STAGES];
+};
@@ -0,0 +1,340 @@
+﻿//=============================================================================
+// DSF読み取り
+//=============================================================================
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include <mmsystem.h>
+#include <mmreg.h>
+#include "dsf_reader.h"
+
+namespace {
+
+// DSDチャンク、fmtチャンク、dataチャンクのヘッダまでのバイト数
+const DWORD DSD_CHUNK_SIZE = 28;
+const DWORD FMT_CHUNK_SIZE = 52;
+const DWORD DATA_HEADER_SIZE = 12;
+const DWORD HEADER_SIZE = DSD_CHUNK_SIZE + FMT_CHUNK_SIZE + DATA_HEADER_SIZE;
+
+// シーク時、フィルタを落ち着かせるために手前から変換するバイト数
+const DWORD PREROLL_BYTES = 512;
+
+//-----------------------------------------------------------------------------
+// リトルエンディアンの値を取得する
+//-----------------------------------------------------------------------------
+DWORD GetInt32(const BYTE* data)
+{
+	return *reinterpret_cast<const DWORD*>(data);
+}
+
+//-----------------------------------------------------------------------------
+// 64bitのビット数を、バイト数に変換する（4GB以上は対応しない）
+//-----------------------------------------------------------------------------
+DWORD GetBytesFromBits(const BYTE* data)
+{
+	DWORD lo = GetInt32(&data[0]);
+	DWORD hi = GetInt32(&data[4]);
+	if (hi >= 8) {
+		return 0;
+	}
+
+	return (lo >> 3) | (hi << 29);
+}
+
+//-----------------------------------------------------------------------------
+// .dsfを開く
+//-----------------------------------------------------------------------------
+bool OpenSource(FileStream& file, const wchar_t* path, BYTE* header)
+{
+	if (!file.Open(path)) {
+		return false;
+	}
+
+	// ヘッダは固定長なので、まとめて読む
+	if (file.Read(header, HEADER_SIZE) != HEADER_SIZE) {
+		file.Close();
+		return false;
+	}
+
+	if (*reinterpret_cast<const FOURCC*>(&header[0]) != mmioFOURCC('D', 'S', 'D', ' ') ||
+		GetInt32(&header[4]) != DSD_CHUNK_SIZE) {
+		file.Close();
+		return false;
+	}
+
+	const BYTE* fmt = &header[DSD_CHUNK_SIZE];
+	if (*reinterpret_cast<const FOURCC*>(&fmt[0]) != mmioFOURCC('f', 'm', 't', ' ') ||
+		GetInt32(&fmt[4]) != FMT_CHUNK_SIZE) {
+		file.Close();
+		return false;
+	}
+
+	const BYTE* data = &header[DSD_CHUNK_SIZE + FMT_CHUNK_SIZE];
+	if (*reinterpret_cast<const FOURCC*>(&data[0]) != mmioFOURCC('d', 'a', 't', 'a')) {
+		file.Close();
+		return false;
+	}
+
+	return true;
+}
+
+} //namespace
+
+
+//-----------------------------------------------------------------------------
+// 解析
+//-----------------------------------------------------------------------------
+bool DsfReader::Parse(const wchar_t* path, Metadata* meta)
+{
+	DsfReader reader;
+	if (!reader.Open(path)) {
+		return false;
+	}
+
+	meta->duration = MulDiv(reader.m_bytes, 8000, reader.m_dsd_rate);
+	meta->seekable = true;
+
+	wsprintf(meta->extra, L"DSF, DSD%d, %d ch -> %d Hz, 24 bit",
+		reader.m_dsd_rate / 44100, reader.m_format.nChannels, reader.m_format.nSamplesPerSec);
+
+	reader.Close();
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// コンストラクタ
+//-----------------------------------------------------------------------------
+DsfReader::DsfReader()
+	: m_file()
+	, m_format()
+	, m_decoder()
+	, m_dsd_rate(0)
+	, m_fptr(0)
+	, m_bytes(0)
+	, m_block_size(0)
+	, m_block_pos(0)
+	, m_block_len(0)
+	, m_block(NULL)
+	, m_temp(NULL)
+{
+}
+
+//-----------------------------------------------------------------------------
+// デストラクタ
+//-----------------------------------------------------------------------------
+DsfReader::~DsfReader()
+{
+	Close();
+}
+
+//-----------------------------------------------------------------------------
+// 開く
+//-----------------------------------------------------------------------------
+bool DsfReader::Open(const wchar_t* path)
+{
+	BYTE header[HEADER_SIZE];
+	FileStream& file = m_file;
+	if (!OpenSource(file, path, header)) {
+		return false;
+	}
+
+	const BYTE* fmt = &header[DSD_CHUNK_SIZE];
+	DWORD format_id = GetInt32(&fmt[16]);
+	DWORD num_channels = GetInt32(&fmt[24]);
+	DWORD sample_rate = GetInt32(&fmt[28]);
+	DWORD sample_bits = GetInt32(&fmt[32]);
+	DWORD bytes = GetBytesFromBits(&fmt[36]);
+	DWORD block_size = GetInt32(&fmt[44]);
+
+	// DSD rawのみ対応、sample_bitsが1ならLSBが先、8ならMSBが先
+	if (format_id != 0 || (sample_bits != 1 && sample_bits != 8) || bytes == 0 || block_size == 0) {
+		Close();
+		return false;
+	}
+
+	// ブロックの途中で、出力フレームが分かれないこと
+	if (!m_decoder.Init(num_channels, sample_rate, (sample_bits == 1)) ||
+		(block_size % m_decoder.GetBytesPerFrame()) != 0) {
+		Close();
+		return false;
+	}
+
+	m_block = static_cast<BYTE*>(HeapAlloc(GetProcessHeap(), 0, block_size * num_channels));
+	if (!m_block) {
+		Close();
+		return false;
+	}
+
+	m_format.wFormatTag			= WAVE_FORMAT_PCM;
+	m_format.nChannels			= static_cast<WORD>(num_channels);
+	m_format.nSamplesPerSec		= m_decoder.GetSampleRate();
+	m_format.wBitsPerSample		= 24;
+	m_format.nBlockAlign		= m_format.nChannels * m_format.wBitsPerSample / 8;
+	m_format.nAvgBytesPerSec	= m_format.nSamplesPerSec * m_format.nBlockAlign;
+	m_format.cbSize				= 0;
+
+	m_temp = static_cast<BYTE*>(HeapAlloc(GetProcessHeap(), 0,
+		(PREROLL_BYTES / m_decoder.GetBytesPerFrame()) * m_format.nBlockAlign));
+	if (!m_temp) {
+		Close();
+		return false;
+	}
+
+	m_dsd_rate = sample_rate;
+	m_fptr = HEADER_SIZE;
+	m_bytes = bytes;
+	m_block_size = block_size;
+
+	file.Seek(m_fptr);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// 閉じる
+//-----------------------------------------------------------------------------
+void DsfReader::Close()
+{
+	m_file.Close();
+
+	if (m_block) {
+		HeapFree(GetProcessHeap(), 0, m_block);
+		m_block = NULL;
+	}
+
+	if (m_temp) {
+		HeapFree(GetProcessHeap(), 0, m_temp);
+		m_temp = NULL;
+	}
+
+	m_decoder.Release();
+	m_pos = 0;
+	m_sample = 0;
+	m_block_pos = 0;
+	m_block_len = 0;
+}
+
+//-----------------------------------------------------------------------------
+// フォーマット取得
+//-----------------------------------------------------------------------------
+const WAVEFORMATEX& DsfReader::GetFormat() const
+{
+	return m_format;
+}
+
+//-----------------------------------------------------------------------------
+// 読み取り
+//-----------------------------------------------------------------------------
+int DsfReader::Read(void* buffer, int size)
+{
+	const DWORD bytes_per_frame = m_decoder.GetBytesPerFrame();
+
+	DWORD bytes = (size / m_format.nBlockAlign) * bytes_per_frame;
+	if (bytes > m_bytes - m_pos) {
+		bytes = m_bytes - m_pos;
+		bytes -= bytes % bytes_per_frame;
+	}
+
+	return Decode(static_cast<BYTE*>(buffer), bytes) * m_format.nBlockAlign;
+}
+
+//-----------------------------------------------------------------------------
+// シーク
+//-----------------------------------------------------------------------------
+DWORD DsfReader::SeekSample(DWORD sample)
+{
+	const DWORD bytes_per_frame = m_decoder.GetBytesPerFrame();
+
+	DWORD samples = m_bytes / bytes_per_frame;
+	if (sample > samples) {
+		sample = samples;
+	}
+
+	DWORD target = sample * bytes_per_frame;
+
+	// 少し手前のブロックから読み直す
+	DWORD start = (target > PREROLL_BYTES)? (target - PREROLL_BYTES) : 0;
+	DWORD block = start / m_block_size;
+
+	DWORD fp = m_fptr + block * m_block_size * m_format.nChannels;
+	m_file.Seek(fp);
+
+	m_pos = block * m_block_size;
+	m_block_pos = 0;
+	m_block_len = 0;
+	m_decoder.Reset();
+
+	if (!ReadBlock()) {
+		return 0;
+	}
+
+	m_block_pos = start - m_pos;
+	m_pos = start;
+
+	// 手前の分は、変換して捨てる
+	Decode(m_temp, target - start);
+	return m_sample;
+}
+
+//-----------------------------------------------------------------------------
+// 変換
+//-----------------------------------------------------------------------------
+int DsfReader::Decode(BYTE* dest, DWORD bytes)
+{
+	const DWORD bytes_per_frame = m_decoder.GetBytesPerFrame();
+	const int channels = m_format.nChannels;
+
+	int frames = 0;
+	while (0 < bytes) {
+		if (m_block_pos >= m_block_len && !ReadBlock()) {
+			break;
+		}
+
+		DWORD count = m_block_len - m_block_pos;
+		count = (count > bytes)? bytes : count;
+		count = (count > DsdDecoder::MAX_BYTES)? DsdDecoder::MAX_BYTES : count;
+		count -= count % bytes_per_frame;
+		if (count == 0) {
+			break;
+		}
+
+		// ブロック内は、チャンネル毎にblock_sizeずつ並んでいる
+		const BYTE* src[DsdDecoder::MAX_CHANNELS];
+		for (int ch = 0; ch < channels; ++ch) {
+			src[ch] = &m_block[ch * m_block_size + m_block_pos];
+		}
+
+		frames += m_decoder.Process(src, count, dest + frames * m_format.nBlockAlign);
+		m_block_pos += count;
+		m_pos += count;
+		bytes -= count;
+	}
+
+	// DSDでは、m_posはチャンネル毎のバイト数
+	m_sample = m_pos / bytes_per_frame;
+	return frames;
+}
+
+//-----------------------------------------------------------------------------
+// 次のブロックを読み込む
+//-----------------------------------------------------------------------------
+bool DsfReader::ReadBlock()
+{
+	if (m_pos >= m_bytes) {
+		return false;
+	}
+
+	DWORD size = m_block_size * m_format.nChannels;
+	if (m_file.Read(m_block, size) != size) {
+		return false;
+	}
+
+	// 最後のブロックは、後ろが埋め草になっている
+	m_block_pos = 0;
+	m_block_len = m_bytes - m_pos;
+	if (m_block_len > m_block_size) {
+		m_block_len = m_block_size;
+	}
+
+	return true;
+}
@@ -0,0 +1,50 @@
+﻿//=============================================================================
+// DSF読み取り
+//=============================================================================
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include "luna_pi.h"
+#include "file_stream.h"
+#include "reader.h"
+#include "dsd_decoder.h"
+
+//-----------------------------------------------------------------------------
+// DSF読み取り
+//-----------------------------------------------------------------------------
+class DsfReader : public Reader
+{
+public:
+	static bool Parse(const wchar_t* path, Metadata* meta);
+
+public:
+	DsfReader();
+	virtual ~DsfReader();
+
+	virtual bool Open(const wchar_t* path);
+	virtual void Close();
+
+	virtual const WAVEFORMATEX& GetFormat() const;
+
+	virtual int Read(void* buffer, int length);
+	virtual DWORD SeekSample(DWORD sample);
+
+private:
+	int Decode(BYTE* dest, DWORD bytes);
+	bool ReadBlock();
+
+private:
+	FileStream		m_file;
+	WAVEFORMATEX	m_format;
+	DsdDecoder		m_decoder;
+	DWORD			m_dsd_rate;		// DSDのサンプリング周波数
+	DWORD			m_fptr;			// データの先頭位置
+	DWORD			m_bytes;		// チャンネル毎のDSDバイト数
+	DWORD			m_block_size;	// チャンネル毎のブロックサイズ
+	DWORD			m_block_pos;	// ブロック内の変換済みバイト数
+	DWORD			m_block_len;	// ブロック内の有効なバイト数
+	BYTE*			m_block;		// ブロック（チャンネル毎に並ぶ）
+	BYTE*			m_temp;			// シーク時の読み捨て用
+};
@@ -0,0 +1,153 @@
+﻿//=============================================================================
+// 浮動小数点PCM変換
+// ・CRTなしでビルドするため、スカラー部分もSSE2の組込み関数で変換する。
+//   （キャストで変換すると、_ftol2が必要になる）
+//=============================================================================
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include <emmintrin.h>
+#include "float_pcm.h"
+
+namespace {
+
+// ±1.0を32bit整数に合わせる倍率
+const float FLOAT_SCALE = 2147483648.0f;
+const double DOUBLE_SCALE = 2147483648.0;
+
+// doubleの変換時の上限
+const double DOUBLE_LIMIT = 2147483647.0;
+
+// 32bit整数を±1.0に合わせる倍率
+const float INT32_TO_FLOAT = 1.0f / 2147483648.0f;
+
+//-----------------------------------------------------------------------------
+// 32bit単位のバイトスワップ
+//-----------------------------------------------------------------------------
+inline __m128i Swap32(__m128i value)
+{
+	value = _mm_shufflelo_epi16(value, _MM_SHUFFLE(2, 3, 0, 1));
+	value = _mm_shufflehi_epi16(value, _MM_SHUFFLE(2, 3, 0, 1));
+	return _mm_or_si128(_mm_slli_epi16(value, 8), _mm_srli_epi16(value, 8));
+}
+
+//-----------------------------------------------------------------------------
+// 64bit単位のバイトスワップ
+//-----------------------------------------------------------------------------
+inline __m128i Swap64(__m128i value)
+{
+	return Swap32(_mm_shuffle_epi32(value, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+//-----------------------------------------------------------------------------
+// floatを４つずつ変換する
+//-----------------------------------------------------------------------------
+inline __m128i ConvertFloat(__m128i bits, bool big_endian)
+{
+	if (big_endian) {
+		bits = Swap32(bits);
+	}
+
+	// 範囲外は0x80000000になるので、上限を超えた分だけ反転して0x7FFFFFFFにする
+	__m128 scale = _mm_set1_ps(FLOAT_SCALE);
+	__m128 value = _mm_mul_ps(_mm_castsi128_ps(bits), scale);
+	__m128i over = _mm_castps_si128(_mm_cmpge_ps(value, scale));
+	return _mm_xor_si128(_mm_cvtps_epi32(value), over);
+}
+
+//-----------------------------------------------------------------------------
+// doubleを２つずつ変換する（結果は下位64bit）
+//-----------------------------------------------------------------------------
+inline __m128i ConvertDouble(__m128i bits, bool big_endian)
+{
+	if (big_endian) {
+		bits = Swap64(bits);
+	}
+
+	__m128d value = _mm_mul_pd(_mm_castsi128_pd(bits), _mm_set1_pd(DOUBLE_SCALE));
+	value = _mm_min_pd(value, _mm_set1_pd(DOUBLE_LIMIT));
+	return _mm_cvtpd_epi32(value);
+}
+
+} //namespace
+
+
+//-----------------------------------------------------------------------------
+// 32bit float変換
+//-----------------------------------------------------------------------------
+void Float32ToInt32(const BYTE* src, int* dest, int count, bool big_endian)
+{
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+		__m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4 + 16));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), ConvertFloat(v0, big_endian));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i + 4), ConvertFloat(v1, big_endian));
+	}
+
+	for (; i < count; ++i) {
+		__m128i v = _mm_cvtsi32_si128(*reinterpret_cast<const int*>(src + i * 4));
+		dest[i] = _mm_cvtsi128_si32(ConvertFloat(v, big_endian));
+	}
+}
+
+//-----------------------------------------------------------------------------
+// 64bit float変換
+//-----------------------------------------------------------------------------
+void Float64ToInt32(const BYTE* src, int* dest, int count, bool big_endian)
+{
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 8));
+		__m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 8 + 16));
+
+		__m128i value = _mm_unpacklo_epi64(ConvertDouble(v0, big_endian), ConvertDouble(v1, big_endian));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), value);
+	}
+
+	for (; i < count; ++i) {
+		__m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i * 8));
+		dest[i] = _mm_cvtsi128_si32(ConvertDouble(v, big_endian));
+	}
+}
+
+//-----------------------------------------------------------------------------
+// 整数PCMからfloatへの変換
+// ・上位ビットに詰めて32bit整数にしてから、倍率を掛ける。
+//   （整数からfloatへの変換はCRTが不要）
+//-----------------------------------------------------------------------------
+void PcmToFloat(const BYTE* src, int bits, int channels, int frames, float* const planes[], int offset)
+{
+	for (int ch = 0; ch < channels; ++ch) {
+		float* dest = planes[ch] + offset;
+
+		if (bits == 8) {
+			const BYTE* p = src + ch;
+			for (int i = 0; i < frames; ++i, p += channels) {
+				dest[i] = static_cast<float>((p[0] - 128) << 24) * INT32_TO_FLOAT;
+			}
+		}
+		else if (bits == 16) {
+			const short* p = reinterpret_cast<const short*>(src) + ch;
+			for (int i = 0; i < frames; ++i, p += channels) {
+				dest[i] = static_cast<float>(p[0] << 16) * INT32_TO_FLOAT;
+			}
+		}
+		else if (bits == 24) {
+			const BYTE* p = src + ch * 3;
+			const int step = channels * 3;
+			for (int i = 0; i < frames; ++i, p += step) {
+				int value = (p[0] << 8) | (p[1] << 16) | (p[2] << 24);
+				dest[i] = static_cast<float>(value) * INT32_TO_FLOAT;
+			}
+		}
+		else if (bits == 32) {
+			const int* p = reinterpret_cast<const int*>(src) + ch;
+			for (int i = 0; i < frames; ++i, p += channels) {
+				dest[i] = static_cast<float>(p[0]) * INT32_TO_FLOAT;
+			}
+		}
+	}
+}
@@ -0,0 +1,28 @@
+﻿//=============================================================================
+// 浮動小数点PCM変換
+//=============================================================================
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+
+//-----------------------------------------------------------------------------
+// 32bit floatを32bit整数PCMに変換する
+// ・±1.0を整数の最大値に合わせ、範囲外はクリップする。
+// ・srcとdestは同じ位置でもよい。
+//-----------------------------------------------------------------------------
+void Float32ToInt32(const BYTE* src, int* dest, int count, bool big_endian);
+
+//-----------------------------------------------------------------------------
+// 64bit floatを32bit整数PCMに変換する
+// ・srcとdestは同じ先頭位置でもよい（前から詰めて書き込む）。
+//-----------------------------------------------------------------------------
+void Float64ToInt32(const BYTE* src, int* dest, int count, bool big_endian);
+
+//-----------------------------------------------------------------------------
+// 整数PCMを、チャンネル毎のfloatに変換する
+// ・8bitは符号なし、それ以外は符号付き（リトルエンディアン）として扱う。
+// ・planes[ch]のoffsetの位置から書き込む。
+//-----------------------------------------------------------------------------
+void PcmToFloat(const BYTE* src, int bits, int channels, int frames, float* const planes[], int offset);
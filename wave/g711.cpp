@@ -0,0 +1,241 @@
+﻿//=============================================================================
+// G.711(μ-law/A-law)展開
+//=============================================================================
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include <intrin.h>
+#include <tmmintrin.h>
+#include "g711.h"
+
+namespace {
+
+//-----------------------------------------------------------------------------
+// μ-law展開テーブル
+//-----------------------------------------------------------------------------
+const short MULAW_TABLE[256] =
+{
+	-32124, -31100, -30076, -29052, -28028, -27004, -25980, -24956,
+	-23932, -22908, -21884, -20860, -19836, -18812, -17788, -16764,
+	-15996, -15484, -14972, -14460, -13948, -13436, -12924, -12412,
+	-11900, -11388, -10876, -10364,  -9852,  -9340,  -8828,  -8316,
+	 -7932,  -7676,  -7420,  -7164,  -6908,  -6652,  -6396,  -6140,
+	 -5884,  -5628,  -5372,  -5116,  -4860,  -4604,  -4348,  -4092,
+	 -3900,  -3772,  -3644,  -3516,  -3388,  -3260,  -3132,  -3004,
+	 -2876,  -2748,  -2620,  -2492,  -2364,  -2236,  -2108,  -1980,
+	 -1884,  -1820,  -1756,  -1692,  -1628,  -1564,  -1500,  -1436,
+	 -1372,  -1308,  -1244,  -1180,  -1116,  -1052,   -988,   -924,
+	  -876,   -844,   -812,   -780,   -748,   -716,   -684,   -652,
+	  -620,   -588,   -556,   -524,   -492,   -460,   -428,   -396,
+	  -372,   -356,   -340,   -324,   -308,   -292,   -276,   -260,
+	  -244,   -228,   -212,   -196,   -180,   -164,   -148,   -132,
+	  -120,   -112,   -104,    -96,    -88,    -80,    -72,    -64,
+	   -56,    -48,    -40,    -32,    -24,    -16,     -8,      0,
+	 32124,  31100,  30076,  29052,  28028,  27004,  25980,  24956,
+	 23932,  22908,  21884,  20860,  19836,  18812,  17788,  16764,
+	 15996,  15484,  14972,  14460,  13948,  13436,  12924,  12412,
+	 11900,  11388,  10876,  10364,   9852,   9340,   8828,   8316,
+	  7932,   7676,   7420,   7164,   6908,   6652,   6396,   6140,
+	  5884,   5628,   5372,   5116,   4860,   4604,   4348,   4092,
+	  3900,   3772,   3644,   3516,   3388,   3260,   3132,   3004,
+	  2876,   2748,   2620,   2492,   2364,   2236,   2108,   1980,
+	  1884,   1820,   1756,   1692,   1628,   1564,   1500,   1436,
+	  1372,   1308,   1244,   1180,   1116,   1052,    988,    924,
+	   876,    844,    812,    780,    748,    716,    684,    652,
+	   620,    588,    556,    524,    492,    460,    428,    396,
+	   372,    356,    340,    324,    308,    292,    276,    260,
+	   244,    228,    212,    196,    180,    164,    148,    132,
+	   120,    112,    104,     96,     88,     80,     72,     64,
+	    56,     48,     40,     32,     24,     16,      8,      0,
+};
+
+//-----------------------------------------------------------------------------
+// A-law展開テーブル
+//-----------------------------------------------------------------------------
+const short ALAW_TABLE[256] =
+{
+	 -5504,  -5248,  -6016,  -5760,  -4480,  -4224,  -4992,  -4736,
+	 -7552,  -7296,  -8064,  -7808,  -6528,  -6272,  -7040,  -6784,
+	 -2752,  -2624,  -3008,  -2880,  -2240,  -2112,  -2496,  -2368,
+	 -3776,  -3648,  -4032,  -3904,  -3264,  -3136,  -3520,  -3392,
+	-22016, -20992, -24064, -23040, -17920, -16896, -19968, -18944,
+	-30208, -29184, -32256, -31232, -26112, -25088, -28160, -27136,
+	-11008, -10496, -12032, -11520,  -8960,  -8448,  -9984,  -9472,
+	-15104, -14592, -16128, -15616, -13056, -12544, -14080, -13568,
+	  -344,   -328,   -376,   -360,   -280,   -264,   -312,   -296,
+	  -472,   -456,   -504,   -488,   -408,   -392,   -440,   -424,
+	   -88,    -72,   -120,   -104,    -24,     -8,    -56,    -40,
+	  -216,   -200,   -248,   -232,   -152,   -136,   -184,   -168,
+	 -1376,  -1312,  -1504,  -1440,  -1120,  -1056,  -1248,  -1184,
+	 -1888,  -1824,  -2016,  -1952,  -1632,  -1568,  -1760,  -1696,
+	  -688,   -656,   -752,   -720,   -560,   -528,   -624,   -592,
+	  -944,   -912,  -1008,   -976,   -816,   -784,   -880,   -848,
+	  5504,   5248,   6016,   5760,   4480,   4224,   4992,   4736,
+	  7552,   7296,   8064,   7808,   6528,   6272,   7040,   6784,
+	  2752,   2624,   3008,   2880,   2240,   2112,   2496,   2368,
+	  3776,   3648,   4032,   3904,   3264,   3136,   3520,   3392,
+	 22016,  20992,  24064,  23040,  17920,  16896,  19968,  18944,
+	 30208,  29184,  32256,  31232,  26112,  25088,  28160,  27136,
+	 11008,  10496,  12032,  11520,   8960,   8448,   9984,   9472,
+	 15104,  14592,  16128,  15616,  13056,  12544,  14080,  13568,
+	   344,    328,    376,    360,    280,    264,    312,    296,
+	   472,    456,    504,    488,    408,    392,    440,    424,
+	    88,     72,    120,    104,     24,      8,     56,     40,
+	   216,    200,    248,    232,    152,    136,    184,    168,
+	  1376,   1312,   1504,   1440,   1120,   1056,   1248,   1184,
+	  1888,   1824,   2016,   1952,   1632,   1568,   1760,   1696,
+	   688,    656,    752,    720,    560,    528,    624,    592,
+	   944,    912,   1008,    976,    816,    784,    880,    848,
+};
+
+//-----------------------------------------------------------------------------
+// SSSE3が使えるか？（-1:未確認）
+//-----------------------------------------------------------------------------
+int g_has_ssse3 = -1;
+
+bool HasSSSE3()
+{
+	if (g_has_ssse3 < 0) {
+		int info[4];
+		__cpuid(info, 1);
+		g_has_ssse3 = ((info[2] & (1 << 9)) != 0)? 1 : 0;
+	}
+
+	return (g_has_ssse3 != 0);
+}
+
+//-----------------------------------------------------------------------------
+// テーブル展開
+//-----------------------------------------------------------------------------
+void DecodeTable(const short* table, const BYTE* src, short* dest, int count)
+{
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		short s0 = table[src[i + 0]];
+		short s1 = table[src[i + 1]];
+		short s2 = table[src[i + 2]];
+		short s3 = table[src[i + 3]];
+
+		dest[i + 0] = s0;
+		dest[i + 1] = s1;
+		dest[i + 2] = s2;
+		dest[i + 3] = s3;
+	}
+
+	for (; i < count; ++i) {
+		dest[i] = table[src[i]];
+	}
+}
+
+//-----------------------------------------------------------------------------
+// μ-law展開(SSSE3)、16サンプルずつ処理して、処理したサンプル数を返す
+// ・t = (((mantissa << 3) + 0x84) << exponent) - 0x84、符号ビットが立っていれば負
+// ・1 << exponentは、pshufbで引いて乗算する
+//-----------------------------------------------------------------------------
+int DecodeMuLawSSSE3(const BYTE* src, short* dest, int count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i invert = _mm_set1_epi8(-1);
+	const __m128i mask_07 = _mm_set1_epi8(0x07);
+	const __m128i mask_0f = _mm_set1_epi8(0x0F);
+	const __m128i bias = _mm_set1_epi16(0x84);
+	const __m128i shift_table = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+
+	int i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&src[i]));
+		x = _mm_xor_si128(x, invert);
+
+		__m128i sign = _mm_cmplt_epi8(x, zero);
+		__m128i exponent = _mm_and_si128(_mm_srli_epi16(x, 4), mask_07);
+		__m128i mantissa = _mm_and_si128(x, mask_0f);
+		__m128i scale = _mm_shuffle_epi8(shift_table, exponent);
+
+		__m128i m_lo = _mm_add_epi16(_mm_slli_epi16(_mm_unpacklo_epi8(mantissa, zero), 3), bias);
+		__m128i m_hi = _mm_add_epi16(_mm_slli_epi16(_mm_unpackhi_epi8(mantissa, zero), 3), bias);
+		__m128i t_lo = _mm_sub_epi16(_mm_mullo_epi16(m_lo, _mm_unpacklo_epi8(scale, zero)), bias);
+		__m128i t_hi = _mm_sub_epi16(_mm_mullo_epi16(m_hi, _mm_unpackhi_epi8(scale, zero)), bias);
+
+		__m128i s_lo = _mm_unpacklo_epi8(sign, sign);
+		__m128i s_hi = _mm_unpackhi_epi8(sign, sign);
+		t_lo = _mm_sub_epi16(_mm_xor_si128(t_lo, s_lo), s_lo);
+		t_hi = _mm_sub_epi16(_mm_xor_si128(t_hi, s_hi), s_hi);
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&dest[i + 0]), t_lo);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&dest[i + 8]), t_hi);
+	}
+
+	return i;
+}
+
+//-----------------------------------------------------------------------------
+// A-law展開(SSSE3)、16サンプルずつ処理して、処理したサンプル数を返す
+// ・t = ((mantissa << 4) + (segment? 0x108 : 8)) << (segment? segment - 1 : 0)
+// ・符号ビットが立っていれば正、立っていなければ負
+//-----------------------------------------------------------------------------
+int DecodeALawSSSE3(const BYTE* src, short* dest, int count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i toggle = _mm_set1_epi8(0x55);
+	const __m128i mask_07 = _mm_set1_epi8(0x07);
+	const __m128i mask_0f = _mm_set1_epi8(0x0F);
+	const __m128i shift_table = _mm_setr_epi8(1, 1, 2, 4, 8, 16, 32, 64, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i add_table = _mm_setr_epi8(0, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i base = _mm_set1_epi16(8);
+
+	int i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&src[i]));
+		x = _mm_xor_si128(x, toggle);
+
+		// A-lawは符号ビットが立っている方が正なので、立っていない方を負にする
+		__m128i sign = _mm_cmpgt_epi8(x, _mm_cmpeq_epi8(zero, zero));
+		__m128i segment = _mm_and_si128(_mm_srli_epi16(x, 4), mask_07);
+		__m128i mantissa = _mm_and_si128(x, mask_0f);
+		__m128i scale = _mm_shuffle_epi8(shift_table, segment);
+		__m128i upper = _mm_shuffle_epi8(add_table, segment);
+
+		// (mantissa << 4) + 8 + (segment? 0x100 : 0)
+		__m128i m_lo = _mm_or_si128(_mm_slli_epi16(_mm_unpacklo_epi8(mantissa, zero), 4), _mm_unpacklo_epi8(zero, upper));
+		__m128i m_hi = _mm_or_si128(_mm_slli_epi16(_mm_unpackhi_epi8(mantissa, zero), 4), _mm_unpackhi_epi8(zero, upper));
+		__m128i t_lo = _mm_mullo_epi16(_mm_add_epi16(m_lo, base), _mm_unpacklo_epi8(scale, zero));
+		__m128i t_hi = _mm_mullo_epi16(_mm_add_epi16(m_hi, base), _mm_unpackhi_epi8(scale, zero));
+
+		__m128i s_lo = _mm_unpacklo_epi8(sign, sign);
+		__m128i s_hi = _mm_unpackhi_epi8(sign, sign);
+		t_lo = _mm_sub_epi16(_mm_xor_si128(t_lo, s_lo), s_lo);
+		t_hi = _mm_sub_epi16(_mm_xor_si128(t_hi, s_hi), s_hi);
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&dest[i + 0]), t_lo);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&dest[i + 8]), t_hi);
+	}
+
+	return i;
+}
+
+} //namespace
+
+
+//-----------------------------------------------------------------------------
+// G.711展開
+//-----------------------------------------------------------------------------
+void G711Decode(G711Law law, const BYTE* src, short* dest, int count)
+{
+	int done = 0;
+
+	if (law == G711_MULAW) {
+		if (HasSSSE3()) {
+			done = DecodeMuLawSSSE3(src, dest, count);
+		}
+
+		DecodeTable(MULAW_TABLE, src + done, dest + done, count - done);
+	}
+	else if (law == G711_ALAW) {
+		if (HasSSSE3()) {
+			done = DecodeALawSSSE3(src, dest, count);
+		}
+
+		DecodeTable(ALAW_TABLE, src + done, dest + done, count - done);
+	}
+}
@@ -0,0 +1,24 @@
+﻿//=============================================================================
+// G.711(μ-law/A-law)展開
+//=============================================================================
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+
+//-----------------------------------------------------------------------------
+// G.711の種類
+//-----------------------------------------------------------------------------
+enum G711Law
+{
+	G711_NONE,		// G.711ではない（リニアPCM）
+	G711_MULAW,		// μ-law
+	G711_ALAW,		// A-law
+};
+
+//-----------------------------------------------------------------------------
+// G.711の8bitサンプルを、16bit PCMに展開する
+// ・srcをdestの後半（dest + count バイト目以降）に置いた場合は、同じバッファで展開できる。
+//-----------------------------------------------------------------------------
+void G711Decode(G711Law law, const BYTE* src, short* dest, int count);
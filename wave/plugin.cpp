@@ -14,6 +14,48 @@
 #include "aif_reader.h"
 #include "snd_reader.h"
 #include "caf_reader.h"
+#include "dsf_reader.h"
+#include "dff_reader.h"
+#include "float_pcm.h"
+#include "decode_ahead.h"
+#include "pre_open.h"
+#include "batch_parser.h"
+#include "meta_cache.h"
+
+// RenderFloatで、整数PCMを一旦読み込むバッファのバイト数（スタックに置くので4KB未満）
+static const int FLOAT_READ_SIZE = 2048;
+
+// 先読み時に１回で読み取る、おおよそのバイト数
+static const int AHEAD_CHUNK_SIZE = 16384;
+
+// 解析結果の版（Parseの結果が変わる変更をしたら上げて、メタデータキャッシュを無効にする）
+static const DWORD PARSER_VERSION = 1;
+
+// 先読みする時間（.iniのConfig/DecodeAhead、ミリ秒）
+static int g_ahead_time = 0;
+
+// 次の曲の事前準備
+static PreOpen g_pre_open;
+
+// 一括解析
+static BatchParser g_batch_parser;
+
+// メタデータキャッシュ
+static MetaCache g_meta_cache;
+
+// 再生時コンテキスト
+struct Context
+{
+	Reader*		reader;
+	DecodeAhead	ahead;		// 先読み（有効時は、readerは先読みスレッドだけが操作する）
+	DWORD		ahead_base;	// 先読み開始時のサンプル位置
+};
+
+// 多チャンネルの出力配置（.iniのConfig/ChannelLayout）
+static MixLayout g_mix_layout = MIX_PASSTHROUGH;
+
+// プラグイン構造体（GetLunaPluginは、baseの部分を返す）
+static LunaPlugin2 g_plugin;
 
 //-----------------------------------------------------------------------------
 // Dll Entry Point
@@ -47,9 +89,39 @@ int _purecall()
 }
 
 //-----------------------------------------------------------------------------
-// 解析
+// 読み取り（先読みスレッドからも呼ぶ）
 //-----------------------------------------------------------------------------
-static int LPAPI Parse(const wchar_t* path, Metadata* meta)
+static int ReadSource(void* context, void* buffer, int size)
+{
+	Reader* reader = static_cast<Reader*>(context);
+	return reader->Read(buffer, size);
+}
+
+//-----------------------------------------------------------------------------
+// 読み取り（先読み中なら、先読みしたデータから）
+//-----------------------------------------------------------------------------
+static int ReadPcm(Context* cxt, void* buffer, int size)
+{
+	if (cxt->ahead.IsActive()) {
+		return cxt->ahead.Read(buffer, size);
+	}
+
+	return cxt->reader->Read(buffer, size);
+}
+
+//-----------------------------------------------------------------------------
+// 先読みを（再）開始
+//-----------------------------------------------------------------------------
+static void StartAhead(Context* cxt)
+{
+	cxt->ahead_base = cxt->reader->Tell();
+	cxt->ahead.Start();
+}
+
+//-----------------------------------------------------------------------------
+// ファイルを解析（一括解析では、スレッド毎に使い回すオブジェクトはない）
+//-----------------------------------------------------------------------------
+static int ParseFile(void* /*worker*/, const wchar_t* path, Metadata* meta)
 {
 	if (WavReader::Parse(path, meta)) {
 		return true;
@@ -67,15 +139,48 @@ static int LPAPI Parse(const wchar_t* path, Metadata* meta)
 		return true;
 	}
 
+	if (DsfReader::Parse(path, meta)) {
+		return true;
+	}
+
+	if (DffReader::Parse(path, meta)) {
+		return true;
+	}
+
 	return false;
 }
 
 //-----------------------------------------------------------------------------
-// 開く
+// 解析（キャッシュにあれば、ファイルは開かない）
 //-----------------------------------------------------------------------------
-static Handle LPAPI Open(const wchar_t* path, Output* out)
+static int LPAPI Parse(const wchar_t* path, Metadata* meta)
 {
-	Reader* reader = new WavReader();
+	if (g_meta_cache.Lookup(path, meta)) {
+		return true;
+	}
+
+	if (!ParseFile(NULL, path, meta)) {
+		return false;
+	}
+
+	g_meta_cache.Store(path, meta);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// 一括解析
+//-----------------------------------------------------------------------------
+static int LPAPI ParseBatch(const wchar_t* const* paths, int count, ParseCallback callback, void* user)
+{
+	return g_batch_parser.Run(paths, count, callback, user);
+}
+
+//-----------------------------------------------------------------------------
+// 開く（ahead_timeミリ秒分を先読みする）
+//-----------------------------------------------------------------------------
+static Handle OpenContext(const wchar_t* path, Output* out, int ahead_time)
+{
+	Reader* reader = new WavReader(g_mix_layout);
 	if (!reader->Open(path)) {
 		delete reader;
 
@@ -90,19 +195,67 @@ static Handle LPAPI Open(const wchar_t* path, Output* out)
 				reader = new CafReader();
 				if (!reader->Open(path)) {
 					delete reader;
-					return NULL;
+
+					reader = new DsfReader();
+					if (!reader->Open(path)) {
+						delete reader;
+
+						reader = new DffReader();
+						if (!reader->Open(path)) {
+							delete reader;
+							return NULL;
+						}
+					}
 				}
 			}
 		}
 	}
 
+	Context* cxt = new Context();
+	if (!cxt) {
+		delete reader;
+		return NULL;
+	}
+
+	cxt->reader = reader;
+
 	const WAVEFORMATEX& wfx = reader->GetFormat();
 
+	if (ahead_time > 0) {
+		int size = MulDiv(wfx.nAvgBytesPerSec, ahead_time, 1000);
+		BYTE silence = (wfx.wBitsPerSample == 8)? 0x80 : 0;
+		if (cxt->ahead.Init(ReadSource, reader, size, AHEAD_CHUNK_SIZE, wfx.nBlockAlign, silence)) {
+			StartAhead(cxt);
+		}
+	}
+
 	out->sample_rate	= wfx.nSamplesPerSec;
 	out->sample_bits	= wfx.wBitsPerSample;
 	out->num_channels	= wfx.nChannels;
 	out->unit_length	= 0;
-	return reader;
+	return cxt;
+}
+
+//-----------------------------------------------------------------------------
+// 開く（事前準備していれば、それを返す）
+//-----------------------------------------------------------------------------
+static Handle LPAPI Open(const wchar_t* path, Output* out)
+{
+	Handle handle = g_pre_open.Take(path, out);
+	if (handle) {
+		return handle;
+	}
+
+	return OpenContext(path, out, g_ahead_time);
+}
+
+//-----------------------------------------------------------------------------
+// 事前準備で開く（先読みしない設定でも、先頭は読み込んでおく）
+//-----------------------------------------------------------------------------
+static Handle PrepareContext(const wchar_t* path, Output* out)
+{
+	int ahead_time = (g_ahead_time > 0)? g_ahead_time : PreOpen::PREROLL_TIME;
+	return OpenContext(path, out, ahead_time);
 }
 
 //-----------------------------------------------------------------------------
@@ -110,9 +263,11 @@ static Handle LPAPI Open(const wchar_t* path, Output* out)
 //-----------------------------------------------------------------------------
 static void LPAPI Close(Handle handle)
 {
-	Reader* reader = static_cast<Reader*>(handle);
-	if (reader) {
-		delete reader;
+	Context* cxt = static_cast<Context*>(handle);
+	if (cxt) {
+		cxt->ahead.Release();
+		delete cxt->reader;
+		delete cxt;
 	}
 }
 
@@ -121,39 +276,146 @@ static void LPAPI Close(Handle handle)
 //-----------------------------------------------------------------------------
 static int LPAPI Render(Handle handle, void* buffer, int size)
 {
-	Reader* reader = static_cast<Reader*>(handle);
-	if (reader) {
-		return reader->Read(buffer, size);
+	Context* cxt = static_cast<Context*>(handle);
+	if (cxt) {
+		return ReadPcm(cxt, buffer, size);
 	}
 
 	return 0;
 }
 
+//-----------------------------------------------------------------------------
+// float形式でのレンダリング
+//-----------------------------------------------------------------------------
+static int LPAPI RenderFloat(Handle handle, float** planes, int frames)
+{
+	Context* cxt = static_cast<Context*>(handle);
+	if (!cxt || !planes) {
+		return 0;
+	}
+
+	const WAVEFORMATEX& wfx = cxt->reader->GetFormat();
+	const int align = wfx.nBlockAlign;
+	const int chunk = FLOAT_READ_SIZE / align;
+
+	BYTE temp[FLOAT_READ_SIZE];
+	int used = 0;
+	while (used < frames) {
+		int count = (chunk > frames - used)? (frames - used) : chunk;
+		int readed = ReadPcm(cxt, temp, count * align) / align;
+		if (readed <= 0) {
+			break;
+		}
+
+		PcmToFloat(temp, wfx.wBitsPerSample, wfx.nChannels, readed, planes, used);
+		used += readed;
+	}
+
+	return used;
+}
+
 //-----------------------------------------------------------------------------
 // シーク
 //-----------------------------------------------------------------------------
 static int LPAPI Seek(Handle handle, int time_ms)
 {
-	Reader* reader = static_cast<Reader*>(handle);
-	if (reader) {
-		return reader->Seek(time_ms);
+	Context* cxt = static_cast<Context*>(handle);
+	if (cxt) {
+		cxt->ahead.Stop();
+		int result = cxt->reader->Seek(time_ms);
+		StartAhead(cxt);
+		return result;
 	}
 
 	return 0;
 }
 
+//-----------------------------------------------------------------------------
+// サンプル単位のシーク
+//-----------------------------------------------------------------------------
+static __int64 LPAPI SeekFrame(Handle handle, __int64 frame)
+{
+	Context* cxt = static_cast<Context*>(handle);
+	if (!cxt || frame < 0) {
+		return -1;
+	}
+
+	// データは4GB未満なので、サンプル位置は32bitに収まる
+	DWORD sample = (frame > 0xFFFFFFFF)? 0xFFFFFFFF : static_cast<DWORD>(frame);
+
+	cxt->ahead.Stop();
+	DWORD result = cxt->reader->SeekSample(sample);
+	StartAhead(cxt);
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// 現在のサンプル位置取得
+//-----------------------------------------------------------------------------
+static __int64 LPAPI TellFrame(Handle handle)
+{
+	Context* cxt = static_cast<Context*>(handle);
+	if (!cxt) {
+		return -1;
+	}
+
+	// 先読み中は、readerは先読みスレッドが進めている
+	if (cxt->ahead.IsActive()) {
+		return cxt->ahead_base + cxt->ahead.GetReadFrames();
+	}
+
+	return cxt->reader->Tell();
+}
+
+//-----------------------------------------------------------------------------
+// 次の曲の事前準備
+//-----------------------------------------------------------------------------
+static int LPAPI Prepare(const wchar_t* path)
+{
+	return g_pre_open.Start(path, PrepareContext, Close);
+}
+
+//-----------------------------------------------------------------------------
+// プラグイン解放
+//-----------------------------------------------------------------------------
+static void LPAPI Release()
+{
+	g_pre_open.Cancel();
+	g_meta_cache.Close();
+}
+
+//-----------------------------------------------------------------------------
+// 設定読み込み
+//-----------------------------------------------------------------------------
+static void LoadConfig(HINSTANCE instance)
+{
+	UINT layout = GetPluginIniInt(instance, L"ChannelLayout", MIX_PASSTHROUGH);
+	if (layout == MIX_REORDER || layout == MIX_STEREO) {
+		g_mix_layout = static_cast<MixLayout>(layout);
+	}
+
+	g_ahead_time = GetDecodeAheadTime(instance);
+	g_batch_parser.Init(GetParseThreadNum(instance), ParseFile, NULL, NULL, &g_meta_cache);
+}
+
 //-----------------------------------------------------------------------------
 // プラグインエクスポート関数
 //-----------------------------------------------------------------------------
-LPEXPORT LunaPlugin* GetLunaPlugin(HINSTANCE /*instance*/)
+LPEXPORT LunaPlugin* GetLunaPlugin(HINSTANCE instance)
 {
-	static LunaPlugin plugin;
+	LoadConfig(instance);
+
+	LunaPlugin& plugin = g_plugin.base;
 
 	plugin.plugin_kind = KIND_PLUGIN;
-	plugin.plugin_name = L"WAVE plugin v1.04";
-	plugin.support_type = L"*.wav;*.aif;*.aiff;*.au;*.snd;*.caf;";
+	plugin.plugin_name = L"WAVE plugin v1.05";
+	plugin.support_type = L"*.wav;*.aif;*.aiff;*.au;*.snd;*.caf;*.dsf;*.dff;";
+
+	if (IsMetaCacheEnabled(instance)) {
+		g_meta_cache.Open(instance, plugin.plugin_name, PARSER_VERSION);
+	}
 
-	plugin.Release	= NULL;
+	plugin.Release	= Release;
 	plugin.Property	= NULL;
 	plugin.Parse	= Parse;
 	plugin.Open		= Open;
@@ -163,3 +425,22 @@ LPEXPORT LunaPlugin* GetLunaPlugin(HINSTANCE /*instance*/)
 
 	return &plugin;
 }
+
+//-----------------------------------------------------------------------------
+// 拡張プラグインエクスポート関数
+//-----------------------------------------------------------------------------
+LPEXPORT LunaPlugin2* GetLunaPlugin2(HINSTANCE instance)
+{
+	if (!GetLunaPlugin(instance)) {
+		return NULL;
+	}
+
+	g_plugin.version	= LUNA_PLUGIN2_VERSION;
+	g_plugin.SeekFrame	= SeekFrame;
+	g_plugin.TellFrame	= TellFrame;
+	g_plugin.RenderFloat	= RenderFloat;
+	g_plugin.Prepare	= Prepare;
+	g_plugin.ParseBatch	= ParseBatch;
+
+	return &g_plugin;
+}
@@ -33,11 +33,12 @@ extern "C" NTSYSAPI void NTAPI RtlMoveMemory(void* dest, const void* src, size_t
 
 //-----------------------------------------------------------------------------
 // PCM読み取りベースクラス
+// ・読み取り位置は各クラスのRead/Seekで更新し、ファイルには問い合わせない。
 //-----------------------------------------------------------------------------
 class Reader
 {
 public:
-	Reader() {}
+	Reader() : m_pos(0), m_sample(0), m_gap(0) {}
 	virtual ~Reader() {}
 
 	virtual bool Open(const wchar_t* path) = 0;
@@ -46,5 +47,31 @@ public:
 	virtual const WAVEFORMATEX& GetFormat() const = 0;
 
 	virtual int Read(void* buffer, int length) = 0;
-	virtual int Seek(int time_ms) = 0;
+
+	// 指定サンプル位置へシークし、実際に移動したサンプル位置を返す
+	virtual DWORD SeekSample(DWORD sample) = 0;
+
+	// ミリ秒単位のシーク
+	int Seek(int time_ms)
+	{
+		const int rate = GetFormat().nSamplesPerSec;
+		return MulDiv(SeekSample(MulDiv(time_ms, rate, 1000)), 1000, rate);
+	}
+
+	// 現在位置（サンプル数）
+	DWORD Tell() const
+	{
+		return m_sample + m_gap;
+	}
+
+	// 現在位置（ミリ秒）
+	int TellMs() const
+	{
+		return MulDiv(m_sample + m_gap, 1000, GetFormat().nSamplesPerSec);
+	}
+
+protected:
+	DWORD	m_pos;		// データ部の先頭からの読み取り位置（ファイル上のバイト数）
+	DWORD	m_sample;	// 次に出力するサンプル位置
+	DWORD	m_gap;		// ファイルにない無音を出力したサンプル数（録音中の追従、シークで0に戻す）
 };
@@ -27,12 +27,10 @@ unsigned int Swap32(unsigned int value)
 //-----------------------------------------------------------------------------
 // FourCCを読み込む
 //-----------------------------------------------------------------------------
-FOURCC ReadFourCC(HANDLE file)
+FOURCC ReadFourCC(FileStream& file)
 {
 	FOURCC value = 0;
-	DWORD readed = 0;
-
-	if (!ReadFile(file, &value, sizeof(value), &readed, NULL)) {
+	if (file.Read(&value, sizeof(value)) != sizeof(value)) {
 		return 0;
 	}
 
@@ -42,12 +40,10 @@ FOURCC ReadFourCC(HANDLE file)
 //-----------------------------------------------------------------------------
 // 整数４バイト読み込む
 //-----------------------------------------------------------------------------
-DWORD ReadInt32(HANDLE file)
+DWORD ReadInt32(FileStream& file)
 {
 	DWORD value = 0;
-	DWORD readed = 0;
-
-	if (!ReadFile(file, &value, sizeof(value), &readed, NULL)) {
+	if (file.Read(&value, sizeof(value)) != sizeof(value)) {
 		return 0;
 	}
 
@@ -57,38 +53,35 @@ DWORD ReadInt32(HANDLE file)
 //-----------------------------------------------------------------------------
 // .sndを開く
 //-----------------------------------------------------------------------------
-HANDLE OpenSource(const wchar_t* path)
+bool OpenSource(FileStream& file, const wchar_t* path)
 {
-	HANDLE file = CreateFile(path, GENERIC_READ,
-		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
-		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-	if (file == INVALID_HANDLE_VALUE) {
-		return INVALID_HANDLE_VALUE;
+	if (!file.Open(path)) {
+		return false;
 	}
 
 	FOURCC data_cc = ReadFourCC(file);
 	if (data_cc != mmioFOURCC('.', 's', 'n', 'd')) {
-		CloseHandle(file);
-		return INVALID_HANDLE_VALUE;
+		file.Close();
+		return false;
 	}
 
-	return file;
+	return true;
 }
 
 //-----------------------------------------------------------------------------
 // PCMフォーマットを取得する
 //-----------------------------------------------------------------------------
-bool GetPcmFormat(HANDLE file, WAVEFORMATEX& wfx)
+bool GetPcmFormat(FileStream& file, WAVEFORMATEX& wfx, G711Law& law)
 {
-	SetFilePointer(file, 12, NULL, FILE_BEGIN);
+	file.Seek(12);
 
 	WORD sample_bits = 0;
+	law = G711_NONE;
 
 	// エンコードについては…
 	// https://ja.wikipedia.org/wiki/Sun%E3%82%AA%E3%83%BC%E3%83%87%E3%82%A3%E3%82%AA%E3%83%95%E3%82%A1%E3%82%A4%E3%83%AB
 	DWORD encode = ReadInt32(file);
 	switch (encode) {
-	case 1:  //= 8ビット G.711 μ-law:
 	case 6:  //= 32ビットIEEE浮動小数点数
 	case 7:  //= 64ビットIEEE浮動小数点数
 	case 8:  //= 断片化されたサンプルデータ
@@ -105,10 +98,19 @@ bool GetPcmFormat(HANDLE file, WAVEFORMATEX& wfx)
 	case 24: //= ITU-T G.722 ADPCM
 	case 25: //= ITU-T G.723 3ビット ADPCM
 	case 26: //= ITU-T G.723 5ビット ADPCM
-	case 27: //= 8ビット G.711 A-law
 	default:
 		return false;
 
+	case 1:  //= 8ビット G.711 μ-law（16bitに展開する）
+		sample_bits = 16;
+		law = G711_MULAW;
+		break;
+
+	case 27: //= 8ビット G.711 A-law（16bitに展開する）
+		sample_bits = 16;
+		law = G711_ALAW;
+		break;
+
 	case 2:	//= 8ビット線形PCM
 		sample_bits = 8;
 		break;
@@ -152,11 +154,17 @@ bool SndReader::Parse(const wchar_t* path, Metadata* meta)
 		return false;
 	}
 
-	meta->duration = MulDiv(reader.m_size, 1000, reader.m_format.nAvgBytesPerSec);
+	meta->duration = MulDiv(reader.m_size, 1000, reader.m_format.nSamplesPerSec * reader.m_align);
 	meta->seekable = true;
 
-	wsprintf(meta->extra, L"Sun AU, %d Hz, %d bit, %d ch",
-		reader.m_format.nSamplesPerSec, reader.m_format.wBitsPerSample, reader.m_format.nChannels);
+	if (reader.m_law != G711_NONE) {
+		wsprintf(meta->extra, L"Sun AU, %s, %d Hz, %d ch", (reader.m_law == G711_MULAW)? L"u-law" : L"A-law",
+			reader.m_format.nSamplesPerSec, reader.m_format.nChannels);
+	}
+	else {
+		wsprintf(meta->extra, L"Sun AU, %d Hz, %d bit, %d ch",
+			reader.m_format.nSamplesPerSec, reader.m_format.wBitsPerSample, reader.m_format.nChannels);
+	}
 
 	reader.Close();
 	return true;
@@ -166,10 +174,12 @@ bool SndReader::Parse(const wchar_t* path, Metadata* meta)
 // コンストラクタ
 //-----------------------------------------------------------------------------
 SndReader::SndReader()
-	: m_file(INVALID_HANDLE_VALUE)
+	: m_file()
 	, m_format()
 	, m_size(0)
 	, m_fptr(0)
+	, m_align(0)
+	, m_law(G711_NONE)
 {
 }
 
@@ -186,33 +196,35 @@ SndReader::~SndReader()
 //-----------------------------------------------------------------------------
 bool SndReader::Open(const wchar_t* path)
 {
-	HANDLE file = OpenSource(path);
-	if (file == INVALID_HANDLE_VALUE) {
+	FileStream& file = m_file;
+	if (!OpenSource(file, path)) {
 		return false;
 	}
 
-	if (!GetPcmFormat(file, m_format)) {
-		CloseHandle(file);
+	if (!GetPcmFormat(file, m_format, m_law)) {
+		Close();
 		return false;
 	}
 
-	SetFilePointer(file, 4, NULL, FILE_BEGIN);
+	file.Seek(4);
 
 	m_fptr = ReadInt32(file);
 	m_size = ReadInt32(file);
 
 	if (m_size == 0xffffffff) {
-		m_size = GetFileSize(file, NULL) - m_fptr;
+		m_size = file.GetSize() - m_fptr;
 	}
 
 	if (m_size == 0 || m_fptr == 0) {
-		CloseHandle(file);
+		Close();
 		return false;
 	}
 
-	SetFilePointer(file, m_fptr, NULL, FILE_BEGIN);
+	file.Seek(m_fptr);
+
+	// G.711は、ファイル上は１サンプル１バイト
+	m_align = (m_law != G711_NONE)? m_format.nChannels : m_format.nBlockAlign;
 
-	m_file = file;
 	return true;
 }
 
@@ -221,10 +233,10 @@ bool SndReader::Open(const wchar_t* path)
 //-----------------------------------------------------------------------------
 void SndReader::Close()
 {
-	if (m_file != INVALID_HANDLE_VALUE) {
-		CloseHandle(m_file);
-		m_file = INVALID_HANDLE_VALUE;
-	}
+	m_file.Close();
+
+	m_pos = 0;
+	m_sample = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -240,15 +252,29 @@ const WAVEFORMATEX& SndReader::GetFormat() const
 //-----------------------------------------------------------------------------
 int SndReader::Read(void* buffer, int size)
 {
-	DWORD end = m_fptr + m_size;
-	DWORD cur = SetFilePointer(m_file, 0, NULL, FILE_CURRENT);
-	if (cur + size >= end) {
-		size = end - cur;
+	// G.711は、読み込んだデータをバッファの後半に置いて、先頭から16bitに展開する
+	int read_size = (m_law != G711_NONE)? (size / 2) : size;
+
+	if (m_pos + read_size >= m_size) {
+		read_size = m_size - m_pos;
+	}
+
+	BYTE* read_buf = static_cast<BYTE*>(buffer);
+	if (m_law != G711_NONE) {
+		read_buf += read_size;
 	}
 
-	DWORD readed = 0;
-	if (ReadFile(m_file, buffer, size, &readed, NULL)) {
-		if (m_format.wBitsPerSample == 16) {
+	DWORD readed = m_file.Read(read_buf, read_size);
+	if (0 < readed) {
+		m_pos += readed;
+		m_sample = m_pos / m_align;
+		size = readed;
+
+		if (m_law != G711_NONE) {
+			G711Decode(m_law, read_buf, static_cast<short*>(buffer), readed);
+			return readed * 2;
+		}
+		else if (m_format.wBitsPerSample == 16) {
 			unsigned short* data = static_cast<unsigned short*>(buffer);
 			for (int i = 0; i < size / 2; ++i) {
 				data[i] = Swap16(data[i]);
@@ -278,14 +304,17 @@ int SndReader::Read(void* buffer, int size)
 //-----------------------------------------------------------------------------
 // シーク
 //-----------------------------------------------------------------------------
-int SndReader::Seek(int time_ms)
+DWORD SndReader::SeekSample(DWORD sample)
 {
-	DWORD fp = MulDiv(time_ms, m_format.nAvgBytesPerSec, 1000);
-	fp -= (fp % m_format.nBlockAlign);
-
-	if (SetFilePointer(m_file, m_fptr + fp, 0, FILE_BEGIN)) {
-		return time_ms;
+	DWORD samples = m_size / m_align;
+	if (sample > samples) {
+		sample = samples;
 	}
 
-	return 0;
+	DWORD fp = sample * m_align;
+	m_file.Seek(m_fptr + fp);
+
+	m_pos = fp;
+	m_sample = sample;
+	return sample;
 }
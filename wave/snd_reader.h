@@ -7,7 +7,9 @@
 
 #include <windows.h>
 #include "luna_pi.h"
+#include "file_stream.h"
 #include "reader.h"
+#include "g711.h"
 
 //-----------------------------------------------------------------------------
 // SND読み取り
@@ -27,11 +29,13 @@ public:
 	virtual const WAVEFORMATEX& GetFormat() const;
 
 	virtual int Read(void* buffer, int length);
-	virtual int Seek(int time_ms);
+	virtual DWORD SeekSample(DWORD sample);
 
 private:
-	HANDLE			m_file;
+	FileStream		m_file;
 	WAVEFORMATEX	m_format;
 	DWORD			m_size;
 	DWORD			m_fptr;
+	DWORD			m_align;	// ファイル上の１フレームのバイト数
+	G711Law			m_law;
 };
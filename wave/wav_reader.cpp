@@ -8,133 +8,101 @@
 #include <mmsystem.h>
 #include <mmreg.h>
 #include "wav_reader.h"
+#include "chunk_index.h"
 
 namespace {
 
+// RIFFヘッダ("RIFF" + サイズ + "WAVE")のバイト数
+const DWORD RIFF_HEADER_SIZE = 12;
+
+// fmtチャンクの最大バイト数（MS ADPCMの係数を含む）
+const DWORD FMT_MAX_SIZE = 256;
+
+// ADPCMを一度にまとめて展開する最大ブロック数
+const int ADPCM_BATCH_BLOCKS = 1024;
+
+// この時間内に更新されたファイルは、録音中の可能性がある
+const DWORD FOLLOW_RECENT_MS = 5000;
+
+// この時間ファイルのサイズが変わらなければ、録音が終了したとみなす
+const DWORD FOLLOW_TIMEOUT_MS = 3000;
+
+// チャンネル変換時に、一度に読み込むフレーム数
+const int MIX_FRAMES = 1024;
+
 //-----------------------------------------------------------------------------
 // FourCCを読み込む
 //-----------------------------------------------------------------------------
-FOURCC ReadFourCC(HANDLE file)
+FOURCC ReadFourCC(FileStream& file)
 {
 	FOURCC value = 0;
-	DWORD readed = 0;
-
-	if (!ReadFile(file, &value, sizeof(value), &readed, NULL)) {
+	if (file.Read(&value, sizeof(value)) != sizeof(value)) {
 		return 0;
 	}
 
 	return value;
 }
 
-//-----------------------------------------------------------------------------
-// four_ccで指定されたチャンクへシークする
-//-----------------------------------------------------------------------------
-bool SeekToChunk(HANDLE file, const char* four_cc, DWORD& size)
-{
-	FOURCC target_cc = mmioFOURCC(four_cc[0], four_cc[1], four_cc[2], four_cc[3]);
-	while (true) {
-		DWORD readed = 0;
-
-		FOURCC data_cc = ReadFourCC(file);
-		ReadFile(file, &size, sizeof(size), &readed, NULL);
-		if (readed != sizeof(size)) {
-			return false;
-		}
-
-		if (data_cc == target_cc) {
-			return true;
-		}
-
-		// サイズは、最低WORDアラインメントがいる
-		if ((size & 1) == 1) {
-			++size;
-		}
-
-		SetFilePointer(file, size, NULL, FILE_CURRENT);
-		if (GetLastError() != NO_ERROR) {
-			return false;
-		}
-	}
-
-	return false;
-}
-
 //-----------------------------------------------------------------------------
 // .wavを開く
 //-----------------------------------------------------------------------------
-HANDLE OpenSource(const wchar_t* path)
+bool OpenSource(FileStream& file, const wchar_t* path)
 {
-	HANDLE file = CreateFile(path, GENERIC_READ,
-		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
-		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-	if (file == INVALID_HANDLE_VALUE) {
-		return INVALID_HANDLE_VALUE;
+	if (!file.Open(path)) {
+		return false;
 	}
 
 	FOURCC riff_cc = ReadFourCC(file);
 	if (riff_cc != mmioFOURCC('R', 'I', 'F', 'F')) {
-		CloseHandle(file);
-		return INVALID_HANDLE_VALUE;
+		file.Close();
+		return false;
 	}
 
-	DWORD readed = 0;
 	DWORD riff_size = 0;
-	ReadFile(file, &riff_size, sizeof(riff_size), &readed, NULL);
+	file.Read(&riff_size, sizeof(riff_size));
 	// RIFFサイズ（※サイズが間違ってる場合があるので、チェックはしない）
-	//if (riff_size != GetFileSize(file, NULL) - 8) {
-	//	CloseHandle(file);
-	//	return INVALID_HANDLE_VALUE;
+	//if (riff_size != file.GetSize() - 8) {
+	//	file.Close();
+	//	return false;
 	//}
 
 	FOURCC wave_cc = ReadFourCC(file);
 	if (wave_cc != mmioFOURCC('W', 'A', 'V', 'E')) {
-		CloseHandle(file);
-		return INVALID_HANDLE_VALUE;
+		file.Close();
+		return false;
 	}
 
-	return file;
+	return true;
 }
 
 //-----------------------------------------------------------------------------
 // PCMフォーマットを取得する
 //-----------------------------------------------------------------------------
-bool GetPcmFormat(HANDLE file, WAVEFORMATEX& wfx)
+bool GetPcmFormat(const FileStream& file, const ChunkIndex& index, WAVEFORMATEX& wfx, DWORD& channel_mask, G711Law& law, AdpcmFormat& adpcm)
 {
-	DWORD chunk_size = 0;
-	if (!SeekToChunk(file, "fmt ", chunk_size)) {
+	const ChunkEntry* entry = index.Find(mmioFOURCC('f', 'm', 't', ' '));
+	if (!entry) {
 		return false;
 	}
 
 	WAVEFORMATEXTENSIBLE wfex;
 	RtlZeroMemory(&wfex, sizeof(wfex));
 
-	DWORD size = chunk_size;
-	if (chunk_size > sizeof(wfex)) {
+	// 拡張部分のうち、不要な部分は読まない
+	DWORD size = entry->size;
+	if (size > sizeof(wfex)) {
 		size = sizeof(wfex);
 	}
 
-	DWORD readed = 0;
-
-	// Read format tag
-	ReadFile(file, &wfex, size, &readed, NULL);
-	if (size != readed) {
+	if (!index.Read(file, entry, &wfex, size)) {
 		return false;
 	}
 
-	// チャンクのサイズの方が大きい場合は、シークしておく
-	if (size < chunk_size) {
-		if ((chunk_size & 1) == 1) {
-			++chunk_size;
-		}
-
-		SetFilePointer(file, chunk_size - size, NULL, FILE_CURRENT);
-		if (GetLastError() != NO_ERROR) {
-			return false;
-		}
-	}
-
 	RtlMoveMemory(&wfx, &wfex.Format, sizeof(wfx));
 	wfx.cbSize = 0;
+	channel_mask = 0;
+	law = G711_NONE;
+	adpcm.type = ADPCM_NONE;
 
 	// WAVEFORMATの場合、wBitsPerSampleがないので、nAvgBytesPerSecから算出
 	if (wfx.wBitsPerSample == 0 && wfx.nSamplesPerSec != 0 && wfx.nChannels != 0) {
@@ -145,9 +113,36 @@ bool GetPcmFormat(HANDLE file, WAVEFORMATEX& wfx)
 		return true;
 	}
 
+	// G.711は、16bit PCMに展開する
+	if ((wfx.wFormatTag == WAVE_FORMAT_MULAW || wfx.wFormatTag == WAVE_FORMAT_ALAW) && wfx.wBitsPerSample == 8) {
+		law = (wfx.wFormatTag == WAVE_FORMAT_MULAW)? G711_MULAW : G711_ALAW;
+
+		wfx.wFormatTag		= WAVE_FORMAT_PCM;
+		wfx.wBitsPerSample	= 16;
+		wfx.nBlockAlign		= wfx.nChannels * wfx.wBitsPerSample / 8;
+		wfx.nAvgBytesPerSec	= wfx.nSamplesPerSec * wfx.nBlockAlign;
+		return true;
+	}
+
+	// ADPCMは、16bit PCMに展開する（係数があるので、fmtを全部読む）
+	if (wfx.wFormatTag == WAVE_FORMAT_IMA_ADPCM || wfx.wFormatTag == WAVE_FORMAT_ADPCM) {
+		BYTE fmt_data[FMT_MAX_SIZE];
+		DWORD fmt_size = (entry->size > FMT_MAX_SIZE)? FMT_MAX_SIZE : entry->size;
+		if (!index.Read(file, entry, fmt_data, fmt_size) || !AdpcmGetFormat(fmt_data, fmt_size, adpcm)) {
+			return false;
+		}
+
+		wfx.wFormatTag		= WAVE_FORMAT_PCM;
+		wfx.wBitsPerSample	= 16;
+		wfx.nBlockAlign		= wfx.nChannels * wfx.wBitsPerSample / 8;
+		wfx.nAvgBytesPerSec	= wfx.nSamplesPerSec * wfx.nBlockAlign;
+		return true;
+	}
+
 	if (wfx.wFormatTag == WAVE_FORMAT_EXTENSIBLE) {
 		if (InlineIsEqualGUID(wfex.SubFormat, KSDATAFORMAT_SUBTYPE_PCM)) {
 			wfx.wFormatTag = WAVE_FORMAT_PCM;
+			channel_mask = wfex.dwChannelMask;
 			return true;
 		}
 	
@@ -160,24 +155,101 @@ bool GetPcmFormat(HANDLE file, WAVEFORMATEX& wfx)
 	return false;
 }
 
+//-----------------------------------------------------------------------------
+// ADPCMの総フレーム数を取得する
+//-----------------------------------------------------------------------------
+DWORD GetAdpcmFrames(const FileStream& file, const ChunkIndex& index, const AdpcmFormat& adpcm, DWORD data_size)
+{
+	DWORD frames = AdpcmCountFrames(adpcm, data_size);
+
+	// factがあれば、最終ブロックの余りを除いた正確な値がわかる
+	DWORD fact_frames = 0;
+	if (index.Read(file, index.Find(mmioFOURCC('f', 'a', 'c', 't')), &fact_frames, sizeof(fact_frames))) {
+		if (0 < fact_frames && fact_frames < frames) {
+			frames = fact_frames;
+		}
+	}
+
+	return frames;
+}
+
+//-----------------------------------------------------------------------------
+// 録音中のファイルか？
+// ・dataのサイズが未確定(0/-1)、または最近更新されているものを対象とする。
+// ・書きながらヘッダも更新する録音ソフトでは、dataのサイズとファイルサイズが一致するので、
+//   サイズではなく更新日時で判断する。
+//-----------------------------------------------------------------------------
+bool IsRecording(const FileStream& file, const ChunkEntry* data)
+{
+	if (data->size == 0 || data->size == 0xFFFFFFFF) {
+		return true;
+	}
+
+	DWORD file_size = file.GetSize();
+	if (file_size == 0) {
+		return false;
+	}
+
+	// 最近更新されていなければ、録音は終わっている
+	if (!file.IsWrittenWithin(FOLLOW_RECENT_MS)) {
+		return false;
+	}
+
+	// dataの後ろにチャンクが続いている場合は、録音中ではない
+	DWORD end = data->offset + data->size + (data->size & 1);
+	if (end + 8 <= file_size) {
+		BYTE four_cc[4];
+		if (file.ReadAt(end, four_cc, sizeof(four_cc)) != sizeof(four_cc)) {
+			return false;
+		}
+
+		bool is_chunk = true;
+		for (int i = 0; i < 4; ++i) {
+			if (four_cc[i] < 0x20 || 0x7E < four_cc[i]) {
+				is_chunk = false;
+			}
+		}
+
+		if (is_chunk) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// 録音中のファイルの、現時点のdataのバイト数を取得する
+//-----------------------------------------------------------------------------
+DWORD GetRecordingSize(const FileStream& file, DWORD data_offset, DWORD align)
+{
+	DWORD file_size = file.GetSize();
+	if (file_size <= data_offset || align == 0) {
+		return 0;
+	}
+
+	// 書きかけのフレームは含めない
+	DWORD size = file_size - data_offset;
+	return size - (size % align);
+}
+
 //-----------------------------------------------------------------------------
 // メタデータを取得する
 //-----------------------------------------------------------------------------
-void GetMetadata(HANDLE file, Metadata* meta)
+void GetMetadata(const FileStream& file, const ChunkIndex& index, Metadata* meta)
 {
-	DWORD size = 0;
-	if (!SeekToChunk(file, "LIST", size)) {
+	const ChunkEntry* entry = index.Find(mmioFOURCC('L', 'I', 'S', 'T'));
+	if (!entry) {
 		return;
 	}
 
+	DWORD size = entry->size;
 	char* data = static_cast<char*>(HeapAlloc(GetProcessHeap(), 0, size + 32));
 	if (!data) {
 		return;
 	}
 
-	DWORD readed = 0;
-	ReadFile(file, data, size, &readed, NULL);
-	if (readed != size) {
+	if (!index.Read(file, entry, data, size)) {
 		HeapFree(GetProcessHeap(), 0, data);
 		return;
 	}
@@ -225,31 +297,83 @@ void GetMetadata(HANDLE file, Metadata* meta)
 //-----------------------------------------------------------------------------
 bool WavReader::Parse(const wchar_t* path, Metadata* meta)
 {
-	WavReader reader;
-	if (!reader.Open(path)) {
+	FileStream file;
+	if (!OpenSource(file, path)) {
 		return false;
 	}
 
-	GetMetadata(reader.m_file, meta);
+	// LISTはdataの後ろにある場合もあるので、終端まで走査する
+	ChunkIndex index;
+	if (!index.Build(file, RIFF_HEADER_SIZE, ChunkIndex::LAYOUT_RIFF, 0)) {
+		return false;
+	}
 
-	meta->duration = MulDiv(reader.m_size, 1000, reader.m_format.nAvgBytesPerSec);
-	meta->seekable = true;
+	WAVEFORMATEX wfx;
+	DWORD channel_mask = 0;
+	G711Law law = G711_NONE;
+	AdpcmFormat adpcm;
+	if (!GetPcmFormat(file, index, wfx, channel_mask, law, adpcm)) {
+		return false;
+	}
+
+	const ChunkEntry* data = index.Find(mmioFOURCC('d', 'a', 't', 'a'));
+	if (!data) {
+		return false;
+	}
+
+	GetMetadata(file, index, meta);
 
-	wsprintf(meta->extra, L"WAVE, %d Hz, %d bit, %d ch",
-		reader.m_format.nSamplesPerSec, reader.m_format.wBitsPerSample, reader.m_format.nChannels);
+	// 録音中のファイルは、現時点の長さとする
+	DWORD data_size = data->size;
+	if (adpcm.type == ADPCM_NONE && IsRecording(file, data)) {
+		DWORD align = (law != G711_NONE)? wfx.nChannels : wfx.nBlockAlign;
+		data_size = GetRecordingSize(file, data->offset, align);
+	}
+
+	if (adpcm.type != ADPCM_NONE) {
+		DWORD frames = GetAdpcmFrames(file, index, adpcm, data->size);
+		meta->duration = MulDiv(frames, 1000, wfx.nSamplesPerSec);
+		wsprintf(meta->extra, L"WAVE, %s ADPCM, %d Hz, %d ch", (adpcm.type == ADPCM_IMA)? L"IMA" : L"MS",
+			wfx.nSamplesPerSec, wfx.nChannels);
+	}
+	else if (law != G711_NONE) {
+		meta->duration = MulDiv(data_size, 1000, wfx.nSamplesPerSec * wfx.nChannels);
+		wsprintf(meta->extra, L"WAVE, %s, %d Hz, %d ch", (law == G711_MULAW)? L"u-law" : L"A-law",
+			wfx.nSamplesPerSec, wfx.nChannels);
+	}
+	else {
+		meta->duration = MulDiv(data_size, 1000, wfx.nAvgBytesPerSec);
+		wsprintf(meta->extra, L"WAVE, %d Hz, %d bit, %d ch",
+			wfx.nSamplesPerSec, wfx.wBitsPerSample, wfx.nChannels);
+	}
 
-	reader.Close();
+	meta->seekable = true;
 	return true;
 }
 
 //-----------------------------------------------------------------------------
 // コンストラクタ
 //-----------------------------------------------------------------------------
-WavReader::WavReader()
-	: m_file(INVALID_HANDLE_VALUE)
+WavReader::WavReader(MixLayout layout)
+	: m_file()
 	, m_format()
 	, m_size(0)
 	, m_fptr(0)
+	, m_align(0)
+	, m_law(G711_NONE)
+	, m_layout(layout)
+	, m_mixer()
+	, m_mix_buf(NULL)
+	, m_follow(false)
+	, m_follow_tick(0)
+	, m_adpcm()
+	, m_block_buf(NULL)
+	, m_block_cap(0)
+	, m_pcm_buf(NULL)
+	, m_pcm_pos(0)
+	, m_pcm_len(0)
+	, m_block(0)
+	, m_frames(0)
 {
 }
 
@@ -266,25 +390,64 @@ WavReader::~WavReader()
 //-----------------------------------------------------------------------------
 bool WavReader::Open(const wchar_t* path)
 {
-	HANDLE file = OpenSource(path);
-	if (file == INVALID_HANDLE_VALUE) {
+	FileStream& file = m_file;
+	if (!OpenSource(file, path)) {
+		return false;
+	}
+
+	// 再生にはdataまでのチャンクがあれば十分
+	const FOURCC data_cc = mmioFOURCC('d', 'a', 't', 'a');
+
+	ChunkIndex index;
+	if (!index.Build(file, RIFF_HEADER_SIZE, ChunkIndex::LAYOUT_RIFF, data_cc)) {
+		Close();
 		return false;
 	}
 
-	if (!GetPcmFormat(file, m_format)) {
-		CloseHandle(file);
+	DWORD channel_mask = 0;
+	if (!GetPcmFormat(file, index, m_format, channel_mask, m_law, m_adpcm)) {
+		Close();
 		return false;
 	}
 
-	DWORD size = 0;
-	if (!SeekToChunk(file, "data", size)) {
-		CloseHandle(file);
+	const ChunkEntry* data = index.Find(data_cc);
+	if (!data) {
+		Close();
 		return false;
 	}
 
-	m_file = file;
-	m_size = size;
-	m_fptr = SetFilePointer(file, 0, NULL, FILE_CURRENT);
+	m_size = data->size;
+	m_fptr = data->offset;
+
+	// G.711は、ファイル上は１サンプル１バイト
+	m_align = (m_law != G711_NONE)? m_format.nChannels : m_format.nBlockAlign;
+
+	// 録音中のファイルは、dataのサイズを確定せずに追従する（ADPCMは対象外）
+	if (m_adpcm.type == ADPCM_NONE && IsRecording(file, data)) {
+		StartFollow();
+	}
+
+	// ADPCMは、ブロック単位で読んで展開する
+	if (m_adpcm.type != ADPCM_NONE) {
+		m_frames = GetAdpcmFrames(file, index, m_adpcm, m_size);
+		m_pcm_buf = static_cast<short*>(HeapAlloc(GetProcessHeap(), 0,
+			m_adpcm.samples_per_block * m_format.nBlockAlign));
+		if (!m_pcm_buf || !ReserveBlockBuffer(m_adpcm.block_align)) {
+			Close();
+			return false;
+		}
+	}
+
+	// チャンネル配置を変換する場合、展開後のPCMを一旦読み込む
+	if (m_mixer.Init(m_layout, m_format, channel_mask)) {
+		m_mix_buf = static_cast<BYTE*>(HeapAlloc(GetProcessHeap(), 0, MIX_FRAMES * m_format.nBlockAlign));
+		if (!m_mix_buf) {
+			Close();
+			return false;
+		}
+	}
+
+	file.Seek(m_fptr);
 	return true;
 }
 
@@ -293,10 +456,34 @@ bool WavReader::Open(const wchar_t* path)
 //-----------------------------------------------------------------------------
 void WavReader::Close()
 {
-	if (m_file != INVALID_HANDLE_VALUE) {
-		CloseHandle(m_file);
-		m_file = INVALID_HANDLE_VALUE;
+	m_file.Close();
+
+	m_follow = false;
+
+	if (m_block_buf) {
+		HeapFree(GetProcessHeap(), 0, m_block_buf);
+		m_block_buf = NULL;
+		m_block_cap = 0;
 	}
+
+	if (m_pcm_buf) {
+		HeapFree(GetProcessHeap(), 0, m_pcm_buf);
+		m_pcm_buf = NULL;
+	}
+
+	if (m_mix_buf) {
+		HeapFree(GetProcessHeap(), 0, m_mix_buf);
+		m_mix_buf = NULL;
+	}
+
+	m_adpcm.type = ADPCM_NONE;
+	m_pcm_pos = 0;
+	m_pcm_len = 0;
+	m_block = 0;
+	m_pos = 0;
+	m_sample = 0;
+	m_gap = 0;
+	m_frames = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -304,7 +491,7 @@ void WavReader::Close()
 //-----------------------------------------------------------------------------
 const WAVEFORMATEX& WavReader::GetFormat() const
 {
-	return m_format;
+	return m_mixer.IsActive()? m_mixer.GetFormat() : m_format;
 }
 
 //-----------------------------------------------------------------------------
@@ -312,14 +499,92 @@ const WAVEFORMATEX& WavReader::GetFormat() const
 //-----------------------------------------------------------------------------
 int WavReader::Read(void* buffer, int size)
 {
-	DWORD end = m_fptr + m_size;
-	DWORD cur = SetFilePointer(m_file, 0, NULL, FILE_CURRENT);
-	if (cur + size >= end) {
-		size = end - cur;
+	int total = m_mixer.IsActive()? ReadMixed(buffer, size) : ReadSource(buffer, size);
+
+	// 録音中で、まだ書かれていない分は無音にする（終了と判断されないように）
+	// 次のReadで、続きが書かれていれば読み取る。無音の分は、現在位置に加える
+	if (m_follow && total < size) {
+		const WAVEFORMATEX& format = GetFormat();
+		BYTE silence = (format.wBitsPerSample == 8)? 0x80 : 0;
+		FillMemory(static_cast<BYTE*>(buffer) + total, size - total, silence);
+		m_gap += (size - total) / format.nBlockAlign;
+		total = size;
 	}
 
-	DWORD readed = 0;
-	if (ReadFile(m_file, buffer, size, &readed, NULL)) {
+	return total;
+}
+
+//-----------------------------------------------------------------------------
+// 出力のチャンネル配置に変換して読み取る
+//-----------------------------------------------------------------------------
+int WavReader::ReadMixed(void* buffer, int size)
+{
+	// ファイルのチャンネル配置で読み込み、出力の配置に変換する
+	const int out_align = m_mixer.GetFormat().nBlockAlign;
+	const int src_align = m_format.nBlockAlign;
+
+	BYTE* dest = static_cast<BYTE*>(buffer);
+	int frames = size / out_align;
+	int total = 0;
+
+	while (0 < frames) {
+		int count = (frames > MIX_FRAMES)? MIX_FRAMES : frames;
+		int readed = ReadSource(m_mix_buf, count * src_align) / src_align;
+		if (readed <= 0) {
+			break;
+		}
+
+		m_mixer.Process(m_mix_buf, dest, readed);
+		dest += readed * out_align;
+		total += readed * out_align;
+		frames -= readed;
+
+		if (readed < count) {
+			break;
+		}
+	}
+
+	return total;
+}
+
+//-----------------------------------------------------------------------------
+// ファイルのチャンネル配置のまま読み取る
+//-----------------------------------------------------------------------------
+int WavReader::ReadSource(void* buffer, int size)
+{
+	if (m_adpcm.type != ADPCM_NONE) {
+		return ReadAdpcm(static_cast<BYTE*>(buffer), size);
+	}
+
+	// G.711は、読み込んだデータをバッファの後半に置いて、先頭から16bitに展開する
+	if (m_law != G711_NONE) {
+		size /= 2;
+	}
+
+	// 録音中は待たずに、まだ書かれていなければ0を返す
+	if (m_follow && !CheckRecording()) {
+		return 0;
+	}
+
+	if (m_pos + size >= m_size) {
+		size = m_size - m_pos;
+	}
+
+	BYTE* read_buf = static_cast<BYTE*>(buffer);
+	if (m_law != G711_NONE) {
+		read_buf += size;
+	}
+
+	DWORD readed = m_file.Read(read_buf, size);
+	if (0 < readed) {
+		m_pos += readed;
+		m_sample = m_pos / m_align;
+
+		if (m_law != G711_NONE) {
+			G711Decode(m_law, read_buf, static_cast<short*>(buffer), readed);
+			return readed * 2;
+		}
+
 		return readed;
 	}
 
@@ -329,14 +594,196 @@ int WavReader::Read(void* buffer, int size)
 //-----------------------------------------------------------------------------
 // シーク
 //-----------------------------------------------------------------------------
-int WavReader::Seek(int time_ms)
+DWORD WavReader::SeekSample(DWORD sample)
 {
-	DWORD fp = MulDiv(time_ms, m_format.nAvgBytesPerSec, 1000);
-	fp -= (fp % m_format.nBlockAlign);
+	// 追従中に出力した無音は数えず、ファイル上の位置にする
+	m_gap = 0;
+
+	// ADPCMは、ブロックの先頭から展開して、手前の分を読み飛ばす
+	if (m_adpcm.type != ADPCM_NONE) {
+		if (sample > m_frames) {
+			sample = m_frames;
+		}
 
-	if (SetFilePointer(m_file, m_fptr + fp, 0, FILE_BEGIN)) {
-		return time_ms;
+		DWORD block = sample / m_adpcm.samples_per_block;
+		m_file.Seek(m_fptr + block * m_adpcm.block_align);
+
+		m_block = block;
+		m_pos = block * m_adpcm.block_align;
+		m_sample = block * m_adpcm.samples_per_block;
+		m_pcm_pos = 0;
+		m_pcm_len = 0;
+
+		int skip = sample - m_sample;
+		if (0 < skip) {
+			DWORD rest = m_size - m_pos;
+			DWORD bytes = (rest > static_cast<DWORD>(m_adpcm.block_align))? m_adpcm.block_align : rest;
+
+			DWORD readed = m_file.Read(m_block_buf, bytes);
+			if (readed == 0) {
+				return m_sample;
+			}
+
+			m_pcm_len = AdpcmDecodeBlock(m_adpcm, m_block_buf, readed, m_pcm_buf);
+			m_pcm_pos = (skip > m_pcm_len)? m_pcm_len : skip;
+			++m_block;
+			m_pos = m_block * m_adpcm.block_align;
+			m_sample += m_pcm_pos;
+		}
+
+		return m_sample;
 	}
 
-	return 0;
+	// 録音中は、まだ書かれていない位置へは行けない
+	if (m_follow) {
+		CheckRecording();
+	}
+
+	DWORD samples = m_size / m_align;
+	if (sample > samples) {
+		sample = samples;
+	}
+
+	DWORD fp = sample * m_align;
+	m_file.Seek(m_fptr + fp);
+
+	m_pos = fp;
+	m_sample = sample;
+	return sample;
+}
+
+//-----------------------------------------------------------------------------
+// ADPCM読み取り
+//-----------------------------------------------------------------------------
+int WavReader::ReadAdpcm(BYTE* buffer, int size)
+{
+	const int frame_bytes = m_format.nBlockAlign;
+	const int block_align = m_adpcm.block_align;
+	const int samples_per_block = m_adpcm.samples_per_block;
+
+	int frames = size / frame_bytes;
+	if (static_cast<DWORD>(frames) > m_frames - m_sample) {
+		frames = m_frames - m_sample;
+	}
+
+	int done = 0;
+
+	// 前回展開したブロックの残り
+	if (m_pcm_pos < m_pcm_len) {
+		int count = m_pcm_len - m_pcm_pos;
+		count = (count > frames)? frames : count;
+
+		CopyMemory(buffer, &m_pcm_buf[m_pcm_pos * m_format.nChannels], count * frame_bytes);
+		m_pcm_pos += count;
+		done += count;
+	}
+
+	// 丸ごと収まるブロックは、バッファへ直接展開する
+	// 再生中なのでこのスレッドで展開し、ブロックバッファが巨大にならないよう区切る
+	int blocks = (frames - done) / samples_per_block;
+	while (0 < blocks) {
+		int count = (blocks > ADPCM_BATCH_BLOCKS)? ADPCM_BATCH_BLOCKS : blocks;
+		DWORD bytes = count * block_align;
+		if (!ReserveBlockBuffer(bytes)) {
+			break;
+		}
+
+		DWORD readed = m_file.Read(m_block_buf, bytes);
+		if (readed == 0) {
+			break;
+		}
+
+		// 欠けたブロックは、次の端数処理で読み直す
+		int full = readed / block_align;
+		if (static_cast<int>(readed) != full * block_align) {
+			m_file.Skip(full * block_align - readed);
+		}
+
+		AdpcmDecodeBlocks(m_adpcm, m_block_buf, full, reinterpret_cast<short*>(buffer + done * frame_bytes));
+		m_block += full;
+		done += full * samples_per_block;
+		blocks -= count;
+
+		if (full < count) {
+			break;
+		}
+	}
+
+	// 端数は１ブロック展開して、残りは次回に回す
+	if (done < frames) {
+		DWORD rest = m_size - m_block * block_align;
+		DWORD bytes = (rest > static_cast<DWORD>(block_align))? block_align : rest;
+
+		DWORD readed = (0 < bytes)? m_file.Read(m_block_buf, bytes) : 0;
+		if (0 < readed) {
+			m_pcm_len = AdpcmDecodeBlock(m_adpcm, m_block_buf, readed, m_pcm_buf);
+			m_pcm_pos = 0;
+			++m_block;
+
+			int count = frames - done;
+			count = (count > m_pcm_len)? m_pcm_len : count;
+
+			CopyMemory(buffer + done * frame_bytes, m_pcm_buf, count * frame_bytes);
+			m_pcm_pos = count;
+			done += count;
+		}
+	}
+
+	m_pos = m_block * block_align;
+	m_sample += done;
+	return done * frame_bytes;
+}
+
+//-----------------------------------------------------------------------------
+// ブロックバッファを確保する
+//-----------------------------------------------------------------------------
+bool WavReader::ReserveBlockBuffer(DWORD size)
+{
+	if (size <= m_block_cap) {
+		return true;
+	}
+
+	BYTE* buffer = static_cast<BYTE*>(HeapAlloc(GetProcessHeap(), 0, size));
+	if (!buffer) {
+		return false;
+	}
+
+	if (m_block_buf) {
+		HeapFree(GetProcessHeap(), 0, m_block_buf);
+	}
+
+	m_block_buf = buffer;
+	m_block_cap = size;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// 録音中のファイルへの追従を開始する
+//-----------------------------------------------------------------------------
+void WavReader::StartFollow()
+{
+	m_follow = true;
+	m_follow_tick = GetTickCount();
+	m_size = GetRecordingSize(m_file, m_fptr, m_align);
+}
+
+//-----------------------------------------------------------------------------
+// 録音中のファイルの伸びを確認し、読めるデータがあればtrueを返す
+// ・再生スレッドを止めないように、待たずに現在のサイズを見るだけにする。
+// ・サイズが変わらないまま一定時間経ったら、録音が終わったとみなして追従をやめる。
+//-----------------------------------------------------------------------------
+bool WavReader::CheckRecording()
+{
+	DWORD size = GetRecordingSize(m_file, m_fptr, m_align);
+	DWORD now = GetTickCount();
+
+	if (size != m_size) {
+		m_size = size;
+		m_follow_tick = now;
+	}
+	else if (now - m_follow_tick >= FOLLOW_TIMEOUT_MS) {
+		m_follow = false;
+	}
+
+	return (m_pos + m_align <= m_size);
 }
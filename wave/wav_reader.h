@@ -7,7 +7,11 @@
 
 #include <windows.h>
 #include "luna_pi.h"
+#include "file_stream.h"
 #include "reader.h"
+#include "g711.h"
+#include "adpcm.h"
+#include "channel_mixer.h"
 
 //-----------------------------------------------------------------------------
 // WAV読み取り
@@ -18,7 +22,7 @@ public:
 	static bool Parse(const wchar_t* path, Metadata* meta);
 
 public:
-	WavReader();
+	explicit WavReader(MixLayout layout);
 	virtual ~WavReader();
 
 	virtual bool Open(const wchar_t* path);
@@ -27,11 +31,40 @@ public:
 	virtual const WAVEFORMATEX& GetFormat() const;
 
 	virtual int Read(void* buffer, int length);
-	virtual int Seek(int time_ms);
+	virtual DWORD SeekSample(DWORD sample);
 
 private:
-	HANDLE			m_file;
+	int ReadMixed(void* buffer, int size);
+	int ReadSource(void* buffer, int size);
+	int ReadAdpcm(BYTE* buffer, int size);
+	bool ReserveBlockBuffer(DWORD size);
+	void StartFollow();
+	bool CheckRecording();
+
+private:
+	FileStream		m_file;
 	WAVEFORMATEX	m_format;
 	DWORD			m_size;
 	DWORD			m_fptr;
+	DWORD			m_align;	// ファイル上の１フレームのバイト数
+	G711Law			m_law;
+
+	// チャンネル配置の変換
+	MixLayout		m_layout;
+	ChannelMixer	m_mixer;
+	BYTE*			m_mix_buf;		// 変換前のPCM（MIX_FRAMESフレーム分）
+
+	// 録音中のファイルの追従
+	bool			m_follow;		// dataのサイズを確定せず、ファイルの伸びに追従する
+	DWORD			m_follow_tick;	// 最後にファイルが伸びたのを確認した時刻
+
+	// ADPCM
+	AdpcmFormat		m_adpcm;
+	BYTE*			m_block_buf;	// ファイルから読んだブロック
+	DWORD			m_block_cap;	// m_block_bufのバイト数
+	short*			m_pcm_buf;		// 展開済みの１ブロック
+	int				m_pcm_pos;		// m_pcm_bufの読み取り位置（フレーム）
+	int				m_pcm_len;		// m_pcm_bufのフレーム数
+	DWORD			m_block;		// 次に読むブロック番号
+	DWORD			m_frames;		// 総フレーム数
 };